@@ -50,12 +50,16 @@ int App::start(int argc, char** argv) {
     ("tcp_port", bpo::value<uint16_t>(), "If specified, this TCP port will be opened on all shards (kernel-based incoming connection load-balancing via shared bind on same port from multiple listeners. Conflicts with --tcp_endpoints")
     ("tcp_endpoints", bpo::value<std::vector<k2::String>>()->multitoken(), "A list(space-delimited) of TCP listening endpoints to assign to each core. You can specify either full endpoints, e.g. 'tcp+k2rpc://192.168.1.2:12345' or just ports , e.g. '12345'. If simple ports are specified, the stack will bind to 0.0.0.0. Conflicts with --tcp_port")
     ("enable_tx_checksum", bpo::value<bool>()->default_value(false), "enables transport-level checksums (and validation) on all messages. it incurs double read penalty(data is read separately to compute checksum)")
+    ("log_async", bpo::value<bool>()->default_value(true), "If true, log lines are written out by a background thread instead of the logging thread")
+    ("log_ring_size", bpo::value<size_t>()->default_value(1<<20), "The size in bytes of the per-thread ring for async logging. Lines which do not fit in the ring are dropped")
     ("log_level", bpo::value<std::vector<k2::String>>()->multitoken(), "A list(space-delimited) of log levels. The very first entry must be one of VERBOSE|DEBUG|INFO|WARN|ERROR|FATAL and it sets the global log level. Subsequent entries are of the form <log_module_name>=<log_level> and allow the user to override the log level for particular log modules")
     ;
 
     // we are now ready to assemble the running application
     auto result = _app->run_deprecated(argc, argv, [&] {
         auto& config = _app->configuration();
+        k2::logging::Logger::asyncOutput = config["log_async"].as<bool>();
+        k2::logging::Logger::ringSize = config["log_ring_size"].as<size_t>();
         return seastar::smp::invoke_on_all([&] {
             // setup log configuration in each core
             k2::logging::Logger::threadId = seastar::this_shard_id();
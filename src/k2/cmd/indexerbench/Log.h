@@ -1,7 +1,7 @@
 /*
 MIT License
 
-Copyright(c) 2020 Futurewei Cloud
+Copyright(c) 2021 Futurewei Cloud
 
     Permission is hereby granted,
     free of charge, to any person obtaining a copy of this software and associated documentation files(the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
@@ -22,18 +22,9 @@ Copyright(c) 2020 Futurewei Cloud
 */
 
 #pragma once
-#include <k2/common/Common.h>
 
-namespace k2
-{
-//
-//  K2 internal MVCC representation
-//
-template<typename ValueType>
-struct VersionedTreeNode {
-    uint64_t version;
-    ValueType value;
-    std::unique_ptr<VersionedTreeNode<ValueType>> next;
-};
+#include <k2/logging/Log.h>
 
+namespace k2::log {
+inline thread_local k2::logging::Logger ibench("k2::indexer_bench");
 }
@@ -0,0 +1,214 @@
+/*
+MIT License
+
+Copyright(c) 2022 Futurewei Cloud
+
+    Permission is hereby granted,
+    free of charge, to any person obtaining a copy of this software and associated documentation files(the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
+
+    The above copyright notice and this permission notice shall be included in all copies
+    or
+    substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS",
+    WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER
+    LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+*/
+
+// Microbenchmark for the K23SI key indexer containers.
+// Each indexer type is loaded with the same YCSB key set, after which we measure point lookups, short scans and
+// inserts with keys drawn from one of the YCSB request distributions.
+#include <k2/appbase/Appbase.h>
+#include <k2/appbase/AppEssentials.h>
+#include <k2/common/MapUtil.h>
+#include <k2/module/k23si/Indexer.h>
+
+#include <seastar/core/later.hh>
+
+#include <set>
+#include <vector>
+
+#include <k2/cmd/ycsb/ycsb_rand.h>
+
+#include "Log.h"
+
+using namespace k2;
+
+class IndexerBench {
+public:  // application lifespan
+    seastar::future<> gracefulStop() {
+        K2LOG_I(log::ibench, "stop");
+        return std::move(_benchFut);
+    }
+
+    seastar::future<> start() {
+        if (seastar::this_shard_id() != 0) {
+            // single-core benchmark
+            return seastar::make_ready_future();
+        }
+        K2LOG_I(log::ibench, "Running with records={}, ops={}, dist={}", _numRecords(), _numOps(), _requestDistName());
+        for (uint64_t id = 0; id < _numRecords() + _numInserts(); ++id) {
+            _keys.push_back(_idToKey(id));
+        }
+        _benchFut = _runType(dto::IndexerType::Map)
+            .then([this] {
+                return _runType(dto::IndexerType::BPTree);
+            })
+            .handle_exception([](auto exc) {
+                K2LOG_W_EXC(log::ibench, exc, "Unable to execute benchmark");
+                return seastar::make_ready_future();
+            })
+            .finally([] {
+                K2LOG_I(log::ibench, "Done with benchmark");
+                AppBase().stop(0);
+            });
+        return seastar::make_ready_future();
+    }
+
+private:
+    // Same key layout as the YCSB benchmark: the id, left-padded to the field length
+    String _idToKey(uint64_t id) {
+        String key(std::to_string(id));
+        return String(_fieldLength() > key.size() ? _fieldLength() - key.size() : 0, char(126)) + key;
+    }
+
+    std::unique_ptr<RandomGenerator> _makeDistribution(uint64_t min, uint64_t max) {
+        auto name = _requestDistName();
+        K2ASSERT(log::ibench, name=="uniform" || name=="zipfian" || name=="szipfian" || name=="latest", "Invalid distribution name");
+        if (name == "uniform") {
+            return std::make_unique<UniformGenerator>(min, max);
+        } else if (name == "zipfian") {
+            return std::make_unique<ZipfianGenerator>(min, max);
+        } else if (name == "szipfian") {
+            return std::make_unique<ScrambledZipfianGenerator>(min, max);
+        }
+        return std::make_unique<LatestGenerator>(min, max);
+    }
+
+    void _report(dto::IndexerType type, const char* phase, TimePoint start, uint64_t ops) {
+        auto elapsed = Clock::now() - start;
+        K2LOG_I(log::ibench, "{} {}: ops={}, total={}, nsPerOp={}", type, phase, ops, elapsed,
+                ops == 0 ? 0 : nsec(elapsed).count() / ops);
+    }
+
+    IndexerKey _indexerKey(uint64_t id) {
+        return IndexerKey(_keys[id], "");
+    }
+
+    // load the initial records in key order, the same way the write path adds new keys
+    void _load(dto::IndexerType type, KeyIndexer& ki) {
+        auto start = Clock::now();
+        for (uint64_t id = 0; id < _numRecords(); ++id) {
+            auto key = _indexerKey(id);
+            auto [before, found, after] = keyRange(key, ki);
+            ki.insert(after, std::make_pair(std::move(key), VersionSet{}));
+        }
+        _report(type, "load", start, _numRecords());
+    }
+
+    void _pointReads(dto::IndexerType type, KeyIndexer& ki) {
+        auto dist = _makeDistribution(0, _numRecords() - 1);
+        std::vector<IndexerKey> keys;
+        keys.reserve(_numOps());
+        for (uint64_t i = 0; i < _numOps(); ++i) {
+            keys.push_back(_indexerKey(dist->getValue()));
+        }
+        uint64_t found = 0;
+        auto start = Clock::now();
+        for (auto& key : keys) {
+            auto [before, fit, after] = keyRange(key, ki);
+            found += fit != ki.end();
+        }
+        _report(type, "read", start, keys.size());
+        K2ASSERT(log::ibench, found == keys.size(), "Missing keys in indexer: found={}, expected={}", found, keys.size());
+
+        // the same reads through the hash index
+        found = 0;
+        start = Clock::now();
+        for (auto& key : keys) {
+            found += ki.findEntry(key) != nullptr;
+        }
+        _report(type, "hashread", start, keys.size());
+        K2ASSERT(log::ibench, found == keys.size(), "Missing keys in hash index: found={}, expected={}", found, keys.size());
+    }
+
+    void _scans(dto::IndexerType type, KeyIndexer& ki) {
+        auto dist = _makeDistribution(0, _numRecords() - 1);
+        UniformGenerator scanLength(1, _maxScanLength());
+        std::vector<std::pair<IndexerKey, uint64_t>> scans;
+        scans.reserve(_numOps());
+        for (uint64_t i = 0; i < _numOps(); ++i) {
+            scans.emplace_back(_indexerKey(dist->getValue()), scanLength.getValue());
+        }
+        uint64_t records = 0;
+        auto start = Clock::now();
+        for (auto& [key, length] : scans) {
+            auto it = ki.lower_bound(key);
+            for (uint64_t i = 0; i < length && it != ki.end(); ++i, ++it) {
+                records += it->second.committed.size() + 1;
+            }
+        }
+        _report(type, "scan", start, scans.size());
+        K2LOG_I(log::ibench, "{} scan: records={}", type, records);
+    }
+
+    void _inserts(dto::IndexerType type, KeyIndexer& ki) {
+        auto start = Clock::now();
+        for (uint64_t id = _numRecords(); id < _numRecords() + _numInserts(); ++id) {
+            auto key = _indexerKey(id);
+            auto [before, found, after] = keyRange(key, ki);
+            ki.insert(after, std::make_pair(std::move(key), VersionSet{}));
+        }
+        _report(type, "insert", start, _numInserts());
+    }
+
+    seastar::future<> _runType(dto::IndexerType type) {
+        return seastar::do_with(KeyIndexer(type), [this, type] (auto& ki) {
+            _load(type, ki);
+            // yield between phases to let the reactor do its housekeeping
+            return seastar::yield()
+                .then([this, type, &ki] {
+                    _pointReads(type, ki);
+                    return seastar::yield();
+                })
+                .then([this, type, &ki] {
+                    _scans(type, ki);
+                    return seastar::yield();
+                })
+                .then([this, type, &ki] {
+                    _inserts(type, ki);
+                    K2ASSERT(log::ibench, ki.size() == _numRecords() + _numInserts(), "Unexpected indexer size: {}", ki.size());
+                });
+        });
+    }
+
+    // all keys, by id
+    std::vector<String> _keys;
+    seastar::future<> _benchFut = seastar::make_ready_future();
+
+    ConfigVar<size_t> _numRecords{"num_records"};
+    ConfigVar<size_t> _numInserts{"num_records_insert"};
+    ConfigVar<uint64_t> _numOps{"num_ops"};
+    ConfigVar<uint32_t> _fieldLength{"field_length"};
+    ConfigVar<uint32_t> _maxScanLength{"max_scan_length"};
+    ConfigVar<String> _requestDistName{"request_dist"};
+}; // class IndexerBench
+
+int main(int argc, char** argv) {
+    App app("IndexerBench");
+    app.addApplet<IndexerBench>();
+    app.addOptions()
+        ("num_records", bpo::value<size_t>()->default_value(1000000), "How many records to load")
+        ("num_records_insert", bpo::value<size_t>()->default_value(100000), "How many records to insert after the load")
+        ("num_ops", bpo::value<uint64_t>()->default_value(1000000), "How many reads and scans to run")
+        ("field_length", bpo::value<uint32_t>()->default_value(20), "The length of the keys")
+        ("max_scan_length", bpo::value<uint32_t>()->default_value(100), "Max number of keys to visit in a scan")
+        ("request_dist", bpo::value<String>()->default_value("szipfian"), "Request distribution"); // choices are: "uniform", "zipfian", "szipfian" (scrambledZipfian), "latest"
+    return app.start(argc, argv);
+}
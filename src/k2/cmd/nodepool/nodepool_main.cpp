@@ -33,14 +33,35 @@ int main(int argc, char** argv) {
     app.addOptions()
         ("partition_request_timeout", bpo::value<k2::ParseableDuration>(), "Timeout of K23SI operations, as chrono literals")
         ("tso_timeout", bpo::value<k2::ParseableDuration>(), "Timeout of TSO operations, as chrono literals")
+        ("tso_batch_size", bpo::value<uint32_t>(), "The number of timestamps to request from the TSO at a time")
         ("cpo_request_timeout", bpo::value<k2::ParseableDuration>(), "CPO request timeout")
         ("cpo_request_backoff", bpo::value<k2::ParseableDuration>(), "CPO request backoff")
-        ("k23si_query_pagination_limit", bpo::value<uint32_t>(), "Max records to return in a single query response")
+        ("k23si_query_pagination_limit", bpo::value<uint32_t>(), "Max records to return in a single query response. Zero disables")
+        ("k23si_query_pagination_bytes_limit", bpo::value<uint32_t>(), "Max bytes of records to return in a single query response. Zero disables")
         ("k23si_query_scan_limit", bpo::value<uint32_t>(), "Max records to scan in a single query execution")
         ("k23si_query_push_limit", bpo::value<uint32_t>(), "Min records in response needed to avoid a push during query processing")
+        ("k23si_compiled_filter_cache_size", bpo::value<uint32_t>(), "Max number of distinct query filters to keep compiled")
+        ("k23si_query_aggregation_group_limit", bpo::value<uint32_t>(), "Max number of groups in a single aggregation query response")
+        ("k23si_query_cursor_cache_size", bpo::value<uint32_t>(), "Max number of paused query cursors to keep for the next page of a query. Zero disables")
+        ("k23si_query_cursor_timeout", bpo::value<k2::ParseableDuration>(), "How long to keep a paused query cursor, as chrono literals")
         ("k23si_max_push_count", bpo::value<uint32_t>(), "Max push count in handleRead and handleWrite")
-        ("k23si_read_cache_size", bpo::value<uint64_t>(), "Max size of read cache")
-        ("k23si_persistence_endpoints", bpo::value<std::vector<k2::String>>()->multitoken()->default_value(std::vector<k2::String>()), "A space-delimited list of k2 persistence endpoints, each core will pick one endpoint");
+        ("k23si_read_cache_size", bpo::value<uint64_t>(), "Memory budget in bytes for the read timestamp cache. Zero means unbounded")
+        ("k23si_gc_slice_keys", bpo::value<uint32_t>(), "Max number of keys the version GC processes before yielding")
+        ("k23si_gc_slice_budget", bpo::value<k2::ParseableDuration>(), "Max time the version GC runs before yielding, as chrono literals")
+        ("k23si_arena_slab_size", bpo::value<uint32_t>(), "Size of the memory slabs which hold record values. Zero disables")
+        ("k23si_arena_compaction_occupancy", bpo::value<double>(), "The version GC compacts slabs with less than this fraction of their memory in use")
+        ("k23si_indexer_hash_index", bpo::value<bool>(), "Keep a hash index for exact-match key lookups next to the ordered key index")
+        ("k23si_txn_finalize_group_size", bpo::value<uint64_t>(), "Max number of transactions to finalize in one message to a partition")
+        ("k23si_txn_finalize_group_window", bpo::value<k2::ParseableDuration>(), "How long to wait for more transactions to finalize in the same message to a partition, as chrono literals. Zero disables")
+        ("k23si_one_phase_commit", bpo::value<bool>(), "Finalize the WIs of transactions which wrote only to their TRH partition in place, without finalize RPCs")
+        ("k23si_persistence_max_inflight_flushes", bpo::value<uint32_t>(), "Max number of persistence flushes in flight at the same time")
+        ("k23si_persistence_flush_bytes", bpo::value<uint64_t>(), "Flush the buffered persistence data once it reaches this many bytes")
+        ("k23si_persistence_target_flush_latency", bpo::value<k2::ParseableDuration>(), "Target latency of persistence flushes, used to size the flush batches, as chrono literals. Zero disables batching")
+        ("k23si_persistence_endpoints", bpo::value<std::vector<k2::String>>()->multitoken()->default_value(std::vector<k2::String>()), "A space-delimited list of k2 persistence endpoints, each partition will pick one endpoint")
+        ("k23si_recovery_page_size", bpo::value<uint64_t>(), "How many bytes to read from persistence at a time during partition recovery")
+        ("k23si_recovery_batch_size", bpo::value<uint32_t>(), "How many persisted records to apply during partition recovery before yielding")
+        ("k23si_snapshot_interval", bpo::value<k2::ParseableDuration>(), "How often to snapshot the indexer to persistence, as chrono literals. Zero disables snapshots")
+        ("k23si_snapshot_chunk_keys", bpo::value<uint32_t>(), "How many keys to write in each indexer snapshot chunk before yielding");
 
     app.addApplet<k2::cpo::HeartbeatResponder>();
     app.addApplet<k2::APIServer>();
@@ -30,5 +30,8 @@ int main(int argc, char** argv) {
     app.addApplet<k2::cpo::HeartbeatResponder>();
     // pass the ss::distributed container to the PersistenceService constructor
     app.addApplet<k2::PersistenceService>();
+    app.addOptions()
+        ("persistence_wal_dir", bpo::value<k2::String>(), "The directory in which to keep the write-ahead log. Each partition uses a separate sub-directory")
+        ("persistence_wal_segment_size", bpo::value<uint64_t>(), "The size in bytes at which the write-ahead log rolls over to a new segment file");
     return app.start(argc, argv);
 }
@@ -28,6 +28,8 @@ Copyright(c) 2020 Futurewei Cloud
 int main(int argc, char** argv) {
     k2::App app("PlogServer");
     app.addApplet<k2::PlogServer>();
+    app.addOptions()
+        ("plog_data_dir", bpo::value<k2::String>(), "The directory in which to keep the plog files. Each shard uses a separate sub-directory");
     return app.start(argc, argv);
 }
 
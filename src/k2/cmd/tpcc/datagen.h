@@ -33,7 +33,8 @@ Copyright(c) 2020 Futurewei Cloud
 #include "tpcc_rand.h"
 #include <boost/range/irange.hpp>
 
-typedef std::vector<std::function<seastar::future<k2::WriteResult>(k2::K2TxnHandle&)>> TPCCData;
+// The rows to load. Each one is built lazily at load time, once the schemas are available
+typedef std::vector<std::function<k2::dto::SKVRecord()>> TPCCData;
 
 struct TPCCDataGen {
     seastar::future<TPCCData> generateItemData()
@@ -47,14 +48,14 @@ struct TPCCDataGen {
             [this] (auto& data, auto& random, auto& range) {
                 return seastar::do_for_each(range, [&random, &data] (auto idx) mutable {
                     auto item = Item(random, idx);
-                    data.push_back([_item=std::move(item)] (k2::K2TxnHandle& txn) mutable {
-                        return writeRow<Item>(_item, txn);
+                    data.push_back([_item=std::move(item)] () mutable {
+                        return makeRecord<Item>(_item);
                     });
                 })
                 .then([&data] () mutable {
-                    data.push_back([meta=TPCCMetadata(true)] (k2::K2TxnHandle& txn) mutable {
+                    data.push_back([meta=TPCCMetadata(true)] () mutable {
                         // the last write signals that load is complete
-                        return writeRow<TPCCMetadata>(meta, txn);
+                        return makeRecord<TPCCMetadata>(meta);
                     });
                     return seastar::make_ready_future<TPCCData>(std::move(data));
                 });
@@ -69,17 +70,17 @@ struct TPCCDataGen {
             // populate secondary index idx_customer_name
             auto idx_customer_name = IdxCustomerName(customer.WarehouseID.value(), customer.DistrictID.value(),
                 customer.LastName.value(), customer.CustomerID.value());
-            data.push_back([_idx_customer_name=std::move(idx_customer_name)] (k2::K2TxnHandle& txn) mutable {
-                return writeRow<IdxCustomerName>(_idx_customer_name, txn);
+            data.push_back([_idx_customer_name=std::move(idx_customer_name)] () mutable {
+                return makeRecord<IdxCustomerName>(_idx_customer_name);
             });
 
-            data.push_back([_customer=std::move(customer)] (k2::K2TxnHandle& txn) mutable {
-                return writeRow<Customer>(_customer, txn);
+            data.push_back([_customer=std::move(customer)] () mutable {
+                return makeRecord<Customer>(_customer);
             });
 
             auto history = History(random, w_id, d_id, i);
-            data.push_back([_history=std::move(history)] (k2::K2TxnHandle& txn) mutable {
-                return writeRow<History>(_history, txn);
+            data.push_back([_history=std::move(history)] () mutable {
+                return makeRecord<History>(_history);
             });
         }
     }
@@ -100,28 +101,28 @@ struct TPCCDataGen {
 
             for (int j=1; j<=order.OrderLineCount; ++j) {
                 auto order_line = OrderLine(random, order, j);
-                data.push_back([_order_line=std::move(order_line)] (k2::K2TxnHandle& txn) mutable {
-                    return writeRow<OrderLine>(_order_line, txn);
+                data.push_back([_order_line=std::move(order_line)] () mutable {
+                    return makeRecord<OrderLine>(_order_line);
                 });
             }
 
             if (i >= 2101) {
                 auto new_order = NewOrder(order);
-                data.push_back([_new_order=std::move(new_order)] (k2::K2TxnHandle& txn) mutable {
-                    return writeRow<NewOrder>(_new_order, txn);
+                data.push_back([_new_order=std::move(new_order)] () mutable {
+                    return makeRecord<NewOrder>(_new_order);
                 });
             }
 
             auto idx_order_customer = IdxOrderCustomer(order.WarehouseID.value(), order.DistrictID.value(),
                                      order.CustomerID.value(), order.OrderID.value());
 
-            data.push_back([_order=std::move(order)] (k2::K2TxnHandle& txn) mutable {
-                return writeRow<Order>(_order, txn);
+            data.push_back([_order=std::move(order)] () mutable {
+                return makeRecord<Order>(_order);
             });
 
             // populate secondary index idx_order_customer
-            data.push_back([_idx_order_customer=std::move(idx_order_customer)] (k2::K2TxnHandle& txn) mutable {
-                return writeRow<IdxOrderCustomer>(_idx_order_customer, txn);
+            data.push_back([_idx_order_customer=std::move(idx_order_customer)] () mutable {
+                return makeRecord<IdxOrderCustomer>(_idx_order_customer);
             });
         }
     }
@@ -151,8 +152,8 @@ struct TPCCDataGen {
             [this, &data, &random] (auto idx) mutable {
                 auto warehouse = Warehouse(random, idx);
 
-                data.push_back([_warehouse=std::move(warehouse)] (k2::K2TxnHandle& txn) mutable {
-                    return writeRow<Warehouse>(_warehouse, txn);
+                data.push_back([_warehouse=std::move(warehouse)] () mutable {
+                    return makeRecord<Warehouse>(_warehouse);
                 });
 
                 K2LOG_I(log::tpcc, "Generating Stock for wh={}", idx);
@@ -161,8 +162,8 @@ struct TPCCDataGen {
                     [&random, &data, idx] (auto& range) {
                         return seastar::do_for_each(range, [&random, &data, idx] (auto jdx) {
                             auto stock = Stock(random, idx, jdx);
-                            data.push_back([_stock=std::move(stock)] (k2::K2TxnHandle& txn) mutable {
-                                return writeRow<Stock>(_stock, txn);
+                            data.push_back([_stock=std::move(stock)] () mutable {
+                                return makeRecord<Stock>(_stock);
                             });
                         });
                     })
@@ -173,8 +174,8 @@ struct TPCCDataGen {
                         [this, &random, &data, idx] (auto& range) {
                             return seastar::do_for_each(range, [this, &random, &data, idx] (auto jdx) {
                                 auto district = District(random, idx, jdx);
-                                data.push_back([_district=std::move(district)] (k2::K2TxnHandle& txn) mutable {
-                                    return writeRow<District>(_district, txn);
+                                data.push_back([_district=std::move(district)] () mutable {
+                                    return makeRecord<District>(_district);
                                 });
 
                                 generateCustomerData(data, random, idx, jdx);
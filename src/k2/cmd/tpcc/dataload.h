@@ -70,19 +70,25 @@ public:
 private:
     future<> insertDataLoop(K2TxnHandle& txn)
     {
-        return do_with((size_t)0, [this, &txn] (size_t& current_size) {
-            return do_until(
-                [this, &current_size] { return _data.size() == 0 || current_size >= _writes_per_load_txn(); },
-                [this, &current_size, &txn] () {
-                auto write_func = std::move(_data.back());
-                _data.pop_back();
-                if (_data.size() %5000 == 0) {
-                    K2LOG_D(log::tpcc, "remaining data size={}", _data.size());
+        std::vector<dto::SKVRecord> records;
+        while (_data.size() > 0 && records.size() < _writes_per_load_txn()) {
+            records.push_back(_data.back()());
+            _data.pop_back();
+            if (_data.size() %5000 == 0) {
+                K2LOG_D(log::tpcc, "remaining data size={}", _data.size());
+            }
+        }
+
+        // all rows of the txn go out together, in one request per partition
+        return do_with(std::move(records), [&txn] (auto& records) {
+            return txn.multiWrite(records)
+            .then([&txn] (std::vector<WriteResult>&& results) {
+                for (auto& result : results) {
+                    if (!result.status.is2xxOK()) {
+                        K2LOG_D(log::tpcc, "writeRow failed: {}", result.status);
+                        return make_exception_future<EndResult>(std::runtime_error("writeRow failed!"));
+                    }
                 }
-                ++current_size;
-
-                return write_func(txn).discard_result();
-            }).then([&txn] () {
                 return txn.end(true);
             }).then([] (EndResult&& result) {
                 if (!result.status.is2xxOK()) {
@@ -54,6 +54,15 @@ static const String itemCollectionName = "TPCCItem";
     } \
     while (0) \
 
+// Build the SKVRecord for the given row, e.g. to write it as part of a batch
+template<typename ValueType>
+dto::SKVRecord makeRecord(ValueType& row)
+{
+    dto::SKVRecord skv_record(row.collectionName, row.schema);
+    row.__writeFields(skv_record);
+    return skv_record;
+}
+
 template<typename ValueType>
 seastar::future<WriteResult> writeRow(ValueType& row, K2TxnHandle& txn, bool erase = false)
 {
@@ -481,6 +481,7 @@ int main(int argc, char** argv) {;
         ("test_duration_s", bpo::value<uint32_t>()->default_value(30), "How long in seconds to run")
         ("partition_request_timeout", bpo::value<ParseableDuration>(), "Timeout of K23SI operations, as chrono literals")
         ("tso_timeout", bpo::value<k2::ParseableDuration>(), "Timeout of TSO operations, as chrono literals")
+        ("tso_batch_size", bpo::value<uint32_t>(), "The number of timestamps to request from the TSO at a time")
         ("dataload_txn_timeout", bpo::value<ParseableDuration>(), "Timeout of dataload txn, as chrono literal")
         ("writes_per_load_txn", bpo::value<size_t>()->default_value(10), "The number of writes to do in the load phase between txn commit calls")
         ("districts_per_warehouse", bpo::value<int16_t>()->default_value(10), "The number of districts per warehouse")
@@ -490,6 +491,7 @@ int main(int argc, char** argv) {;
         ("cpo_request_backoff", bpo::value<ParseableDuration>(), "CPO request backoff")
         ("create_collection_deadline", bpo::value<ParseableDuration>(), "Collection creation and assignment deadline")
         ("delivery_txn_batch_size", bpo::value<uint16_t>()->default_value(10), "The batch number of Delivery transaction")
+        ("new_order_async_writes", bpo::value<bool>()->default_value(false), "Send the writes of NewOrder transactions as async writes")
         ("txn_weights", bpo::value<std::vector<int>>()->multitoken()->default_value(std::vector<int>({43,4,4,45,4})), "A comma-separated list of exactly 5 elements denoting the percentage for each txn type: Payment, OrderStatus, Delivery, NewOrder, and StockLevel");
 
     app.addApplet<k2::tso::TSOClient>();
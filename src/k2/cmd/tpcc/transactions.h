@@ -348,6 +348,7 @@ public:
     future<bool> attempt() override {
         K2TxnOptions options{};
         options.deadline = Deadline(5s);
+        options.asyncWrites = _async_writes();
         return _client.beginTxn(options)
         .then([this] (K2TxnHandle&& txn) {
             _txn = std::move(txn);
@@ -402,30 +403,42 @@ private:
             // Write order secondary index row
             future<WriteResult> order_idx_update = writeRow<IdxOrderCustomer>(idx_order_customer, _txn);
 
-            future<> line_updates = parallel_for_each(_lines.begin(), _lines.end(), [this] (OrderLine& line) {
-                return _txn.read<Item>(Item(*(line.ItemID)))
-                .then([this, i_id=*(line.ItemID)] (auto&& result) {
-                    if (result.status == dto::K23SIStatus::KeyNotFound) {
-                        return make_exception_future<Item>(std::runtime_error("Bad ItemID"));
-                    } else if (!result.status.is2xxOK()) {
-                        K2LOG_D(log::tpcc, "Bad read status: {}", result.status);
-                        return make_exception_future<Item>(std::runtime_error("Bad read status"));
-                    }
-
-                    return make_ready_future<Item>(std::move(result.value));
+            // read all items and stocks for the order lines with one request per partition
+            std::vector<Item> items;
+            std::vector<Stock> stocks;
+            for (OrderLine& line : _lines) {
+                items.emplace_back(*(line.ItemID));
+                stocks.emplace_back(*(line.SupplyWarehouseID), *(line.ItemID));
+            }
+            future<> item_reads = _txn.multiRead<Item>(std::move(items))
+            .then([this] (auto&& results) {
+                _items = std::move(results);
+            });
+            future<> stock_reads = _txn.multiRead<Stock>(std::move(stocks))
+            .then([this] (auto&& results) {
+                _stocks = std::move(results);
+            });
 
-                }).then([this, supply_id=*(line.SupplyWarehouseID)] (Item&& item) {
-                    return _txn.read<Stock>(Stock(supply_id, *(item.ItemID)))
-                    .then([item, supply_id] (auto&& result) {
-                        if (!result.status.is2xxOK()) {
-                            K2LOG_D(log::tpcc, "Bad read status: {}", result.status);
-                            return make_exception_future<std::pair<Item, Stock>>(std::runtime_error("Bad read status"));
-                        }
-                        return make_ready_future<std::pair<Item, Stock>>(std::make_pair(std::move(item), result.value));
-                    });
+            future<> line_updates = when_all_succeed(std::move(item_reads), std::move(stock_reads)).discard_result()
+            .then([this] {
+                for (size_t i = 0; i < _lines.size(); ++i) {
+                    if (_items[i].status == dto::K23SIStatus::KeyNotFound) {
+                        return make_exception_future<>(std::runtime_error("Bad ItemID"));
+                    } else if (!_items[i].status.is2xxOK()) {
+                        K2LOG_D(log::tpcc, "Bad read status: {}", _items[i].status);
+                        return make_exception_future<>(std::runtime_error("Bad read status"));
+                    }
+                    if (!_stocks[i].status.is2xxOK()) {
+                        K2LOG_D(log::tpcc, "Bad read status: {}", _stocks[i].status);
+                        return make_exception_future<>(std::runtime_error("Bad read status"));
+                    }
+                }
 
-                }).then([this, line] (std::pair<Item, Stock>&& pair) mutable {
-                    auto& [item, stock] = pair;
+                std::vector<future<>> updates;
+                for (size_t i = 0; i < _lines.size(); ++i) {
+                    OrderLine& line = _lines[i];
+                    Item& item = _items[i].value;
+                    Stock& stock = _stocks[i].value;
                     *(line.Amount) = *(item.Price) * *(line.Quantity);
                     _total_amount += *(line.Amount);
                     line.DistInfo = stock.getDistInfo(*(line.DistrictID));
@@ -437,8 +450,9 @@ private:
                     auto line_update = writeRow<OrderLine>(line, _txn);
                     auto stock_update = partialUpdateRow<Stock, std::vector<k2::String>>(updateStock, stockUpdateFields, _txn);
 
-                    return when_all_succeed(std::move(line_update), std::move(stock_update)).discard_result();
-                });
+                    updates.push_back(when_all_succeed(std::move(line_update), std::move(stock_update)).discard_result());
+                }
+                return when_all_succeed(updates.begin(), updates.end()).discard_result();
             });
 
             return when_all_succeed(std::move(line_updates), std::move(order_update), std::move(order_idx_update), std::move(new_order_update), std::move(district_update)).discard_result();
@@ -515,12 +529,16 @@ private:
     bool _failed;
     Order _order;
     std::vector<OrderLine> _lines;
+    // the items and stocks for the order lines, in the order of _lines
+    std::vector<ReadResult<Item>> _items;
+    std::vector<ReadResult<Stock>> _stocks;
     // The below variables are needed to "display" the order total amount,
     // but are not needed for any DB operations
     DecimalD25 _w_tax;
     DecimalD25 _d_tax;
     DecimalD25 _c_discount;
     DecimalD25 _total_amount = 0;
+    ConfigVar<bool> _async_writes{"new_order_async_writes"};
 };
 
 class OrderStatusT : public TPCCTxn
@@ -1315,31 +1333,31 @@ private:
             _query_orderline.setLimit(-1);
             _query_orderline.setReverseDirection(false);
 
-            std::vector<String> projection{"ItemID"}; // make projection
-            _query_orderline.addProjection(projection);
+            // the distinct item ids are computed by the server as the groups of an aggregation
+            _query_orderline.addGroupBy("ItemID");
+            _query_orderline.addAggregate(dto::AggregateFunction::COUNT);
             dto::expression::Expression filter{};   // make filter Expression
             _query_orderline.setFilterExpression(std::move(filter));
 
-            return do_with(std::vector<std::vector<dto::SKVRecord>>(), false,
-            [this] (std::vector<std::vector<dto::SKVRecord>>& result_set, bool& done) {
+            return do_with(std::vector<dto::AggregateGroup>(), false,
+            [this] (std::vector<dto::AggregateGroup>& groups, bool& done) {
                 return do_until(
                 [this, &done] () { return done; },
-                [this, &result_set, &done] () {
+                [this, &groups, &done] () {
                     return _txn.query(_query_orderline)
-                    .then([this, &result_set, &done] (auto&& response) {
+                    .then([this, &groups, &done] (auto&& response) {
                         CHECK_READ_STATUS(response);
                         done = response.status.is2xxOK() ? _query_orderline.isDone() : true;
-                        result_set.push_back(std::move(response.records));
+                        groups = std::move(response.aggregates);
 
                         return make_ready_future();
                     });
                 })
-                .then([this, &result_set] () {
+                .then([this, &groups] () {
                     std::set<int32_t> item_ids;
-                    for (std::vector<dto::SKVRecord>& set : result_set) {
-                        for (dto::SKVRecord& rec : set) {
-                            std::optional<int32_t> itemId = rec.deserializeField<int32_t>("ItemID");
-                            item_ids.insert(*itemId);
+                    for (dto::AggregateGroup& group : groups) {
+                        if (!group.groupValues[0].isNull()) {
+                            item_ids.insert(group.groupValues[0].intValue);
                         }
                     }
 
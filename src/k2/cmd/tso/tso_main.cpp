@@ -30,6 +30,8 @@ int main(int argc, char** argv) {
     app.addApplet<k2::cpo::HeartbeatResponder>();
     app.addApplet<k2::tso::TSOService>();
 
-    app.addOptions()("tso.clock_poller_cpu", bpo::value<int16_t>(), "CPU to which to pin the GPS clock polling thread");
+    app.addOptions()
+        ("tso.clock_poller_cpu", bpo::value<int16_t>(), "CPU to which to pin the GPS clock polling thread")
+        ("tso.max_batch_size", bpo::value<uint32_t>(), "The max number of timestamps returned for a single request");
     return app.start(argc, argv);
 }
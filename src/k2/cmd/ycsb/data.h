@@ -239,8 +239,8 @@ private:
     const static inline String _metadata_key{"ycsb_system_metadata"};
 };
 
-// function to write the given YCSB Data row
-seastar::future<WriteResult> writeRow(YCSBData& row, K2TxnHandle& txn, bool erase = false, dto::ExistencePrecondition precondition = dto::ExistencePrecondition::None)
+// function to build the SKV record for the given YCSB Data row
+dto::SKVRecord makeRecord(YCSBData& row)
 {
     dto::SKVRecord skv_record(YCSBData::collectionName, YCSBData::schema); // create SKV record
 
@@ -248,6 +248,14 @@ seastar::future<WriteResult> writeRow(YCSBData& row, K2TxnHandle& txn, bool eras
         skv_record.serializeNext<String>(field); // add fields to SKV record
     }
 
+    return skv_record;
+}
+
+// function to write the given YCSB Data row
+seastar::future<WriteResult> writeRow(YCSBData& row, K2TxnHandle& txn, bool erase = false, dto::ExistencePrecondition precondition = dto::ExistencePrecondition::None)
+{
+    dto::SKVRecord skv_record = makeRecord(row);
+
     return txn.write<dto::SKVRecord>(skv_record, erase, precondition).then([] (WriteResult&& result) {
         if (!result.status.is2xxOK() && result.status.code!=412 && result.status.code!=404) { // k2::Statuses::S412_Precondition_Failed for write with erase=false and key already exists and k2::Statuses::S404_Not_Found for write with erase=true and key does not exist
             K2LOG_D(log::ycsb, "writeRow failed and is retryable: {}", result.status);
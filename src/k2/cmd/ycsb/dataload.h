@@ -74,25 +74,29 @@ private:
     seastar::future<> insertDataLoop(K2TxnHandle& txn, size_t start_idx, size_t endIdxShard)
     {
         K2LOG_D(log::ycsb, "Starting transaction, start_idx is {}", start_idx);
-        return seastar::do_with((size_t)0, [this, &txn, start_idx, endIdxShard] (size_t& current_size) {
-            return seastar::do_until(
-                [this, &current_size, start_idx, endIdxShard] { return ((current_size >= _writes_per_load_txn()) || ((start_idx + current_size)>= endIdxShard)); },
-                [this, &current_size, &txn, start_idx] () {
-                uint8_t isLoad = _random.BiasedInt();
-                if((!(_requestDistName()=="latest") && isLoad) || (_requestDistName()=="latest" && (start_idx + current_size)<_num_records())){ // load record with prob = _num_records / _num_keys or if latest load all records uptil num_records()
-                    K2LOG_D(log::ycsb, "Record being loaded now in this txn is {}", start_idx + current_size);
-
-                    YCSBData row(start_idx + current_size, _random); // generate row
-                    ++current_size;
-
-                    return writeRow(row, txn).discard_result();
+        std::vector<dto::SKVRecord> records;
+        for (size_t current_size = 0; current_size < _writes_per_load_txn() && (start_idx + current_size) < endIdxShard; ++current_size) {
+            uint8_t isLoad = _random.BiasedInt();
+            if((!(_requestDistName()=="latest") && isLoad) || (_requestDistName()=="latest" && (start_idx + current_size)<_num_records())){ // load record with prob = _num_records / _num_keys or if latest load all records uptil num_records()
+                K2LOG_D(log::ycsb, "Record being loaded now in this txn is {}", start_idx + current_size);
+
+                YCSBData row(start_idx + current_size, _random); // generate row
+                records.push_back(makeRecord(row));
+                continue;
+            }
+            K2LOG_D(log::ycsb, "Record {} skipped", start_idx + current_size);
+        }
+
+        // all rows of the txn go out together, in one request per partition
+        return seastar::do_with(std::move(records), [&txn] (auto& records) {
+            return txn.multiWrite(records)
+            .then([&txn] (std::vector<WriteResult>&& results) {
+                for (auto& result : results) {
+                    if (!result.status.is2xxOK()) {
+                        K2LOG_D(log::ycsb, "writeRow failed and is retryable: {}", result.status);
+                        return seastar::make_exception_future<EndResult>(std::runtime_error("writeRow failed!"));
+                    }
                 }
-                K2LOG_D(log::ycsb, "Record {} skipped", start_idx + current_size);
-                ++current_size;
-
-                return seastar::make_ready_future<>();
-
-            }).then([&txn] () {
                 K2LOG_D(log::ycsb, "Ending transaction");
                 return txn.end(true);
             }).then([] (EndResult&& result) {
@@ -237,29 +237,21 @@ private:
             _query_scan.setFilterExpression(std::move(filter));
             _scanResult.clear();
 
-            return seastar::do_with((bool)false,  [this] (bool& done) {
-                return seastar::do_until(
-                [this, &done] () { return done; },
-                [this, &done] () {
-                    return _txn.query(_query_scan)
-                    .then([this, &done] (auto&& response) {
-                        CHECK_READ_STATUS(response);
-                        done = response.status.is2xxOK() ? _query_scan.isDone() : true;
-
-                        _scanResult.reserve(_scanResult.size()+response.records.size()); // reserve space for writing the records in scan result
-                        for (dto::SKVRecord& rec : response.records) {
-                            YCSBData data;
-                            SKVRecordToYCSBData(0,data,rec); // convert skvrecord to YCSBData object
-                            _scanResult.push_back(data); // store result in _scanResult
-                        }
-
-                        return seastar::make_ready_future();
-                    });
-                })
-                .then([this] () {
-                    K2LOG_D(log::ycsb, "Scan succeeded");
-                    return seastar::make_ready_future();
-                });
+            // stream the pages so that the next page is fetched while we convert the records of the current one
+            return _txn.queryStream(_query_scan, [this] (QueryResult&& result) {
+                _scanResult.reserve(_scanResult.size()+result.records.size()); // reserve space for writing the records in scan result
+                for (dto::SKVRecord& rec : result.records) {
+                    YCSBData data;
+                    SKVRecordToYCSBData(0,data,rec); // convert skvrecord to YCSBData object
+                    _scanResult.push_back(data); // store result in _scanResult
+                }
+                return seastar::make_ready_future();
+            })
+            .then([] (Status&& status) {
+                QueryResult result(std::move(status));
+                CHECK_READ_STATUS(result);
+                K2LOG_D(log::ycsb, "Scan succeeded");
+                return seastar::make_ready_future();
             });
         });
     }
@@ -477,6 +477,7 @@ int main(int argc, char** argv) {;
         ("insert_proportion",bpo::value<double>()->default_value(0), "Insert Proportion")
         ("delete_proportion",bpo::value<double>()->default_value(0), "Delete Proportion")
         ("max_scan_length",bpo::value<uint32_t>()->default_value(10), "Maximum scan length")
+        ("query_prefetch_depth",bpo::value<uint32_t>(), "Number of query pages a scan fetches ahead of processing its results")
         ("max_fields_update",bpo::value<uint32_t>()->default_value(1), "Maximum number of fields to update")
         ("ops_per_txn",bpo::value<uint64_t>()->default_value(1), "The number of operations per transaction");
 
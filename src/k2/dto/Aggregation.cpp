@@ -0,0 +1,224 @@
+/*
+MIT License
+
+Copyright(c) 2020 Futurewei Cloud
+
+    Permission is hereby granted,
+    free of charge, to any person obtaining a copy of this software and associated documentation files(the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
+
+    The above copyright notice and this permission notice shall be included in all copies
+    or
+    substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS",
+    WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER
+    LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+*/
+
+#include "Aggregation.h"
+
+namespace k2 {
+namespace dto {
+
+namespace {
+
+// The way a value is held in an AggregateValue
+enum class ValueKind { Integer, Floating, String, Other };
+
+ValueKind kindOf(FieldType type) {
+    switch (type) {
+        case FieldType::INT16T:
+        case FieldType::INT32T:
+        case FieldType::INT64T:
+        case FieldType::UINT16T:
+        case FieldType::UINT32T:
+        case FieldType::BOOL:
+            return ValueKind::Integer;
+        case FieldType::FLOAT:
+        case FieldType::DOUBLE:
+            return ValueKind::Floating;
+        case FieldType::STRING:
+            return ValueKind::String;
+        default:
+            return ValueKind::Other;
+    }
+}
+
+template <typename T>
+void readFieldValue(const SchemaField& field, SKVRecord& record, uint32_t fieldIndex, AggregateValue& value) {
+    if (kindOf(field.type) == ValueKind::Other) {
+        throw TypeMismatchException(fmt::format("cannot aggregate field {} of type {}", field.name, field.type));
+    }
+    std::optional<T> fieldValue = record.deserializeField<T>(fieldIndex);
+    if (!fieldValue) {
+        return;
+    }
+
+    value.type = field.type;
+    value.count = 1;
+    if constexpr (std::is_same_v<T, String>) {
+        value.stringValue = std::move(*fieldValue);
+    } else if constexpr (std::is_same_v<T, float> || std::is_same_v<T, double>) {
+        value.doubleValue = *fieldValue;
+    } else if constexpr (std::is_integral_v<T>) {
+        value.intValue = *fieldValue;
+    }
+}
+
+// Compares two non-null values of the same kind
+int compareValues(const AggregateValue& a, const AggregateValue& b) {
+    auto kind = kindOf(a.type);
+    if (kind != kindOf(b.type)) {
+        throw TypeMismatchException(fmt::format("cannot compare aggregate values of types {} and {}", a.type, b.type));
+    }
+    switch (kind) {
+        case ValueKind::Integer:
+            return a.intValue < b.intValue ? -1 : (a.intValue > b.intValue ? 1 : 0);
+        case ValueKind::Floating:
+            return a.doubleValue < b.doubleValue ? -1 : (a.doubleValue > b.doubleValue ? 1 : 0);
+        default:
+            return a.stringValue.compare(b.stringValue);
+    }
+}
+
+// Combines the given (partial) value into the accumulated value of the aggregate function
+void combine(AggregateFunction function, AggregateValue& acc, AggregateValue&& value) {
+    if (function == AggregateFunction::COUNT) {
+        acc.type = FieldType::INT64T;
+        acc.count += value.count;
+        acc.intValue = acc.count;
+        return;
+    }
+    if (value.isNull()) {
+        return;
+    }
+
+    if (function == AggregateFunction::SUM) {
+        auto kind = kindOf(value.type);
+        if (kind != ValueKind::Integer && kind != ValueKind::Floating) {
+            throw TypeMismatchException(fmt::format("cannot SUM values of type {}", value.type));
+        }
+        if (!acc.isNull() && kindOf(acc.type) != kind) {
+            throw TypeMismatchException(fmt::format("cannot SUM values of types {} and {}", acc.type, value.type));
+        }
+        if (kind == ValueKind::Integer) {
+            acc.type = FieldType::INT64T;
+            acc.intValue += value.intValue;
+        } else {
+            acc.type = FieldType::DOUBLE;
+            acc.doubleValue += value.doubleValue;
+        }
+        acc.count += value.count;
+        return;
+    }
+
+    // MIN and MAX
+    auto count = acc.count + value.count;
+    if (acc.isNull()) {
+        acc = std::move(value);
+    } else {
+        auto cmp = compareValues(value, acc);
+        if ((function == AggregateFunction::MIN && cmp < 0) || (function == AggregateFunction::MAX && cmp > 0)) {
+            acc = std::move(value);
+        }
+    }
+    acc.count = count;
+}
+
+}  // namespace
+
+Aggregator::Aggregator(AggregationSpec spec) : _spec(std::move(spec)) {
+}
+
+void Aggregator::_resolveFields(const std::shared_ptr<Schema>& schema) {
+    _schema = schema;
+    _groupByFields.clear();
+    for (const String& name : _spec.groupBy) {
+        _groupByFields.push_back(schema->getFieldIndex(name));
+    }
+    _aggregateFields.clear();
+    for (const Aggregate& aggregate : _spec.aggregates) {
+        _aggregateFields.push_back(aggregate.fieldName.empty() ? std::nullopt : schema->getFieldIndex(aggregate.fieldName));
+    }
+}
+
+void Aggregator::add(SKVRecord& record) {
+    if (record.schema != _schema) {
+        _resolveFields(record.schema);
+    }
+
+    std::vector<AggregateValue> groupValues(_spec.groupBy.size());
+    for (size_t i = 0; i < _groupByFields.size(); ++i) {
+        if (auto idx = _groupByFields[i]; idx) {
+            K2_DTO_CAST_APPLY_FIELD_VALUE(readFieldValue, _schema->fields[*idx], record, *idx, groupValues[i]);
+        }
+    }
+    AggregateGroup& group = _findGroup(std::move(groupValues));
+
+    for (size_t i = 0; i < _spec.aggregates.size(); ++i) {
+        AggregateValue value;
+        if (_spec.aggregates[i].fieldName.empty()) {
+            // COUNT of records
+            value.count = 1;
+        } else if (auto idx = _aggregateFields[i]; idx) {
+            K2_DTO_CAST_APPLY_FIELD_VALUE(readFieldValue, _schema->fields[*idx], record, *idx, value);
+        }
+        combine(_spec.aggregates[i].function, group.values[i], std::move(value));
+    }
+}
+
+void Aggregator::merge(std::vector<AggregateGroup>&& groups) {
+    for (AggregateGroup& partial : groups) {
+        AggregateGroup& group = _findGroup(std::move(partial.groupValues));
+        for (size_t i = 0; i < partial.values.size() && i < _spec.aggregates.size(); ++i) {
+            combine(_spec.aggregates[i].function, group.values[i], std::move(partial.values[i]));
+        }
+    }
+}
+
+std::vector<AggregateGroup> Aggregator::release() {
+    std::vector<AggregateGroup> groups = std::move(_groups);
+    _groups.clear();
+    _groupIndex.clear();
+    return groups;
+}
+
+AggregateGroup& Aggregator::_findGroup(std::vector<AggregateValue>&& groupValues) {
+    // The group key is a binary encoding of the group values. Different field types never share a group
+    String key;
+    for (const AggregateValue& value : groupValues) {
+        key.append(reinterpret_cast<const char*>(&value.type), sizeof(value.type));
+        if (value.isNull()) {
+            continue;
+        }
+        switch (kindOf(value.type)) {
+            case ValueKind::Integer:
+                key.append(reinterpret_cast<const char*>(&value.intValue), sizeof(value.intValue));
+                break;
+            case ValueKind::Floating:
+                key.append(reinterpret_cast<const char*>(&value.doubleValue), sizeof(value.doubleValue));
+                break;
+            default: {
+                uint32_t size = value.stringValue.size();
+                key.append(reinterpret_cast<const char*>(&size), sizeof(size));
+                key.append(value.stringValue.data(), size);
+            }
+        }
+    }
+
+    auto [it, inserted] = _groupIndex.try_emplace(std::move(key), _groups.size());
+    if (inserted) {
+        _groups.push_back(AggregateGroup{.groupValues = std::move(groupValues), .values = {}});
+        _groups.back().values.resize(_spec.aggregates.size());
+    }
+    return _groups[it->second];
+}
+
+}  // namespace dto
+}  // namespace k2
@@ -0,0 +1,132 @@
+/*
+MIT License
+
+Copyright(c) 2020 Futurewei Cloud
+
+    Permission is hereby granted,
+    free of charge, to any person obtaining a copy of this software and associated documentation files(the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
+
+    The above copyright notice and this permission notice shall be included in all copies
+    or
+    substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS",
+    WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER
+    LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+*/
+
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include <k2/common/Common.h>
+#include <k2/transport/PayloadSerialization.h>
+#include "FieldTypes.h"
+#include "SKVRecord.h"
+
+namespace k2 {
+namespace dto {
+
+// The aggregate functions which can be computed by the server during a query
+K2_DEF_ENUM(AggregateFunction,
+    COUNT,  /* number of non-null values of the field, or number of records if no field is given */
+    SUM,    /* sum of an integer or floating point field */
+    MIN,    /* min of an integer, floating point, BOOL or STRING field */
+    MAX     /* max of an integer, floating point, BOOL or STRING field */
+);
+
+// One aggregate function to compute over the records of a query
+struct Aggregate {
+    AggregateFunction function = AggregateFunction::COUNT;
+    String fieldName;
+
+    K2_PAYLOAD_FIELDS(function, fieldName);
+    K2_DEF_FMT(Aggregate, function, fieldName);
+};
+
+// Describes the aggregation of a query. If there are aggregates, the server returns them instead of the records
+struct AggregationSpec {
+    std::vector<Aggregate> aggregates;
+    // The records are aggregated in one group per distinct tuple of values of these fields
+    std::vector<String> groupBy;
+
+    bool empty() const { return aggregates.empty(); }
+
+    K2_PAYLOAD_FIELDS(aggregates, groupBy);
+    K2_DEF_FMT(AggregationSpec, aggregates, groupBy);
+};
+
+// A value in an aggregation result. It is either the value of a group-by field, or the (partial) result of an
+// aggregate function. Integer and BOOL fields are held in intValue and floating point fields in doubleValue.
+struct AggregateValue {
+    // NULL_T if the value is null, e.g. MIN over a group with only null values.
+    // COUNT is an INT64T, SUM is an INT64T or a DOUBLE, and all other values have the type of their field
+    FieldType type = FieldType::NULL_T;
+    int64_t intValue = 0;
+    double doubleValue = 0;
+    String stringValue;
+    // the number of non-null values which went into this value
+    int64_t count = 0;
+
+    bool isNull() const { return type == FieldType::NULL_T; }
+
+    K2_PAYLOAD_FIELDS(type, intValue, doubleValue, stringValue, count);
+    K2_DEF_FMT(AggregateValue, type, intValue, doubleValue, stringValue, count);
+};
+
+// The result of an aggregation for one group
+struct AggregateGroup {
+    // in the order of AggregationSpec::groupBy
+    std::vector<AggregateValue> groupValues;
+    // in the order of AggregationSpec::aggregates
+    std::vector<AggregateValue> values;
+
+    K2_PAYLOAD_FIELDS(groupValues, values);
+    K2_DEF_FMT(AggregateGroup, groupValues, values);
+};
+
+// Computes the groups of an aggregation. The server adds records to it as it scans, and the client uses it to
+// combine the partial groups from each page and partition
+class Aggregator {
+public:
+    Aggregator() = default;
+    Aggregator(AggregationSpec spec);
+
+    // Aggregate the given record into its group. Fields which are not in the record's schema are treated as null.
+    // Throws TypeMismatchException if an aggregate is not supported for the type of its field
+    void add(SKVRecord& record);
+
+    // Combine the given partial groups into this aggregator
+    void merge(std::vector<AggregateGroup>&& groups);
+
+    // the number of groups so far
+    size_t size() const { return _groups.size(); }
+
+    // Moves the groups out of the aggregator, leaving it empty
+    std::vector<AggregateGroup> release();
+
+private:
+    AggregateGroup& _findGroup(std::vector<AggregateValue>&& groupValues);
+    void _resolveFields(const std::shared_ptr<Schema>& schema);
+
+    AggregationSpec _spec;
+    std::vector<AggregateGroup> _groups;
+    std::unordered_map<String, size_t> _groupIndex;
+
+    // the field indexes of the groupBy and aggregate fields, for the schema of the last record we added
+    std::shared_ptr<Schema> _schema;
+    std::vector<std::optional<uint32_t>> _groupByFields;
+    std::vector<std::optional<uint32_t>> _aggregateFields;
+};
+
+}  // namespace dto
+}  // namespace k2
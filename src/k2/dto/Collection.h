@@ -162,6 +162,11 @@ K2_DEF_ENUM(HashScheme,
 K2_DEF_ENUM(StorageDriver,
             K23SI);
 
+// The ordered index used by the K23SI storage driver to hold the keys of a collection
+K2_DEF_ENUM(IndexerType,
+            BPTree,
+            Map);
+
 
 struct CollectionMetadata {
     String name;
@@ -173,8 +178,9 @@ struct CollectionMetadata {
     // This is used by the CPO only. If deleted is true the CPO will not return the collection
     // for getCollection RPCs, but the user can try to offload it again.
     bool deleted{false};
-    K2_PAYLOAD_FIELDS(name, hashScheme, storageDriver, capacity, retentionPeriod, heartbeatDeadline, deleted);
-    K2_DEF_FMT(CollectionMetadata, name, hashScheme, storageDriver, capacity, retentionPeriod, heartbeatDeadline, deleted);
+    IndexerType indexerType{IndexerType::BPTree};
+    K2_PAYLOAD_FIELDS(name, hashScheme, storageDriver, capacity, retentionPeriod, heartbeatDeadline, deleted, indexerType);
+    K2_DEF_FMT(CollectionMetadata, name, hashScheme, storageDriver, capacity, retentionPeriod, heartbeatDeadline, deleted, indexerType);
 };
 
 
@@ -251,7 +257,7 @@ public:
     bool owns(const Key& key, const bool reverse = false) const;
     Partition& operator()() { return _partition; }
     const Partition& operator()() const { return _partition; }
-    HashScheme getHashScheme() { return _scheme; }
+    HashScheme getHashScheme() const { return _scheme; }
     K2_DEF_FMT(OwnerPartition, _partition);
 
 private:
@@ -28,18 +28,37 @@ namespace dto {
 
 void Schema::setKeyFieldsByName(const std::vector<String>& keys, std::vector<uint32_t>& keyFields) {
     for (const String& keyName : keys) {
-        bool found = false;
-        for (size_t i = 0; i < fields.size(); ++i) {
-            if (keyName == fields[i].name) {
-                found = true;
-                keyFields.push_back(i);
-                break;
-            }
+        auto idx = getFieldIndex(keyName);
+        K2ASSERT(log::dto, idx.has_value(), "failed to find field by name");
+        if (idx) {
+            keyFields.push_back(*idx);
         }
-        K2ASSERT(log::dto, found, "failed to find field by name");
     }
 }
 
+std::optional<uint32_t> Schema::getFieldIndex(const String& fieldName) const {
+    auto it = _fieldIndexByName.find(fieldName);
+    if (it != _fieldIndexByName.end() && it->second < fields.size() && fields[it->second].name == fieldName) {
+        return it->second;
+    }
+    if (it == _fieldIndexByName.end() && _fieldIndexByName.size() == fields.size()) {
+        return std::nullopt;
+    }
+
+    // the fields have changed since we built the map (or it was never built). Rebuild it
+    _fieldIndexByName.clear();
+    _fieldIndexByName.reserve(fields.size());
+    for (uint32_t i = 0; i < fields.size(); ++i) {
+        // keep the first occurrence in case of duplicates to match linear-search semantics
+        _fieldIndexByName.emplace(fields[i].name, i);
+    }
+    it = _fieldIndexByName.find(fieldName);
+    if (it == _fieldIndexByName.end()) {
+        return std::nullopt;
+    }
+    return it->second;
+}
+
 void Schema::setPartitionKeyFieldsByName(const std::vector<String>& keys) {
     setKeyFieldsByName(keys, partitionKeyFields);
 }
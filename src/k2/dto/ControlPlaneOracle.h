@@ -25,6 +25,9 @@ Copyright(c) 2020 Futurewei Cloud
 
 #include <k2/transport/Status.h>
 
+#include <optional>
+#include <unordered_map>
+
 #include "Collection.h"
 #include "FieldTypes.h"
 #include "Timestamp.h"
@@ -119,9 +122,16 @@ struct Schema {
     // Used to make sure that the partition and range key definitions do not change between versions
     Status canUpgradeTo(const dto::Schema& other) const;
 
+    // Returns the index of the field with the given name, or nullopt if there is no such field.
+    // Lookups are O(1) via a name->index map which is built lazily and rebuilt if fields are added or removed
+    std::optional<uint32_t> getFieldIndex(const String& fieldName) const;
+
     K2_PAYLOAD_FIELDS(name, version, fields, partitionKeyFields, rangeKeyFields);
 
     K2_DEF_FMT(Schema, name, version, fields, partitionKeyFields, rangeKeyFields);
+
+    // not serialized. Cache for getFieldIndex()
+    mutable std::unordered_map<String, uint32_t> _fieldIndexByName{};
 };
 
 // Request to create a schema and attach it to a collection
@@ -32,13 +32,10 @@ struct SchematizedValue {
     SchematizedValue(Value& v, SKVRecord& rec) : val(v), rec(rec), type(v.type) {
         K2ASSERT(log::dto, rec.schema, "Record must have a schema");
         if (val.isReference()) {
-            for (size_t i = 0; i < rec.schema->fields.size(); ++i) {
-                if (rec.schema->fields[i].name == val.fieldName) {
-                    sfieldIndex = i;
-                    nullLast = rec.schema->fields[i].nullLast;
-                    type = rec.schema->fields[i].type;
-                    break;
-                }
+            if (auto idx = rec.schema->getFieldIndex(val.fieldName); idx) {
+                sfieldIndex = *idx;
+                nullLast = rec.schema->fields[*idx].nullLast;
+                type = rec.schema->fields[*idx].type;
             }
             // If a fieldName has been provided(meaning this is a reference value), and we can't find it in the incoming
             // schema, then we can't
@@ -97,13 +94,9 @@ compareOptionals(std::tuple<bool, std::optional<T1>>&, std::tuple<bool, std::opt
     throw TypeMismatchException(fmt::format("non-comparable types: {}, {}", TToFieldType<T1>(), TToFieldType<T1>()));
 }
 
-// template specialization comparing two optionals of comparable types
+// compares two optional values of comparable types, accounting for the nullLast flag of each
 template <typename T1, typename T2>
-std::enable_if_t<is_comparable<T1, T2>::value, int>
-compareOptionals(std::tuple<bool, std::optional<T1>>& a, std::tuple<bool, std::optional<T2>>& b) {
-    auto& [a_nullLast, a_opt] = a;
-    auto& [b_nullLast, b_opt] = b;
-
+int compareValues(bool a_nullLast, const std::optional<T1>& a_opt, bool b_nullLast, const std::optional<T2>& b_opt) {
     if (!a_opt && !b_opt) {
         // NULLs of compatible types compare as equal
         return 0;
@@ -127,7 +120,14 @@ compareOptionals(std::tuple<bool, std::optional<T1>>& a, std::tuple<bool, std::o
     return -1;
 }
 
-
+// template specialization comparing two optionals of comparable types
+template <typename T1, typename T2>
+std::enable_if_t<is_comparable<T1, T2>::value, int>
+compareOptionals(std::tuple<bool, std::optional<T1>>& a, std::tuple<bool, std::optional<T2>>& b) {
+    auto& [a_nullLast, a_opt] = a;
+    auto& [b_nullLast, b_opt] = b;
+    return compareValues(a_nullLast, a_opt, b_nullLast, b_opt);
+}
 
 template <typename B_TYPE, typename A>
 void _innerCompareHelper(SchematizedValue& b, A& a_opt, int& result) {
@@ -159,6 +159,18 @@ void Expression::copyPayloads() {
     }
 }
 
+Expression Expression::share() {
+    Expression result{.op = op, .valueChildren = {}, .expressionChildren = {}};
+    for (Value& value : valueChildren) {
+        result.valueChildren.push_back(Value{.fieldName = value.fieldName, .type = value.type, .literal = value.literal.shareAll()});
+    }
+
+    for (Expression& exp : expressionChildren) {
+        result.expressionChildren.push_back(exp.share());
+    }
+    return result;
+}
+
 bool Expression::evaluate(SKVRecord& rec) {
     switch(op) {
         case Operation::EQ: {
@@ -460,6 +472,339 @@ bool Expression::NOT_handler(SKVRecord& rec) {
     return !expressionChildren[0].evaluate(rec);
 }
 
+// Compiled expressions
+
+using Operand = CompiledExpression::Operand;
+
+// returns the value of the operand for the given record. Literals are returned directly, and references are
+// deserialized into the given scratch space
+template <typename T>
+const std::optional<T>& _loadOperand(const Operand& o, SKVRecord& rec, std::optional<T>& scratch) {
+    if (!o.isReference) {
+        return std::get<std::optional<T>>(o.literal);
+    }
+    scratch = rec.deserializeField<T>(o.fieldIndex);
+    return scratch;
+}
+
+template <typename A, typename B>
+int _compareOperands(const Operand& a, const Operand& b, SKVRecord& rec) {
+    std::optional<A> aScratch;
+    std::optional<B> bScratch;
+    const auto& aOpt = _loadOperand<A>(a, rec, aScratch);
+    const auto& bOpt = _loadOperand<B>(b, rec, bScratch);
+    return compareValues(a.nullLast, aOpt, b.nullLast, bOpt);
+}
+
+template <typename T>
+bool _isNullOperand(const Operand& a, SKVRecord& rec) {
+    return !rec.deserializeField<T>(a.fieldIndex).has_value();
+}
+
+// same as constructing a SchematizedValue, which fails if a reference can't be found in the schema
+void _checkResolved(const Operand& o) {
+    if (!o.resolved) {
+        throw NoFieldFoundException("unable to create reference with FieldType::NOT_KNOWN");
+    }
+}
+
+// same as SchematizedValue::get() for literals, but done once at compile time
+template <typename T>
+void _decodeOperand(Operand& o, const Value& v) {
+    if (TToFieldType<T>() != o.type) {
+        throw TypeMismatchException(fmt::format("bad type in schematized value get: have {}, got {}", o.type, TToFieldType<T>()));
+    }
+    if (o.isReference) {
+        return;
+    }
+    T result{};
+    if (!const_cast<Payload&>(v.literal).shareAll().read(result)) {
+        throw DeserializationError(fmt::format("Unable to deserialize value literal of type {}", TToFieldType<T>()));
+    }
+    o.literal = std::optional<T>(std::move(result));
+}
+
+// selects the comparison for operand types (A, B). The last argument is only used to deduce A
+template <typename B, typename A>
+void _compileCompareInner(Operand& b, const Value& vb, CompiledExpression::CompareFn& fn, A*) {
+    _decodeOperand<B>(b, vb);
+    if constexpr (is_comparable<A, B>::value) {
+        fn = &_compareOperands<A, B>;
+    } else {
+        throw TypeMismatchException(fmt::format("non-comparable types: {}, {}", TToFieldType<A>(), TToFieldType<B>()));
+    }
+}
+
+template <typename A>
+void _compileCompareOuter(Operand& a, Operand& b, const Value& va, const Value& vb, CompiledExpression::CompareFn& fn) {
+    _decodeOperand<A>(a, va);
+    K2_DTO_CAST_APPLY_FIELD_VALUE(_compileCompareInner, b, vb, fn, (A*)nullptr);
+}
+
+template <typename T>
+void _compileIsNull(Operand& a, CompiledExpression::IsNullFn& fn) {
+    (void) a;
+    fn = &_isNullOperand<T>;
+}
+
+// checks and decodes a boolean value child of a logical operation
+void _compileBoolOperand(Operand& o, const Value& v, const char* opName) {
+    _checkResolved(o);
+    if (o.type != FieldType::BOOL) {
+        throw TypeMismatchException(fmt::format("{} handler value with non-bool field: {}", opName, o.type));
+    }
+    _decodeOperand<bool>(o, v);
+}
+
+bool _loadBool(const Operand& o, SKVRecord& rec) {
+    std::optional<bool> scratch;
+    const auto& opt = _loadOperand<bool>(o, rec, scratch);
+    return opt.has_value() && *opt;
+}
+
+CompiledExpression::CompiledExpression(const Expression& exp, const Schema& schema) {
+    _compile(exp, schema);
+}
+
+uint32_t CompiledExpression::_compile(const Expression& exp, const Schema& schema) {
+    uint32_t idx = _program.size();
+    _program.emplace_back();
+    _program[idx].op = exp.op;
+
+    _program[idx].valueBegin = _operands.size();
+    for (auto& value : exp.valueChildren) {
+        Operand o;
+        o.isReference = value.isReference();
+        if (o.isReference) {
+            if (auto fieldIdx = schema.getFieldIndex(value.fieldName); fieldIdx) {
+                o.resolved = true;
+                o.fieldIndex = *fieldIdx;
+                o.nullLast = schema.fields[*fieldIdx].nullLast;
+                o.type = schema.fields[*fieldIdx].type;
+            }
+        } else {
+            o.resolved = true;
+            o.type = value.type;
+        }
+        _operands.push_back(std::move(o));
+    }
+    _program[idx].valueEnd = _operands.size();
+
+    std::vector<uint32_t> children;
+    for (auto& child : exp.expressionChildren) {
+        children.push_back(_compile(child, schema));
+    }
+    _program[idx].childBegin = _children.size();
+    _children.insert(_children.end(), children.begin(), children.end());
+    _program[idx].childEnd = _children.size();
+
+    try {
+        _compileInstruction(_program[idx], exp);
+    } catch (...) {
+        _program[idx].error = std::current_exception();
+    }
+    return idx;
+}
+
+// Performs the same checks, in the same order, as the corresponding Expression handler
+void CompiledExpression::_compileInstruction(Instruction& inst, const Expression& exp) {
+    auto nvals = exp.valueChildren.size();
+    auto nexps = exp.expressionChildren.size();
+    auto operand = [this, &inst](size_t i) -> Operand& { return _operands[inst.valueBegin + i]; };
+
+    switch (exp.op) {
+        case Operation::EQ:
+        case Operation::GT:
+        case Operation::GTE:
+        case Operation::LT:
+        case Operation::LTE: {
+            if (nvals != 2 || nexps > 0) {
+                throw InvalidExpressionException(fmt::format("expression {} must have exactly 2 value children(have {}) and no expression children(have {})", exp.op, nvals, nexps));
+            }
+            _checkResolved(operand(0));
+            _checkResolved(operand(1));
+            K2_DTO_CAST_APPLY_FIELD_VALUE(_compileCompareOuter, operand(0), operand(1), exp.valueChildren[0], exp.valueChildren[1], inst.compare);
+            break;
+        }
+        case Operation::IS_NULL: {
+            if (nvals != 1 || nexps > 0 || !exp.valueChildren[0].isReference()) {
+                throw InvalidExpressionException(fmt::format("expression IS_NULL must have exactly 1 value literal children(have {}) and no expression children(have {})", nvals, nexps));
+            }
+            _checkResolved(operand(0));
+            K2_DTO_CAST_APPLY_FIELD_VALUE(_compileIsNull, operand(0), inst.isNull);
+            break;
+        }
+        case Operation::IS_EXACT_TYPE: {
+            if (nvals != 2 || nexps > 0 || !exp.valueChildren[0].isReference() || exp.valueChildren[1].isReference()) {
+                throw InvalidExpressionException(fmt::format("expression IS_EXACT_TYPE must have exactly 2 value children, where child0 is a literal and child1 is a reference(have {}) and no expression children(have {})", nvals, nexps));
+            }
+            _checkResolved(operand(0));
+            _decodeOperand<FieldType>(operand(1), exp.valueChildren[1]);
+            // the field types are fixed by the schema so the result is known now
+            inst.constant = std::get<std::optional<FieldType>>(operand(1).literal).value() == operand(0).type;
+            break;
+        }
+        case Operation::STARTS_WITH:
+        case Operation::CONTAINS:
+        case Operation::ENDS_WITH: {
+            if (nvals != 2 || nexps > 0) {
+                throw InvalidExpressionException(fmt::format("expression {} must have exactly 2 value children and no expression children(have {})", exp.op, nvals, nexps));
+            }
+            _checkResolved(operand(0));
+            _checkResolved(operand(1));
+            if (operand(0).type != FieldType::STRING || operand(1).type != FieldType::STRING) {
+                throw TypeMismatchException(fmt::format("{} handler non-string fields: {}, {}", exp.op, operand(0).type, operand(1).type));
+            }
+            _decodeOperand<String>(operand(0), exp.valueChildren[0]);
+            _decodeOperand<String>(operand(1), exp.valueChildren[1]);
+            break;
+        }
+        case Operation::AND:
+        case Operation::OR: {
+            if (nvals + nexps == 0) {
+                throw InvalidExpressionException(fmt::format("expression {} must have 1 or more children", exp.op));
+            }
+            for (size_t i = 0; i < nvals; ++i) {
+                _compileBoolOperand(operand(i), exp.valueChildren[i], exp.op == Operation::AND ? "AND" : "OR");
+            }
+            break;
+        }
+        case Operation::XOR: {
+            if (nvals + nexps != 2) {
+                throw InvalidExpressionException(fmt::format("expression XOR must have exactly 2 total children(have {} value and {} expression)", nvals, nexps));
+            }
+            if (nvals == 2) {
+                _checkResolved(operand(0));
+                _checkResolved(operand(1));
+                if (operand(0).type != FieldType::BOOL || operand(1).type != FieldType::BOOL) {
+                    throw TypeMismatchException(fmt::format("XOR handler two non-bool fields: {}, {}", operand(0).type, operand(1).type));
+                }
+                _decodeOperand<bool>(operand(0), exp.valueChildren[0]);
+                _decodeOperand<bool>(operand(1), exp.valueChildren[1]);
+            } else if (nvals == 1) {
+                _compileBoolOperand(operand(0), exp.valueChildren[0], "XOR");
+            }
+            break;
+        }
+        case Operation::NOT: {
+            if (nvals + nexps != 1) {
+                throw InvalidExpressionException(fmt::format("expression NOT must have exactly 1 total children(have {} value and {} expression)", nvals, nexps));
+            }
+            if (nvals == 1) {
+                _compileBoolOperand(operand(0), exp.valueChildren[0], "NOT");
+            }
+            break;
+        }
+        case Operation::UNKNOWN: {
+            if (nvals + nexps == 0) {
+                // empty expression - allow it
+                inst.constant = true;
+                break;
+            }
+            throw InvalidExpressionException(fmt::format("UNKNOWN operation {} in expression", exp.op));
+        }
+        default:
+            throw InvalidExpressionException(fmt::format("non-supported operation {} in expression", exp.op));
+    }
+}
+
+bool CompiledExpression::evaluate(SKVRecord& rec) const {
+    if (_program.empty()) {
+        // default-constructed, i.e. an empty expression
+        return true;
+    }
+    return _eval(_program[0], rec);
+}
+
+bool CompiledExpression::_eval(const Instruction& inst, SKVRecord& rec) const {
+    if (inst.error) {
+        std::rethrow_exception(inst.error);
+    }
+    auto child = [this, &inst](size_t i) -> const Instruction& { return _program[_children[inst.childBegin + i]]; };
+    auto nvals = inst.valueEnd - inst.valueBegin;
+    auto nexps = inst.childEnd - inst.childBegin;
+    const Operand* ops = _operands.data() + inst.valueBegin;
+
+    switch (inst.op) {
+        case Operation::EQ:
+            return inst.compare(ops[0], ops[1], rec) == 0;
+        case Operation::GT:
+            return inst.compare(ops[0], ops[1], rec) > 0;
+        case Operation::GTE:
+            return inst.compare(ops[0], ops[1], rec) >= 0;
+        case Operation::LT:
+            return inst.compare(ops[0], ops[1], rec) < 0;
+        case Operation::LTE:
+            return inst.compare(ops[0], ops[1], rec) <= 0;
+        case Operation::IS_NULL:
+            return inst.isNull(ops[0], rec);
+        case Operation::IS_EXACT_TYPE:
+        case Operation::UNKNOWN:
+            return inst.constant;
+        case Operation::STARTS_WITH:
+        case Operation::CONTAINS:
+        case Operation::ENDS_WITH: {
+            std::optional<String> aScratch, bScratch;
+            const auto& aOpt = _loadOperand<String>(ops[0], rec, aScratch);
+            const auto& bOpt = _loadOperand<String>(ops[1], rec, bScratch);
+            if (!bOpt) return true;   // all strings start with, contain, and end with nothing
+            if (!aOpt) return false;  // null strings do not start with, contain, or end with anything
+            if (inst.op == Operation::CONTAINS) {
+                return aOpt->find(*bOpt) != String::npos;
+            }
+            if (aOpt->size() < bOpt->size()) return false;
+            auto offset = inst.op == Operation::STARTS_WITH ? 0 : aOpt->size() - bOpt->size();
+            return ::memcmp(aOpt->c_str() + offset, bOpt->c_str(), bOpt->size()) == 0;
+        }
+        case Operation::AND: {
+            bool result = true;
+            // all values are read, as in the interpreter, but expressions are short-circuited
+            for (uint32_t i = 0; i < nvals; ++i) {
+                result = _loadBool(ops[i], rec) && result;
+            }
+            for (uint32_t i = 0; i < nexps; ++i) {
+                result = result && _eval(child(i), rec);
+            }
+            return result;
+        }
+        case Operation::OR: {
+            bool result = false;
+            for (uint32_t i = 0; i < nvals; ++i) {
+                result = _loadBool(ops[i], rec) || result;
+            }
+            for (uint32_t i = 0; i < nexps; ++i) {
+                result = result || _eval(child(i), rec);
+            }
+            return result;
+        }
+        case Operation::XOR: {
+            if (nvals == 2) {
+                std::optional<bool> aScratch, bScratch;
+                const auto& aOpt = _loadOperand<bool>(ops[0], rec, aScratch);
+                const auto& bOpt = _loadOperand<bool>(ops[1], rec, bScratch);
+                return aOpt.has_value() && bOpt.has_value() && (*aOpt != *bOpt);
+            } else if (nvals == 1) {
+                std::optional<bool> aScratch;
+                const auto& aOpt = _loadOperand<bool>(ops[0], rec, aScratch);
+                auto eval = _eval(child(0), rec);
+                return aOpt.has_value() && (*aOpt != eval);
+            }
+            auto expAeval = _eval(child(0), rec);
+            auto expBeval = _eval(child(1), rec);
+            return expAeval != expBeval;
+        }
+        case Operation::NOT: {
+            if (nvals == 1) {
+                // no value means "false". That means we need to return not(false), i.e. "true" if not set
+                return !_loadBool(ops[0], rec);
+            }
+            return !_eval(child(0), rec);
+        }
+        default:
+            throw InvalidExpressionException(fmt::format("non-supported operation {} in expression", inst.op));
+    }
+}
+
 } // ns expression
 } // dto
 } // k2
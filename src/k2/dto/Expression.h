@@ -23,7 +23,10 @@ Copyright(c) 2020 Futurewei Cloud
 
 #pragma once
 
+#include <exception>
 #include <functional>
+#include <optional>
+#include <variant>
 #include <vector>
 
 #include <k2/common/Common.h>
@@ -138,6 +141,10 @@ struct Expression {
     // memory of the payloads will be allocated in the context of the current thread.
     void copyPayloads();
 
+    // Returns a copy of this expression which shares the payloads of the literals with this expression.
+    // Used when the same filter has to be sent in several requests at once
+    Expression share();
+
     K2_PAYLOAD_FIELDS(op, valueChildren, expressionChildren);
     K2_DEF_FMT(Expression, op, valueChildren, expressionChildren);
 
@@ -158,6 +165,65 @@ struct Expression {
     bool NOT_handler(SKVRecord& rec);
 };
 
+// An Expression compiled against a particular schema version into a flat program. Field references are resolved
+// to field indexes, literals are decoded once, and comparisons are specialized for the operand types, so that
+// evaluating a record doesn't re-interpret the expression tree.
+// Evaluation returns the same results and throws the same exceptions as Expression::evaluate(). Errors which only
+// depend on the expression and schema are found at compile time, but are deferred until the particular node is
+// evaluated so that the short-circuit behavior of the interpreter is preserved.
+class CompiledExpression {
+public:
+    CompiledExpression() = default;
+    CompiledExpression(const Expression& exp, const Schema& schema);
+
+    // Evaluate the given record, which must be of the schema this expression was compiled against
+    bool evaluate(SKVRecord& rec) const;
+
+    // A resolved field reference or a decoded literal
+    struct Operand {
+        bool isReference = false;
+        bool resolved = false; // false if this is a reference to a field which isn't in the schema
+        uint32_t fieldIndex = 0;
+        bool nullLast = false;
+        FieldType type = FieldType::NOT_KNOWN;
+        std::variant<std::monostate, std::optional<String>, std::optional<int16_t>, std::optional<int32_t>,
+                     std::optional<int64_t>, std::optional<uint16_t>, std::optional<uint32_t>,
+                     std::optional<uint64_t>, std::optional<float>, std::optional<double>, std::optional<bool>,
+                     std::optional<DecimalD25>, std::optional<DecimalD50>, std::optional<DecimalD100>,
+                     std::optional<FieldType>> literal;
+    };
+
+    // type-specialized operations, selected at compile time
+    typedef int (*CompareFn)(const Operand& a, const Operand& b, SKVRecord& rec);
+    typedef bool (*IsNullFn)(const Operand& a, SKVRecord& rec);
+
+    struct Instruction {
+        Operation op = Operation::UNKNOWN;
+        // the value children of this instruction, in _operands
+        uint32_t valueBegin = 0;
+        uint32_t valueEnd = 0;
+        // the expression children of this instruction, as indexes into _program stored in _children
+        uint32_t childBegin = 0;
+        uint32_t childEnd = 0;
+        CompareFn compare = nullptr;
+        IsNullFn isNull = nullptr;
+        // the result for instructions which can be fully evaluated at compile time (IS_EXACT_TYPE, empty UNKNOWN)
+        bool constant = false;
+        // the error to raise when this instruction is evaluated
+        std::exception_ptr error;
+    };
+
+private:
+    uint32_t _compile(const Expression& exp, const Schema& schema);
+    void _compileInstruction(Instruction& inst, const Expression& exp);
+    bool _eval(const Instruction& inst, SKVRecord& rec) const;
+
+    // the instructions in pre-order. The root is at index 0
+    std::vector<Instruction> _program;
+    std::vector<Operand> _operands;
+    std::vector<uint32_t> _children;
+};
+
 // helper builder: creates a value literal
 template <typename T>
 inline Value makeValueLiteral(T&& literal) {
@@ -31,6 +31,8 @@ Copyright(c) 2020 Futurewei Cloud
 #include "SKVRecord.h"
 #include "Timestamp.h"
 #include "Expression.h"
+#include "Aggregation.h"
+#include "Persistence.h"
 
 namespace k2::dto {
 
@@ -162,6 +164,29 @@ struct K23SIReadResponse {
     K2_DEF_FMT(K23SIReadResponse, value);
 };
 
+// Read a batch of keys which are owned by the same partition, in one round trip
+struct K23SIMultiReadRequest {
+    PVID pvid; // the partition version ID. Should be coming from an up-to-date partition map
+    String collectionName; // the name of the collection
+    K23SI_MTR mtr; // the MTR for the issuing transaction
+    // use the name "key" so that we can use common routing from CPO client. This is one of the keys to read
+    Key key;
+    std::vector<Key> keys; // the keys to read
+
+    K2_PAYLOAD_FIELDS(pvid, collectionName, mtr, key, keys);
+    K2_DEF_FMT(K23SIMultiReadRequest, pvid, collectionName, mtr, key, keys);
+};
+
+// The response for multi-key READs. There is a status and a value for each requested key, in request order.
+// The status for each key is the same as the status of a single-key read. A key which isn't owned by the
+// partition gets RefreshCollection and the client should read it separately.
+struct K23SIMultiReadResponse {
+    std::vector<Status> statuses;
+    std::vector<SKVRecord::Storage> values;
+    K2_PAYLOAD_FIELDS(statuses, values);
+    K2_DEF_FMT(K23SIMultiReadResponse, statuses);
+};
+
 // status codes for reads
 struct K23SIStatus {
     static const inline Status KeyNotFound=k2::Statuses::S404_Not_Found;
@@ -217,6 +242,47 @@ struct K23SIWriteResponse {
     K2_DEF_FMT(K23SIWriteResponse);
 };
 
+// One of the writes in a multi-write. The fields have the same meaning as in K23SIWriteRequest
+struct K23SIMultiWriteRecord {
+    bool isDelete = false;
+    ExistencePrecondition precondition = ExistencePrecondition::None;
+    uint64_t request_id;
+    Key key;
+    SKVRecord::Storage value;
+    std::vector<uint32_t> fieldsForPartialUpdate;
+
+    K2_PAYLOAD_FIELDS(isDelete, precondition, request_id, key, value, fieldsForPartialUpdate);
+    K2_DEF_FMT(K23SIMultiWriteRecord, isDelete, precondition, request_id, key, value, fieldsForPartialUpdate);
+};
+
+// Write a batch of records from the same transaction which are owned by the same partition, in one round trip.
+// The server places all the WIs and persists them together before responding
+struct K23SIMultiWriteRequest {
+    PVID pvid; // the partition version ID. Should be coming from an up-to-date partition map
+    String collectionName; // the name of the collection
+    K23SI_MTR mtr; // the MTR for the issuing transaction
+    Key trh; // the TRH key for the transaction, same as in K23SIWriteRequest
+    String trhCollection; // the collection for the TRH
+    // if this is set, the server which receives the request will be designated the TRH. In that case the
+    // routing key must be the TRH key
+    bool designateTRH = false;
+    // use the name "key" so that we can use common routing from CPO client. This is the key of one of the writes
+    Key key;
+    std::vector<K23SIMultiWriteRecord> writes; // the writes in the batch
+
+    K2_PAYLOAD_FIELDS(pvid, collectionName, mtr, trh, trhCollection, designateTRH, key, writes);
+    K2_DEF_FMT(K23SIMultiWriteRequest, pvid, collectionName, mtr, trh, trhCollection, designateTRH, key, writes);
+};
+
+// The response for multi-writes. There is a status for each write, in request order, which is the same as
+// the status of a single write. A key which isn't owned by the partition gets RefreshCollection and the
+// client should write it separately.
+struct K23SIMultiWriteResponse {
+    std::vector<Status> statuses;
+    K2_PAYLOAD_FIELDS(statuses);
+    K2_DEF_FMT(K23SIMultiWriteResponse, statuses);
+};
+
 struct K23SIQueryRequest {
     PVID pvid; // the partition version ID. Should be coming from an up-to-date partition map
     String collectionName;
@@ -232,19 +298,29 @@ struct K23SIQueryRequest {
 
     expression::Expression filterExpression; // the filter expression for this query
     std::vector<String> projection; // Fields by name to include in projection
+    // If not empty, the server returns the aggregates over the matching records instead of the records.
+    // recordLimit and projection do not apply to aggregation queries
+    AggregationSpec aggregation;
+    // The server-side cursor to resume, as returned with the previous page of this query. 0 means no cursor.
+    // The cursor is only a hint: the server resumes from key regardless
+    uint64_t cursorId = 0;
 
     K2_PAYLOAD_FIELDS(pvid, collectionName, mtr, key, endKey, exclusiveKey, recordLimit, includeVersionMismatch,
-                      reverseDirection, filterExpression, projection);
+                      reverseDirection, filterExpression, projection, aggregation, cursorId);
     K2_DEF_FMT(K23SIQueryRequest, pvid, collectionName, mtr, key, endKey, exclusiveKey, recordLimit,
-        includeVersionMismatch, reverseDirection, filterExpression, projection);
+        includeVersionMismatch, reverseDirection, filterExpression, projection, aggregation, cursorId);
 };
 
 struct K23SIQueryResponse {
     Key nextToScan; // For continuation token
     bool exclusiveToken = false; // whether nextToScan should be excluded or included
     std::vector<SKVRecord::Storage> results;
-    K2_PAYLOAD_FIELDS(nextToScan, exclusiveToken, results);
-    K2_DEF_FMT(K23SIQueryResponse, nextToScan, exclusiveToken, results);
+    // partial aggregates over the records scanned in this page, for aggregation queries
+    std::vector<AggregateGroup> aggregates;
+    // the server-side cursor kept for the next page, or 0 if the server didn't keep one
+    uint64_t cursorId = 0;
+    K2_PAYLOAD_FIELDS(nextToScan, exclusiveToken, results, aggregates, cursorId);
+    K2_DEF_FMT(K23SIQueryResponse, nextToScan, exclusiveToken, results, aggregates, cursorId);
 };
 
 struct K23SITxnHeartbeatRequest {
@@ -267,21 +343,99 @@ struct K23SITxnHeartbeatResponse {
     K2_DEF_FMT(K23SITxnHeartbeatResponse);
 };
 
+// Heartbeat for all of a client's transactions whose TRH is in the same partition
+struct K23SITxnMultiHeartbeatRequest {
+    // the partition version ID for the TRHs. Should be coming from an up-to-date partition map
+    PVID pvid;
+    // the name of the collection
+    String collectionName;
+    // use the name "key" so that we can use common routing from CPO client. This is one of the trh keys
+    Key key;
+    // the trh key and MTR of each transaction we want to heartbeat
+    std::vector<Key> trhKeys;
+    std::vector<K23SI_MTR> mtrs;
+
+    K2_PAYLOAD_FIELDS(pvid, collectionName, key, trhKeys, mtrs);
+    K2_DEF_FMT(K23SITxnMultiHeartbeatRequest, pvid, collectionName, key, mtrs);
+};
+
+// There is a status for each transaction, in request order. The status for each transaction is the same as
+// the status of a single heartbeat
+struct K23SITxnMultiHeartbeatResponse {
+    std::vector<Status> statuses;
+    K2_PAYLOAD_FIELDS(statuses);
+    K2_DEF_FMT(K23SITxnMultiHeartbeatResponse, statuses);
+};
+
 template <typename ValueType>
 struct K23SI_PersistenceRequest {
+    // the collection and partition which own the log this value goes into
+    String collectionName;
+    uint64_t partitionId = 0;
+    // the log stream of the partition to write to
+    LogStreamType stream = LogStreamType::WAL;
+    // if set, the value is written at the start of a new segment
+    bool newSegment = false;
+    // Identifies the writer of the log stream, and the position of this request among the writer's requests,
+    // starting from 1. Persistence rejects requests which would leave a gap in the log, e.g. when an earlier
+    // request of the same writer failed. A writer starts over with a new ID
+    uint64_t writerId = 0;
+    uint64_t sequence = 0;
     SerializeAsPayload<ValueType> value;  // the value of the write
-    K2_PAYLOAD_FIELDS(value);
-    K2_DEF_FMT(K23SI_PersistenceRequest);
+    K2_PAYLOAD_FIELDS(collectionName, partitionId, stream, newSegment, writerId, sequence, value);
+    K2_DEF_FMT(K23SI_PersistenceRequest, collectionName, partitionId, stream, newSegment, writerId, sequence);
 };
 
 struct K23SI_PersistenceResponse {
-    K2_PAYLOAD_EMPTY;
-    K2_DEF_FMT(K23SI_PersistenceResponse);
+    // the end of the log stream after this write, i.e. the position at which the next write will go
+    uint64_t segment = 0;
+    uint64_t offset = 0;
+    K2_PAYLOAD_FIELDS(segment, offset);
+    K2_DEF_FMT(K23SI_PersistenceResponse, segment, offset);
 };
 
+// Used by a partition to read back its log from persistence during recovery.
+// The log is read in pages. Each response tells the caller where to continue reading from.
 struct K23SI_PersistenceRecoveryRequest {
+    String collectionName;
+    uint64_t partitionId = 0;
+    // the log stream of the partition to read from
+    LogStreamType stream = LogStreamType::WAL;
+    // the position in the log from which to start reading. Zeroes mean the start of the log
+    uint64_t segment = 0;
+    uint64_t offset = 0;
+    // the max amount of data to return in one response
+    uint64_t maxBytes = 0;
+    K2_PAYLOAD_FIELDS(collectionName, partitionId, stream, segment, offset, maxBytes);
+    K2_DEF_FMT(K23SI_PersistenceRecoveryRequest, collectionName, partitionId, stream, segment, offset, maxBytes);
+};
+
+struct K23SI_PersistenceRecoveryResponse {
+    // the persisted values, concatenated in the order in which they were persisted
+    Payload records;
+    // the position in the log from which to continue reading
+    uint64_t segment = 0;
+    uint64_t offset = 0;
+    // set if there is no more data to read
+    bool done = false;
+    K2_PAYLOAD_FIELDS(records, segment, offset, done);
+    K2_DEF_FMT(K23SI_PersistenceRecoveryResponse, segment, offset, done);
+};
+
+// Used by a partition to drop the part of a log stream which it no longer needs for recovery
+struct K23SI_PersistenceTruncateRequest {
+    String collectionName;
+    uint64_t partitionId = 0;
+    LogStreamType stream = LogStreamType::WAL;
+    // all segments before this one are removed
+    uint64_t segment = 0;
+    K2_PAYLOAD_FIELDS(collectionName, partitionId, stream, segment);
+    K2_DEF_FMT(K23SI_PersistenceTruncateRequest, collectionName, partitionId, stream, segment);
+};
+
+struct K23SI_PersistenceTruncateResponse {
     K2_PAYLOAD_EMPTY;
-    K2_DEF_FMT(K23SI_PersistenceRecoveryRequest);
+    K2_DEF_FMT(K23SI_PersistenceTruncateResponse);
 };
 
 struct K23SI_PersistencePartialUpdate {
@@ -348,9 +502,12 @@ struct K23SITxnEndRequest {
     bool syncFinalize=false;
     // The interval from end to Finalize for a transaction
     Duration timeToFinalize{0};
+    // The number of async writes sent in this transaction. The TRH commits only after all of them have reported
+    // a successful outcome
+    uint64_t asyncWrites{0};
 
-    K2_PAYLOAD_FIELDS(pvid, collectionName, key, mtr, action, writeRanges, syncFinalize, timeToFinalize);
-    K2_DEF_FMT(K23SITxnEndRequest, pvid, collectionName, key, mtr, action, writeRanges, syncFinalize, timeToFinalize);
+    K2_PAYLOAD_FIELDS(pvid, collectionName, key, mtr, action, writeRanges, syncFinalize, timeToFinalize, asyncWrites);
+    K2_DEF_FMT(K23SITxnEndRequest, pvid, collectionName, key, mtr, action, writeRanges, syncFinalize, timeToFinalize, asyncWrites);
 };
 
 struct K23SITxnEndResponse {
@@ -358,6 +515,31 @@ struct K23SITxnEndResponse {
     K2_DEF_FMT(K23SITxnEndResponse);
 };
 
+// Sent by the partition which handled an async write to the TRH of the writing transaction
+struct K23SITxnWriteOutcomeRequest {
+    // the partition version ID for the TRH. Should be coming from an up-to-date partition map
+    PVID pvid;
+    // the name of the TRH collection
+    String collectionName;
+    // trh of the transaction which did the write.
+    // use the name "key" so that we can use common routing from CPO client
+    Key key;
+    // the MTR for the transaction which did the write
+    K23SI_MTR mtr;
+    // the request_id of the write
+    uint64_t request_id;
+    // true if the write was applied. Any other outcome aborts the transaction
+    bool success{false};
+
+    K2_PAYLOAD_FIELDS(pvid, collectionName, key, mtr, request_id, success);
+    K2_DEF_FMT(K23SITxnWriteOutcomeRequest, pvid, collectionName, key, mtr, request_id, success);
+};
+
+struct K23SITxnWriteOutcomeResponse {
+    K2_PAYLOAD_EMPTY;
+    K2_DEF_FMT(K23SITxnWriteOutcomeResponse);
+};
+
 struct K23SITxnFinalizeRequest {
     // the partition version ID for the TRH. Should be coming from an up-to-date partition map
     PVID pvid;
@@ -377,6 +559,28 @@ struct K23SITxnFinalizeResponse {
     K2_DEF_FMT(K23SITxnFinalizeResponse);
 };
 
+// Finalization of multiple transactions in the same partition, coalesced by the TRH
+struct K23SITxnMultiFinalizeRequest {
+    // the partition version ID for the participant. Should be coming from an up-to-date partition map
+    PVID pvid;
+    // the name of the collection
+    String collectionName;
+    // the transactions to finalize, and whether to abort or commit each of them
+    std::vector<Timestamp> txnTimestamps;
+    std::vector<EndAction> actions;
+
+    K2_PAYLOAD_FIELDS(pvid, collectionName, txnTimestamps, actions);
+    K2_DEF_FMT(K23SITxnMultiFinalizeRequest, pvid, collectionName, txnTimestamps, actions);
+};
+
+// There is a status for each transaction, in request order. The status for each transaction is the same as
+// the status of a single finalize
+struct K23SITxnMultiFinalizeResponse {
+    std::vector<Status> statuses;
+    K2_PAYLOAD_FIELDS(statuses);
+    K2_DEF_FMT(K23SITxnMultiFinalizeResponse, statuses);
+};
+
 struct K23SIPushSchemaRequest {
     String collectionName;
     Schema schema;
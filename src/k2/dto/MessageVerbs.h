@@ -70,6 +70,18 @@ enum Verbs : k2::Verb {
     K23SI_TXN_FINALIZE,
     K23SI_PUSH_SCHEMA,
     K23SI_QUERY,
+    // K23SI reads of multiple keys from the same partition
+    K23SI_MULTI_READ,
+    // K23SI writes of multiple keys from the same partition
+    K23SI_MULTI_WRITE,
+    // K23SI one-way writes. The outcome is reported to the TRH instead of the client
+    K23SI_ASYNC_WRITE,
+    // sent to the TRH with the outcome of an async write
+    K23SI_TXN_WRITE_OUTCOME,
+    // K23SI heartbeat of multiple transactions whose TRH is in the same partition
+    K23SI_TXN_MULTI_HEARTBEAT,
+    // sent to finalize the WIs of multiple K23SI transactions in the same partition
+    K23SI_TXN_MULTI_FINALIZE,
 
     /************ K23SI Persistence *****************/
     K23SI_Persist = 80,
@@ -78,6 +90,10 @@ enum Verbs : k2::Verb {
     PLOG_READ,
     PLOG_SEAL,
     PLOG_GET_STATUS,
+    // read back a partition's persisted log during recovery
+    K23SI_PERSISTENCE_RECOVERY,
+    // drop the part of a partition's persisted log which is no longer needed
+    K23SI_PERSISTENCE_TRUNCATE,
     /************ K23SI Inspection ******************/
     K23SI_INSPECT_RECORDS = 100,
     K23SI_INSPECT_TXN,
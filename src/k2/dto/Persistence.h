@@ -22,10 +22,18 @@ Copyright(c) 2020 Futurewei Cloud
 */
 #pragma once
 // This file contains DTOs for K2 Plog Service
+#include <k2/common/Common.h>
+#include <k2/transport/PayloadSerialization.h>
 
 namespace k2 {
 namespace dto {
 
+// The log streams which a partition keeps in persistence
+K2_DEF_ENUM(LogStreamType,
+    WAL,
+    IndexerSnapshot,
+    Aux);
+
 struct PlogCreateRequest {
     String plogId;
     K2_PAYLOAD_FIELDS(plogId);
@@ -51,22 +51,43 @@ void SKVRecord::serializeNull() {
         storage.excludedFields = std::vector<bool>(schema->fields.size(), false);
     }
 
+    recordFieldOffset();
     storage.excludedFields[fieldCursor] = true;
     ++fieldCursor;
 }
 
-// NoOp function to be used with the convience macros to get document fields
-template <typename T>
-void NoOp(std::optional<T> value, const String& fieldName, int n) {
-    (void) value;
-    (void) fieldName;
-    (void) n;
-};
+// Called during serialization, before the field at fieldCursor is written
+void SKVRecord::recordFieldOffset() {
+    if (fieldOffsets.size() == fieldCursor) {
+        fieldOffsets.push_back(storage.fieldData.getCurrentPosition());
+    }
+}
 
 uint32_t SKVRecord::getFieldCursor() const {
     return fieldCursor;
 }
 
+template <typename T>
+void skipFieldHelper(const SchemaField& fieldInfo, Payload& fieldData) {
+    (void) fieldInfo;
+    fieldData.skip<T>();
+}
+
+// Walks the fields from the last known offset, recording the offsets up to (and including) the given index
+void SKVRecord::buildFieldOffsets(uint32_t fieldIndex) {
+    if (fieldOffsets.empty()) {
+        storage.fieldData.seek(0);
+        fieldOffsets.push_back(storage.fieldData.getCurrentPosition());
+    }
+    storage.fieldData.seek(fieldOffsets.back());
+    for (uint32_t i = fieldOffsets.size() - 1; i < fieldIndex; ++i) {
+        if (storage.excludedFields.size() == 0 || !storage.excludedFields[i]) {
+            K2_DTO_CAST_APPLY_FIELD_VALUE(skipFieldHelper, schema->fields[i], storage.fieldData);
+        }
+        fieldOffsets.push_back(storage.fieldData.getCurrentPosition());
+    }
+}
+
 void SKVRecord::seekField(uint32_t fieldIndex) {
     if (fieldIndex > schema->fields.size()) {
         throw NoFieldFoundException();
@@ -76,19 +97,11 @@ void SKVRecord::seekField(uint32_t fieldIndex) {
         return;
     }
 
-    if (fieldIndex < fieldCursor) {
-        fieldCursor = 0;
-        storage.fieldData.seek(0);
-    }
-
-    while(fieldIndex != fieldCursor) {
-        if (storage.excludedFields.size() > 0 && storage.excludedFields[fieldCursor]) {
-            ++fieldCursor;
-            continue;
-        }
-
-        DO_ON_NEXT_RECORD_FIELD((*this), NoOp, 0);
+    if (fieldIndex >= fieldOffsets.size()) {
+        buildFieldOffsets(fieldIndex);
     }
+    storage.fieldData.seek(fieldOffsets[fieldIndex]);
+    fieldCursor = fieldIndex;
 }
 
 // We expose the storage in case the user wants to write it to file or otherwise
@@ -251,14 +264,6 @@ SKVRecord SKVRecord::cloneToOtherSchema(const String& collection, std::shared_pt
     return SKVRecord(collection, other_schema, storage.share(), keyValuesAvailable);
 }
 
-template <typename T>
-void skipFieldDataHelper(SchemaField fieldInfo, Payload& fieldData) {
-    (void) fieldInfo;
-    // TODO change this to payload skip when available
-    T tmp{};
-    fieldData.read(tmp);
-}
-
 // This method takes the SKVRecord extracts the key fields and creates a new SKVRecord with those fields
 SKVRecord SKVRecord::getSKVKeyRecord() {
     if (!keyValuesAvailable) {
@@ -281,7 +286,7 @@ SKVRecord SKVRecord::getSKVKeyRecord() {
     // Skipping key fields in fieldData so we can truncate the remaining value data in the payload
     for (size_t i = 0; i < num_keys; ++i) {
         if (!key_storage.excludedFields[i]) {
-            K2_DTO_CAST_APPLY_FIELD_VALUE(skipFieldDataHelper, schema->fields[i], key_storage.fieldData);
+            K2_DTO_CAST_APPLY_FIELD_VALUE(skipFieldHelper, schema->fields[i], key_storage.fieldData);
         }
     }
     key_storage.fieldData.truncateToCurrent();
@@ -91,6 +91,7 @@ public:
             }
         }
 
+        recordFieldOffset();
         storage.fieldData.write(field);
         ++fieldCursor;
     }
@@ -121,15 +122,15 @@ public:
     // Deserialization can be in any order, but the preferred method is in-order
     template <typename T>
     std::optional<T> deserializeField(const String& name) {
-        for (size_t i = 0; i < schema->fields.size(); ++i) {
-            if (schema->fields[i].name == name) {
-                return deserializeField<T>(i);
-            }
+        if (auto idx = schema->getFieldIndex(name); idx) {
+            return deserializeField<T>(*idx);
         }
 
         throw NoFieldFoundException(fmt::format("schema not followed in record deserialization for name {}", name));
     }
 
+    // Positions the cursor at the given field. This is O(1) once the field offsets for the record are known.
+    // Offsets are recorded during serialization, or computed with a single pass on the first seek
     void seekField(uint32_t fieldIndex);
 
     template <typename T>
@@ -238,6 +239,8 @@ public:
 
 private:
     void constructKeyStrings();
+    void recordFieldOffset();
+    void buildFieldOffsets(uint32_t fieldIndex);
     template <typename T>
     void makeKeyString(std::optional<T> value, const String& fieldName, int tmp);
     Storage storage;
@@ -245,6 +248,8 @@ private:
     std::vector<String> partitionKeys;
     std::vector<String> rangeKeys;
     uint32_t fieldCursor = 0;
+    // The payload position at which each field starts (excluded fields take up no space). Not serialized
+    std::vector<Payload::PayloadPosition> fieldOffsets;
     bool keyValuesAvailable = false; // Whether the values for key fields are in the storage payload
     bool keyStringsConstructed = false; // Whether the encoded keys are already in the vectors above
 
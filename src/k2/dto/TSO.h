@@ -26,15 +26,23 @@ Copyright(c) 2020 Futurewei Cloud
 namespace k2::dto {
 
 struct GetTimestampRequest {
-    K2_PAYLOAD_EMPTY;
-    K2_DEF_FMT(GetTimestampRequest);
+    // the number of timestamps the client would like. The TSO may return fewer
+    uint32_t count = 1;
+
+    K2_PAYLOAD_FIELDS(count);
+    K2_DEF_FMT(GetTimestampRequest, count);
 };
 
+// A batch of consecutive timestamps: the given timestamp, followed by count-1 timestamps whose endCount is
+// one nanosecond apart. The client may hand them out as long as no more than validFor has passed since it
+// sent the request. Until then each timestamp in the batch is guaranteed to contain the true time
 struct GetTimestampResponse{
     Timestamp timestamp;
+    uint32_t count = 1;
+    Duration validFor{0};
 
-    K2_PAYLOAD_FIELDS(timestamp);
-    K2_DEF_FMT(GetTimestampResponse, timestamp);
+    K2_PAYLOAD_FIELDS(timestamp, count, validFor);
+    K2_DEF_FMT(GetTimestampResponse, timestamp, count, validFor);
 };
 
 }  // k2::dto
@@ -0,0 +1,571 @@
+/*
+MIT License
+
+Copyright(c) 2022 Futurewei Cloud
+
+    Permission is hereby granted,
+    free of charge, to any person obtaining a copy of this software and associated documentation files(the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
+
+    The above copyright notice and this permission notice shall be included in all copies
+    or
+    substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS",
+    WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER
+    LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+namespace k2 {
+
+// An ordered map, implemented as a B+tree.
+// Compared to std::map, a lookup touches a few contiguous nodes instead of chasing a pointer per tree level:
+// - each node stores an array of 8-byte key windows which are binary-searched before any full key is compared.
+//   A window holds the key bytes which follow the prefix shared by all keys in the node, so keys with long
+//   common prefixes (e.g. encoded keys from the same schema) can still be told apart by their windows.
+// - leaves are linked in key order for range iteration.
+// Entries (key/value pairs) are allocated individually and never move, so pointers and references to an entry remain
+// valid until the entry is erased. Iterators however are invalidated by any insert or erase.
+// Leaves are not merged when they become underfull. A node is released once it becomes empty.
+//
+// KeyTraits must provide
+//     static int compare(const K& a, const K& b);
+//     static std::string_view prefixBytes(const K& k);
+// where the lexicographic order of prefixBytes() must agree with compare(), i.e. compare(a, b) < 0 implies
+// prefixBytes(a) <= prefixBytes(b), and equal keys have equal prefixBytes(). compare() is used to break ties.
+template <typename K, typename V, typename KeyTraits, uint16_t LeafSlots=32, uint16_t InnerSlots=32>
+class BPTree {
+    static_assert(LeafSlots >= 4 && InnerSlots >= 4, "BPTree nodes must have at least 4 slots");
+    struct NodeBase;
+    struct LeafNode;
+    struct InnerNode;
+
+public:
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef std::pair<const K, V> value_type;
+    typedef size_t size_type;
+
+    // bidirectional iterator over the entries in key order
+    template <bool Const>
+    class IteratorT {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef BPTree::value_type value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef std::conditional_t<Const, const value_type*, value_type*> pointer;
+        typedef std::conditional_t<Const, const value_type&, value_type&> reference;
+
+        IteratorT() = default;
+
+        // iterators can be converted to const_iterators
+        template <bool C = Const, typename = std::enable_if_t<C>>
+        IteratorT(const IteratorT<false>& o) : _tree(o._tree), _leaf(o._leaf), _idx(o._idx) {}
+
+        reference operator*() const { return *_leaf->entries[_idx]; }
+        pointer operator->() const { return _leaf->entries[_idx]; }
+
+        IteratorT& operator++() {
+            if (++_idx == _leaf->count) {
+                // only the root leaf can be empty so the next leaf (if any) has at least one element
+                _leaf = _leaf->next;
+                _idx = 0;
+            }
+            return *this;
+        }
+        IteratorT operator++(int) {
+            auto result = *this;
+            ++(*this);
+            return result;
+        }
+
+        IteratorT& operator--() {
+            if (_leaf == nullptr) {
+                // rewinding end()
+                _leaf = _tree->_lastLeaf;
+                _idx = _leaf->count - 1;
+            } else if (_idx == 0) {
+                _leaf = _leaf->prev;
+                _idx = _leaf->count - 1;
+            } else {
+                --_idx;
+            }
+            return *this;
+        }
+        IteratorT operator--(int) {
+            auto result = *this;
+            --(*this);
+            return result;
+        }
+
+        bool operator==(const IteratorT& o) const { return _leaf == o._leaf && _idx == o._idx; }
+        bool operator!=(const IteratorT& o) const { return !(*this == o); }
+
+    private:
+        friend class BPTree;
+        template <bool> friend class IteratorT;
+        IteratorT(const BPTree* tree, LeafNode* leaf, uint16_t idx) : _tree(tree), _leaf(leaf), _idx(idx) {}
+
+        const BPTree* _tree{nullptr};
+        // the leaf holding the current element, or nullptr for end()
+        LeafNode* _leaf{nullptr};
+        // the position of the current element in the leaf
+        uint16_t _idx{0};
+    };
+    typedef IteratorT<false> iterator;
+    typedef IteratorT<true> const_iterator;
+
+public: // lifecycle
+    BPTree() = default;
+    ~BPTree() { clear(); }
+
+    BPTree(const BPTree&) = delete;
+    BPTree& operator=(const BPTree&) = delete;
+
+    BPTree(BPTree&& o) noexcept : _root(o._root), _firstLeaf(o._firstLeaf), _lastLeaf(o._lastLeaf), _size(o._size) {
+        o._root = nullptr;
+        o._firstLeaf = o._lastLeaf = nullptr;
+        o._size = 0;
+    }
+    BPTree& operator=(BPTree&& o) noexcept {
+        if (this != &o) {
+            clear();
+            std::swap(_root, o._root);
+            std::swap(_firstLeaf, o._firstLeaf);
+            std::swap(_lastLeaf, o._lastLeaf);
+            std::swap(_size, o._size);
+        }
+        return *this;
+    }
+
+public: // API
+    size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+
+    // the number of node levels, i.e. 1 when the root is a leaf, and 0 before the first insert
+    size_t height() const {
+        size_t result = 0;
+        for (const NodeBase* n = _root; n != nullptr; n = n->isLeaf ? nullptr : static_cast<const InnerNode*>(n)->children[0]) {
+            ++result;
+        }
+        return result;
+    }
+
+    iterator begin() { return _size == 0 ? end() : iterator(this, _firstLeaf, 0); }
+    iterator end() { return iterator(this, nullptr, 0); }
+    const_iterator begin() const { return _size == 0 ? end() : const_iterator(this, _firstLeaf, 0); }
+    const_iterator end() const { return const_iterator(this, nullptr, 0); }
+    const_iterator cbegin() const { return begin(); }
+    const_iterator cend() const { return end(); }
+
+    // first element not less than the given key
+    iterator lower_bound(const K& key) { return _bound<false>(key, false); }
+    const_iterator lower_bound(const K& key) const { return _bound<true>(key, false); }
+
+    // first element greater than the given key
+    iterator upper_bound(const K& key) { return _bound<false>(key, true); }
+    const_iterator upper_bound(const K& key) const { return _bound<true>(key, true); }
+
+    iterator find(const K& key) {
+        auto it = lower_bound(key);
+        return (it != end() && KeyTraits::compare(it->first, key) == 0) ? it : end();
+    }
+    const_iterator find(const K& key) const {
+        auto it = lower_bound(key);
+        return (it != end() && KeyTraits::compare(it->first, key) == 0) ? it : end();
+    }
+
+    std::pair<iterator, iterator> equal_range(const K& key) {
+        auto lower = lower_bound(key);
+        auto upper = lower;
+        if (lower != end() && KeyTraits::compare(lower->first, key) == 0) {
+            ++upper;
+        }
+        return std::make_pair(lower, upper);
+    }
+
+    // Insert the given key/value pair if the key doesn't exist yet.
+    // Returns an iterator to the element with the key and a flag indicating if the insert took place
+    template <typename PairT>
+    std::pair<iterator, bool> insert(PairT&& kv) {
+        if (_root == nullptr) {
+            _root = _firstLeaf = _lastLeaf = new LeafNode();
+        }
+        auto kb = KeyTraits::prefixBytes(kv.first);
+        auto* leaf = _findLeaf(kv.first, kb);
+        auto idx = _search(*leaf, kv.first, kb, false);
+        if (idx < leaf->count && KeyTraits::compare(leaf->entries[idx]->first, kv.first) == 0) {
+            return std::make_pair(iterator(this, leaf, idx), false);
+        }
+        return std::make_pair(_insertAt(leaf, idx, new value_type(std::forward<PairT>(kv))), true);
+    }
+
+    // Insert with a position hint. The hint is used if the new element belongs right before it, in which case
+    // we skip the tree descent. Otherwise this behaves the same as insert(kv)
+    template <typename PairT>
+    iterator insert(const_iterator hint, PairT&& kv) {
+        if (_size > 0 && _hintFits(hint, kv.first)) {
+            auto* leaf = hint._leaf == nullptr ? _lastLeaf : hint._leaf;
+            uint16_t idx = hint._leaf == nullptr ? _lastLeaf->count : hint._idx;
+            // We can't insert at the front of a leaf without knowing the separator in the parent, unless it is the
+            // very first leaf. Fall back to a regular insert in that case.
+            if (idx > 0 || leaf == _firstLeaf) {
+                return _insertAt(leaf, idx, new value_type(std::forward<PairT>(kv)));
+            }
+        }
+        return insert(std::forward<PairT>(kv)).first;
+    }
+
+    // Erase the element at the given position. Returns an iterator to the element which followed the erased one
+    iterator erase(const_iterator pos) {
+        auto* leaf = pos._leaf;
+        auto idx = pos._idx;
+        delete leaf->entries[idx];
+        std::move(leaf->entries + idx + 1, leaf->entries + leaf->count, leaf->entries + idx);
+        std::move(leaf->windows + idx + 1, leaf->windows + leaf->count, leaf->windows + idx);
+        --leaf->count;
+        --_size;
+        if (leaf->count == 0 && leaf != _root) {
+            auto* next = leaf->next;
+            _removeLeaf(leaf);
+            return iterator(this, next, 0);
+        }
+        if (idx == leaf->count) {
+            return iterator(this, leaf->next, 0);
+        }
+        return iterator(this, leaf, idx);
+    }
+    iterator erase(iterator pos) { return erase(const_iterator(pos)); }
+
+    void clear() {
+        if (_root != nullptr) {
+            _destroy(_root);
+        }
+        _root = nullptr;
+        _firstLeaf = _lastLeaf = nullptr;
+        _size = 0;
+    }
+
+private: // types
+    struct NodeBase {
+        explicit NodeBase(bool leaf) : isLeaf(leaf) {}
+        InnerNode* parent{nullptr};
+        // the number of keys in the node
+        uint16_t count{0};
+        bool isLeaf;
+        // the length of the prefix (in KeyTraits::prefixBytes()) shared by all keys in the node
+        size_t skip{0};
+    };
+
+    struct LeafNode : NodeBase {
+        LeafNode() : NodeBase(true) {}
+        // the key windows for the entries
+        uint64_t windows[LeafSlots];
+        // the entries, sorted by key
+        value_type* entries[LeafSlots];
+        // neighbor leaves, in key order
+        LeafNode* prev{nullptr};
+        LeafNode* next{nullptr};
+    };
+
+    struct InnerNode : NodeBase {
+        InnerNode() : NodeBase(false) {}
+        // the key windows for the separators
+        uint64_t windows[InnerSlots];
+        // separators: all keys in children[i] are less than keys[i], and all keys in children[i+1] are not less than keys[i]
+        K keys[InnerSlots];
+        NodeBase* children[InnerSlots + 1];
+    };
+
+private: // helpers
+    static const K& _keyAt(const LeafNode& n, uint16_t i) { return n.entries[i]->first; }
+    static const K& _keyAt(const InnerNode& n, uint16_t i) { return n.keys[i]; }
+
+    // the (zero-padded) 8 bytes which follow the first skip bytes, packed so that integer comparison
+    // agrees with lexicographic comparison
+    static uint64_t _window(std::string_view bytes, size_t skip) {
+        uint64_t result = 0;
+        for (size_t i = skip; i < skip + 8; ++i) {
+            result <<= 8;
+            if (i < bytes.size()) {
+                result |= static_cast<uint8_t>(bytes[i]);
+            }
+        }
+        return result;
+    }
+
+    static size_t _commonPrefix(std::string_view a, std::string_view b) {
+        auto [ait, bit] = std::mismatch(a.begin(), a.end(), b.begin(), b.end());
+        return ait - a.begin();
+    }
+
+    template <typename NodeT>
+    static void _rebuildWindows(NodeT& n) {
+        for (uint16_t i = 0; i < n.count; ++i) {
+            n.windows[i] = _window(KeyTraits::prefixBytes(_keyAt(n, i)), n.skip);
+        }
+    }
+
+    // recompute the shared prefix of the node. Since the keys are sorted, the prefix shared by the
+    // first and the last key is shared by all keys in between
+    template <typename NodeT>
+    static void _resetPrefix(NodeT& n) {
+        n.skip = n.count == 0 ? 0 : _commonPrefix(KeyTraits::prefixBytes(_keyAt(n, 0)), KeyTraits::prefixBytes(_keyAt(n, n.count - 1)));
+        _rebuildWindows(n);
+    }
+
+    // shorten the shared prefix of the node if needed so that it covers the given key bytes.
+    // Must be called before the key is added to the node
+    template <typename NodeT>
+    static void _admitPrefix(NodeT& n, std::string_view kb) {
+        if (n.count == 0) {
+            n.skip = kb.size();
+            return;
+        }
+        auto common = _commonPrefix(kb, KeyTraits::prefixBytes(_keyAt(n, 0)).substr(0, n.skip));
+        if (common < n.skip) {
+            n.skip = common;
+            _rebuildWindows(n);
+        }
+    }
+
+    // Returns the first slot in the node whose key is greater than (upper=true) or not less than (upper=false) the given key.
+    // kb must be the prefixBytes() of key
+    template <typename NodeT>
+    static uint16_t _search(const NodeT& n, const K& key, std::string_view kb, bool upper) {
+        if (n.count == 0) {
+            return 0;
+        }
+        // a key which doesn't have the shared prefix sorts either before or after all keys in the node
+        if (int c = kb.substr(0, n.skip).compare(KeyTraits::prefixBytes(_keyAt(n, 0)).substr(0, n.skip)); c != 0) {
+            return c < 0 ? 0 : n.count;
+        }
+        auto w = _window(kb, n.skip);
+        uint16_t lo = 0, hi = n.count;
+        while (lo < hi) {
+            uint16_t mid = (lo + hi) / 2;
+            bool goRight;
+            if (n.windows[mid] != w) {
+                goRight = n.windows[mid] < w;
+            } else {
+                // same window. Only the full keys can tell
+                auto c = KeyTraits::compare(_keyAt(n, mid), key);
+                goRight = upper ? c <= 0 : c < 0;
+            }
+            if (goRight) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+    LeafNode* _findLeaf(const K& key, std::string_view kb) const {
+        NodeBase* n = _root;
+        while (!n->isLeaf) {
+            auto* inner = static_cast<InnerNode*>(n);
+            n = inner->children[_search(*inner, key, kb, true)];
+        }
+        return static_cast<LeafNode*>(n);
+    }
+
+    template <bool Const>
+    IteratorT<Const> _bound(const K& key, bool upper) const {
+        if (_root == nullptr) {
+            return IteratorT<Const>(this, nullptr, 0);
+        }
+        auto kb = KeyTraits::prefixBytes(key);
+        auto* leaf = _findLeaf(key, kb);
+        auto idx = _search(*leaf, key, kb, upper);
+        if (idx == leaf->count) {
+            return IteratorT<Const>(this, leaf->next, 0);
+        }
+        return IteratorT<Const>(this, leaf, idx);
+    }
+
+    // check if the given key belongs right before the hint position
+    bool _hintFits(const_iterator hint, const K& key) const {
+        if (hint != end() && KeyTraits::compare(key, hint->first) >= 0) {
+            return false;
+        }
+        if (hint != begin()) {
+            auto prev = hint;
+            --prev;
+            return KeyTraits::compare(prev->first, key) < 0;
+        }
+        return true;
+    }
+
+    static uint16_t _childIndex(const InnerNode* parent, const NodeBase* child) {
+        uint16_t i = 0;
+        while (parent->children[i] != child) ++i;
+        return i;
+    }
+
+    iterator _insertAt(LeafNode* leaf, uint16_t idx, value_type* entry) {
+        if (leaf->count == LeafSlots) {
+            auto* right = _splitLeaf(leaf);
+            // stay in the left leaf at the split point so that the first key of the right leaf doesn't change
+            if (idx > leaf->count) {
+                idx -= leaf->count;
+                leaf = right;
+            }
+        }
+        auto kb = KeyTraits::prefixBytes(entry->first);
+        _admitPrefix(*leaf, kb);
+        std::move_backward(leaf->entries + idx, leaf->entries + leaf->count, leaf->entries + leaf->count + 1);
+        std::move_backward(leaf->windows + idx, leaf->windows + leaf->count, leaf->windows + leaf->count + 1);
+        leaf->entries[idx] = entry;
+        leaf->windows[idx] = _window(kb, leaf->skip);
+        ++leaf->count;
+        ++_size;
+        return iterator(this, leaf, idx);
+    }
+
+    // split the given full leaf in two, returning the new right sibling
+    LeafNode* _splitLeaf(LeafNode* leaf) {
+        auto* right = new LeafNode();
+        uint16_t mid = leaf->count / 2;
+        right->count = leaf->count - mid;
+        std::copy(leaf->entries + mid, leaf->entries + leaf->count, right->entries);
+        leaf->count = mid;
+
+        right->prev = leaf;
+        right->next = leaf->next;
+        if (leaf->next != nullptr) {
+            leaf->next->prev = right;
+        } else {
+            _lastLeaf = right;
+        }
+        leaf->next = right;
+
+        _resetPrefix(*leaf);
+        _resetPrefix(*right);
+        _insertIntoParent(leaf, right->entries[0]->first, right);
+        return right;
+    }
+
+    // split the given full inner node in two. The middle separator moves up to the parent
+    void _splitInner(InnerNode* node) {
+        auto* right = new InnerNode();
+        uint16_t mid = node->count / 2;
+        K promoted = std::move(node->keys[mid]);
+        right->count = node->count - mid - 1;
+        std::move(node->keys + mid + 1, node->keys + node->count, right->keys);
+        std::copy(node->children + mid + 1, node->children + node->count + 1, right->children);
+        for (uint16_t i = 0; i <= right->count; ++i) {
+            right->children[i]->parent = right;
+        }
+        node->count = mid;
+
+        _resetPrefix(*node);
+        _resetPrefix(*right);
+        _insertIntoParent(node, std::move(promoted), right);
+    }
+
+    // register the new right sibling of the given node with their parent
+    void _insertIntoParent(NodeBase* left, K sep, NodeBase* right) {
+        auto* parent = left->parent;
+        if (parent == nullptr) {
+            // we split the root. Grow the tree
+            auto* root = new InnerNode();
+            root->keys[0] = std::move(sep);
+            root->children[0] = left;
+            root->children[1] = right;
+            root->count = 1;
+            left->parent = right->parent = root;
+            _resetPrefix(*root);
+            _root = root;
+            return;
+        }
+        if (parent->count == InnerSlots) {
+            _splitInner(parent);
+            // the split may have moved us to the new sibling
+            parent = left->parent;
+        }
+        auto ci = _childIndex(parent, left);
+        _admitPrefix(*parent, KeyTraits::prefixBytes(sep));
+        std::move_backward(parent->keys + ci, parent->keys + parent->count, parent->keys + parent->count + 1);
+        std::move_backward(parent->windows + ci, parent->windows + parent->count, parent->windows + parent->count + 1);
+        std::move_backward(parent->children + ci + 1, parent->children + parent->count + 1, parent->children + parent->count + 2);
+        parent->keys[ci] = std::move(sep);
+        parent->windows[ci] = _window(KeyTraits::prefixBytes(parent->keys[ci]), parent->skip);
+        parent->children[ci + 1] = right;
+        right->parent = parent;
+        ++parent->count;
+    }
+
+    void _removeLeaf(LeafNode* leaf) {
+        (leaf->prev != nullptr ? leaf->prev->next : _firstLeaf) = leaf->next;
+        (leaf->next != nullptr ? leaf->next->prev : _lastLeaf) = leaf->prev;
+        _removeChild(leaf);
+        delete leaf;
+    }
+
+    // unlink the given empty node from its parent. Inner nodes which are left without children are removed as well
+    void _removeChild(NodeBase* child) {
+        auto* parent = child->parent;
+        auto ci = _childIndex(parent, child);
+        if (parent->count == 0) {
+            // this was the only child. The root always has at least two children, so the parent isn't the root
+            _removeChild(parent);
+            delete parent;
+            return;
+        }
+        // drop the separator on the side of the removed child
+        uint16_t ki = ci == 0 ? 0 : ci - 1;
+        std::move(parent->keys + ki + 1, parent->keys + parent->count, parent->keys + ki);
+        std::move(parent->windows + ki + 1, parent->windows + parent->count, parent->windows + ki);
+        std::move(parent->children + ci + 1, parent->children + parent->count + 1, parent->children + ci);
+        --parent->count;
+
+        // shrink the tree while the root only has a single child
+        while (!_root->isLeaf && static_cast<InnerNode*>(_root)->count == 0) {
+            auto* oldRoot = static_cast<InnerNode*>(_root);
+            _root = oldRoot->children[0];
+            _root->parent = nullptr;
+            delete oldRoot;
+        }
+    }
+
+    void _destroy(NodeBase* n) {
+        if (n->isLeaf) {
+            auto* leaf = static_cast<LeafNode*>(n);
+            for (uint16_t i = 0; i < leaf->count; ++i) {
+                delete leaf->entries[i];
+            }
+            delete leaf;
+        } else {
+            auto* inner = static_cast<InnerNode*>(n);
+            for (uint16_t i = 0; i <= inner->count; ++i) {
+                _destroy(inner->children[i]);
+            }
+            delete inner;
+        }
+    }
+
+private: // members
+    // the root node is created on the first insert
+    NodeBase* _root{nullptr};
+    LeafNode* _firstLeaf{nullptr};
+    LeafNode* _lastLeaf{nullptr};
+    size_t _size{0};
+}; // class BPTree
+
+} // namespace k2
@@ -0,0 +1,141 @@
+/*
+MIT License
+
+Copyright(c) 2022 Futurewei Cloud
+
+    Permission is hereby granted,
+    free of charge, to any person obtaining a copy of this software and associated documentation files(the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
+
+    The above copyright notice and this permission notice shall be included in all copies
+    or
+    substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS",
+    WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER
+    LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace k2 {
+
+// An open-addressing hash index over entries which are owned by another container.
+// The index maps a key to the entry for that key and is meant to sit next to an ordered container (e.g. a BPTree) as an
+// O(1) shortcut for exact-match lookups. The owning container must keep entries at a stable address until they are
+// erased from the index.
+// Slots are probed linearly and erased with backward shifting, so there are no tombstones and probe sequences
+// stay short under churn. Each slot caches the full hash so that keys are only compared on a hash match.
+//
+// Traits must provide
+//     static size_t hash(const K& key);
+//     static const K& key(const E& entry);
+//     static bool equal(const K& a, const K& b);
+template <typename K, typename E, typename Traits>
+class HashIndex {
+public:
+    // find the entry with the given key, or nullptr if there is none. The hash must be Traits::hash(key)
+    E* find(const K& key, size_t hash) const {
+        if (_size == 0) {
+            return nullptr;
+        }
+        for (size_t i = hash & _mask;; i = (i + 1) & _mask) {
+            auto& slot = _slots[i];
+            if (slot.entry == nullptr) {
+                return nullptr;
+            }
+            if (slot.hash == hash && Traits::equal(Traits::key(*slot.entry), key)) {
+                return slot.entry;
+            }
+        }
+    }
+    E* find(const K& key) const { return find(key, Traits::hash(key)); }
+
+    // index a new entry. There must be no other entry with the same key in the index
+    void insert(E* entry) {
+        // keep the load factor under 3/4
+        if ((_size + 1) * 4 > _slots.size() * 3) {
+            _rehash(_slots.empty() ? 16 : _slots.size() * 2);
+        }
+        _place(Slot{.hash = Traits::hash(Traits::key(*entry)), .entry = entry});
+        ++_size;
+    }
+
+    // remove the given entry from the index. Does nothing if the entry isn't indexed
+    void erase(const E* entry) {
+        if (_size == 0) {
+            return;
+        }
+        auto i = Traits::hash(Traits::key(*entry)) & _mask;
+        while (_slots[i].entry != entry) {
+            if (_slots[i].entry == nullptr) {
+                return;
+            }
+            i = (i + 1) & _mask;
+        }
+        // shift back any entries which would become unreachable through the hole we're leaving
+        for (auto j = (i + 1) & _mask; _slots[j].entry != nullptr; j = (j + 1) & _mask) {
+            auto home = _slots[j].hash & _mask;
+            // the entry at j can fill the hole at i if its home slot isn't in the (cyclic) range (i, j]
+            if (((j - home) & _mask) >= ((j - i) & _mask)) {
+                _slots[i] = _slots[j];
+                i = j;
+            }
+        }
+        _slots[i] = Slot{};
+        --_size;
+    }
+
+    size_t size() const { return _size; }
+
+    // the memory held by the index
+    size_t capacityBytes() const { return _slots.capacity() * sizeof(Slot); }
+
+    void clear() {
+        _slots.clear();
+        _mask = 0;
+        _size = 0;
+    }
+
+private:
+    struct Slot {
+        size_t hash{0};
+        // nullptr for an empty slot
+        E* entry{nullptr};
+    };
+
+    void _place(Slot slot) {
+        auto i = slot.hash & _mask;
+        while (_slots[i].entry != nullptr) {
+            i = (i + 1) & _mask;
+        }
+        _slots[i] = slot;
+    }
+
+    void _rehash(size_t capacity) {
+        std::vector<Slot> old(capacity);
+        old.swap(_slots);
+        _mask = capacity - 1;
+        for (auto& slot : old) {
+            if (slot.entry != nullptr) {
+                _place(slot);
+            }
+        }
+    }
+
+    std::vector<Slot> _slots;
+    size_t _mask{0};
+    size_t _size{0};
+}; // class HashIndex
+
+} // namespace k2
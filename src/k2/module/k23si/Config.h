@@ -53,9 +53,22 @@ struct K23SIConfig {
     // how many writes to finalize in parallel
     ConfigVar<uint64_t> finalizeBatchSize{"k23si_txn_finalize_batch_size", 20};
 
-    // Max number of records to return in a single query response
+    // Finalizations of different transactions for the same partition are coalesced into one message, which is sent
+    // once it has this many transactions or when the window passes. A window of zero disables the coalescing
+    ConfigVar<uint64_t> finalizeGroupSize{"k23si_txn_finalize_group_size", 64};
+    ConfigDuration finalizeGroupWindow{"k23si_txn_finalize_group_window", 200us};
+
+    // A transaction whose writes are all in the partition which holds its record is committed in one phase: its WIs
+    // are finalized in place as soon as the end action is persisted, without any finalize RPCs
+    ConfigVar<bool> onePhaseCommit{"k23si_one_phase_commit", true};
+
+    // Max number of records to return in a single query response. Zero leaves pages bounded only by size
     ConfigVar<uint32_t> paginationLimit{"k23si_query_pagination_limit", 10};
 
+    // Max size of the records in a single query response. The page ends with the record which reaches the limit,
+    // so that every page makes progress regardless of the record size. Zero disables
+    ConfigVar<uint32_t> paginationBytesLimit{"k23si_query_pagination_bytes_limit", 512 * 1024};
+
     // Max number of records to scan in a single query request before response sent
     ConfigVar<uint32_t> scanLimit{"k23si_query_scan_limit", 0};
 
@@ -65,12 +78,57 @@ struct K23SIConfig {
     // Default is > paginiationLimit so it will always push
     ConfigVar<uint32_t> queryPushLimit{"k23si_query_push_limit", 11};
 
+    // Max number of distinct query filters to keep compiled. Pages of the same query reuse the compiled filter
+    ConfigVar<uint32_t> compiledFilterCacheSize{"k23si_compiled_filter_cache_size", 1000};
+
+    // Max number of groups to return in a single response of an aggregation query
+    ConfigVar<uint32_t> aggregationGroupLimit{"k23si_query_aggregation_group_limit", 1000};
+
+    // Max number of paused query cursors to keep. A query page which stops in the middle of the partition keeps its
+    // cursor so that the next page can resume the scan without seeking or re-building the query state. Zero disables
+    ConfigVar<uint32_t> queryCursorCacheSize{"k23si_query_cursor_cache_size", 1000};
+    // how long to keep a paused query cursor around for the next page of the query
+    ConfigDuration queryCursorTimeout{"k23si_query_cursor_timeout", 5s};
+
     // the endpoint for our persistence
     ConfigVar<std::vector<String>> persistenceEndpoint{"k23si_persistence_endpoints"};
     ConfigDuration persistenceTimeout{"k23si_persistence_timeout", 10s};
     ConfigDuration persistenceAutoflushDeadline{"k23si_autoflush_deadline", 1s};
+    // how many flushes can be in flight to persistence at the same time. They complete in the order they were sent
+    ConfigVar<uint32_t> persistenceMaxInflightFlushes{"k23si_persistence_max_inflight_flushes", 4};
+    // buffered data is flushed once it reaches this size. This is also the largest batch the group commit waits for
+    ConfigVar<uint64_t> persistenceFlushBytes{"k23si_persistence_flush_bytes", 256 * 1024};
+    // While other flushes are in flight, a flush waits for more data up to this long. The size of the batches is
+    // tuned so that flushes complete within this latency. Zero sends every flush as soon as there is room in flight
+    ConfigDuration persistenceTargetFlushLatency{"k23si_persistence_target_flush_latency", 1ms};
+    // how much data to request from persistence at a time when replaying the log during recovery
+    ConfigVar<uint64_t> recoveryPageSize{"k23si_recovery_page_size", 1024 * 1024};
+    // how many persisted records to apply during recovery before yielding
+    ConfigVar<uint32_t> recoveryBatchSize{"k23si_recovery_batch_size", 1000};
+    // how often to write a snapshot of the indexer to persistence. Recovery loads the latest snapshot and only replays
+    // the WAL written after it. Zero disables snapshots
+    ConfigDuration snapshotInterval{"k23si_snapshot_interval", 10min};
+    // how many keys to write out in each snapshot chunk. The snapshot yields after each chunk
+    ConfigVar<uint32_t> snapshotChunkKeys{"k23si_snapshot_chunk_keys", 1000};
 
     // maximum push count for a key during handleRead() and handWrite()
     ConfigVar<uint32_t> maxPushCount{"k23si_max_push_count", 1};
+
+    // Version garbage collection runs in small slices so that it doesn't hold the reactor for long.
+    // A slice ends when either limit is reached, after which the collector yields to other tasks
+    ConfigVar<uint32_t> gcSliceKeys{"k23si_gc_slice_keys", 1000};
+    ConfigDuration gcSliceBudget{"k23si_gc_slice_budget", 500us};
+
+    // Record values are stored in slabs of this size instead of in their own allocations. Zero disables
+    ConfigVar<uint32_t> arenaSlabSize{"k23si_arena_slab_size", 256 * 1024};
+    // The version GC moves the values out of slabs which have less than this fraction of their memory in use
+    ConfigVar<double> arenaCompactionOccupancy{"k23si_arena_compaction_occupancy", 0.5};
+
+    // Keep a hash index next to the ordered key index so that reads and writes of existing keys are O(1)
+    ConfigVar<bool> indexerHashIndex{"k23si_indexer_hash_index", true};
+
+    // Memory budget in bytes for the read timestamp cache. When it is exceeded, the oldest ranges are dropped
+    // and the cache's low water mark is raised to cover them. Zero means unbounded
+    ConfigVar<uint64_t> readCacheSize{"k23si_read_cache_size", 16 * 1024 * 1024};
 };
 }
@@ -25,22 +25,98 @@ Copyright(c) 2022 Futurewei Cloud
 
 #include <k2/common/MapUtil.h>
 
+#include <seastar/core/later.hh>
+#include <seastar/core/loop.hh>
+
+#include <algorithm>
 #include <iterator>
 
 namespace k2 {
 // *********************** IndexerKey API
-int IndexerKey::compare(const IndexerKey& o) const noexcept {
-    auto pkcomp = partitionKey.compare(o.partitionKey);
-    if (pkcomp == 0) {
-        // if the partition keys are equal, return the comparison of the range keys
-        return rangeKey.compare(o.rangeKey);
+// the encoding bytes for the IndexerKey. See FieldTypes.cpp for the same scheme applied to key fields
+static constexpr char ESCAPE = '\0';
+static constexpr char TERM = 0x01;
+static constexpr char ESCAPED_NULL = (char)0xFF;
+
+IndexerKey::IndexerKey(const String& partitionKey, const String& rangeKey) {
+    size_t nulls = std::count(partitionKey.begin(), partitionKey.end(), ESCAPE);
+    _bytes = String(String::initialized_later(), partitionKey.size() + nulls + 2 + rangeKey.size());
+    auto out = _bytes.begin();
+    if (nulls == 0) {
+        out = std::copy(partitionKey.begin(), partitionKey.end(), out);
+    }
+    else {
+        for (char c : partitionKey) {
+            *out++ = c;
+            if (c == ESCAPE) {
+                *out++ = ESCAPED_NULL;
+            }
+        }
+    }
+    *out++ = ESCAPE;
+    *out++ = TERM;
+    std::copy(rangeKey.begin(), rangeKey.end(), out);
+}
+
+size_t IndexerKey::_rangeKeyOffset() const noexcept {
+    // the partition key ends at the first ESCAPE which isn't followed by ESCAPED_NULL
+    auto pos = _bytes.find(ESCAPE);
+    while (pos != String::npos && pos + 1 < _bytes.size() && _bytes[pos + 1] == ESCAPED_NULL) {
+        pos = _bytes.find(ESCAPE, pos + 2);
+    }
+    return pos == String::npos ? _bytes.size() : std::min(pos + 2, _bytes.size());
+}
+
+void IndexerKey::decode(String& partitionKey, String& rangeKey) const {
+    if (_bytes.empty()) {
+        partitionKey = String();
+        rangeKey = String();
+        return;
+    }
+    auto rkOffset = _rangeKeyOffset();
+    auto pkEnd = rkOffset - 2;
+    size_t nulls = 0;
+    for (auto pos = _bytes.find(ESCAPE); pos < pkEnd; pos = _bytes.find(ESCAPE, pos + 2)) {
+        ++nulls;
+    }
+    partitionKey = String(String::initialized_later(), pkEnd - nulls);
+    if (nulls == 0) {
+        std::copy(_bytes.begin(), _bytes.begin() + pkEnd, partitionKey.begin());
+    }
+    else {
+        auto out = partitionKey.begin();
+        for (size_t i = 0; i < pkEnd; ++i) {
+            *out++ = _bytes[i];
+            if (_bytes[i] == ESCAPE) {
+                ++i; // skip the ESCAPED_NULL
+            }
+        }
     }
-    return pkcomp;
+    rangeKey = String(_bytes.data() + rkOffset, _bytes.size() - rkOffset);
+}
+
+String IndexerKey::getPartitionKey() const {
+    String partitionKey, rangeKey;
+    decode(partitionKey, rangeKey);
+    return partitionKey;
+}
+
+String IndexerKey::getRangeKey() const {
+    auto rkOffset = _rangeKeyOffset();
+    return String(_bytes.data() + rkOffset, _bytes.size() - rkOffset);
+}
+
+int IndexerKey::compare(const IndexerKey& o) const noexcept {
+    return _bytes.compare(o._bytes);
 }
 
 bool IndexerKey::operator<(const IndexerKey& o) const noexcept {
     return compare(o) < 0;
 }
+
+bool IndexerKey::operator==(const IndexerKey& o) const noexcept {
+    return _bytes == o._bytes;
+}
 // *********************** end IndexerKey API
 
 // *********************** VersionSet API
@@ -49,14 +125,101 @@ bool VersionSet::empty() const {
 }
 // *********************** end VersionSet API
 
+// *********************** KeyIndexer API
+KeyIndexer::KeyIndexer(dto::IndexerType type, bool hashIndex) {
+    if (hashIndex) {
+        _hashIndex.emplace();
+    }
+    switch (type) {
+        case dto::IndexerType::Map:
+            _impl.emplace<MapT>();
+            break;
+        case dto::IndexerType::BPTree:
+            _impl.emplace<BPTreeT>();
+            break;
+        default:
+            throw std::invalid_argument(fmt::format("Unknown indexer type: {}", type));
+    }
+}
+
+size_t KeyIndexer::size() const {
+    return std::visit([](const auto& impl) { return impl.size(); }, _impl);
+}
+
+KeyIndexer::iterator KeyIndexer::begin() {
+    return std::visit([](auto& impl) { return iterator(impl.begin()); }, _impl);
+}
+
+KeyIndexer::iterator KeyIndexer::end() {
+    return std::visit([](auto& impl) { return iterator(impl.end()); }, _impl);
+}
+
+KeyIndexer::const_iterator KeyIndexer::begin() const {
+    return std::visit([](const auto& impl) { return const_iterator(impl.begin()); }, _impl);
+}
+
+KeyIndexer::const_iterator KeyIndexer::end() const {
+    return std::visit([](const auto& impl) { return const_iterator(impl.end()); }, _impl);
+}
+
+KeyIndexer::iterator KeyIndexer::lower_bound(const IndexerKey& key) {
+    return std::visit([&key](auto& impl) { return iterator(impl.lower_bound(key)); }, _impl);
+}
+
+std::pair<KeyIndexer::iterator, KeyIndexer::iterator> KeyIndexer::equal_range(const IndexerKey& key) {
+    return std::visit([&key](auto& impl) {
+        auto [lower, upper] = impl.equal_range(key);
+        return std::make_pair(iterator(lower), iterator(upper));
+    }, _impl);
+}
+
+KeyIndexer::iterator KeyIndexer::insert(iterator hint, std::pair<IndexerKey, VersionSet>&& kv) {
+    ++_version;
+    auto it = std::visit([&hint, &kv](auto& impl) {
+        using ImplIt = typename std::decay_t<decltype(impl)>::iterator;
+        return iterator(impl.insert(std::get<ImplIt>(hint._it), std::move(kv)));
+    }, _impl);
+    if (_hashIndex) {
+        _hashIndex->insert(&(*it));
+    }
+    return it;
+}
+
+KeyIndexer::iterator KeyIndexer::erase(iterator pos) {
+    ++_version;
+    if (_hashIndex) {
+        _hashIndex->erase(&(*pos));
+    }
+    return std::visit([&pos](auto& impl) {
+        using ImplIt = typename std::decay_t<decltype(impl)>::iterator;
+        return iterator(impl.erase(std::get<ImplIt>(pos._it)));
+    }, _impl);
+}
+KeyIndexer::value_type* KeyIndexer::findEntry(const IndexerKey& key, size_t hash) {
+    if (_hashIndex) {
+        return _hashIndex->find(key, hash);
+    }
+    auto it = lower_bound(key);
+    return it != end() && it->first == key ? &(*it) : nullptr;
+}
+// *********************** end KeyIndexer API
+
 // *********************** Indexer API
-seastar::future<> Indexer::start(dto::Timestamp createdTs) {
+seastar::future<> Indexer::start(dto::Timestamp createdTs, dto::IndexerType indexerType, bool hashIndex) {
     _createdTs = createdTs;
+    _indexerType = indexerType;
+    _hashIndex = hashIndex;
+    // nothing can have been read before the indexer was created
+    _readCache = ReadCache(createdTs, _readCacheBudget);
     return seastar::make_ready_future();
 }
 
 seastar::future<> Indexer::stop() {
-    return seastar::make_ready_future();
+    _stopping = true;
+    // wait for any in-progress GC pass to notice that we're stopping
+    auto fut = std::move(_gcFut);
+    _gcFut = seastar::make_ready_future();
+    return fut;
 }
 
 const Indexer::SchemaIndexer& Indexer::getSchemaIndexer() const {
@@ -64,13 +227,17 @@ const Indexer::SchemaIndexer& Indexer::getSchemaIndexer() const {
 }
 
 void Indexer::createSchema(const dto::Schema& schema) {
+    createSchema(schema.name);
+}
+
+void Indexer::createSchema(const String& schemaName) {
     // create a default indexer for the schema if one doesn't exist
-    auto [iter, success] = _schemaIndexer.try_emplace(schema.name);
+    auto [iter, success] = _schemaIndexer.try_emplace(schemaName, _indexerType, _hashIndex);
     if (success) {
-        K2LOG_D(log::skvsvr, "Created new schema indexer for {}", schema.name);
-        // if we did create a new indexer, set the low/high watermarks to the time we created the main indexer
-        iter->second.lastReadTimeLow = _createdTs;
-        iter->second.lastReadTimeHigh = _createdTs;
+        // Each schema gets its own id, which never changes. The read cache covers the key ranges of all
+        // schemas, which are told apart by their ids
+        iter->second.schemaId = _nextSchemaId++;
+        K2LOG_D(log::skvsvr, "Created new {} schema indexer for {} with id {}", _indexerType, schemaName, iter->second.schemaId);
     }
 }
 
@@ -80,11 +247,190 @@ size_t Indexer::size() {
     // the schema indexes anyway.
     size_t sz = 0;
     for (auto&[_,idxr]: _schemaIndexer) {
-        sz += idxr.impl.size();
+        sz += idxr.size();
     }
     return sz;
 }
 
+void Indexer::setGCSliceLimits(uint32_t sliceKeys, Duration sliceBudget) {
+    _gcSliceKeys = std::max(sliceKeys, 1u);
+    _gcSliceBudget = sliceBudget;
+}
+
+const VersionGCStats& Indexer::getGCStats() const {
+    return _gcStats;
+}
+
+void Indexer::setArenaLimits(size_t slabSize, double compactionOccupancy) {
+    _arena = RecordArena(slabSize, compactionOccupancy);
+}
+
+dto::SKVRecord::Storage Indexer::copyValue(dto::SKVRecord::Storage& value) {
+    return _arena.copy(value);
+}
+
+RecordArenaStats Indexer::getArenaStats() const {
+    return _arena.getStats();
+}
+
+void Indexer::setReadCacheBudget(size_t memoryBudget) {
+    _readCacheBudget = memoryBudget;
+    _readCache.setMemoryBudget(memoryBudget);
+}
+
+ReadCacheStats Indexer::getReadCacheStats() const {
+    return _readCache.getStats();
+}
+
+void Indexer::updateRetentionTimestamp(dto::Timestamp rts) {
+    _retentionTs.maxEq(rts);
+    _readCache.expire(_retentionTs);
+    if (_gcRunning || _stopping) {
+        // the running pass will finish with the older timestamp. The next refresh will pick up the new one
+        return;
+    }
+    _gcRunning = true;
+    _gcFut = seastar::do_with(GCCursor{.rts = _retentionTs}, [this] (auto& cursor) {
+        for (auto& [name, _] : _schemaIndexer) {
+            cursor.schemas.push_back(name);
+        }
+        K2LOG_D(log::skvsvr, "Starting version GC pass at rts={} over {} schemas", cursor.rts, cursor.schemas.size());
+        _arena.beginPass();
+        return seastar::repeat([this, &cursor] {
+            if (_stopping || _gcSlice(cursor)) {
+                return seastar::make_ready_future<seastar::stop_iteration>(seastar::stop_iteration::yes);
+            }
+            // let other tasks run before we continue with the next slice
+            return seastar::yield().then([] { return seastar::stop_iteration::no; });
+        });
+    })
+    .handle_exception([] (auto exc) {
+        K2LOG_W_EXC(log::skvsvr, exc, "caught exception during version GC");
+        return seastar::make_ready_future();
+    })
+    .finally([this] {
+        _gcRunning = false;
+        K2LOG_D(log::skvsvr, "Version GC pass done with stats {}", _gcStats);
+    });
+}
+
+void Indexer::collectGarbage(dto::Timestamp rts) {
+    _retentionTs.maxEq(rts);
+    _readCache.expire(_retentionTs);
+    GCCursor cursor{.rts = _retentionTs};
+    for (auto& [name, _] : _schemaIndexer) {
+        cursor.schemas.push_back(name);
+    }
+    _arena.beginPass();
+    while (!_gcSlice(cursor));
+}
+
+bool Indexer::_gcSlice(GCCursor& cursor) {
+    auto sliceEnd = Clock::now() + _gcSliceBudget;
+    uint32_t processed = 0;
+    while (cursor.schemaIdx < cursor.schemas.size()) {
+        // look up the schema each time since the schema indexer may have been modified while we yielded
+        auto sit = _schemaIndexer.find(cursor.schemas[cursor.schemaIdx]);
+        if (sit == _schemaIndexer.end()) {
+            ++cursor.schemaIdx;
+            cursor.nextKey.reset();
+            continue;
+        }
+        auto& si = sit->second;
+        auto it = cursor.nextKey ? si.lower_bound(*cursor.nextKey) : si.begin();
+        while (it != si.end()) {
+            if (processed >= _gcSliceKeys || (processed % 64 == 0 && Clock::now() >= sliceEnd)) {
+                // out of budget for this slice. Remember where to continue from
+                cursor.nextKey = it->first;
+                return false;
+            }
+            it = _gcKey(si, it, cursor.rts);
+            ++processed;
+        }
+        ++cursor.schemaIdx;
+        cursor.nextKey.reset();
+    }
+    _gcStats.completedPasses++;
+    _arena.endPass();
+    return true;
+}
+
+Indexer::ScanCursor Indexer::startScan() const {
+    ScanCursor cursor;
+    for (auto& [name, _] : _schemaIndexer) {
+        cursor.schemas.push_back(name);
+    }
+    return cursor;
+}
+
+bool Indexer::scanSlice(ScanCursor& cursor, uint32_t maxKeys,
+                        const std::function<void(const String& schemaName, const IndexerKey& key, const VersionSet& vset)>& visitor) {
+    uint32_t visited = 0;
+    while (cursor.schemaIdx < cursor.schemas.size()) {
+        auto& schemaName = cursor.schemas[cursor.schemaIdx];
+        auto sit = _schemaIndexer.find(schemaName);
+        if (sit == _schemaIndexer.end()) {
+            ++cursor.schemaIdx;
+            cursor.nextKey.reset();
+            continue;
+        }
+        auto& si = sit->second;
+        for (auto it = cursor.nextKey ? si.lower_bound(*cursor.nextKey) : si.begin(); it != si.end(); ++it) {
+            if (visited >= maxKeys) {
+                cursor.nextKey = it->first;
+                return false;
+            }
+            visitor(schemaName, it->first, it->second);
+            ++visited;
+        }
+        ++cursor.schemaIdx;
+        cursor.nextKey.reset();
+    }
+    return true;
+}
+
+KeyIndexer::iterator Indexer::_gcKey(KeyIndexer& si, KeyIndexer::iterator it, dto::Timestamp rts) {
+    auto& committed = it->second.committed;
+    // Versions are sorted newest-first. Find the newest version below the retention timestamp. This version
+    // is still needed by transactions at the start of the retention window, but anything older is not.
+    auto keep = committed.size();
+    for (size_t i = 0; i < committed.size(); ++i) {
+        if (committed[i].timestamp.compareCertain(rts) < 0) {
+            keep = i + 1;
+            break;
+        }
+    }
+    // A tombstone as the oldest version we keep is equivalent to having no version at all, so drop it as well
+    if (keep > 0 && committed[keep - 1].isTombstone && committed[keep - 1].timestamp.compareCertain(rts) < 0) {
+        --keep;
+    }
+    if (keep < committed.size()) {
+        for (size_t i = keep; i < committed.size(); ++i) {
+            _gcStats.reclaimedBytes += committed[i].value.fieldData.getSize();
+        }
+        _gcStats.reclaimedVersions += committed.size() - keep;
+        committed.erase(committed.begin() + keep, committed.end());
+    }
+
+    if (!it->second.empty()) {
+        // measure the memory still in use by the remaining values, and compact it if needed
+        for (auto& rec : committed) {
+            _arena.visit(rec.value);
+        }
+        if (it->second.WI) {
+            _arena.visit(it->second.WI->data.value);
+        }
+        return std::next(it);
+    }
+
+    // No WI and no committed versions remain - the key can be removed entirely.
+    // Observations of the key are in the read cache, which doesn't depend on the key existing
+    K2LOG_D(log::skvsvr, "GC removing key={}", it->first);
+    auto next = si.erase(it);
+    _gcStats.removedKeys++;
+    return next;
+}
+
 Indexer::Iterator Indexer::find(const dto::Key& key, bool reverse) {
     // if schema doesn't exist, it is an internal error - upon deployment of a new schema, we create an indexer for it
     auto it = _schemaIndexer.find(key.schemaName);
@@ -93,33 +439,74 @@ Indexer::Iterator Indexer::find(const dto::Key& key, bool reverse) {
         throw std::runtime_error("Schema does not exist in schema indexer");
     }
 
-    auto [before, found, after] = keyRange(IndexerKey{.partitionKey=key.partitionKey,.rangeKey=key.rangeKey}, it->second.impl);
+    IndexerKey ikey(key.partitionKey, key.rangeKey);
+    auto& si = it->second;
+    // Most reads and writes are for keys which exist. We can go straight to those through the hash index
+    if (auto* entry = si.findEntry(ikey); entry != nullptr) {
+        return Iterator(entry, si, _readCache, reverse, it->first);
+    }
+    // For a missing key we need the neighbors in case the key is added, or we're asked to iterate
+    auto [before, found, after] = keyRange(ikey, si);
 
-    return Iterator(before, found, after, it->second, reverse, key.schemaName);
+    return Iterator(before, found, after, si, _readCache, reverse, it->first, std::move(ikey));
 }
 // *********************** end Indexer API
 
 // *********************** Indexer::Iterator API
-Indexer::Iterator::Iterator(KeyIndexer::iterator beforeIt, KeyIndexer::iterator foundIt, KeyIndexer::iterator afterIt, KeyIndexer& si, bool reverse, String schemaName):
-    _beforeIt(beforeIt), _foundIt(foundIt), _afterIt(afterIt), _si(si), _reverse(reverse), _schemaName(schemaName) {
+Indexer::Iterator::Iterator(KeyIndexer::iterator beforeIt, KeyIndexer::iterator foundIt, KeyIndexer::iterator afterIt, KeyIndexer& si,
+                            ReadCache& readCache, bool reverse, const String& schemaName, std::optional<IndexerKey> missingKey):
+    _beforeIt(beforeIt), _foundIt(foundIt), _afterIt(afterIt), _si(si), _readCache(readCache), _reverse(reverse), _schemaName(schemaName) {
+    _entry = _foundIt == _si.end() ? nullptr : &(*_foundIt);
+    if (_entry == nullptr) {
+        _missingKey = std::move(missingKey);
+    }
+}
+
+Indexer::Iterator::Iterator(KeyIndexer::value_type* entry, KeyIndexer& si, ReadCache& readCache, bool reverse, const String& schemaName):
+    _entry(entry), _positioned(false), _si(si), _readCache(readCache), _reverse(reverse), _schemaName(schemaName) {
+}
+
+void Indexer::Iterator::_position() {
+    if (_positioned) {
+        return;
+    }
+    auto [before, found, after] = keyRange(_entry->first, _si);
+    _beforeIt = before;
+    _foundIt = found;
+    _afterIt = after;
+    _positioned = true;
+}
+
+void Indexer::Iterator::_positionRange(ReadCacheBound& start, ReadCacheBound& end) const {
+    auto id = _si.schemaId;
+    if (_entry != nullptr || _missingKey) {
+        auto bytes = _entry != nullptr ? _entry->first.bytes() : _missingKey->bytes();
+        start = ReadCacheBound::pointStart(id, bytes);
+        end = ReadCacheBound::pointEnd(id, bytes);
+        return;
+    }
+    // we're past the end of iteration, which covers everything beyond the last key in the direction of iteration
+    if (!_reverse) {
+        start = _beforeIt == _si.end() ? ReadCacheBound::schemaStart(id) : ReadCacheBound::pointEnd(id, _beforeIt->first.bytes());
+        end = ReadCacheBound::schemaEnd(id);
+    }
+    else {
+        start = ReadCacheBound::schemaStart(id);
+        end = _afterIt == _si.end() ? ReadCacheBound::schemaEnd(id) : ReadCacheBound::pointStart(id, _afterIt->first.bytes());
+    }
 }
 
 // returns the time of the last observation(read) on the key associated with this Iterator.
 dto::Timestamp Indexer::Iterator::getLastReadTime() const {
-    // 1. this Iterator points to a an existing key. Return the stored ts
-    if (_foundIt != _si.impl.end()) {
-        return _foundIt->second.lastReadTime;
-    }
-    // 2. this Iterator points to a non-existing key. Return the min(neighborLow, neighborHigh).
-    auto nlow = _beforeIt == _si.impl.end() ? _si.lastReadTimeLow : _beforeIt->second.lastReadTime;
-    auto nhigh = _afterIt == _si.impl.end() ? _si.lastReadTimeHigh : _afterIt->second.lastReadTime;
-    return nlow.min(nhigh);
+    ReadCacheBound start, end;
+    _positionRange(start, end);
+    return _readCache.getMax(start, end);
 }
 
 // returns the time of the last committed value, or ZERO if there are no committed values
 dto::Timestamp Indexer::Iterator::getLastCommittedTime() const {
-    if (_foundIt != _si.impl.end() && _foundIt->second.committed.size() > 0) {
-        return _foundIt->second.committed[0].timestamp;
+    if (_entry != nullptr && _entry->second.committed.size() > 0) {
+        return _entry->second.committed[0].timestamp;
     }
     return dto::Timestamp::ZERO;
 }
@@ -127,30 +514,30 @@ dto::Timestamp Indexer::Iterator::getLastCommittedTime() const {
 // get the latest DataRecord in this Iterator, either WI or committed.
 // Return nullptr if there are no values present (WI or otherwise)
 dto::DataRecord* Indexer::Iterator::getLatestDataRecord() const {
-    if (_foundIt == _si.impl.end()) {
+    if (_entry == nullptr) {
         return nullptr;
     }
-    if (_foundIt->second.WI.has_value()) {
-        return &(_foundIt->second.WI->data);
-    } else if (_foundIt->second.committed.size() > 0) {
-        return &(_foundIt->second.committed[0]);
+    if (_entry->second.WI.has_value()) {
+        return &(_entry->second.WI->data);
+    } else if (_entry->second.committed.size() > 0) {
+        return &(_entry->second.committed[0]);
     }
     return nullptr;
 }
 
 dto::WriteIntent* Indexer::Iterator::getWI() const {
-    if (_foundIt != _si.impl.end() && _foundIt->second.WI.has_value()) {
-        return &(_foundIt->second.WI.value());
+    if (_entry != nullptr && _entry->second.WI.has_value()) {
+        return &(_entry->second.WI.value());
     }
     return nullptr;
 }
 
 std::vector<dto::DataRecord> Indexer::Iterator::getAllDataRecords() const {
     std::vector<dto::DataRecord> result;
-    if (_foundIt == _si.impl.end()) {
+    if (_entry == nullptr) {
         return result;
     }
-    result.reserve(1 + _foundIt->second.committed.size());
+    result.reserve(1 + _entry->second.committed.size());
     auto* wi = getWI();
     if (wi) {
         dto::DataRecord copy{
@@ -161,7 +548,7 @@ std::vector<dto::DataRecord> Indexer::Iterator::getAllDataRecords() const {
         result.push_back(std::move(copy));
     }
 
-    for (auto& rec : _foundIt->second.committed) {
+    for (auto& rec : _entry->second.committed) {
         dto::DataRecord copy{
             .value = rec.value.share(),
             .timestamp = rec.timestamp,
@@ -173,7 +560,7 @@ std::vector<dto::DataRecord> Indexer::Iterator::getAllDataRecords() const {
 }
 
 std::tuple<dto::DataRecord*, bool> Indexer::Iterator::getDataRecordAt(dto::Timestamp ts) {
-    if (_foundIt == _si.impl.end()) {
+    if (_entry == nullptr) {
         return std::make_tuple(nullptr, false);
     }
     if (auto* wi = getWI(); wi) {
@@ -190,7 +577,7 @@ std::tuple<dto::DataRecord*, bool> Indexer::Iterator::getDataRecordAt(dto::Times
     }
 
     // return the first record we can find which is older than the given timestamp
-    for (auto& rec: _foundIt->second.committed) {
+    for (auto& rec: _entry->second.committed) {
         if (rec.timestamp.compareCertain(ts) <= 0) {
             return std::make_tuple(&rec, false);
         }
@@ -198,66 +585,99 @@ std::tuple<dto::DataRecord*, bool> Indexer::Iterator::getDataRecordAt(dto::Times
     return std::make_tuple(nullptr, false);
 }
 
-void Indexer::Iterator::addWI(const dto::Key& key, dto::DataRecord&& rec, uint64_t request_id) {
-    // We need to create the key in the indexer if it didn't exist before
-    if (_foundIt == _si.impl.end()) {
-        auto lastRead = getLastReadTime();
-        _foundIt = _si.impl.insert(_afterIt, std::make_pair(
-            IndexerKey{.partitionKey=key.partitionKey, .rangeKey=key.rangeKey}, VersionSet{}));
-        // mark the new entry as being observed at the same time as the neighbors.
-        _foundIt->second.lastReadTime = lastRead;
+void Indexer::Iterator::_ensureKey(const dto::Key& key) {
+    // We need to create the key in the indexer if it didn't exist before. A missing key always has its neighbors
+    // positioned since they can't be found through the hash index
+    if (_entry == nullptr) {
+        _foundIt = _si.insert(_afterIt, std::make_pair(IndexerKey(key.partitionKey, key.rangeKey), VersionSet{}));
+        _entry = &(*_foundIt);
+        _missingKey.reset();
+        // inserting may invalidate other iterators into the key indexer. Re-acquire the neighbors
+        _beforeIt = _foundIt == _si.begin() ? _si.end() : std::prev(_foundIt);
+        _afterIt = std::next(_foundIt);
         K2LOG_D(log::skvsvr, "Created new key {}", key);
     }
     else {
-        const IndexerKey& ourKey = _foundIt->first;
-        K2ASSERT(log::skvsvr, ourKey.partitionKey == key.partitionKey && ourKey.rangeKey == key.rangeKey, "Key mismatch while adding key: have={}, given={}", ourKey, key);
+        const IndexerKey& ourKey = _entry->first;
+        K2ASSERT(log::skvsvr, ourKey == IndexerKey(key.partitionKey, key.rangeKey), "Key mismatch while adding key: have={}, given={}", ourKey, key);
+    }
+}
+
+void Indexer::Iterator::addWI(const dto::Key& key, dto::DataRecord&& rec, uint64_t request_id) {
+    _ensureKey(key);
+    _entry->second.WI = dto::WriteIntent{.data=std::move(rec), .request_id=request_id};
+}
+
+void Indexer::Iterator::addCommitted(const dto::Key& key, dto::DataRecord&& rec) {
+    _ensureKey(key);
+    auto& committed = _entry->second.committed;
+    // versions are sorted newest-first
+    auto pos = committed.begin();
+    while (pos != committed.end() && pos->timestamp.compareCertain(rec.timestamp) == dto::Timestamp::GT) {
+        ++pos;
+    }
+    if (pos != committed.end() && pos->timestamp.compareCertain(rec.timestamp) == dto::Timestamp::EQ) {
+        return;
     }
-    _foundIt->second.WI = dto::WriteIntent{.data=std::move(rec), .request_id=request_id};
+    committed.insert(pos, std::move(rec));
 }
 
 void Indexer::Iterator::abortWI() {
-    if (_foundIt != _si.impl.end()) {
-        _foundIt->second.WI.reset();
-        if (_foundIt->second.committed.empty()) {
-            auto lastObservedAt = _foundIt->second.lastReadTime;
-            // this entire entry can now be removed as it has no WI and no committed data
-            K2LOG_D(log::skvsvr, "Removing empty entry for key={}, lastObserved=", _foundIt->first, lastObservedAt);
-            _si.impl.erase(_foundIt);
-            _foundIt = _si.impl.end();
-            // update the neighbors with our timestamp
-            observeAt(lastObservedAt);
+    if (_entry != nullptr) {
+        _entry->second.WI.reset();
+        if (_entry->second.committed.empty()) {
+            // this entire entry can now be removed as it has no WI and no committed data.
+            // Any observations of the key stay in the read cache
+            K2LOG_D(log::skvsvr, "Removing empty entry for key={}", _entry->first);
+            // erasing may invalidate other iterators into the key indexer. Re-acquire the neighbors
+            _position();
+            _missingKey = _entry->first;
+            _afterIt = _si.erase(_foundIt);
+            _beforeIt = _afterIt == _si.begin() ? _si.end() : std::prev(_afterIt);
+            _foundIt = _si.end();
+            _entry = nullptr;
         }
     }
 }
 
 void Indexer::Iterator::commitWI() {
-    K2ASSERT(log::skvsvr, _foundIt != _si.impl.end() && _foundIt->second.WI.has_value(), "WI must have value to commit");
-    _foundIt->second.committed.push_front(std::move(_foundIt->second.WI->data));
-    _foundIt->second.WI.reset();
+    K2ASSERT(log::skvsvr, _entry != nullptr && _entry->second.WI.has_value(), "WI must have value to commit");
+    _entry->second.committed.push_front(std::move(_entry->second.WI->data));
+    _entry->second.WI.reset();
 }
 
 void Indexer::Iterator::observeAt(dto::Timestamp ts) {
-    K2LOG_D(log::skvsvr, "Observing at ts={}, bit={}, fit={}, ait={}", ts,
-            _beforeIt == _si.impl.end() ? IndexerKey{} : _beforeIt->first,
-            _foundIt == _si.impl.end() ? IndexerKey{} : _foundIt->first,
-            _afterIt == _si.impl.end() ? IndexerKey{} : _afterIt->first);
-    if (_foundIt != _si.impl.end()) {
-        _foundIt->second.lastReadTime.maxEq(ts);
-    } else {
-        _beforeIt != _si.impl.end() ? _beforeIt->second.lastReadTime.maxEq(ts) : _si.lastReadTimeLow.maxEq(ts);
-        _afterIt  != _si.impl.end() ? _afterIt->second.lastReadTime.maxEq(ts)  : _si.lastReadTimeHigh.maxEq(ts);
+    ReadCacheBound start, end;
+    _positionRange(start, end);
+    K2LOG_D(log::skvsvr, "Observing at ts={}, range=[{}, {})", ts, start, end);
+    _readCache.add(start, end, ts);
+}
+
+void Indexer::Iterator::observeScanFrom(const dto::Key& startKey, dto::Timestamp ts) {
+    ReadCacheBound start, end;
+    _positionRange(start, end);
+    IndexerKey ikey(startKey.partitionKey, startKey.rangeKey);
+    if (!_reverse) {
+        start = ReadCacheBound::pointStart(_si.schemaId, ikey.bytes());
+    }
+    else {
+        end = ReadCacheBound::pointEnd(_si.schemaId, ikey.bytes());
     }
+    K2LOG_D(log::skvsvr, "Observing scan at ts={}, range=[{}, {})", ts, start, end);
+    _readCache.add(start, end, ts);
 }
 
 bool Indexer::Iterator::hasData() const {
-    return _foundIt != _si.impl.end() && !_foundIt->second.empty();
+    return _entry != nullptr && !_entry->second.empty();
 }
 
 void Indexer::Iterator::next() {
     if (atEnd()) {
         return;
     }
-    auto end = _si.impl.end();
+    _position();
+    _missingKey.reset();
+    auto end = _si.end();
     if (!_reverse) {
         // forward direction
         if (_foundIt != end) {
@@ -276,7 +696,7 @@ void Indexer::Iterator::next() {
             _afterIt = _foundIt;
         }
         _foundIt = _beforeIt;
-        if (_beforeIt != _si.impl.begin() && _beforeIt != end) {
+        if (_beforeIt != _si.begin() && _beforeIt != end) {
             // this is only safe to do if we are not at begin()
             --_beforeIt;
         } else {
@@ -284,19 +704,27 @@ void Indexer::Iterator::next() {
             _beforeIt = end;
         }
     }
+    _entry = _foundIt == end ? nullptr : &(*_foundIt);
 }
 
 bool Indexer::Iterator::atEnd() const {
-    auto end = _si.impl.end();
+    if (!_positioned) {
+        // we're at an existing key
+        return false;
+    }
+    auto end = _si.end();
     return _foundIt == end &&
            ((_reverse && _beforeIt == end) || (!_reverse && _afterIt == end));
 }
 
+uint64_t Indexer::Iterator::getIndexerVersion() const {
+    return _si.version();
+}
+
 dto::Key Indexer::Iterator::getKey() const {
     dto::Key result{};
-    if (_foundIt != _si.impl.end()) {
-        result.partitionKey = _foundIt->first.partitionKey;
-        result.rangeKey = _foundIt->first.rangeKey;
+    if (_entry != nullptr) {
+        _entry->first.decode(result.partitionKey, result.rangeKey);
         result.schemaName = _schemaName;
     }
     return result;
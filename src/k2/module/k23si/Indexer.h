@@ -26,7 +26,10 @@ Copyright(c) 2022 Futurewei Cloud
 #include <map>
 #include <unordered_map>
 #include <deque>
+#include <functional>
 #include <optional>
+#include <string_view>
+#include <variant>
 
 #if K2_MODULE_POOL_ALLOCATOR == 1
 // this can only work on GCC > 4
@@ -36,21 +39,47 @@ Copyright(c) 2022 Futurewei Cloud
 #include <k2/common/Common.h>
 #include <k2/dto/K23SI.h>
 #include <k2/dto/Timestamp.h>
+#include <k2/indexer/BPTree.h>
+#include <k2/indexer/HashIndex.h>
 
 #include "Log.h"
+#include "ReadCache.h"
+#include "RecordArena.h"
 
 namespace k2 {
 
 // the type holding multiple committed versions of a key
 typedef std::deque<dto::DataRecord> VersionsT;
 
-// A key in the indexer. Since this is a schema-aware indexer, we only need to store the pkey and the rkey
-struct IndexerKey {
-    String partitionKey;
-    String rangeKey;
+// A key in the indexer. Since this is a schema-aware indexer, we only need to store the pkey and the rkey.
+// Both are kept in a single buffer, encoded so that a plain byte comparison of two keys agrees with comparing
+// their (partitionKey, rangeKey) pairs:
+//     escaped(partitionKey) ESCAPE TERM rangeKey
+// where escaping replaces each ESCAPE byte in the partition key with ESCAPE ESCAPED_NULL. This is the same
+// scheme which FieldToKeyString uses to terminate key fields.
+// Compared to storing the two strings separately, a key takes a single allocation and comparisons are a single memcmp
+class IndexerKey {
+public:
+    IndexerKey() = default;
+    IndexerKey(const String& partitionKey, const String& rangeKey);
+
+    // decode the parts of the key
+    String getPartitionKey() const;
+    String getRangeKey() const;
+    void decode(String& partitionKey, String& rangeKey) const;
+
+    // the encoded key bytes
+    std::string_view bytes() const noexcept { return std::string_view(_bytes.data(), _bytes.size()); }
+
     int compare(const IndexerKey& o) const noexcept;
     bool operator<(const IndexerKey& o) const noexcept;
-    K2_DEF_FMT(IndexerKey, partitionKey, rangeKey);
+    bool operator==(const IndexerKey& o) const noexcept;
+
+private:
+    // the position of the range key in the encoded bytes
+    size_t _rangeKeyOffset() const noexcept;
+
+    String _bytes;
 };
 
 // This struct is the "value" we store for each key in the indexer and represents
@@ -64,32 +93,154 @@ struct VersionSet {
     // Use to check if there is any data stored in this VSet (WI or committed)
     bool empty() const;
 
-    // This timestamp represents the last time when there was a read for this key. This is used
-    // to prevent mutations ot observed history which is required for
-    // the consistency guarantees in the K23SI transaction protocol
-    dto::Timestamp lastReadTime{dto::Timestamp::ZERO};
-
     // a static vset used to represent an empty container
     static const VersionSet EMPTY;
 };
 inline const VersionSet VersionSet::EMPTY{};
 
-// Sorted Key indexer used to map key->vset. It also provides the last observed times at its lowest and highest bounds
-struct KeyIndexer {
-    // the last time we observed the lowest bound (a virtual key smaller than all other keys)
-    dto::Timestamp lastReadTimeLow{dto::Timestamp::ZERO};
-    // the last time we observed the highes bound (a virtual key bigger than all other keys)
-    dto::Timestamp lastReadTimeHigh{dto::Timestamp::ZERO};
-    // the type holding versions for all keys, i.e. the implementation for this key indexer
+// Allows IndexerKeys to be stored in a BPTree. The encoded bytes are ordered the same way as the keys, so the
+// entire key can be used as the search prefix
+struct IndexerKeyTraits {
+    static int compare(const IndexerKey& a, const IndexerKey& b) noexcept {
+        return a.compare(b);
+    }
+    static std::string_view prefixBytes(const IndexerKey& key) noexcept {
+        return key.bytes();
+    }
+};
+
+// Allows the entries of a KeyIndexer to be found by key in a HashIndex
+struct IndexerEntryHashTraits {
+    static size_t hash(const IndexerKey& key) noexcept {
+        return std::hash<std::string_view>{}(key.bytes());
+    }
+    static const IndexerKey& key(const std::pair<const IndexerKey, VersionSet>& entry) noexcept {
+        return entry.first;
+    }
+    static bool equal(const IndexerKey& a, const IndexerKey& b) noexcept {
+        return a == b;
+    }
+};
+
+// Sorted Key indexer used to map key->vset.
+// The container which stores the keys is picked per collection (see dto::IndexerType). This class provides the
+// subset of the std::map API which the Indexer needs, dispatching to the container in use.
+// Optionally, the entries are also kept in a hash index so that exact-match lookups don't have to navigate the
+// ordered container.
+class KeyIndexer {
+public:
+    // the std::map based container
     #if K2_MODULE_POOL_ALLOCATOR == 1
-    typedef std::map<IndexerKey, VersionSet, std::less<IndexerKey>, __gnu_cxx::__pool_alloc<std::pair<IndexerKey, VersionSet>>> KeyIndexerT;
+    typedef std::map<IndexerKey, VersionSet, std::less<IndexerKey>, __gnu_cxx::__pool_alloc<std::pair<IndexerKey, VersionSet>>> MapT;
     #else
-    typedef std::map<IndexerKey, VersionSet> KeyIndexerT;
+    typedef std::map<IndexerKey, VersionSet> MapT;
     #endif
-    // the implementation container for storing key->vset
-    KeyIndexerT impl;
-    // an iterator for our implementation container
-    typedef KeyIndexerT::iterator iterator;
+    // the B+tree based container
+    typedef BPTree<IndexerKey, VersionSet, IndexerKeyTraits> BPTreeT;
+
+    typedef std::pair<const IndexerKey, VersionSet> value_type;
+
+    // iterator over either container
+    template <bool Const>
+    class IteratorT {
+        typedef std::conditional_t<Const, MapT::const_iterator, MapT::iterator> MapIt;
+        typedef std::conditional_t<Const, BPTreeT::const_iterator, BPTreeT::iterator> BPTreeIt;
+
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef KeyIndexer::value_type value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef std::conditional_t<Const, const value_type*, value_type*> pointer;
+        typedef std::conditional_t<Const, const value_type&, value_type&> reference;
+
+        IteratorT() = default;
+        IteratorT(MapIt it) : _it(it) {}
+        IteratorT(BPTreeIt it) : _it(it) {}
+
+        reference operator*() const {
+            return std::visit([](const auto& it) -> reference { return *it; }, _it);
+        }
+        pointer operator->() const { return &(**this); }
+
+        IteratorT& operator++() {
+            std::visit([](auto& it) { ++it; }, _it);
+            return *this;
+        }
+        IteratorT operator++(int) {
+            auto result = *this;
+            ++(*this);
+            return result;
+        }
+        IteratorT& operator--() {
+            std::visit([](auto& it) { --it; }, _it);
+            return *this;
+        }
+        IteratorT operator--(int) {
+            auto result = *this;
+            --(*this);
+            return result;
+        }
+
+        bool operator==(const IteratorT& o) const { return _it == o._it; }
+        bool operator!=(const IteratorT& o) const { return !(*this == o); }
+
+    private:
+        friend class KeyIndexer;
+        std::variant<MapIt, BPTreeIt> _it;
+    };
+    typedef IteratorT<false> iterator;
+    typedef IteratorT<true> const_iterator;
+
+    KeyIndexer(dto::IndexerType type, bool hashIndex=true);
+
+    // the id of the schema whose keys we hold. Used to place the keys in the read cache
+    uint32_t schemaId{0};
+
+    // std::map-like API
+    size_t size() const;
+    iterator begin();
+    iterator end();
+    const_iterator begin() const;
+    const_iterator end() const;
+    const_iterator cbegin() const { return begin(); }
+    const_iterator cend() const { return end(); }
+    iterator lower_bound(const IndexerKey& key);
+    std::pair<iterator, iterator> equal_range(const IndexerKey& key);
+    // insert a new key, using the given position as a hint
+    iterator insert(iterator hint, std::pair<IndexerKey, VersionSet>&& kv);
+    iterator erase(iterator pos);
+
+    // Exact-match lookup. Returns the entry for the given key, or nullptr if there is no such key. Uses the hash
+    // index if there is one, and the ordered container otherwise. The hash must be IndexerEntryHashTraits::hash(key)
+    value_type* findEntry(const IndexerKey& key, size_t hash);
+    value_type* findEntry(const IndexerKey& key) { return findEntry(key, IndexerEntryHashTraits::hash(key)); }
+
+    // the memory used by the hash index
+    size_t hashIndexBytes() const { return _hashIndex ? _hashIndex->capacityBytes() : 0; }
+
+    // The structural version of the container. It changes whenever a key is inserted or erased, i.e. whenever
+    // iterators into the container may have been invalidated or their neighbors may have changed
+    uint64_t version() const { return _version; }
+
+private:
+    // the container implementation
+    std::variant<MapT, BPTreeT> _impl;
+    // the hash index over the entries in _impl. The entries of both containers don't move until they are erased
+    std::optional<HashIndex<IndexerKey, value_type, IndexerEntryHashTraits>> _hashIndex;
+    uint64_t _version{0};
+};
+
+// Cumulative statistics from the version garbage collector
+struct VersionGCStats {
+    // number of committed versions which have been dropped
+    uint64_t reclaimedVersions{0};
+    // total size of the user payloads of dropped versions
+    uint64_t reclaimedBytes{0};
+    // number of keys which were removed since they only had tombstones left
+    uint64_t removedKeys{0};
+    // number of completed GC passes over the entire indexer
+    uint64_t completedPasses{0};
+    K2_DEF_FMT(VersionGCStats, reclaimedVersions, reclaimedBytes, removedKeys, completedPasses);
 };
 
 // The indexer for K2 records. It stores records, mapped as: IndexerKey --> dto::DataRecord
@@ -97,12 +248,15 @@ class Indexer {
 public: // lifecycle
     // The Indexer must be started with a timestamp which indicates when it was created.
     // This timestamp is used to track observations for elements in the indexer.
-    seastar::future<> start(dto::Timestamp createdTs);
+    // The indexer type determines the container used to store the keys for each schema. With hashIndex, the keys
+    // are also indexed by hash, which makes lookups of existing keys O(1)
+    seastar::future<> start(dto::Timestamp createdTs, dto::IndexerType indexerType=dto::IndexerType::BPTree, bool hashIndex=true);
 
     // The Indexer must be stopped before it is destroyed to allow for various state to be safely closed.
     seastar::future<> stop();
 
-    // the type for the schema indexer - maps schemaName->KeyIndexer
+    // the type for the schema indexer - maps schemaName->KeyIndexer. Schemas are never removed, so the
+    // names stored here serve as the interned schema names for the Iterators and the key indexers
     typedef std::unordered_map<String, KeyIndexer> SchemaIndexer;
 
 public: // API
@@ -119,15 +273,124 @@ public: // API
     // creates a new key indexer for the given schema.
     void createSchema(const dto::Schema& schema);
 
+    // creates a new key indexer for the schema with the given name. Used when we find keys for a schema
+    // which hasn't been pushed to us yet (e.g. during recovery)
+    void createSchema(const String& schemaName);
+
     // raw access to the underlying schema indexer, used by our debugging APIs
     const SchemaIndexer& getSchemaIndexer() const;
 
+    // Called to update the retention timestamp when the server refreshes from TSO.
+    // If there is no version GC pass in progress, this starts a new one in the background.
+    // The GC pass drops all versions which are not visible to any transaction inside the retention window,
+    // i.e. every version older than the newest version below the retention timestamp.
+    void updateRetentionTimestamp(dto::Timestamp rts);
+
+    // Set the limits for a single GC slice. A slice ends when either limit is reached, after which the
+    // collector yields to other tasks
+    void setGCSliceLimits(uint32_t sliceKeys, Duration sliceBudget);
+
+    // Run a complete GC pass synchronously for the given retention timestamp. Used in testing
+    void collectGarbage(dto::Timestamp rts);
+
+    // the statistics from the version GC
+    const VersionGCStats& getGCStats() const;
+
+    // Set up the memory arena for the record values. Must be called before any values are stored.
+    // See RecordArena for the parameters
+    void setArenaLimits(size_t slabSize, double compactionOccupancy);
+
+    // Copy a record value into the indexer's memory. Values stored in the indexer should be copied this way
+    // rather than holding on to the (typically much bigger) buffers of the message they came in
+    dto::SKVRecord::Storage copyValue(dto::SKVRecord::Storage& value);
+
+    // the statistics for the memory holding the record values
+    RecordArenaStats getArenaStats() const;
+
+    // Set the memory budget for the read cache. Zero means unbounded
+    void setReadCacheBudget(size_t memoryBudget);
+
+    // the statistics for the read cache
+    ReadCacheStats getReadCacheStats() const;
+
+    // Position of a scan over all keys in the indexer which is done in slices, e.g. when writing a snapshot.
+    // Same as the GC, the scan doesn't hold on to map iterators between slices
+    struct ScanCursor {
+        // the schemas which existed when the scan started
+        std::vector<String> schemas;
+        // the schema we're currently scanning
+        size_t schemaIdx{0};
+        // the next key to visit in the current schema. If not set, we start from the beginning of the schema
+        std::optional<IndexerKey> nextKey;
+    };
+
+    // start a new scan over all schemas which currently exist
+    ScanCursor startScan() const;
+
+    // Call the visitor for up to maxKeys keys, starting at the cursor. Returns true when the scan is complete
+    bool scanSlice(ScanCursor& cursor, uint32_t maxKeys,
+                   const std::function<void(const String& schemaName, const IndexerKey& key, const VersionSet& vset)>& visitor);
+
 private:
+    // Position of an in-progress GC pass. The collector doesn't hold on to map iterators across slices
+    // since the indexer can be modified while we yield. Instead we remember the next key to look at.
+    struct GCCursor {
+        // the retention timestamp for this pass
+        dto::Timestamp rts;
+        // the schemas which existed when the pass started
+        std::vector<String> schemas;
+        // the schema we're currently processing
+        size_t schemaIdx{0};
+        // the next key to process in the current schema. If not set, we start from the beginning of the schema
+        std::optional<IndexerKey> nextKey;
+    };
+
+    // process up to gcSliceKeys keys or until gcSliceBudget time elapses. Returns true if the pass is complete
+    bool _gcSlice(GCCursor& cursor);
+
+    // drop the versions in the given key indexer position which are no longer needed.
+    // Returns an iterator to the next position (the given one may be erased)
+    KeyIndexer::iterator _gcKey(KeyIndexer& si, KeyIndexer::iterator it, dto::Timestamp rts);
+
     // the time at which the indexer got created. This will be the assumed observed time for any keys we do not have
     dto::Timestamp _createdTs{dto::Timestamp::ZERO};
 
+    // the type of key indexer to create for new schemas
+    dto::IndexerType _indexerType{dto::IndexerType::BPTree};
+
+    // should new key indexers keep a hash index
+    bool _hashIndex{true};
+
     // the indexer, mapping schema_name -> indexer_for_schema
     SchemaIndexer _schemaIndexer;
+
+    // the latest retention timestamp we've been told about
+    dto::Timestamp _retentionTs{dto::Timestamp::ZERO};
+
+    // set while there is a background GC pass running
+    bool _gcRunning{false};
+
+    // set when we're asked to stop so that any background GC pass can bail out
+    bool _stopping{false};
+
+    // tracks the background GC pass
+    seastar::future<> _gcFut = seastar::make_ready_future();
+
+    VersionGCStats _gcStats;
+
+    // the memory for the record values. Compacted by the version GC
+    RecordArena _arena;
+
+    // the read timestamps for the keys of all schemas
+    ReadCache _readCache;
+    size_t _readCacheBudget{0};
+
+    // the id for the next schema we create
+    uint32_t _nextSchemaId{0};
+
+    // GC slice limits
+    uint32_t _gcSliceKeys{1000};
+    Duration _gcSliceBudget{500us};
 }; // class KeyIndexer
 
 
@@ -142,10 +405,17 @@ public:
     // which we created the Iterator.
     // We also need to have a reference to the underlying KeyIndexer which is being iterated
     // as well as the direction of iteration.
-    Iterator(KeyIndexer::iterator beforeIt, KeyIndexer::iterator foundIt, KeyIndexer::iterator afterIt, KeyIndexer& si, bool reverse, String schemaName);
+    // If the key we're created for doesn't exist, it must be given so that reads of the key can be tracked.
+    Iterator(KeyIndexer::iterator beforeIt, KeyIndexer::iterator foundIt, KeyIndexer::iterator afterIt, KeyIndexer& si,
+             ReadCache& readCache, bool reverse, const String& schemaName, std::optional<IndexerKey> missingKey=std::nullopt);
+
+    // An Iterator for an existing key, found through the hash index. The iterators into the KeyIndexer are only
+    // looked up once they are needed, i.e. when the Iterator moves or the key is removed
+    Iterator(KeyIndexer::value_type* entry, KeyIndexer& si, ReadCache& readCache, bool reverse, const String& schemaName);
 
 public: // APIs
-    // returns the time of the last observation(read) on the key associated with the current Iterator position
+    // returns the time of the last observation(read) on the key associated with the current Iterator position.
+    // Past the end of iteration, this covers all keys past the last key in the direction of iteration
     dto::Timestamp getLastReadTime() const;
 
     // returns the time of the last committed value, or ZERO if there are no committed values at the current Iterator position
@@ -175,9 +445,17 @@ public: // APIs
     void abortWI();
     void commitWI();
 
+    // Add a committed version at the current Iterator position, in timestamp order. Used when restoring
+    // versions during recovery. Versions which we already have are ignored
+    void addCommitted(const dto::Key& key, dto::DataRecord&& rec);
+
     // register an observation at the current Iterator position from a transaction with the given timestamp
     void observeAt(dto::Timestamp ts);
 
+    // register an observation of all keys from the given start key up to and including the current Iterator
+    // position (in the direction of iteration). This is how a scan records everything it has read as one range
+    void observeScanFrom(const dto::Key& startKey, dto::Timestamp ts);
+
     // use to determine if the current Iterator position contains any data records (wi or committed)
     bool hasData() const;
 
@@ -191,7 +469,20 @@ public: // APIs
     // Otherwise it returns a key with empty contents.
     dto::Key getKey() const;
 
+    // the structural version of the key indexer we're iterating (see KeyIndexer::version()). An Iterator which
+    // is kept around can only be used again if this version hasn't changed in the meantime
+    uint64_t getIndexerVersion() const;
+
 private:
+    // create the entry for the given key at the current Iterator position if it doesn't exist yet
+    void _ensureKey(const dto::Key& key);
+
+    // look up the iterators into the KeyIndexer if we were created without them
+    void _position();
+
+    // the key range in the read cache for the current position
+    void _positionRange(ReadCacheBound& start, ReadCacheBound& end) const;
+
     // iterators pointing into the KeyIndexer for the keys:
     // These iterators are always in the forward direction. We may rewind them if we're asked
     // to iterate in reverse but they are always positioned forward.
@@ -199,14 +490,41 @@ private:
     KeyIndexer::iterator _foundIt; // at the current position
     KeyIndexer::iterator _afterIt; // the next position
 
+    // the entry at the current position, or nullptr if there is no key at the current position
+    KeyIndexer::value_type* _entry{nullptr};
+
+    // set when the iterators above are valid. Otherwise only _entry is set
+    bool _positioned{true};
+
+    // the key at the current position if it doesn't exist in the KeyIndexer
+    std::optional<IndexerKey> _missingKey;
+
     // this is the key indexer which is being iterated by this Iterator
     KeyIndexer& _si;
 
+    // the read cache where we track observations
+    ReadCache& _readCache;
+
     // the direction in which we're iterating
     bool _reverse{false};
 
-    // the name of the schema we're iterating
-    String _schemaName;
+    // the name of the schema we're iterating. This is the interned name from the schema indexer
+    const String& _schemaName;
 }; // class Iterator
 
 } // namespace k2
+
+template <> // fmt support
+struct fmt::formatter<k2::IndexerKey> {
+    template <typename ParseContext>
+    constexpr auto parse(ParseContext& ctx) {
+        return ctx.begin();
+    }
+
+    template <typename FormatContext>
+    auto format(k2::IndexerKey const& key, FormatContext& ctx) const {
+        k2::String partitionKey, rangeKey;
+        key.decode(partitionKey, rangeKey);
+        return fmt::format_to(ctx.out(), "{{partitionKey={}, rangeKey={}}}", partitionKey, rangeKey);
+    }
+};
@@ -23,6 +23,9 @@ Copyright(c) 2020 Futurewei Cloud
 
 #include "Module.h"
 
+#include <algorithm>
+#include <numeric>
+
 #include <k2/appbase/AppEssentials.h>
 #include <k2/common/Defer.h>
 #include <k2/cpo/client/Heartbeat.h>
@@ -52,7 +55,10 @@ bool K23SIPartitionModule::_validateRequestPartition(const RequestT& req) const
     // 1. common case assumes RequestT a Read request;
     // 2. now for the other cases, only Query request is implemented.
     if constexpr (std::is_same<RequestT, dto::K23SIQueryRequest>::value) {
-        result = result && _partition.owns(req.key, req.reverseDirection);
+        // a query on a hash partitioned collection is sent to every partition with the same start key, and
+        // each partition scans its own keys. The pvid check above is the only ownership test which applies
+        result = result && (_partition.getHashScheme() != dto::HashScheme::Range ||
+                            _partition.owns(req.key, req.reverseDirection));
     } else if constexpr(has_key_field<RequestT>::value) {
         result = result && _partition.owns(req.key);
     }
@@ -133,6 +139,23 @@ Status K23SIPartitionModule::_validateReadRequest(const RequestT& request) const
     return dto::K23SIStatus::OK;
 }
 
+Status K23SIPartitionModule::_validateMultiReadKey(const dto::Key& key) const {
+    if (!_partition.owns(key)) {
+        // the client should route this key separately
+        return dto::K23SIStatus::RefreshCollection("key is not owned by the partition in multi-read");
+    }
+    if (key.partitionKey.empty()) {
+        // do not allow empty partition key
+        return dto::K23SIStatus::BadParameter("missing partition key in multi-read");
+    }
+    if (_schemas.find(key.schemaName) == _schemas.end()) {
+        // server does not have schema
+        return dto::K23SIStatus::OperationNotAllowed("schema does not exist in multi-read");
+    }
+
+    return dto::K23SIStatus::OK;
+}
+
 Status K23SIPartitionModule::_validateWriteRequest(const dto::K23SIWriteRequest& request) {
     if (!_validateRequestPartition(request)) {
         // tell client their collection partition is gone
@@ -189,7 +212,28 @@ seastar::future<> K23SIPartitionModule::_registerVerbs() {
         }
 
         k2::OperationLatencyReporter reporter(_readLatency); // for reporting metrics
-        return handleRead(std::move(request), FastDeadline(_config.readTimeout()), 0)
+        auto txnts = request.mtr.timestamp;
+        return _afterAsyncWrites(txnts, [this, request=std::move(request)] () mutable {
+                    return handleRead(std::move(request), FastDeadline(_config.readTimeout()), 0);
+               })
+               .then([this, reporter=std::move(reporter)](auto&& response) mutable {
+                    reporter.report();
+                    return std::move(response);
+               });
+    });
+
+    RPC().registerRPCObserver<dto::K23SIMultiReadRequest, dto::K23SIMultiReadResponse>
+    (dto::Verbs::K23SI_MULTI_READ, [this, &hb_resp](dto::K23SIMultiReadRequest&& request) {
+        if (!hb_resp.isUp()) {
+            return RPCResponse(dto::K23SIStatus::RefreshCollection("Heartbeat is dead"), dto::K23SIMultiReadResponse{});
+        }
+
+        k2::OperationLatencyReporter reporter(_multiReadLatency); // for reporting metrics
+        _multiReadKeys.add(request.keys.size());
+        auto txnts = request.mtr.timestamp;
+        return _afterAsyncWrites(txnts, [this, request=std::move(request)] () mutable {
+                    return handleMultiRead(std::move(request), FastDeadline(_config.readTimeout()));
+               })
                .then([this, reporter=std::move(reporter)](auto&& response) mutable {
                     reporter.report();
                     return std::move(response);
@@ -203,7 +247,10 @@ seastar::future<> K23SIPartitionModule::_registerVerbs() {
         }
 
         k2::OperationLatencyReporter reporter(_queryPageLatency); // for reporting metrics
-        return handleQuery(std::move(request), dto::K23SIQueryResponse{}, FastDeadline(_config.readTimeout()), 0)
+        auto txnts = request.mtr.timestamp;
+        return _afterAsyncWrites(txnts, [this, request=std::move(request)] () mutable {
+                    return handleQuery(std::move(request), dto::K23SIQueryResponse{}, FastDeadline(_config.readTimeout()), 0);
+                })
                 .then([this, reporter=std::move(reporter)] (auto&& response) mutable {
                     reporter.report();
                     return std::move(response);
@@ -217,7 +264,10 @@ seastar::future<> K23SIPartitionModule::_registerVerbs() {
         }
 
         k2::OperationLatencyReporter reporter(_writeLatency); // for reporting metrics
-        return handleWrite(std::move(request), FastDeadline(_config.writeTimeout()))
+        auto txnts = request.mtr.timestamp;
+        return _afterAsyncWrites(txnts, [this, request=std::move(request)] () mutable {
+                return handleWrite(std::move(request), FastDeadline(_config.writeTimeout()));
+            })
             .then([this, reporter=std::move(reporter)] (auto&& resp) mutable {
                 return _respondAfterFlush(std::move(resp))
                         .then([this, reporter=std::move(reporter)] (auto&& response) mutable {
@@ -227,6 +277,59 @@ seastar::future<> K23SIPartitionModule::_registerVerbs() {
             });
     });
 
+    RPC().registerRPCObserver<dto::K23SIMultiWriteRequest, dto::K23SIMultiWriteResponse>
+    (dto::Verbs::K23SI_MULTI_WRITE, [this, &hb_resp](dto::K23SIMultiWriteRequest&& request) {
+        if (!hb_resp.isUp()) {
+            return RPCResponse(dto::K23SIStatus::RefreshCollection("Heartbeat is dead"), dto::K23SIMultiWriteResponse{});
+        }
+
+        k2::OperationLatencyReporter reporter(_multiWriteLatency); // for reporting metrics
+        _multiWriteKeys.add(request.writes.size());
+        auto txnts = request.mtr.timestamp;
+        return _afterAsyncWrites(txnts, [this, request=std::move(request)] () mutable {
+                return handleMultiWrite(std::move(request), FastDeadline(_config.writeTimeout()));
+            })
+            .then([this, reporter=std::move(reporter)] (auto&& resp) mutable {
+                return _respondAfterFlush(std::move(resp))
+                        .then([this, reporter=std::move(reporter)] (auto&& response) mutable {
+                            reporter.report();
+                            return std::move(response);
+                        });
+            });
+    });
+
+    RPC().registerMessageObserver(dto::Verbs::K23SI_ASYNC_WRITE, [this, &hb_resp](Request&& request) {
+        dto::K23SIWriteRequest writeRequest{};
+        if (!request.payload->read(writeRequest)) {
+            K2LOG_W(log::skvsvr, "unable to parse async write from {}", request.endpoint.url);
+            return;
+        }
+        if (!hb_resp.isUp()) {
+            // the TRH does not hear from this write, and aborts the transaction when asked to commit
+            K2LOG_D(log::skvsvr, "Dropping async write in txn {} since heartbeat is dead", writeRequest.mtr);
+            return;
+        }
+
+        k2::OperationLatencyReporter reporter(_writeLatency); // for reporting metrics
+        // there is no response to wait for. The TRH finds out about the outcome
+        (void)handleAsyncWrite(std::move(writeRequest))
+            .handle_exception([] (auto exc) {
+                K2LOG_W_EXC(log::skvsvr, exc, "async write failed with uncaught exception");
+            })
+            .finally([reporter=std::move(reporter)] () mutable {
+                reporter.report();
+            });
+    });
+
+    RPC().registerRPCObserver<dto::K23SITxnWriteOutcomeRequest, dto::K23SITxnWriteOutcomeResponse>
+    (dto::Verbs::K23SI_TXN_WRITE_OUTCOME, [this, &hb_resp](dto::K23SITxnWriteOutcomeRequest&& request) {
+        if (!hb_resp.isUp()) {
+            return RPCResponse(dto::K23SIStatus::RefreshCollection("Heartbeat is dead"), dto::K23SITxnWriteOutcomeResponse{});
+        }
+
+        return handleTxnWriteOutcome(std::move(request));
+    });
+
     RPC().registerRPCObserver<dto::K23SITxnPushRequest, dto::K23SITxnPushResponse>
     (dto::Verbs::K23SI_TXN_PUSH, [this, &hb_resp](dto::K23SITxnPushRequest&& request) {
         if (!hb_resp.isUp()) {
@@ -260,6 +363,15 @@ seastar::future<> K23SIPartitionModule::_registerVerbs() {
         return handleTxnHeartbeat(std::move(request));
     });
 
+    RPC().registerRPCObserver<dto::K23SITxnMultiHeartbeatRequest, dto::K23SITxnMultiHeartbeatResponse>
+    (dto::Verbs::K23SI_TXN_MULTI_HEARTBEAT, [this, &hb_resp](dto::K23SITxnMultiHeartbeatRequest&& request) {
+        if (!hb_resp.isUp()) {
+            return RPCResponse(dto::K23SIStatus::RefreshCollection("Heartbeat is dead"), dto::K23SITxnMultiHeartbeatResponse{});
+        }
+
+        return handleTxnMultiHeartbeat(std::move(request));
+    });
+
     RPC().registerRPCObserver<dto::K23SITxnFinalizeRequest, dto::K23SITxnFinalizeResponse>
     (dto::Verbs::K23SI_TXN_FINALIZE, [this, &hb_resp](dto::K23SITxnFinalizeRequest&& request) {
         if (!hb_resp.isUp()) {
@@ -272,6 +384,18 @@ seastar::future<> K23SIPartitionModule::_registerVerbs() {
                 });
     });
 
+    RPC().registerRPCObserver<dto::K23SITxnMultiFinalizeRequest, dto::K23SITxnMultiFinalizeResponse>
+    (dto::Verbs::K23SI_TXN_MULTI_FINALIZE, [this, &hb_resp](dto::K23SITxnMultiFinalizeRequest&& request) {
+        if (!hb_resp.isUp()) {
+            return RPCResponse(dto::K23SIStatus::RefreshCollection("Heartbeat is dead"), dto::K23SITxnMultiFinalizeResponse{});
+        }
+
+        return handleTxnMultiFinalize(std::move(request))
+                .then([this] (auto&& resp) {
+                    return _respondAfterFlush(std::move(resp));
+                });
+    });
+
     RPC().registerRPCObserver<dto::K23SIPushSchemaRequest, dto::K23SIPushSchemaResponse>
     (dto::Verbs::K23SI_PUSH_SCHEMA, [this](dto::K23SIPushSchemaRequest&& request) {
         return handlePushSchema(std::move(request));
@@ -312,12 +436,18 @@ void K23SIPartitionModule::_unregisterVerbs() {
     APIServer& api_server = AppBase().getDist<APIServer>().local();
 
     RPC().registerMessageObserver(dto::Verbs::K23SI_READ, nullptr);
+    RPC().registerMessageObserver(dto::Verbs::K23SI_MULTI_READ, nullptr);
     RPC().registerMessageObserver(dto::Verbs::K23SI_QUERY, nullptr);
     RPC().registerMessageObserver(dto::Verbs::K23SI_WRITE, nullptr);
+    RPC().registerMessageObserver(dto::Verbs::K23SI_MULTI_WRITE, nullptr);
+    RPC().registerMessageObserver(dto::Verbs::K23SI_ASYNC_WRITE, nullptr);
+    RPC().registerMessageObserver(dto::Verbs::K23SI_TXN_WRITE_OUTCOME, nullptr);
     RPC().registerMessageObserver(dto::Verbs::K23SI_TXN_PUSH, nullptr);
     RPC().registerMessageObserver(dto::Verbs::K23SI_TXN_END, nullptr);
     RPC().registerMessageObserver(dto::Verbs::K23SI_TXN_HEARTBEAT, nullptr);
+    RPC().registerMessageObserver(dto::Verbs::K23SI_TXN_MULTI_HEARTBEAT, nullptr);
     RPC().registerMessageObserver(dto::Verbs::K23SI_TXN_FINALIZE, nullptr);
+    RPC().registerMessageObserver(dto::Verbs::K23SI_TXN_MULTI_FINALIZE, nullptr);
     RPC().registerMessageObserver(dto::Verbs::K23SI_PUSH_SCHEMA, nullptr);
     RPC().registerMessageObserver(dto::Verbs::K23SI_INSPECT_RECORDS, nullptr);
     RPC().registerMessageObserver(dto::Verbs::K23SI_INSPECT_TXN, nullptr);
@@ -338,12 +468,69 @@ void K23SIPartitionModule::_registerMetrics() {
                         sm::description("Number of keys in indexer"), labels),
         sm::make_counter("total_WI", _totalWI, sm::description("Number of WIs created"), labels),
         sm::make_counter("finalized_WI", _finalizedWI, sm::description("Number of WIs finalized"), labels),
-        sm::make_gauge("record_versions", _recordVersions, sm::description("Number of record versions over all records"), labels),
+        sm::make_counter("group_finalized_txns", _groupFinalizedTxns, sm::description("Number of txns finalized through a multi-txn finalize request"), labels),
+        sm::make_gauge("record_versions", [this]{ return _recordVersions - _indexer.getGCStats().reclaimedVersions;},
+                        sm::description("Number of record versions over all records"), labels),
+        sm::make_counter("gc_reclaimed_versions", [this]{ return _indexer.getGCStats().reclaimedVersions;},
+                        sm::description("Number of record versions dropped by the version GC"), labels),
+        sm::make_counter("gc_reclaimed_bytes", [this]{ return _indexer.getGCStats().reclaimedBytes;},
+                        sm::description("Total size of user payloads dropped by the version GC"), labels),
+        sm::make_counter("gc_removed_keys", [this]{ return _indexer.getGCStats().removedKeys;},
+                        sm::description("Number of tombstoned keys removed by the version GC"), labels),
+        sm::make_counter("gc_passes", [this]{ return _indexer.getGCStats().completedPasses;},
+                        sm::description("Number of completed version GC passes"), labels),
+        sm::make_gauge("arena_slabs", [this]{ return _indexer.getArenaStats().slabs;},
+                        sm::description("Number of memory slabs holding record values"), labels),
+        sm::make_gauge("arena_slab_bytes", [this]{ return _indexer.getArenaStats().slabBytes;},
+                        sm::description("Total memory in slabs holding record values"), labels),
+        sm::make_gauge("arena_live_bytes", [this]{ return _indexer.getArenaStats().liveBytes;},
+                        sm::description("Memory in use by record values in slabs, as of the last version GC pass"), labels),
+        sm::make_counter("arena_large_bytes", [this]{ return _indexer.getArenaStats().largeBytes;},
+                        sm::description("Total size of record values too big for a slab"), labels),
+        sm::make_counter("arena_relocated_bytes", [this]{ return _indexer.getArenaStats().relocatedBytes;},
+                        sm::description("Total size of record values moved out of sparse slabs"), labels),
+        sm::make_counter("arena_freed_slabs", [this]{ return _indexer.getArenaStats().freedSlabs;},
+                        sm::description("Number of memory slabs freed"), labels),
+        sm::make_gauge("read_cache_ranges", [this]{ return _indexer.getReadCacheStats().ranges;},
+                        sm::description("Number of key ranges in the read timestamp cache"), labels),
+        sm::make_gauge("read_cache_bytes", [this]{ return _indexer.getReadCacheStats().bytes;},
+                        sm::description("Memory used by the read timestamp cache"), labels),
+        sm::make_counter("read_cache_evicted_ranges", [this]{ return _indexer.getReadCacheStats().evictedRanges;},
+                        sm::description("Number of read cache ranges dropped to stay within the memory budget"), labels),
+        sm::make_counter("read_cache_expired_ranges", [this]{ return _indexer.getReadCacheStats().expiredRanges;},
+                        sm::description("Number of read cache ranges dropped after falling out of the retention window"), labels),
         sm::make_counter("total_committed_payload", _totalCommittedPayload, sm::description("Total size of committed payloads"), labels),
+        sm::make_counter("recovery_records", _recoveredRecords, sm::description("Number of persisted records replayed during recovery"), labels),
+        sm::make_counter("recovery_bytes", _recoveredBytes, sm::description("Size of persisted data replayed during recovery"), labels),
+        sm::make_gauge("recovery_records_per_sec", [this]{ auto secs = std::chrono::duration<double>(_recoveryTime).count(); return secs > 0 ? _recoveredRecords / secs : 0.0;},
+                        sm::description("Replay throughput in records/s during recovery"), labels),
+        sm::make_gauge("recovery_mbytes_per_sec", [this]{ auto secs = std::chrono::duration<double>(_recoveryTime).count(); return secs > 0 ? _recoveredBytes / 1'000'000.0 / secs : 0.0;},
+                        sm::description("Replay throughput in MB/s during recovery"), labels),
+        sm::make_gauge("recovery_time_to_serve_ms", [this]{ return msec(_timeToServe).count();},
+                        sm::description("Time from partition start until it started serving requests, in milliseconds"), labels),
+        sm::make_counter("recovery_snapshot_records", _snapshotRecoveredRecords, sm::description("Number of records loaded from an indexer snapshot during recovery"), labels),
+        sm::make_counter("query_filter_compilations", _filterCompilations, sm::description("Number of query filters compiled"), labels),
+        sm::make_counter("query_filter_cache_hits", _filterCacheHits, sm::description("Number of query pages which reused a compiled filter"), labels),
+        sm::make_counter("query_cursor_hits", _queryCursorHits, sm::description("Number of query pages which resumed a paused cursor"), labels),
+        sm::make_counter("query_cursor_misses", _queryCursorMisses, sm::description("Number of query pages whose cursor could not be resumed"), labels),
+        sm::make_gauge("query_cursors", [this]{ return _queryCursors.size();}, sm::description("Number of paused query cursors"), labels),
+        sm::make_counter("snapshots", _snapshots, sm::description("Number of completed indexer snapshots"), labels),
+        sm::make_counter("snapshot_failures", _snapshotFailures, sm::description("Number of indexer snapshots which could not be completed"), labels),
+        sm::make_counter("snapshot_keys", _snapshotKeys, sm::description("Number of keys written in indexer snapshots"), labels),
+        sm::make_gauge("snapshot_duration_ms", [this]{ return msec(_lastSnapshotTime).count();},
+                        sm::description("Time it took to write the last indexer snapshot, in milliseconds"), labels),
         sm::make_histogram("read_latency", [this]{ return _readLatency.getHistogram();},
                 sm::description("Latency of Read Operations"), labels),
+        sm::make_histogram("multi_read_latency", [this]{ return _multiReadLatency.getHistogram();},
+                sm::description("Latency of Multi-key Read Operations"), labels),
+        sm::make_histogram("multi_read_keys", [this]{ return _multiReadKeys.getHistogram();},
+                sm::description("Number of keys in each Multi-key Read Operation"), labels),
         sm::make_histogram("write_latency", [this]{ return _writeLatency.getHistogram();},
                 sm::description("Latency of Write Operations"), labels),
+        sm::make_histogram("multi_write_latency", [this]{ return _multiWriteLatency.getHistogram();},
+                sm::description("Latency of Multi-key Write Operations"), labels),
+        sm::make_histogram("multi_write_keys", [this]{ return _multiWriteKeys.getHistogram();},
+                sm::description("Number of writes in each Multi-key Write Operation"), labels),
         sm::make_histogram("query_page_latency", [this]{ return _queryPageLatency.getHistogram();},
                 sm::description("Latency of Query Page Operations"), labels),
         sm::make_histogram("push_latency", [this]{ return _pushLatency.getHistogram();},
@@ -356,7 +543,7 @@ void K23SIPartitionModule::_registerMetrics() {
 }
 
 seastar::future<> K23SIPartitionModule::start() {
-
+    auto startTime = Clock::now();
     _registerMetrics();
 
     K2LOG_I(log::skvsvr, "init cpo with {}", _cpoEndpoint);
@@ -384,25 +571,47 @@ seastar::future<> K23SIPartitionModule::start() {
                     _retentionTimestamp.maxEq(ts - _cmeta.retentionPeriod);
                     _txnMgr.updateRetentionTimestamp(_retentionTimestamp);
                     _twimMgr.updateRetentionTimestamp(_retentionTimestamp);
+                    // kicks off a background pass of the version GC
+                    _indexer.updateRetentionTimestamp(_retentionTimestamp);
                 });
         });
         _retentionUpdateTimer.armPeriodic(_config.retentionTimestampUpdateInterval());
-        _persistence = std::make_shared<Persistence>();
+        _persistence = std::make_shared<Persistence>(_cmeta.name, _partition().keyRangeV.pvid.id);
         return _persistence->start()
             .then([this] {
-                return _indexer.start(_retentionTimestamp);
+                _indexer.setGCSliceLimits(_config.gcSliceKeys(), _config.gcSliceBudget());
+                _indexer.setArenaLimits(_config.arenaSlabSize(), _config.arenaCompactionOccupancy());
+                _indexer.setReadCacheBudget(_config.readCacheSize());
+                return _indexer.start(_retentionTimestamp, _cmeta.indexerType, _config.indexerHashIndex());
             })
             .then([this] {
                 return _twimMgr.start(_retentionTimestamp, _persistence, _cpoEndpoint);
             })
             .then([this] {
+                _txnMgr.setLocalFinalizer([this] (dto::Timestamp txnts, dto::EndAction action) {
+                    return _finalizeLocalTxn(txnts, action);
+                });
                 return _txnMgr.start(_cmeta.name, _retentionTimestamp, _cmeta.heartbeatDeadline, _persistence, _cpoEndpoint);
             })
             .then([this] {
                 return _recovery();
             })
             .then([this] {
+                _queryCursorExpiry.start(_config.queryCursorTimeout(), [this](QueryCursor& cursor) {
+                    _queryCursors.erase(cursor.id);
+                    return seastar::make_ready_future();
+                });
                 return _registerVerbs();
+            })
+            .then([this, startTime] {
+                _timeToServe = Clock::now() - startTime;
+                K2LOG_I(log::skvsvr, "Partition {} serving after {}", _partition, _timeToServe);
+                if (_config.snapshotInterval() > 0s) {
+                    _snapshotTimer.setCallback([this] {
+                        return _takeSnapshot();
+                    });
+                    _snapshotTimer.armPeriodic(_config.snapshotInterval());
+                }
             });
     });
 }
@@ -413,7 +622,15 @@ K23SIPartitionModule::~K23SIPartitionModule() {
 
 seastar::future<> K23SIPartitionModule::gracefulStop() {
     K2LOG_I(log::skvsvr, "stop for cname={}, part={}", _cmeta.name, _partition);
-    return _retentionUpdateTimer.stop()
+    _stopping = true;
+    return _queryCursorExpiry.stop()
+        .then([this] {
+            _queryCursors.clear();
+            return _snapshotTimer.stop();
+        })
+        .then([this] {
+            return _retentionUpdateTimer.stop();
+        })
         .then([this] {
             return _txnMgr.gracefulStop();
         })
@@ -438,10 +655,9 @@ seastar::future<> K23SIPartitionModule::gracefulStop() {
 // Helper for iterating over the indexer, modifies it to end() if iterator would go past the target schema
 // or if it would go past begin() for reverse scan. Starting iterator must not be end() and must
 // point to a record with the target schema
-void K23SIPartitionModule::_scanAdvance(Indexer::Iterator& iter, const dto::K23SIQueryRequest& request) {
+void K23SIPartitionModule::_scanAdvance(Indexer::Iterator& iter) {
     if (!iter.atEnd()) {
         iter.next();
-        iter.observeAt(request.mtr.timestamp);
     }
 }
 
@@ -449,17 +665,16 @@ void K23SIPartitionModule::_scanAdvance(Indexer::Iterator& iter, const dto::K23S
 // desired schema and (eventually) reverse direction scan
 Indexer::Iterator K23SIPartitionModule::_initializeScan(const dto::K23SIQueryRequest& request) {
     auto iter = _indexer.find(request.key, request.reverseDirection);
-    iter.observeAt(request.mtr.timestamp);
     if (!iter.hasData() || // this key didn't exist in the indexer
         request.exclusiveKey) { // key is found, but we're asked to start with the next key in sequence
-        _scanAdvance(iter, request);
+        _scanAdvance(iter);
     }
     return iter;
 }
 
 // Helper for handleQuery. Checks to see if the indexer scan should stop.
 bool K23SIPartitionModule::_isScanDone(const Indexer::Iterator& iter, const dto::K23SIQueryRequest& request,
-                                       size_t response_size, uint64_t num_scans) {
+                                       size_t response_size, size_t response_bytes, uint64_t num_scans) {
     // we're at end of iteration
     if (iter.atEnd()) {
         return true;
@@ -478,7 +693,9 @@ bool K23SIPartitionModule::_isScanDone(const Indexer::Iterator& iter, const dto:
         return true;
     } else if (request.recordLimit >= 0 && response_size == (uint32_t)request.recordLimit) {
         return true;
-    } else if (response_size == _config.paginationLimit()) {
+    } else if (_config.paginationLimit() > 0 && response_size == _config.paginationLimit()) {
+        return true;
+    } else if (_config.paginationBytesLimit() > 0 && response_bytes >= _config.paginationBytesLimit()) {
         return true;
     } else if (_config.scanLimit() > 0 && num_scans == _config.scanLimit()) {
         return true;
@@ -514,6 +731,11 @@ dto::Key K23SIPartitionModule::_getContinuationToken(const Indexer::Iterator& it
         return ikey;
     }
 
+    if (_partition.getHashScheme() != dto::HashScheme::Range) {
+        // The client scans each hash partition separately so there is no next partition to continue in
+        return dto::Key();
+    }
+
     // This is the multi-partition case
     if (request.reverseDirection) {
         response.exclusiveToken = true;
@@ -532,10 +754,105 @@ dto::Key K23SIPartitionModule::_getContinuationToken(const Indexer::Iterator& it
     }
 }
 
+std::shared_ptr<K23SIPartitionModule::CompiledFilter>
+K23SIPartitionModule::_getCompiledFilter(const dto::K23SIQueryRequest& request) {
+    auto& exp = request.filterExpression;
+    if (exp.op == dto::expression::Operation::UNKNOWN && exp.valueChildren.empty() && exp.expressionChildren.empty()) {
+        // no filter
+        return nullptr;
+    }
+
+    // The pages of a query carry the same filter, so we key the cache on the serialized filter
+    Payload serialized(Payload::DefaultAllocator());
+    serialized.write(request.key.schemaName);
+    serialized.write(exp);
+    serialized.seek(0);
+    String cacheKey(String::initialized_later(), serialized.getSize());
+    serialized.read(cacheKey.data(), cacheKey.size());
+
+    auto it = _compiledFilters.find(cacheKey);
+    if (it != _compiledFilters.end()) {
+        ++_filterCacheHits;
+        return it->second;
+    }
+
+    while (!_compiledFiltersOrder.empty() && _compiledFilters.size() >= _config.compiledFilterCacheSize()) {
+        _compiledFilters.erase(_compiledFiltersOrder.front());
+        _compiledFiltersOrder.pop_front();
+    }
+    auto filter = std::make_shared<CompiledFilter>();
+    if (_config.compiledFilterCacheSize() > 0) {
+        _compiledFilters[cacheKey] = filter;
+        _compiledFiltersOrder.push_back(std::move(cacheKey));
+    }
+    return filter;
+}
+
+std::optional<Indexer::Iterator>
+K23SIPartitionModule::_resumeQueryCursor(const dto::K23SIQueryRequest& request,
+                                         std::shared_ptr<CompiledFilter>& filter,
+                                         std::shared_ptr<ProjectionPlan>& projection) {
+    if (request.cursorId == 0) {
+        return std::nullopt;
+    }
+    auto it = _queryCursors.find(request.cursorId);
+    if (it == _queryCursors.end()) {
+        // the cursor expired or was never kept
+        ++_queryCursorMisses;
+        return std::nullopt;
+    }
+
+    // A cursor is used for at most one page
+    auto& cursor = it->second;
+    _queryCursorExpiry.erase(cursor);
+    std::optional<Indexer::Iterator> result;
+    // The iterator is positioned at the continuation token of the page which paused it. It is only safe to use if
+    // nothing has been inserted into or erased from the key indexer since, as either may invalidate the iterator
+    if (cursor.nextKey == request.key && !request.exclusiveKey && cursor.mtr == request.mtr &&
+        cursor.reverse == request.reverseDirection && cursor.iter->getIndexerVersion() == cursor.indexerVersion) {
+        ++_queryCursorHits;
+        result.emplace(std::move(*cursor.iter));
+        filter = std::move(cursor.filter);
+        projection = std::move(cursor.projection);
+    }
+    else {
+        ++_queryCursorMisses;
+    }
+    _queryCursors.erase(it);
+    return result;
+}
+
+uint64_t K23SIPartitionModule::_pauseQueryCursor(const dto::K23SIQueryRequest& request,
+                                                 const dto::K23SIQueryResponse& response, Indexer::Iterator& iter,
+                                                 std::shared_ptr<CompiledFilter> filter,
+                                                 std::shared_ptr<ProjectionPlan> projection) {
+    // Only a page which stopped in the middle of the partition continues at the current iterator position.
+    // Other pages are either done or continue in another partition
+    if (_config.queryCursorCacheSize() == 0 || _queryCursors.size() >= _config.queryCursorCacheSize() ||
+        iter.atEnd() || response.nextToScan.partitionKey == "" || response.exclusiveToken) {
+        return 0;
+    }
+
+    auto id = _nextQueryCursorId++;
+    auto& cursor = _queryCursors[id];
+    cursor.id = id;
+    cursor.nextKey = response.nextToScan;
+    cursor.mtr = request.mtr;
+    cursor.reverse = request.reverseDirection;
+    cursor.iter.emplace(iter);
+    cursor.indexerVersion = iter.getIndexerVersion();
+    cursor.filter = std::move(filter);
+    cursor.projection = std::move(projection);
+    cursor.expiryTime = Clock::now() + _config.queryCursorTimeout();
+    _queryCursorExpiry.add(cursor);
+    return id;
+}
+
 // Makes the SKVRecord and applies the request's filter to it. If the returned Status is not OK,
 // the caller should return the status in the query response. Otherwise bool in tuple is whether
 // the filter passed
 std::tuple<Status, bool> K23SIPartitionModule::_doQueryFilter(dto::K23SIQueryRequest& request,
+                                                              CompiledFilter& filter,
                                                               dto::SKVRecord::Storage& storage) {
     // We know the schema name exists because it is validated at the beginning of handleQuery
     auto schemaIt = _schemas.find(request.key.schemaName);
@@ -545,12 +862,20 @@ std::tuple<Status, bool> K23SIPartitionModule::_doQueryFilter(dto::K23SIQueryReq
             "Schema version of found record does not exist"), false);
     }
 
+    // compile the filter the first time we see a record of this schema version
+    auto progIt = filter.versions.find(storage.schemaVersion);
+    if (progIt == filter.versions.end()) {
+        ++_filterCompilations;
+        progIt = filter.versions.emplace(storage.schemaVersion,
+                    dto::expression::CompiledExpression(request.filterExpression, *versionIt->second)).first;
+    }
+
     dto::SKVRecord record(request.collectionName, versionIt->second, storage.share(), true);
     bool keep = false;
     Status status = dto::K23SIStatus::OK;
 
     try {
-        keep = request.filterExpression.evaluate(record);
+        keep = progIt->second.evaluate(record);
     }
     catch(dto::NoFieldFoundException&) {}
     catch(dto::TypeMismatchException&) {}
@@ -564,6 +889,27 @@ std::tuple<Status, bool> K23SIPartitionModule::_doQueryFilter(dto::K23SIQueryReq
     return std::make_tuple(std::move(status), keep);
 }
 
+Status K23SIPartitionModule::_doQueryAggregate(dto::K23SIQueryRequest& request, dto::Aggregator& aggregator,
+                                               dto::SKVRecord::Storage& storage) {
+    auto schemaIt = _schemas.find(request.key.schemaName);
+    auto versionIt = schemaIt->second.find(storage.schemaVersion);
+    if (versionIt == schemaIt->second.end()) {
+        return dto::K23SIStatus::OperationNotAllowed("Schema version of found record does not exist");
+    }
+
+    dto::SKVRecord record(request.collectionName, versionIt->second, storage.share(), true);
+    try {
+        aggregator.add(record);
+    }
+    catch (dto::TypeMismatchException& exc) {
+        return dto::K23SIStatus::OperationNotAllowed(fmt::format("TypeMismatch in query aggregation: {}", exc.what()));
+    }
+    catch (dto::DeserializationError&) {
+        return dto::K23SIStatus::OperationNotAllowed("DeserializationError in query aggregation");
+    }
+    return dto::K23SIStatus::OK;
+}
+
 seastar::future<std::tuple<Status, dto::K23SIQueryResponse>>
 K23SIPartitionModule::handleQuery(dto::K23SIQueryRequest&& request, dto::K23SIQueryResponse&& response, FastDeadline deadline, uint32_t count) {
     K2LOG_D(log::skvsvr, "Partition: {}, received query {}", _partition, request);
@@ -573,13 +919,37 @@ K23SIPartitionModule::handleQuery(dto::K23SIQueryRequest&& request, dto::K23SIQu
     if (!validateStatus.is2xxOK()) {
         return RPCResponse(std::move(validateStatus), dto::K23SIQueryResponse{});
     }
-    if (_partition.getHashScheme() != dto::HashScheme::Range) {
-            return RPCResponse(dto::K23SIStatus::OperationNotAllowed("Query not implemented for hash partitioned collection"), dto::K23SIQueryResponse{});
+
+    // Continue the scan from the cursor the previous page kept, if it is still usable
+    std::shared_ptr<CompiledFilter> filter;
+    std::shared_ptr<ProjectionPlan> projection;
+    auto resumed = _resumeQueryCursor(request, filter, projection);
+    request.cursorId = 0;
+    if (!resumed) {
+        filter = _getCompiledFilter(request);
+    }
+    if (!projection && !request.projection.empty()) {
+        projection = std::make_shared<ProjectionPlan>();
+    }
+    // For aggregation queries, the partial aggregates are carried in the response across push retries
+    std::optional<dto::Aggregator> aggregator;
+    if (!request.aggregation.empty()) {
+        aggregator.emplace(request.aggregation);
+        aggregator->merge(std::move(response.aggregates));
+    }
+
+    // the size of the records in the page so far, including the ones from before a push
+    size_t responseBytes = 0;
+    for (auto& storage: response.results) {
+        responseBytes += storage.fieldData.getSize();
     }
 
-    auto iter = _initializeScan(request);
-    for (; !_isScanDone(iter, request, response.results.size(), numScans);
-                        _scanAdvance(iter, request)) {
+    auto iter = resumed ? std::move(*resumed) : _initializeScan(request);
+    for (; !_isScanDone(iter, request, response.results.size(), responseBytes, numScans);
+                        _scanAdvance(iter)) {
+        if (aggregator && aggregator->size() >= _config.aggregationGroupLimit()) {
+            break;
+        }
         ++numScans;
         auto [record, conflict] = iter.getDataRecordAt(request.mtr.timestamp);
 
@@ -591,28 +961,37 @@ K23SIPartitionModule::handleQuery(dto::K23SIQueryRequest&& request, dto::K23SIQu
         // happy case: either committed, or txn is reading its own write
         if (!conflict) {
             if (!record->isTombstone) {
-                auto [status, keep] = _doQueryFilter(request, record->value);
-                if (!status.is2xxOK()) {
-                    return RPCResponse(std::move(status), dto::K23SIQueryResponse{});
-                }
-                if (!keep) {
-                    continue;
+                if (filter) {
+                    auto [status, keep] = _doQueryFilter(request, *filter, record->value);
+                    if (!status.is2xxOK()) {
+                        return RPCResponse(std::move(status), dto::K23SIQueryResponse{});
+                    }
+                    if (!keep) {
+                        continue;
+                    }
                 }
 
-                // apply projection if the user call addProjection
-                if (request.projection.size() == 0) {
+                // aggregate the record, or apply projection if the user call addProjection
+                if (aggregator) {
+                    auto status = _doQueryAggregate(request, *aggregator, record->value);
+                    if (!status.is2xxOK()) {
+                        return RPCResponse(std::move(status), dto::K23SIQueryResponse{});
+                    }
+                } else if (request.projection.size() == 0) {
                     // want all fields
+                    responseBytes += record->value.fieldData.getSize();
                     response.results.push_back(record->value.share());
                 } else {
                     // serialize partial SKVRecord according to projection
                     dto::SKVRecord::Storage storage;
-                    bool success = _makeProjection(record->value, request, storage);
+                    bool success = _makeProjection(record->value, request, *projection, storage);
                     if (!success) {
                         K2LOG_W(log::skvsvr, "Error making projection!");
                         return RPCResponse(dto::K23SIStatus::InternalError("Error making projection"),
                                                 dto::K23SIQueryResponse{});
                     }
 
+                    responseBytes += storage.fieldData.getSize();
                     response.results.push_back(std::move(storage));
                 }
             }
@@ -632,6 +1011,8 @@ K23SIPartitionModule::handleQuery(dto::K23SIQueryRequest&& request, dto::K23SIQu
         // avoid a push
 
         K2LOG_D(log::skvsvr, "About to PUSH in query request");
+        // the part of the range we've scanned so far, up to and including the conflicting key
+        iter.observeScanFrom(request.key, request.mtr.timestamp);
 
         if (ikey != request.key) {
             // reset the push counter if we have advanced the key that is being looked at
@@ -644,6 +1025,9 @@ K23SIPartitionModule::handleQuery(dto::K23SIQueryRequest&& request, dto::K23SIQu
         // add metrics
         _queryPageScans.add(numScans);
         _queryPageReturns.add(response.results.size());
+        if (aggregator) {
+            response.aggregates = aggregator->release();
+        }
 
         return _doPush(request.key, record->timestamp, request.mtr, deadline, ++count)
         .then([this, request=std::move(request),
@@ -656,8 +1040,16 @@ K23SIPartitionModule::handleQuery(dto::K23SIQueryRequest&& request, dto::K23SIQu
         });
     }
 
+    if (aggregator) {
+        response.aggregates = aggregator->release();
+    }
+    // The whole scanned range is recorded in the read cache as a single observation. This covers the gaps
+    // between the keys we returned, so that no writes can be placed into them under our timestamp
+    iter.observeScanFrom(request.key, request.mtr.timestamp);
     response.nextToScan = _getContinuationToken(iter, request, response, response.results.size());
-    K2LOG_D(log::skvsvr, "nextToScan: {}, exclusiveToken: {}", response.nextToScan, response.exclusiveToken);
+    response.cursorId = _pauseQueryCursor(request, response, iter, std::move(filter), std::move(projection));
+    K2LOG_D(log::skvsvr, "nextToScan: {}, exclusiveToken: {}, cursorId: {}", response.nextToScan,
+            response.exclusiveToken, response.cursorId);
 
     _queryPageScans.add(numScans);
     _queryPageReturns.add(response.results.size());
@@ -702,14 +1094,80 @@ K23SIPartitionModule::handleRead(dto::K23SIReadRequest&& request, FastDeadline d
     return RPCResponse(dto::K23SIStatus::OK("read succeeded"), std::move(response));
 }
 
-std::size_t K23SIPartitionModule::_findField(const dto::Schema schema, k2::String fieldName ,dto::FieldType fieldtype) {
-    std::size_t fieldNumber = -1;
-    for (std::size_t i = 0; i < schema.fields.size(); ++i) {
-        if (schema.fields[i].name == fieldName && schema.fields[i].type == fieldtype) {
-            return i;
+seastar::future<std::tuple<Status, dto::K23SIMultiReadResponse>>
+K23SIPartitionModule::handleMultiRead(dto::K23SIMultiReadRequest&& request, FastDeadline deadline) {
+    K2LOG_D(log::skvsvr, "Partition: {}, received multi-read {}", _partition, request);
+
+    Status validateStatus = _validateReadRequest(request);
+    if (!validateStatus.is2xxOK()) {
+        return RPCResponse(std::move(validateStatus), dto::K23SIMultiReadResponse{});
+    }
+
+    dto::K23SIMultiReadResponse response;
+    response.statuses.resize(request.keys.size());
+    response.values.resize(request.keys.size());
+    std::vector<size_t> pending(request.keys.size());
+    std::iota(pending.begin(), pending.end(), 0);
+    return _doMultiRead(std::move(request), std::move(response), std::move(pending), deadline, 0);
+}
+
+seastar::future<std::tuple<Status, dto::K23SIMultiReadResponse>>
+K23SIPartitionModule::_doMultiRead(dto::K23SIMultiReadRequest&& request, dto::K23SIMultiReadResponse&& response,
+                                   std::vector<size_t>&& pending, FastDeadline deadline, uint32_t count) {
+    K2LOG_D(log::skvsvr, "multi-read from txn {}, {} keys pending, count {}", request.mtr, pending.size(), count);
+
+    // the keys which have to be read again after a push, and the pushes for them
+    std::vector<size_t> retry;
+    std::vector<seastar::future<Status>> pushes;
+    for (auto idx: pending) {
+        auto& key = request.keys[idx];
+        Status keyStatus = _validateMultiReadKey(key);
+        if (!keyStatus.is2xxOK()) {
+            response.statuses[idx] = std::move(keyStatus);
+            continue;
+        }
+
+        auto iter = _indexer.find(key);
+        iter.observeAt(request.mtr.timestamp);
+        auto [rec, conflict] = iter.getDataRecordAt(request.mtr.timestamp);
+
+        if (conflict) {
+            // record is still pending and isn't from same transaction.
+            retry.push_back(idx);
+            pushes.push_back(_doPush(key, rec->timestamp, request.mtr, deadline, count + 1));
+        }
+        else if (rec == nullptr || rec->isTombstone) {
+            // no version matches the incoming timestamp (or the version was a tombstone)
+            response.statuses[idx] = dto::K23SIStatus::KeyNotFound("read did not find key");
+        }
+        else {
+            response.statuses[idx] = dto::K23SIStatus::OK("read succeeded");
+            response.values[idx] = rec->value.share();
         }
     }
-    return fieldNumber;
+
+    if (pushes.empty()) {
+        return RPCResponse(dto::K23SIStatus::OK("multi-read succeeded"), std::move(response));
+    }
+
+    return seastar::when_all_succeed(pushes.begin(), pushes.end())
+        .then([this, request=std::move(request), response=std::move(response), retry=std::move(retry), deadline, count]
+              (std::vector<Status>&& challengerResults) mutable {
+            for (auto& retryChallenger: challengerResults) {
+                if (!retryChallenger.is2xxOK()) {
+                    return RPCResponse(dto::K23SIStatus::AbortConflict("incumbent txn won in multi-read push"), dto::K23SIMultiReadResponse{});
+                }
+            }
+            return _doMultiRead(std::move(request), std::move(response), std::move(retry), deadline, count + 1);
+        });
+}
+
+std::size_t K23SIPartitionModule::_findField(const dto::Schema& schema, const k2::String& fieldName, dto::FieldType fieldtype) {
+    auto idx = schema.getFieldIndex(fieldName);
+    if (idx && schema.fields[*idx].type == fieldtype) {
+        return *idx;
+    }
+    return -1;
 }
 
 template <typename T>
@@ -747,7 +1205,7 @@ void _getNextPayloadOffset<String>(const dto::SchemaField& field, Payload& base,
     fieldsOffset.push_back(tmpOffset);
 }
 
-bool K23SIPartitionModule::_isUpdatedField(uint32_t fieldIdx, std::vector<uint32_t> fieldsForPartialUpdate) {
+bool K23SIPartitionModule::_isUpdatedField(uint32_t fieldIdx, const std::vector<uint32_t>& fieldsForPartialUpdate) {
     for(std::size_t i = 0; i < fieldsForPartialUpdate.size(); ++i) {
         if (fieldIdx == fieldsForPartialUpdate[i]) return true;
     }
@@ -970,22 +1428,33 @@ bool K23SIPartitionModule::_parsePartialRecord(dto::K23SIWriteRequest& request,
 }
 
 bool K23SIPartitionModule::_makeProjection(dto::SKVRecord::Storage& fullRec, dto::K23SIQueryRequest& request,
-        dto::SKVRecord::Storage& projectionRec) {
+        ProjectionPlan& plan, dto::SKVRecord::Storage& projectionRec) {
     auto schemaIt = _schemas.find(request.key.schemaName);
     auto schemaVer = schemaIt->second.find(fullRec.schemaVersion);
     dto::Schema& schema = *(schemaVer->second);
     std::vector<bool> excludedFields(schema.fields.size(), true);   // excludedFields for projection
     Payload projectedPayload(Payload::DefaultAllocator());            // payload for projection
 
+    // resolve the projected field names to indexes the first time we see a record of this schema version
+    auto planIt = plan.versions.find(fullRec.schemaVersion);
+    if (planIt == plan.versions.end()) {
+        std::vector<bool> fields(schema.fields.size(), false);
+        for (auto& fieldName : request.projection) {
+            if (auto idx = schema.getFieldIndex(fieldName); idx) {
+                fields[*idx] = true;
+            }
+        }
+        planIt = plan.versions.emplace(fullRec.schemaVersion, std::move(fields)).first;
+    }
+    const std::vector<bool>& projected = planIt->second;
+
     for (uint32_t i = 0; i < schema.fields.size(); ++i) {
         if (fullRec.excludedFields.size() && fullRec.excludedFields[i]) {
             // A value of NULL in the record is treated the same as if the field doesn't exist in the record
             continue;
         }
 
-        std::vector<k2::String>::iterator fieldIt;
-        fieldIt = std::find(request.projection.begin(), request.projection.end(), schema.fields[i].name);
-        if (fieldIt == request.projection.end()) {
+        if (!projected[i]) {
             // advance base payload
             bool success = false;
             K2_DTO_CAST_APPLY_FIELD_VALUE(_advancePayloadPosition, schema.fields[i], fullRec.fieldData,
@@ -1070,6 +1539,53 @@ K23SIPartitionModule::handleWrite(dto::K23SIWriteRequest&& request, FastDeadline
     return _processWrite(std::move(request), deadline, 0);
 }
 
+seastar::future<> K23SIPartitionModule::handleAsyncWrite(dto::K23SIWriteRequest&& request) {
+    auto txnts = request.mtr.timestamp;
+    // later requests in this txn wait until the write is applied
+    _pendingAsyncWrites[txnts].count++;
+    dto::K23SITxnWriteOutcomeRequest outcome{
+        .pvid{}, // will be filled by PartitionRequest
+        .collectionName=request.trhCollection,
+        .key=request.trh,
+        .mtr=request.mtr,
+        .request_id=request.request_id,
+        .success=false
+    };
+    return handleWrite(std::move(request), FastDeadline(_config.writeTimeout()))
+        .then([this] (auto&& resp) {
+            return _respondAfterFlush(std::move(resp));
+        })
+        .finally([this, txnts] {
+            _asyncWriteApplied(txnts);
+        })
+        .then([this, outcome=std::move(outcome)] (auto&& resp) mutable {
+            outcome.success = std::get<0>(resp).is2xxOK();
+            K2LOG_D(log::skvsvr, "reporting async write outcome {} with status {}", outcome, std::get<0>(resp));
+            return seastar::do_with(std::move(outcome), [this] (auto& outcome) {
+                return _cpo.partitionRequest<dto::K23SITxnWriteOutcomeRequest,
+                                             dto::K23SITxnWriteOutcomeResponse,
+                                             dto::Verbs::K23SI_TXN_WRITE_OUTCOME>
+                    (FastDeadline(_config.writeTimeout()), outcome)
+                    .then([&outcome] (auto&& result) {
+                        auto& [status, k2response] = result;
+                        if (!status.is2xxOK()) {
+                            // the TRH aborts the transaction if it does not hear from all of its async writes
+                            K2LOG_W(log::skvsvr, "unable to report async write outcome {} due to {}", outcome, status);
+                        }
+                    });
+            });
+        });
+}
+
+void K23SIPartitionModule::_asyncWriteApplied(const dto::Timestamp& txnts) {
+    auto it = _pendingAsyncWrites.find(txnts);
+    if (it == _pendingAsyncWrites.end() || --it->second.count > 0) {
+        return;
+    }
+    it->second.applied.set_value();
+    _pendingAsyncWrites.erase(it);
+}
+
 seastar::future<std::tuple<Status, dto::K23SIWriteResponse>>
 K23SIPartitionModule::_processWrite(dto::K23SIWriteRequest&& request, FastDeadline deadline, uint32_t count) {
     K2LOG_D(log::skvsvr, "processing write: {} with count {}", request, count);
@@ -1105,13 +1621,21 @@ K23SIPartitionModule::_processWrite(dto::K23SIWriteRequest&& request, FastDeadli
             });
     }
 
+    auto status = _placeWrite(std::move(request), iter);
+    return RPCResponse(std::move(status), dto::K23SIWriteResponse{});
+}
+
+Status
+K23SIPartitionModule::_placeWrite(dto::K23SIWriteRequest&& request, Indexer::Iterator& iter, WIBatch* batch) {
+    auto* wi = iter.getWI();
+
     // Handle idempotency here. If request ids match, then this was a retry message from the client
     // and we should return OK
     if (wi &&
         request.mtr.timestamp == wi->data.timestamp &&
         request.request_id == wi->request_id) {
         K2LOG_D(log::skvsvr, "duplicate write encountered in request {}", request);
-        return RPCResponse(dto::K23SIStatus::Created("wi was already created"), dto::K23SIWriteResponse{});
+        return dto::K23SIStatus::Created("wi was already created");
     }
 
     // Note that if we are here and a WI exists, it must be from the txn of the current request's transaction
@@ -1122,7 +1646,7 @@ K23SIPartitionModule::_processWrite(dto::K23SIWriteRequest&& request, FastDeadli
     if (request.precondition == dto::ExistencePrecondition::Exists && (!head || head->isTombstone)) {
         K2LOG_D(log::skvsvr, "Request {} not accepted since Exists precondition failed", request);
         iter.observeAt(request.mtr.timestamp);
-        return RPCResponse(dto::K23SIStatus::ConditionFailed("Exists precondition failed"), dto::K23SIWriteResponse{});
+        return dto::K23SIStatus::ConditionFailed("Exists precondition failed");
     }
 
     if (request.precondition == dto::ExistencePrecondition::NotExists && head && !head->isTombstone) {
@@ -1135,33 +1659,33 @@ K23SIPartitionModule::_processWrite(dto::K23SIWriteRequest&& request, FastDeadli
 
         // The ConditionFailed status does not mean that the transaction must abort. It is up to the user
         // to decide to abort or not, similar to a KeyNotFound status on read.
-        return RPCResponse(dto::K23SIStatus::ConditionFailed("Previous record exists"), dto::K23SIWriteResponse{});
+        return dto::K23SIStatus::ConditionFailed("Previous record exists");
     }
 
     if (request.fieldsForPartialUpdate.size() > 0) {
         iter.observeAt(request.mtr.timestamp);
 
         if (!head) {
-            return RPCResponse(dto::K23SIStatus::ConditionFailed("cannot apply partial update without previous version"), dto::K23SIWriteResponse{});
+            return dto::K23SIStatus::ConditionFailed("cannot apply partial update without previous version");
         }
         // parse the partial record to full record
         if (!_parsePartialRecord(request, *head)) {
             K2LOG_D(log::skvsvr, "can not parse partial record for key {}", request.key);
-            return RPCResponse(dto::K23SIStatus::ConditionFailed("missing fields or can not interpret partialUpdate"), dto::K23SIWriteResponse{});
+            return dto::K23SIStatus::ConditionFailed("missing fields or can not interpret partialUpdate");
         }
     }
 
     // all checks passed - we're ready to place this WI as the latest version
-    auto status = _createWI(std::move(request), iter);
+    auto status = _createWI(std::move(request), iter, batch);
     K2LOG_D(log::skvsvr, "WI creation with status {}", status);
-    return RPCResponse(std::move(status), dto::K23SIWriteResponse{});
+    return status;
 }
 
 Status
-K23SIPartitionModule::_createWI(dto::K23SIWriteRequest&& request, Indexer::Iterator& iter) {
+K23SIPartitionModule::_createWI(dto::K23SIWriteRequest&& request, Indexer::Iterator& iter, WIBatch* batch) {
     K2LOG_D(log::skvsvr, "Write Request creating WI: {}", request);
     // we need to copy this data into a new memory block so that we don't hold onto and fragment the transport memory
-    dto::DataRecord rec{.value=request.value.copy(), .timestamp=request.mtr.timestamp, .isTombstone=request.isDelete};
+    dto::DataRecord rec{.value=_indexer.copyValue(request.value), .timestamp=request.mtr.timestamp, .isTombstone=request.isDelete};
 
     auto status = _twimMgr.addWrite(std::move(request.mtr), dto::Key(request.key), std::move(request.trh), std::move(request.trhCollection));
 
@@ -1172,10 +1696,127 @@ K23SIPartitionModule::_createWI(dto::K23SIWriteRequest&& request, Indexer::Itera
     // the TWIM accepted the write. Add it as a WI now
     iter.addWI(request.key, std::move(rec), request.request_id);
     _totalWI++;
-    _persistence->append(iter.getWI()->data);
+    auto* wi = iter.getWI();
+    if (batch) {
+        batch->keys.push_back(request.key);
+        batch->wis.push_back(dto::WriteIntent{
+            .data = dto::DataRecord{.value=wi->data.value.share(), .timestamp=wi->data.timestamp, .isTombstone=wi->data.isTombstone},
+            .request_id = wi->request_id
+        });
+    }
+    else {
+        _persistence->appendRecord(PersistedRecordType::WriteIntent, request.key, *wi);
+    }
     return Statuses::S201_Created("WI created");
 }
 
+seastar::future<std::tuple<Status, dto::K23SIMultiWriteResponse>>
+K23SIPartitionModule::handleMultiWrite(dto::K23SIMultiWriteRequest&& request, FastDeadline deadline) {
+    K2LOG_D(log::skvsvr, "Partition: {}, handle multi-write: {}", _partition, request);
+    if (!_validateRequestPartition(request)) {
+        // tell client their collection partition is gone
+        return RPCResponse(dto::K23SIStatus::RefreshCollection("collection refresh needed in multi-write"), dto::K23SIMultiWriteResponse());
+    }
+
+    // Expand the batch into individual writes so that they are validated and applied exactly like single writes
+    std::vector<dto::K23SIWriteRequest> writes;
+    writes.reserve(request.writes.size());
+    for (auto& record: request.writes) {
+        writes.push_back(dto::K23SIWriteRequest{
+            .pvid = request.pvid,
+            .collectionName = request.collectionName,
+            .mtr = request.mtr,
+            .trh = request.trh,
+            .trhCollection = request.trhCollection,
+            .isDelete = record.isDelete,
+            .designateTRH = false,
+            .precondition = record.precondition,
+            .request_id = record.request_id,
+            .key = std::move(record.key),
+            .value = std::move(record.value),
+            .fieldsForPartialUpdate = std::move(record.fieldsForPartialUpdate)
+        });
+    }
+
+    dto::K23SIMultiWriteResponse response;
+    response.statuses.resize(writes.size());
+    std::vector<size_t> pending(writes.size());
+    std::iota(pending.begin(), pending.end(), 0);
+
+    if (request.designateTRH) {
+        return _designateTRH(request.mtr, request.key)
+            .then([this, writes=std::move(writes), response=std::move(response), pending=std::move(pending), deadline, mtr=request.mtr]
+                  (auto&& status) mutable {
+                if (!status.is2xxOK()) {
+                    K2LOG_D(log::skvsvr, "failed creating TR for {}", mtr);
+                    return RPCResponse(std::move(status), dto::K23SIMultiWriteResponse{});
+                }
+
+                K2LOG_D(log::skvsvr, "succeeded creating TR. Processing multi-write for {}", mtr);
+                return _doMultiWrite(std::move(writes), std::move(response), std::move(pending), deadline, 0);
+            });
+    }
+
+    return _doMultiWrite(std::move(writes), std::move(response), std::move(pending), deadline, 0);
+}
+
+seastar::future<std::tuple<Status, dto::K23SIMultiWriteResponse>>
+K23SIPartitionModule::_doMultiWrite(std::vector<dto::K23SIWriteRequest>&& writes, dto::K23SIMultiWriteResponse&& response,
+                                    std::vector<size_t>&& pending, FastDeadline deadline, uint32_t count) {
+    K2LOG_D(log::skvsvr, "multi-write, {} writes pending, count {}", pending.size(), count);
+
+    // the writes which have to be retried after a push, and the pushes for them
+    std::vector<size_t> retry;
+    std::vector<seastar::future<Status>> pushes;
+    WIBatch batch;
+    for (auto idx: pending) {
+        auto& write = writes[idx];
+        if (auto status = _validateWriteRequest(write); !status.is2xxOK()) {
+            K2LOG_D(log::skvsvr, "rejecting write for key {} due to {}", write.key, status);
+            response.statuses[idx] = std::move(status);
+            continue;
+        }
+        auto iter = _indexer.find(write.key);
+        if (auto status = _validateStaleWrite(write, iter); !status.is2xxOK()) {
+            K2LOG_D(log::skvsvr, "rejecting write for key {} due to {}", write.key, status);
+            response.statuses[idx] = std::move(status);
+            continue;
+        }
+
+        auto* wi = iter.getWI();
+        if (wi && wi->data.timestamp != write.mtr.timestamp) {
+            // a WI from a different transaction. Push it and try this write again in the next pass
+            K2LOG_D(log::skvsvr, "different WI found for key {}", write.key);
+            retry.push_back(idx);
+            pushes.push_back(_doPush(write.key, wi->data.timestamp, write.mtr, deadline, count + 1));
+            continue;
+        }
+
+        response.statuses[idx] = _placeWrite(std::move(write), iter, &batch);
+    }
+
+    if (!batch.keys.empty()) {
+        // all the WIs from this pass go out as one record, acknowledged by the single flush before we respond
+        _persistence->appendRecord(PersistedRecordType::WriteIntentBatch, batch.keys, batch.wis);
+    }
+
+    if (pushes.empty()) {
+        return RPCResponse(dto::K23SIStatus::OK("multi-write succeeded"), std::move(response));
+    }
+
+    return seastar::when_all_succeed(pushes.begin(), pushes.end())
+        .then([this, writes=std::move(writes), response=std::move(response), retry=std::move(retry), deadline, count]
+              (std::vector<Status>&& challengerResults) mutable {
+            for (auto& retryChallenger: challengerResults) {
+                if (!retryChallenger.is2xxOK()) {
+                    // the WIs we already placed are cleaned up when the client aborts the transaction
+                    return RPCResponse(dto::K23SIStatus::AbortConflict("incumbent txn won in multi-write push"), dto::K23SIMultiWriteResponse{});
+                }
+            }
+            return _doMultiWrite(std::move(writes), std::move(response), std::move(retry), deadline, count + 1);
+        });
+}
+
 seastar::future<std::tuple<Status, dto::K23SITxnPushResponse>>
 K23SIPartitionModule::handleTxnPush(dto::K23SITxnPushRequest&& request) {
     K2LOG_D(log::skvsvr, "Partition: {}, push request: {}", _partition, request);
@@ -1203,7 +1844,26 @@ K23SIPartitionModule::handleTxnEnd(dto::K23SITxnEndRequest&& request) {
         // the request is outside the retention window
         return RPCResponse(dto::K23SIStatus::AbortRequestTooOld("transaction too old in end"), dto::K23SITxnEndResponse());
     }
-    return _txnMgr.endTxn(std::move(request));
+    auto onePhase = _isOnePhaseTxn(request);
+    return _txnMgr.endTxn(std::move(request), onePhase);
+}
+
+bool K23SIPartitionModule::_isOnePhaseTxn(const dto::K23SITxnEndRequest& request) const {
+    if (!_config.onePhaseCommit() || request.writeRanges.size() != 1) {
+        return false;
+    }
+    auto& [cname, ranges] = *request.writeRanges.begin();
+    return cname == _cmeta.name && ranges.size() == 1 && ranges.begin()->pvid == _partition().keyRangeV.pvid;
+}
+
+seastar::future<std::tuple<Status, dto::K23SITxnWriteOutcomeResponse>>
+K23SIPartitionModule::handleTxnWriteOutcome(dto::K23SITxnWriteOutcomeRequest&& request) {
+    K2LOG_D(log::skvsvr, "Partition: {}, txn write outcome: {}", _partition, request);
+    if (!_validateRequestPartition(request)) {
+        // tell the sender their collection partition is gone
+        return RPCResponse(dto::K23SIStatus::RefreshCollection("collection refresh needed in write outcome"), dto::K23SITxnWriteOutcomeResponse{});
+    }
+    return _txnMgr.writeOutcome(std::move(request));
 }
 
 seastar::future<std::tuple<Status, dto::K23SITxnHeartbeatResponse>>
@@ -1225,6 +1885,49 @@ K23SIPartitionModule::handleTxnHeartbeat(dto::K23SITxnHeartbeatRequest&& request
         });
 }
 
+seastar::future<std::tuple<Status, dto::K23SITxnMultiHeartbeatResponse>>
+K23SIPartitionModule::handleTxnMultiHeartbeat(dto::K23SITxnMultiHeartbeatRequest&& request) {
+    K2LOG_D(log::skvsvr, "Partition: {}, transaction multi-hb: {}", _partition, request);
+    if (!_validateRequestPartition(request)) {
+        // tell client their collection partition is gone
+        K2LOG_D(log::skvsvr, "multi-hb for outdated partition");
+        return RPCResponse(dto::K23SIStatus::RefreshCollection("collection refresh needed in multi-hb"), dto::K23SITxnMultiHeartbeatResponse{});
+    }
+    if (request.trhKeys.size() != request.mtrs.size()) {
+        return RPCResponse(dto::K23SIStatus::BadParameter("trh keys and mtrs do not match in multi-hb"), dto::K23SITxnMultiHeartbeatResponse{});
+    }
+
+    // the transactions which are checked here get their status right away. The rest are heartbeated in one batch
+    std::vector<std::optional<Status>> statuses(request.mtrs.size());
+    std::vector<dto::K23SI_MTR> mtrs;
+    std::vector<dto::Key> trhKeys;
+    for (size_t i = 0; i < request.mtrs.size(); ++i) {
+        if (!_partition.owns(request.trhKeys[i])) {
+            // the client should heartbeat this transaction separately
+            statuses[i] = dto::K23SIStatus::RefreshCollection("trh is not owned by the partition in multi-hb");
+        }
+        else if (!_validateRetentionWindow(request.mtrs[i].timestamp)) {
+            K2LOG_D(log::skvsvr, "txn hb too old txn={}", request.mtrs[i]);
+            statuses[i] = dto::K23SIStatus::AbortRequestTooOld("txn too old in hb");
+        }
+        else {
+            mtrs.push_back(std::move(request.mtrs[i]));
+            trhKeys.push_back(std::move(request.trhKeys[i]));
+        }
+    }
+
+    return _txnMgr.heartbeat(std::move(mtrs), std::move(trhKeys))
+        .then([statuses=std::move(statuses)] (auto&& batchStatuses) mutable {
+            dto::K23SITxnMultiHeartbeatResponse response;
+            response.statuses.reserve(statuses.size());
+            size_t next = 0;
+            for (auto& status : statuses) {
+                response.statuses.push_back(status ? std::move(*status) : std::move(batchStatuses[next++]));
+            }
+            return RPCResponse(dto::K23SIStatus::OK("multi-hb processed"), std::move(response));
+        });
+}
+
 seastar::future<Status>
 K23SIPartitionModule::_doPush(dto::Key key, dto::Timestamp incumbentId, dto::K23SI_MTR challengerMTR, FastDeadline deadline, uint32_t count) {
     if (count > _config.maxPushCount()) {
@@ -1290,6 +1993,7 @@ K23SIPartitionModule::_doPush(dto::Key key, dto::Timestamp incumbentId, dto::K23
                             return seastar::make_ready_future<Status>(std::move(status));
                         }
                         iter.abortWI();
+                        _persistence->appendRecord(PersistedRecordType::WIFinalized, key, request.incumbentMTR.timestamp, dto::EndAction::Abort);
                         _finalizedWI++;
                         break;
                     }
@@ -1300,6 +2004,7 @@ K23SIPartitionModule::_doPush(dto::Key key, dto::Timestamp incumbentId, dto::K23
                         }
                         _totalCommittedPayload += wi->data.value.fieldData.getSize();
                         iter.commitWI();
+                        _persistence->appendRecord(PersistedRecordType::WIFinalized, key, request.incumbentMTR.timestamp, dto::EndAction::Commit);
                         _recordVersions++;
                         _finalizedWI++;
                         break;
@@ -1349,6 +2054,82 @@ K23SIPartitionModule::handleTxnFinalize(dto::K23SITxnFinalizeRequest&& request)
     return RPCResponse(dto::K23SIStatus::OK("Finalization success"), dto::K23SITxnFinalizeResponse{});
 }
 
+seastar::future<std::tuple<Status, dto::K23SITxnMultiFinalizeResponse>>
+K23SIPartitionModule::handleTxnMultiFinalize(dto::K23SITxnMultiFinalizeRequest&& request) {
+    K2LOG_D(log::skvsvr, "Partition: {}, txn multi-finalize: {}", _partition, request);
+    if (!_validateRequestPartition(request)) {
+        // tell client their collection partition is gone
+        return RPCResponse(dto::K23SIStatus::RefreshCollection("collection refresh needed in multi-finalize"), dto::K23SITxnMultiFinalizeResponse{});
+    }
+    if (request.txnTimestamps.size() != request.actions.size()) {
+        return RPCResponse(dto::K23SIStatus::BadParameter("txns and actions do not match in multi-finalize"), dto::K23SITxnMultiFinalizeResponse{});
+    }
+
+    dto::K23SITxnMultiFinalizeResponse response;
+    response.statuses.resize(request.txnTimestamps.size(), dto::K23SIStatus::OK("Finalization success"));
+    // the txns whose twims are in Finalizing state, and whose WIs we can finalize
+    std::vector<size_t> finalizing;
+    for (size_t i = 0; i < request.txnTimestamps.size(); ++i) {
+        auto txnts = request.txnTimestamps[i];
+        auto action = request.actions[i];
+        if (action != dto::EndAction::Commit && action != dto::EndAction::Abort) {
+            response.statuses[i] = dto::K23SIStatus::OperationNotAllowed("request was not an abort or commit, likely memory corruption");
+            continue;
+        }
+        if (auto status = _twimMgr.endTxn(txnts, action); !status.is2xxOK()) {
+            K2LOG_W(log::skvsvr, "Unable to end transaction {} with local txn metadata due to {}", txnts, status);
+            response.statuses[i] = std::move(status);
+            continue;
+        }
+        if (auto status=_twimMgr.finalizingWIs(txnts); !status.is2xxOK()) {
+            K2LOG_W(log::skvsvr, "Unable to start finalizing in transaction {} with local txn metadata due to {}", txnts, status);
+            response.statuses[i] = std::move(status);
+            continue;
+        }
+        finalizing.push_back(i);
+    }
+
+    _finalizeTxnsWIs(request, finalizing, response.statuses);
+
+    for (auto i: finalizing) {
+        if (!response.statuses[i].is2xxOK()) {
+            K2LOG_W(log::skvsvr, "Unable to finalize WIs in transaction {} due to {}", request.txnTimestamps[i], response.statuses[i]);
+            continue;
+        }
+        // Finalize and discard the twim
+        if (auto status=_twimMgr.finalizedTxn(request.txnTimestamps[i]); !status.is2xxOK()) {
+            K2LOG_W(log::skvsvr, "Unable to complete finalization in transaction {} with local txn metadata due to {}", request.txnTimestamps[i], status);
+            response.statuses[i] = std::move(status);
+            continue;
+        }
+        _groupFinalizedTxns++;
+    }
+
+    return RPCResponse(dto::K23SIStatus::OK("Multi-finalization processed"), std::move(response));
+}
+
+Status K23SIPartitionModule::_finalizeLocalTxn(dto::Timestamp txnts, dto::EndAction action) {
+    auto* twim = _twimMgr.getTxnWIMeta(txnts);
+    if (twim == nullptr) {
+        return dto::K23SIStatus::KeyNotFound(fmt::format("Twim not found for txn {}", txnts));
+    }
+    if (twim->state != dto::TxnWIMetaState::InProgress) {
+        // e.g. still persisting, or already finalized via push. Leave it untouched for the regular finalization
+        return dto::K23SIStatus::ServiceUnavailable(fmt::format("Twim {} cannot be finalized in place", *twim));
+    }
+
+    if (auto status = _twimMgr.endTxn(txnts, action); !status.is2xxOK()) {
+        return status;
+    }
+    if (auto status = _twimMgr.finalizingWIs(txnts); !status.is2xxOK()) {
+        return status;
+    }
+    if (auto status = _finalizeTxnWIs(txnts, action); !status.is2xxOK()) {
+        return status;
+    }
+    return _twimMgr.finalizedInPlace(txnts);
+}
+
 Status K23SIPartitionModule::_finalizeTxnWIs(dto::Timestamp txnts, dto::EndAction action) {
     auto* twim = _twimMgr.getTxnWIMeta(txnts);
     if (twim == nullptr) {
@@ -1357,38 +2138,76 @@ Status K23SIPartitionModule::_finalizeTxnWIs(dto::Timestamp txnts, dto::EndActio
     K2ASSERT(log::skvsvr, twim->isCommitted() || twim->isAborted(), "Twim {} has not ended yet", *twim);
     for (auto& key: twim->writeKeys) {
         auto iter = _indexer.find(key);
-        auto* wi = iter.getWI();
-        K2ASSERT(log::skvsvr, wi!=nullptr,
-                 "TWIM {} has registered WI for key{}, but key does not have a WI", *twim, key);
-        K2ASSERT(log::skvsvr, wi->data.timestamp == txnts,
-                 "TWIM {} has registered WI for key{}, but WI is from different transaction {}",
-                 *twim, key, wi->data.timestamp);
-        _finalizedWI++;
-
-        switch (action) {
-            case dto::EndAction::Abort: {
-                K2LOG_D(log::skvsvr, "aborting {}, in txn {}", key, *twim);
-                iter.abortWI();
-                break;
-            }
-            case dto::EndAction::Commit: {
-                K2LOG_D(log::skvsvr, "committing {}, in txn {}", key, *twim);
-                _totalCommittedPayload += wi->data.value.fieldData.getSize();
-                iter.commitWI();
-                _recordVersions++;
-                break;
-            }
-            default:
-                K2LOG_W(log::skvsvr,
-                        "failing finalize due to action mismatch key={}, action={}, twim={}",
-                        key, action, *twim);
-                return dto::K23SIStatus::OperationNotAllowed("request was not an abort or commit, likely memory corruption");
+        if (auto status = _finalizeWI(iter, key, *twim, action); !status.is2xxOK()) {
+            return status;
         }
     }
 
     return dto::K23SIStatus::OK;
 }
 
+void K23SIPartitionModule::_finalizeTxnsWIs(const dto::K23SITxnMultiFinalizeRequest& request,
+                                            const std::vector<size_t>& indexes, std::vector<Status>& statuses) {
+    // the WIs of all txns, as (key, position in the request)
+    std::vector<std::pair<const dto::Key*, size_t>> wis;
+    std::vector<TxnWIMeta*> twims(request.txnTimestamps.size(), nullptr);
+    for (auto i: indexes) {
+        auto* twim = _twimMgr.getTxnWIMeta(request.txnTimestamps[i]);
+        if (twim == nullptr) {
+            statuses[i] = dto::K23SIStatus::KeyNotFound(fmt::format("Twim not found for txn {}", request.txnTimestamps[i]));
+            continue;
+        }
+        K2ASSERT(log::skvsvr, twim->isCommitted() || twim->isAborted(), "Twim {} has not ended yet", *twim);
+        twims[i] = twim;
+        for (auto& key: twim->writeKeys) {
+            wis.emplace_back(&key, i);
+        }
+    }
+
+    // visit the indexer in key order rather than txn by txn, so that nearby keys are finalized together
+    std::sort(wis.begin(), wis.end(), [] (const auto& a, const auto& b) { return *a.first < *b.first; });
+    for (auto& [key, i]: wis) {
+        if (!statuses[i].is2xxOK()) {
+            continue;
+        }
+        auto iter = _indexer.find(*key);
+        if (auto status = _finalizeWI(iter, *key, *twims[i], request.actions[i]); !status.is2xxOK()) {
+            statuses[i] = std::move(status);
+        }
+    }
+}
+
+Status K23SIPartitionModule::_finalizeWI(Indexer::Iterator& iter, const dto::Key& key, TxnWIMeta& twim, dto::EndAction action) {
+    auto* wi = iter.getWI();
+    K2ASSERT(log::skvsvr, wi!=nullptr,
+             "TWIM {} has registered WI for key{}, but key does not have a WI", twim, key);
+    K2ASSERT(log::skvsvr, wi->data.timestamp == twim.mtr.timestamp,
+             "TWIM {} has registered WI for key{}, but WI is from different transaction {}",
+             twim, key, wi->data.timestamp);
+    _finalizedWI++;
+
+    switch (action) {
+        case dto::EndAction::Abort: {
+            K2LOG_D(log::skvsvr, "aborting {}, in txn {}", key, twim);
+            iter.abortWI();
+            break;
+        }
+        case dto::EndAction::Commit: {
+            K2LOG_D(log::skvsvr, "committing {}, in txn {}", key, twim);
+            _totalCommittedPayload += wi->data.value.fieldData.getSize();
+            iter.commitWI();
+            _recordVersions++;
+            break;
+        }
+        default:
+            K2LOG_W(log::skvsvr,
+                    "failing finalize due to action mismatch key={}, action={}, twim={}",
+                    key, action, twim);
+            return dto::K23SIStatus::OperationNotAllowed("request was not an abort or commit, likely memory corruption");
+    }
+    return dto::K23SIStatus::OK;
+}
+
 seastar::future<std::tuple<Status, dto::K23SIPushSchemaResponse>>
 K23SIPartitionModule::handlePushSchema(dto::K23SIPushSchemaRequest&& request) {
     K2LOG_D(log::skvsvr, "handlePushSchema for schema: {}", request.schema.name);
@@ -1470,7 +2289,7 @@ K23SIPartitionModule::handleInspectAllKeys(dto::K23SIInspectAllKeysRequest&& req
     keys.reserve(_indexer.size());
     const auto& si = _indexer.getSchemaIndexer();
     for (auto it = si.cbegin(); it != si.cend(); ++it) {
-        for (auto kit = it->second.impl.cbegin(); kit != it->second.impl.cend(); ++kit) {
+        for (auto kit = it->second.cbegin(); kit != it->second.cend(); ++kit) {
             keys.push_back(dto::Key{.schemaName=it->first, .partitionKey=kit->first.partitionKey, .rangeKey=kit->first.rangeKey});
         }
     }
@@ -1480,9 +2299,339 @@ K23SIPartitionModule::handleInspectAllKeys(dto::K23SIInspectAllKeysRequest&& req
 }
 
 seastar::future<> K23SIPartitionModule::_recovery() {
-    //TODO perform recovery
-    K2LOG_D(log::skvsvr, "Partition: {}, recovery", _partition);
-    return seastar::make_ready_future();
+    K2LOG_I(log::skvsvr, "Partition: {}, recovery", _partition);
+    auto startTime = Clock::now();
+    auto snapshot = std::make_unique<Persistence>(_cmeta.name, _partition().keyRangeV.pvid.id, dto::LogStreamType::IndexerSnapshot);
+    // Load the oldest snapshot we have first. Older snapshots are only truncated once a newer one is complete,
+    // so this is the latest complete snapshot unless there has never been one
+    return seastar::do_with(std::move(snapshot), [this] (auto& snapshot) {
+        return _replayStream(*snapshot, LogPosition{});
+    })
+    .then([this] {
+        _snapshotRecoveredRecords = _recoveredRecords;
+        LogPosition walStart;
+        if (_replayWALStart) {
+            walStart = *_replayWALStart;
+            K2LOG_I(log::skvsvr, "Partition: {}, loaded snapshot with {} records. Replaying WAL from {}",
+                _partition, _snapshotRecoveredRecords, walStart);
+        }
+        else if (_replaySnapshotStarted) {
+            // The WAL is only truncated after a complete snapshot so we still have all of it. Replaying the entire
+            // WAL on top of the partial snapshot is safe since the replay skips anything the snapshot already has
+            K2LOG_W(log::skvsvr, "Partition: {}, found an incomplete snapshot with {} records. Replaying the entire WAL",
+                _partition, _snapshotRecoveredRecords);
+        }
+        return _replayStream(*_persistence, walStart);
+    })
+    .then([this] {
+        size_t displaced = 0;
+        for (auto& [key, recs]: _replayDisplacedWIs) {
+            displaced += recs.size();
+        }
+        if (displaced > 0) {
+            K2LOG_W(log::skvsvr, "Partition: {}, dropping {} replaced WIs whose finalization was not persisted", _partition, displaced);
+        }
+        _replayDisplacedWIs.clear();
+        return _txnMgr.finishReplay();
+    })
+    .then([this, startTime] {
+        _recoveryTime = Clock::now() - startTime;
+        K2LOG_I(log::skvsvr, "Partition: {}, recovered {} records({} bytes) in {}. Have {} keys, {} twims",
+            _partition, _recoveredRecords, _recoveredBytes, _recoveryTime, _indexer.size(), _twimMgr.twims().size());
+    });
+}
+
+seastar::future<> K23SIPartitionModule::_replayStream(Persistence& persistence, LogPosition from) {
+    return persistence.replay(from, [this] (Payload&& page) {
+        _recoveredBytes += page.getSize();
+        return seastar::do_with(std::move(page), true, [this] (auto& page, auto& more) {
+            page.seek(0);
+            return seastar::repeat([this, &page, &more] {
+                // apply the page in small batches, letting other tasks run in between
+                for (uint32_t i = 0; more && i < _config.recoveryBatchSize() && page.getDataRemaining() > 0; ++i) {
+                    more = _replayRecord(page);
+                }
+                if (!more || page.getDataRemaining() == 0) {
+                    return seastar::make_ready_future<seastar::stop_iteration>(seastar::stop_iteration::yes);
+                }
+                return seastar::yield().then([] { return seastar::stop_iteration::no; });
+            })
+            .then([&more] {
+                return more ? seastar::stop_iteration::no : seastar::stop_iteration::yes;
+            });
+        });
+    });
+}
+
+bool K23SIPartitionModule::_replayRecord(Payload& page) {
+    PersistedRecordType type;
+    if (!page.read(type)) {
+        throw std::runtime_error("unable to read persisted record type");
+    }
+    _recoveredRecords++;
+    switch (type) {
+        case PersistedRecordType::WriteIntent: {
+            dto::Key key;
+            dto::WriteIntent wi;
+            if (!page.read(key) || !page.read(wi)) {
+                throw std::runtime_error("unable to read persisted WI");
+            }
+            _replayWI(std::move(key), std::move(wi));
+            break;
+        }
+        case PersistedRecordType::WriteIntentBatch: {
+            std::vector<dto::Key> keys;
+            std::vector<dto::WriteIntent> wis;
+            if (!page.read(keys) || !page.read(wis) || keys.size() != wis.size()) {
+                throw std::runtime_error("unable to read persisted WI batch");
+            }
+            for (size_t i = 0; i < keys.size(); ++i) {
+                _replayWI(std::move(keys[i]), std::move(wis[i]));
+            }
+            break;
+        }
+        case PersistedRecordType::WIFinalized: {
+            dto::Key key;
+            dto::Timestamp txnts;
+            dto::EndAction action;
+            if (!page.read(key) || !page.read(txnts) || !page.read(action)) {
+                throw std::runtime_error("unable to read persisted WI finalization");
+            }
+            auto status = action == dto::EndAction::Commit ? _twimMgr.commitWrite(txnts, key) : _twimMgr.abortWrite(txnts, key);
+            if (!status.is2xxOK()) {
+                K2LOG_W(log::skvsvr, "Unable to replay {} of key {} in txn {} due to {}", action, key, txnts, status);
+            }
+            _replayFinalizeWI(key, txnts, action);
+            break;
+        }
+        case PersistedRecordType::TxnRecord: {
+            TxnRecord rec;
+            if (!page.read(rec)) {
+                throw std::runtime_error("unable to read persisted txn record");
+            }
+            _txnMgr.replay(std::move(rec));
+            break;
+        }
+        case PersistedRecordType::TxnWIMeta: {
+            TxnWIMeta twim;
+            if (!page.read(twim)) {
+                throw std::runtime_error("unable to read persisted twim");
+            }
+            if (twim.state == dto::TxnWIMetaState::FinalizedPIP) {
+                // the txn has been finalized here. Apply the end action to all of its WIs
+                if (auto* local = _twimMgr.getTxnWIMeta(twim.mtr.timestamp); local != nullptr) {
+                    for (auto& key: local->writeKeys) {
+                        _replayFinalizeWI(key, twim.mtr.timestamp, twim.finalizeAction);
+                    }
+                }
+            }
+            _twimMgr.replay(std::move(twim));
+            break;
+        }
+        case PersistedRecordType::SnapshotBegin: {
+            if (_replaySnapshotStarted) {
+                // The snapshot we've been loading was never completed. Use what we have and replay the entire WAL
+                return false;
+            }
+            _replaySnapshotStarted = true;
+            break;
+        }
+        case PersistedRecordType::SnapshotVersion: {
+            dto::Key key;
+            dto::DataRecord rec;
+            if (!page.read(key) || !page.read(rec)) {
+                throw std::runtime_error("unable to read snapshot version");
+            }
+            _indexer.createSchema(key.schemaName);
+            auto iter = _indexer.find(key);
+            rec.value = _indexer.copyValue(rec.value);
+            _totalCommittedPayload += rec.value.fieldData.getSize();
+            iter.addCommitted(key, std::move(rec));
+            _recordVersions++;
+            break;
+        }
+        case PersistedRecordType::SnapshotEnd: {
+            LogPosition walStart;
+            if (!page.read(walStart)) {
+                throw std::runtime_error("unable to read snapshot end");
+            }
+            _replayWALStart = walStart;
+            return false;
+        }
+        default:
+            throw std::runtime_error(fmt::format("unknown persisted record type {}", type));
+    }
+    return true;
+}
+
+void K23SIPartitionModule::_replayWI(dto::Key&& key, dto::WriteIntent&& wi) {
+    K2LOG_D(log::skvsvr, "replaying WI for key {}: {}", key, wi);
+    // the schema may not have been pushed to us yet
+    _indexer.createSchema(key.schemaName);
+    auto iter = _indexer.find(key);
+    auto txnts = wi.data.timestamp;
+    auto* existing = iter.getWI();
+    if (existing != nullptr && existing->data.timestamp == txnts) {
+        // We already have a WI from this txn, either from the snapshot or from an earlier record in the log.
+        // The txn may have written the key again since. Request ids grow with each write from the client, so
+        // the write with the higher id is the latest one
+        if (wi.request_id > existing->request_id) {
+            K2LOG_D(log::skvsvr, "replacing WI in txn {} for key {} with request {}", txnts, key, wi.request_id);
+            wi.data.value = _indexer.copyValue(wi.data.value);
+            iter.addWI(key, std::move(wi.data), wi.request_id);
+        }
+        _twimMgr.replayWrite(txnts, std::move(key));
+        return;
+    }
+    if (iter.getLastCommittedTime().compareCertain(txnts) != dto::Timestamp::LT ||
+        (existing != nullptr && existing->data.timestamp.compareCertain(txnts) == dto::Timestamp::GT)) {
+        // the snapshot has a newer state for the key. The WI was finalized before the snapshot got to it
+        return;
+    }
+    if (existing != nullptr) {
+        // The older WI was finalized before this write came in, but its finalization is further down the log
+        K2LOG_D(log::skvsvr, "replacing WI in txn {} for key {}", existing->data.timestamp, key);
+        _replayDisplacedWIs[key].push_back(std::move(existing->data));
+    }
+    // copy the data so that we don't hold on to the entire page
+    wi.data.value = _indexer.copyValue(wi.data.value);
+    iter.addWI(key, std::move(wi.data), wi.request_id);
+    _twimMgr.replayWrite(txnts, std::move(key));
+    _totalWI++;
+}
+
+void K23SIPartitionModule::_replayFinalizeWI(const dto::Key& key, dto::Timestamp txnts, dto::EndAction action) {
+    auto iter = _indexer.find(key);
+    auto* wi = iter.getWI();
+    if (wi == nullptr || wi->data.timestamp != txnts) {
+        // the WI may have been replaced by a newer one before its finalization got persisted
+        if (auto it = _replayDisplacedWIs.find(key); it != _replayDisplacedWIs.end()) {
+            auto& recs = it->second;
+            auto rit = std::find_if(recs.begin(), recs.end(), [txnts] (auto& rec) { return rec.timestamp == txnts; });
+            if (rit != recs.end()) {
+                _finalizedWI++;
+                if (action == dto::EndAction::Commit) {
+                    _totalCommittedPayload += rit->value.fieldData.getSize();
+                    iter.addCommitted(key, std::move(*rit));
+                    _recordVersions++;
+                }
+                recs.erase(rit);
+                if (recs.empty()) {
+                    _replayDisplacedWIs.erase(it);
+                }
+                return;
+            }
+        }
+        // this is expected when the WI was already finalized in the snapshot we loaded
+        K2LOG_D(log::skvsvr, "Recovered finalization for key {} in txn {} but the key has no matching WI", key, txnts);
+        return;
+    }
+    _finalizedWI++;
+    if (action == dto::EndAction::Commit) {
+        _totalCommittedPayload += wi->data.value.fieldData.getSize();
+        iter.commitWI();
+        _recordVersions++;
+    }
+    else {
+        iter.abortWI();
+    }
+}
+
+seastar::future<> K23SIPartitionModule::_takeSnapshot() {
+    K2LOG_I(log::skvsvr, "Partition: {}, starting indexer snapshot", _partition);
+    auto startTime = Clock::now();
+    auto snapshot = std::make_unique<Persistence>(_cmeta.name, _partition().keyRangeV.pvid.id, dto::LogStreamType::IndexerSnapshot);
+    // each snapshot starts in a new segment so that we can drop the older snapshots once this one is complete
+    snapshot->rollover();
+    snapshot->appendRecord(PersistedRecordType::SnapshotBegin);
+    // The txn state is captured right here, together with flushing the WAL. Everything appended to the WAL before
+    // this point goes out with this flush and is reflected in the snapshot. Everything after it is replayed on
+    // top of the snapshot during recovery.
+    _txnMgr.snapshot(*snapshot);
+    _twimMgr.snapshot(*snapshot);
+    auto walFlush = _persistence->flushWithPosition();
+
+    return seastar::do_with(std::move(snapshot), _indexer.startScan(), LogPosition{}, uint64_t(0), uint64_t(0),
+        [this, startTime, walFlush=std::move(walFlush)]
+        (auto& snapshot, auto& cursor, auto& walStart, auto& snapshotStart, auto& keys) mutable {
+        return std::move(walFlush)
+        .then([this, &snapshot, &walStart] (auto&& result) {
+            auto& [status, position] = result;
+            if (!status.is2xxOK()) {
+                throw std::runtime_error(fmt::format("unable to flush WAL: {}", status));
+            }
+            // take the position reached by our flush. The WAL may have moved on by the time the snapshot start is
+            // persisted, and the records appended meanwhile have to be replayed on top of the snapshot
+            walStart = position;
+            return snapshot->flush();
+        })
+        .then([this, &snapshot, &cursor, &walStart, &snapshotStart, &keys] (Status&& status) {
+            if (!status.is2xxOK()) {
+                throw std::runtime_error(fmt::format("unable to start snapshot: {}", status));
+            }
+            snapshotStart = snapshot->getEndPosition().segment;
+            // The keys are written in chunks while we keep serving requests. Any changes made while we're not looking
+            // are in the WAL after walStart, and replaying them on top of the snapshot is idempotent
+            return seastar::repeat([this, &snapshot, &cursor, &walStart, &keys] {
+                if (_stopping) {
+                    throw std::runtime_error("partition is stopping");
+                }
+                bool done = _indexer.scanSlice(cursor, _config.snapshotChunkKeys(),
+                    [&snapshot, &keys] (const String& schemaName, const IndexerKey& ikey, const VersionSet& vset) {
+                        dto::Key key{.schemaName=schemaName};
+                        ikey.decode(key.partitionKey, key.rangeKey);
+                        for (auto& rec: vset.committed) {
+                            snapshot->appendRecord(PersistedRecordType::SnapshotVersion, key, rec);
+                        }
+                        if (vset.WI.has_value()) {
+                            snapshot->appendRecord(PersistedRecordType::WriteIntent, key, *vset.WI);
+                        }
+                        ++keys;
+                    });
+                if (done) {
+                    snapshot->appendRecord(PersistedRecordType::SnapshotEnd, walStart);
+                }
+                return snapshot->flush()
+                .then([done] (Status&& status) {
+                    if (!status.is2xxOK()) {
+                        throw std::runtime_error(fmt::format("unable to write snapshot chunk: {}", status));
+                    }
+                    return done ? seastar::stop_iteration::yes : seastar::stop_iteration::no;
+                });
+            });
+        })
+        .then([&snapshot, &snapshotStart] {
+            // the snapshot is complete. We no longer need the older snapshots
+            return snapshot->truncate(snapshotStart);
+        })
+        .then([this, &walStart] (Status&& status) {
+            if (!status.is2xxOK()) {
+                throw std::runtime_error(fmt::format("unable to truncate older snapshots: {}", status));
+            }
+            // nor the WAL before the snapshot
+            return _persistence->truncate(walStart.segment);
+        })
+        .then([this, startTime, &walStart, &keys] (Status&& status) {
+            if (!status.is2xxOK()) {
+                K2LOG_W(log::skvsvr, "Unable to truncate WAL before {} due to {}", walStart, status);
+            }
+            _snapshots++;
+            _snapshotKeys += keys;
+            _lastSnapshotTime = Clock::now() - startTime;
+            K2LOG_I(log::skvsvr, "Partition: {}, wrote snapshot of {} keys in {}, WAL replay starts at {}",
+                _partition, keys, _lastSnapshotTime, walStart);
+        })
+        .handle_exception([this] (auto exc) {
+            _snapshotFailures++;
+            K2LOG_W_EXC(log::skvsvr, exc, "Unable to complete indexer snapshot for partition {}", _partition);
+        })
+        .finally([&snapshot] {
+            return snapshot->stop()
+            .handle_exception([] (auto exc) {
+                K2LOG_W_EXC(log::skvsvr, exc, "Unable to stop the snapshot writer");
+            });
+        });
+    });
 }
 
 dto::OwnerPartition& K23SIPartitionModule::getOwnerPartition() {
@@ -23,7 +23,12 @@ Copyright(c) 2020 Futurewei Cloud
 
 #pragma once
 
+#include <deque>
+
+#include <seastar/core/shared_future.hh>
+
 #include <k2/appbase/AppEssentials.h>
+#include <k2/common/ExpiryList.h>
 #include <k2/logging/Chrono.h>
 #include <k2/cpo/client/Client.h>
 #include <k2/dto/Collection.h>
@@ -51,6 +56,9 @@ public: // lifecycle
     // recover data upon startup
     seastar::future<> _recovery();
 
+    // write a snapshot of the indexer to persistence. The snapshot is written in chunks, yielding in between
+    seastar::future<> _takeSnapshot();
+
 public:
     // verb handlers
     // Read is called when we either get a new read, or after we perform a push operation
@@ -59,9 +67,24 @@ public:
     seastar::future<std::tuple<Status, dto::K23SIReadResponse>>
     handleRead(dto::K23SIReadRequest&& request, FastDeadline deadline, uint32_t count);
 
+    // Multi-key read resolves all keys in one pass over the indexer. The keys which hit a conflicting WI are
+    // pushed together, and read again in another pass if all pushes allowed us to retry
+    seastar::future<std::tuple<Status, dto::K23SIMultiReadResponse>>
+    handleMultiRead(dto::K23SIMultiReadRequest&& request, FastDeadline deadline);
+
     seastar::future<std::tuple<Status, dto::K23SIWriteResponse>>
     handleWrite(dto::K23SIWriteRequest&& request, FastDeadline deadline);
 
+    // Multi-write places the WIs for all writes in one pass over the indexer and persists them as a single record.
+    // The writes which hit a WI from another transaction are pushed together, and retried in another pass if all
+    // pushes allowed us to proceed
+    seastar::future<std::tuple<Status, dto::K23SIMultiWriteResponse>>
+    handleMultiWrite(dto::K23SIMultiWriteRequest&& request, FastDeadline deadline);
+
+    // Async writes are one-way. The write is handled as a regular write, and its outcome is sent to the TRH of the
+    // transaction once the write is persisted
+    seastar::future<> handleAsyncWrite(dto::K23SIWriteRequest&& request);
+
     seastar::future<std::tuple<Status, dto::K23SIQueryResponse>>
     handleQuery(dto::K23SIQueryRequest&& request, dto::K23SIQueryResponse&& response, FastDeadline deadline, uint32_t count);
 
@@ -71,12 +94,21 @@ public:
     seastar::future<std::tuple<Status, dto::K23SITxnEndResponse>>
     handleTxnEnd(dto::K23SITxnEndRequest&& request);
 
+    seastar::future<std::tuple<Status, dto::K23SITxnWriteOutcomeResponse>>
+    handleTxnWriteOutcome(dto::K23SITxnWriteOutcomeRequest&& request);
+
     seastar::future<std::tuple<Status, dto::K23SITxnHeartbeatResponse>>
     handleTxnHeartbeat(dto::K23SITxnHeartbeatRequest&& request);
 
+    seastar::future<std::tuple<Status, dto::K23SITxnMultiHeartbeatResponse>>
+    handleTxnMultiHeartbeat(dto::K23SITxnMultiHeartbeatRequest&& request);
+
     seastar::future<std::tuple<Status, dto::K23SITxnFinalizeResponse>>
     handleTxnFinalize(dto::K23SITxnFinalizeRequest&& request);
 
+    seastar::future<std::tuple<Status, dto::K23SITxnMultiFinalizeResponse>>
+    handleTxnMultiFinalize(dto::K23SITxnMultiFinalizeRequest&& request);
+
     seastar::future<std::tuple<Status, dto::K23SIPushSchemaResponse>>
     handlePushSchema(dto::K23SIPushSchemaRequest&& request);
 
@@ -136,11 +168,36 @@ private: // methods
     template <class RequestT>
     Status _validateReadRequest(const RequestT& request) const;
 
-    // helper method used to create and persist a WriteIntent
-    Status _createWI(dto::K23SIWriteRequest&& request, Indexer::Iterator& iter);
+    // validate one of the keys in a multi-key read
+    Status _validateMultiReadKey(const dto::Key& key) const;
+
+    // read the keys at the given indexes in the request and fill in their results in the response
+    seastar::future<std::tuple<Status, dto::K23SIMultiReadResponse>>
+    _doMultiRead(dto::K23SIMultiReadRequest&& request, dto::K23SIMultiReadResponse&& response,
+                 std::vector<size_t>&& pending, FastDeadline deadline, uint32_t count);
+
+    // The WIs created in one pass of a multi-write, which are persisted together
+    struct WIBatch {
+        std::vector<dto::Key> keys;
+        std::vector<dto::WriteIntent> wis;
+    };
+
+    // helper method used to create and persist a WriteIntent. If a batch is given, the WI is added to it
+    // instead of being persisted on its own
+    Status _createWI(dto::K23SIWriteRequest&& request, Indexer::Iterator& iter, WIBatch* batch=nullptr);
+
+    // helper used to check the preconditions of a write which did not find a WI from another transaction,
+    // and to place its WI if they pass
+    Status _placeWrite(dto::K23SIWriteRequest&& request, Indexer::Iterator& iter, WIBatch* batch=nullptr);
+
+    // The fields to include in a query projection, resolved for each schema version of the records seen by the query
+    struct ProjectionPlan {
+        std::unordered_map<uint32_t, std::vector<bool>> versions;
+    };
 
     // helper method used to make a projection SKVRecord payload
-    bool _makeProjection(dto::SKVRecord::Storage& fullRec, dto::K23SIQueryRequest& request, dto::SKVRecord::Storage& projectionRec);
+    bool _makeProjection(dto::SKVRecord::Storage& fullRec, dto::K23SIQueryRequest& request, ProjectionPlan& plan,
+                         dto::SKVRecord::Storage& projectionRec);
 
     // method to parse the partial record to full record, return turn if parse successful
     bool _parsePartialRecord(dto::K23SIWriteRequest& request, dto::DataRecord& previous);
@@ -152,26 +209,70 @@ private: // methods
     bool _makeFieldsForDiffVersion(dto::Schema& schema, dto::Schema& baseSchema, dto::K23SIWriteRequest& request, dto::DataRecord& version);
 
     // find field number matches to 'fieldName' and 'fieldtype' in schema, return -1 if do not find
-    std::size_t _findField(const dto::Schema schema, k2::String fieldName ,dto::FieldType fieldtype);
+    std::size_t _findField(const dto::Schema& schema, const k2::String& fieldName, dto::FieldType fieldtype);
 
     // judge whether fieldIdx is in fieldsForPartialUpdate. return true if yes(is in fieldsForPartialUpdate).
-    bool _isUpdatedField(uint32_t fieldIdx, std::vector<uint32_t> fieldsForPartialUpdate);
+    bool _isUpdatedField(uint32_t fieldIdx, const std::vector<uint32_t>& fieldsForPartialUpdate);
 
     // Helper for iterating over the indexer. Advances to the next iterator position and registers an observation
-    void _scanAdvance(Indexer::Iterator& iter, const dto::K23SIQueryRequest& request);
+    void _scanAdvance(Indexer::Iterator& iter);
 
     // Helper for handleQuery. Returns a directional Iterator to start the scan at, accounting for
     // desired schema and reverse direction scan
     Indexer::Iterator _initializeScan(const dto::K23SIQueryRequest& request);
 
     // Helper for handleQuery. Checks to see if the indexer scan should stop.
-    bool _isScanDone(const Indexer::Iterator& iter, const dto::K23SIQueryRequest& request, size_t response_size, uint64_t num_scans);
+    bool _isScanDone(const Indexer::Iterator& iter, const dto::K23SIQueryRequest& request, size_t response_size,
+                     size_t response_bytes, uint64_t num_scans);
 
     // Helper for handleQuery. Returns continuation token (aka response.nextToScan)
     dto::Key _getContinuationToken(const Indexer::Iterator& iter, const dto::K23SIQueryRequest& request,
                                             dto::K23SIQueryResponse& response, size_t response_size);
 
-    std::tuple<Status, bool> _doQueryFilter(dto::K23SIQueryRequest& request, dto::SKVRecord::Storage& storage);
+    // A query filter compiled against each schema version of the records it has been applied to
+    struct CompiledFilter {
+        std::unordered_map<uint32_t, dto::expression::CompiledExpression> versions;
+    };
+
+    // Helper for handleQuery. Returns the compiled filter for the request, or nullptr if the request has no filter.
+    // Compiled filters are cached by schema and filter so that all pages of a query share them
+    std::shared_ptr<CompiledFilter> _getCompiledFilter(const dto::K23SIQueryRequest& request);
+
+    // A query scan paused at the end of a page, kept so that the next page can resume it directly
+    struct QueryCursor {
+        uint64_t id{0};
+        // the query which paused here. The next page must be for the same query, continuing from the same key
+        dto::Key nextKey;
+        dto::K23SI_MTR mtr;
+        bool reverse{false};
+        // the paused iterator, positioned (and observed) at nextKey
+        std::optional<Indexer::Iterator> iter;
+        // the key indexer version when we paused. The iterator can't be used if the indexer changed since
+        uint64_t indexerVersion{0};
+        std::shared_ptr<CompiledFilter> filter;
+        std::shared_ptr<ProjectionPlan> projection;
+        TimePoint expiryTime;
+        TimePoint expiry() { return expiryTime; }
+        nsbi::list_member_hook<> tsLink;
+    };
+
+    // Helper for handleQuery. If the request continues from a cursor we kept, removes the cursor and returns its
+    // iterator, and its filter and projection plan via the given references. Returns nullopt if there is no such
+    // cursor or if the cursor can no longer be used
+    std::optional<Indexer::Iterator> _resumeQueryCursor(const dto::K23SIQueryRequest& request,
+                                                        std::shared_ptr<CompiledFilter>& filter,
+                                                        std::shared_ptr<ProjectionPlan>& projection);
+
+    // Helper for handleQuery. Keeps the cursor for a page which paused in the middle of the partition and
+    // returns its id, or 0 if the cursor isn't kept
+    uint64_t _pauseQueryCursor(const dto::K23SIQueryRequest& request, const dto::K23SIQueryResponse& response,
+                               Indexer::Iterator& iter, std::shared_ptr<CompiledFilter> filter,
+                               std::shared_ptr<ProjectionPlan> projection);
+
+    std::tuple<Status, bool> _doQueryFilter(dto::K23SIQueryRequest& request, CompiledFilter& filter, dto::SKVRecord::Storage& storage);
+
+    // Helper for handleQuery. Adds the record to the query's aggregation
+    Status _doQueryAggregate(dto::K23SIQueryRequest& request, dto::Aggregator& aggregator, dto::SKVRecord::Storage& storage);
 
     seastar::future<> _registerVerbs();
 
@@ -182,15 +283,60 @@ private: // methods
     // helper used to process the designate TRH part of a write request
     seastar::future<Status> _designateTRH(dto::K23SI_MTR mtr, dto::Key trhKey);
 
+    // Runs the given request handler once the async writes of the txn which arrived before the request have been
+    // applied here, so that reads, queries and writes in the txn observe its earlier async writes
+    template <typename Func>
+    auto _afterAsyncWrites(const dto::Timestamp& txnts, Func&& func) {
+        auto it = _pendingAsyncWrites.find(txnts);
+        if (it == _pendingAsyncWrites.end()) {
+            return func();
+        }
+        return it->second.applied.get_shared_future().then(std::forward<Func>(func));
+    }
+
+    // Called when an async write of the given txn has been applied and persisted
+    void _asyncWriteApplied(const dto::Timestamp& txnts);
+
     // helper used to process the write part of a write request
     seastar::future<std::tuple<Status, dto::K23SIWriteResponse>>
     _processWrite(dto::K23SIWriteRequest&& request, FastDeadline deadline, uint32_t count);
 
+    // process the writes at the given indexes in a multi-write and fill in their statuses in the response
+    seastar::future<std::tuple<Status, dto::K23SIMultiWriteResponse>>
+    _doMultiWrite(std::vector<dto::K23SIWriteRequest>&& writes, dto::K23SIMultiWriteResponse&& response,
+                  std::vector<size_t>&& pending, FastDeadline deadline, uint32_t count);
+
     void _unregisterVerbs();
 
     // helper used to finalize all local WIs for a give transaction
     Status _finalizeTxnWIs(dto::Timestamp txnts, dto::EndAction action);
 
+    // helper used to finalize the WIs of the transactions at the given indexes in a multi-finalize. The WIs of all
+    // transactions are finalized in key order. Fills in the status of each transaction which fails
+    void _finalizeTxnsWIs(const dto::K23SITxnMultiFinalizeRequest& request, const std::vector<size_t>& indexes,
+                          std::vector<Status>& statuses);
+
+    // finalize the WI of the given transaction at the current position of the given iterator
+    Status _finalizeWI(Indexer::Iterator& iter, const dto::Key& key, TxnWIMeta& twim, dto::EndAction action);
+
+    // true if the ending txn wrote only to this partition, so that it can be committed in one phase
+    bool _isOnePhaseTxn(const dto::K23SITxnEndRequest& request) const;
+
+    // finalize in place the WIs of a txn whose TRH is in this partition. Used by the TxnManager for one-phase commit
+    Status _finalizeLocalTxn(dto::Timestamp txnts, dto::EndAction action);
+
+    // replay the given persisted stream from the given position on
+    seastar::future<> _replayStream(Persistence& persistence, LogPosition from);
+
+    // apply a single record from a persisted stream during recovery. Returns false if we should stop reading the stream
+    bool _replayRecord(Payload& page);
+
+    // place a persisted WI during recovery, unless the state we've recovered so far is newer
+    void _replayWI(dto::Key&& key, dto::WriteIntent&& wi);
+
+    // commit or abort the WI for the given key, if it is still present and belongs to the given txn
+    void _replayFinalizeWI(const dto::Key& key, dto::Timestamp txnts, dto::EndAction action);
+
     void _registerMetrics();
 
 private:  // members
@@ -215,6 +361,22 @@ private:  // members
     // schema name -> (schema version -> schema)
     std::unordered_map<String, std::unordered_map<uint32_t, std::shared_ptr<dto::Schema>>> _schemas;
 
+    // (schema name + serialized filter expression) -> compiled filter. Evicted in insertion order
+    std::unordered_map<String, std::shared_ptr<CompiledFilter>> _compiledFilters;
+    std::deque<String> _compiledFiltersOrder;
+
+    // async writes which are still being applied, per txn
+    struct PendingAsyncWrites {
+        uint64_t count{0};
+        seastar::shared_promise<> applied;
+    };
+    std::unordered_map<dto::Timestamp, PendingAsyncWrites> _pendingAsyncWrites;
+
+    // cursor id -> paused query cursor
+    std::unordered_map<uint64_t, QueryCursor> _queryCursors;
+    ExpiryList<QueryCursor, &QueryCursor::tsLink> _queryCursorExpiry;
+    uint64_t _nextQueryCursorId{1};
+
     // config
     K23SIConfig _config;
 
@@ -226,6 +388,19 @@ private:  // members
 
     std::shared_ptr<Persistence> _persistence;
 
+    // timer used to take periodic indexer snapshots
+    PeriodicTimer _snapshotTimer;
+    // set when we're stopping so that a snapshot in progress can bail out
+    bool _stopping{false};
+
+    // set once we've seen the start of an indexer snapshot during recovery
+    bool _replaySnapshotStarted{false};
+    // the WAL position from which to replay, once we've loaded a complete indexer snapshot during recovery
+    std::optional<LogPosition> _replayWALStart;
+    // During recovery, WIs which were replaced by a newer WI before the log shows how they were finalized. This
+    // happens when a WI is finalized in memory and a new write comes in before the finalization is persisted
+    std::unordered_map<dto::Key, std::vector<dto::DataRecord>> _replayDisplacedWIs;
+
     cpo::CPOClient _cpo;
     String _cpoEndpoint; // Obtained from the CPO assignment request
 
@@ -236,9 +411,35 @@ private:  // members
     uint64_t _recordVersions{0};
     uint64_t _totalCommittedPayload{0}; //total committed user payload size
     uint64_t _finalizedWI{0}; // total number of finalized WI
+    uint64_t _groupFinalizedTxns{0}; // number of txns finalized through a multi-finalize
+
+    // recovery metrics
+    uint64_t _recoveredRecords{0}; // number of persisted records replayed
+    uint64_t _recoveredBytes{0}; // size of the persisted data replayed
+    Duration _recoveryTime{0}; // time spent replaying the log
+    Duration _timeToServe{0}; // time from start until we registered our verbs
+
+    // snapshot metrics
+    uint64_t _snapshots{0}; // number of completed snapshots
+    uint64_t _snapshotFailures{0}; // number of snapshots which could not be completed
+    uint64_t _snapshotKeys{0}; // number of keys written in snapshots
+    Duration _lastSnapshotTime{0}; // time it took to write the last complete snapshot
+    uint64_t _snapshotRecoveredRecords{0}; // number of records loaded from a snapshot during recovery
+
+    // query filter metrics
+    uint64_t _filterCompilations{0}; // number of filter programs compiled
+    uint64_t _filterCacheHits{0}; // number of query pages which reused a cached compiled filter
+
+    // query cursor metrics
+    uint64_t _queryCursorHits{0}; // number of query pages which resumed a paused cursor
+    uint64_t _queryCursorMisses{0}; // number of query pages which came with a cursor that could not be resumed
 
     k2::ExponentialHistogram _readLatency;
+    k2::ExponentialHistogram _multiReadLatency;
+    k2::ExponentialHistogram _multiReadKeys;
     k2::ExponentialHistogram _writeLatency;
+    k2::ExponentialHistogram _multiWriteLatency;
+    k2::ExponentialHistogram _multiWriteKeys;
     k2::ExponentialHistogram _queryPageLatency;
     k2::ExponentialHistogram _pushLatency;
     k2::ExponentialHistogram _queryPageScans;
@@ -23,12 +23,19 @@ Copyright(c) 2020 Futurewei Cloud
 
 #include "Persistence.h"
 #include <k2/appbase/Appbase.h>
+
+#include <random>
+
 namespace k2 {
 
-Persistence::Persistence() {
-    int id = seastar::this_shard_id();
-    String endpoint = _config.persistenceEndpoint()[id % _config.persistenceEndpoint().size()];
+Persistence::Persistence(String collectionName, uint64_t partitionId, dto::LogStreamType stream) :
+    _collectionName(std::move(collectionName)), _partitionId(partitionId), _stream(stream) {
+    // pick the endpoint based on the partition so that we find the same log after a restart
+    String endpoint = _config.persistenceEndpoint()[_partitionId % _config.persistenceEndpoint().size()];
     _remoteEndpoint = RPC().getTXEndpoint(endpoint);
+    std::random_device rd;
+    std::mt19937_64 ranAlg(rd());
+    _writerId = std::uniform_int_distribution<uint64_t>(1)(ranAlg);
     _flushTimer.setCallback(
         [this] {
             if (Clock::now() - _lastFlush > _config.persistenceAutoflushDeadline()) {
@@ -42,7 +49,11 @@ Persistence::Persistence() {
             }
             return seastar::make_ready_future();
         });
-    K2LOG_I(log::skvsvr, "ctor with endpoint: {}", _remoteEndpoint->url);
+    _groupTimer.set_callback([this] {
+        K2LOG_D(log::skvsvr, "group commit window passed with bs={}, inflight={}", (_buffer? _buffer->getSize() : 0), _inflight);
+        _sendWaiting();
+    });
+    K2LOG_I(log::skvsvr, "ctor for stream {} with endpoint: {}, writer={}", _stream, _remoteEndpoint->url, _writerId);
 }
 
 void Persistence::_registerMetrics() {
@@ -52,7 +63,11 @@ void Persistence::_registerMetrics() {
 
     _metric_groups.add_group("Nodepool", {
         sm::make_histogram("flush_latency", [this]{ return _flushLatency.getHistogram();},
-                sm::description("Latency of Persistence Flush"), labels)
+                sm::description("Latency of Persistence Flush"), labels),
+        sm::make_counter("flush_sends", _sends, sm::description("Number of batches sent to persistence"), labels),
+        sm::make_gauge("inflight_flushes", [this]{ return _inflight;}, sm::description("Number of batches in flight to persistence"), labels),
+        sm::make_gauge("flush_batch_target", [this]{ return _batchTarget;},
+                sm::description("Size in bytes a batch waits for while other batches are in flight"), labels)
     });
 }
 
@@ -66,6 +81,7 @@ seastar::future<> Persistence::stop() {
     _stopped = true;
     K2LOG_D(log::skvsvr, "Stopping");
 
+    _groupTimer.cancel();
     return _flushTimer.stop()
         .then([this] {
             return flush().discard_result();
@@ -77,36 +93,103 @@ seastar::future<> Persistence::stop() {
 }
 
 seastar::future<Status> Persistence::flush() {
-    k2::OperationLatencyReporter reporter(_flushLatency); // for reporting metrics
+    return flushWithPosition().then([] (auto&& result) {
+        auto& [status, _] = result;
+        return std::move(status);
+    });
+}
+
+seastar::future<std::tuple<Status, LogPosition>> Persistence::flushWithPosition() {
+    auto startTime = Clock::now();
     ++_flushId;
-    K2LOG_D(log::skvsvr, "flush with bs={}, proms={}, fid={}", (_buffer? _buffer->getSize() : 0), _pendingProms.size(), _flushId);
+    K2LOG_D(log::skvsvr, "flush with bs={}, proms={}, inflight={}, fid={}", (_buffer? _buffer->getSize() : 0), _pendingProms.size(), _inflight, _flushId);
+    seastar::future<std::tuple<Status, LogPosition>> fut = 
+        seastar::make_ready_future<std::tuple<Status, LogPosition>>(std::make_tuple(dto::K23SIStatus::OK, _endPosition));
     if (!_buffer) {
         K2ASSERT(log::skvsvr, _pendingProms.size() == 0, "There is no data to send but we have pending promises");
-        return _chainFlushResponse();
+        fut = _chainFlushResponse();
+    }
+    else if (_stopped || _inflight == 0 ||
+             (_inflight < _config.persistenceMaxInflightFlushes() && _buffer->getSize() >= _batchTarget)) {
+        // nothing to wait for, or we have enough data to send another batch in parallel
+        _send();
+        fut = _chainFlushResponse();
+    }
+    else {
+        // group commit: wait for a send to complete or the target latency to pass, and collect more data meanwhile
+        _flushWaiting = true;
+        _pendingProms.emplace_back();
+        fut = _pendingProms.back().get_future();
+        auto target = _config.persistenceTargetFlushLatency();
+        if (nsec(target).count() > 0 && !_groupTimer.armed()) {
+            _groupTimer.arm(target);
+        }
+    }
+    return fut.then([this, startTime] (auto&& result) {
+        auto latency = Clock::now() - startTime;
+        _flushLatency.add(latency);
+        _adjustBatchTarget(latency);
+        return std::move(result);
+    });
+}
+
+void Persistence::_send() {
+    if (!_buffer) {
+        return;
     }
+    _groupTimer.cancel();
+    _flushWaiting = false;
 
     // move the buffered data into a single request and delete the buffer.
     // Any writes after this point will be appended to a new buffer/batch
     dto::K23SI_PersistenceRequest<Payload> request{};
+    request.collectionName = _collectionName;
+    request.partitionId = _partitionId;
+    request.stream = _stream;
+    request.newSegment = std::exchange(_newSegment, false);
+    request.writerId = _writerId;
+    request.sequence = ++_sequence;
     request.value.val = std::move(*_buffer);
     _buffer.reset(nullptr);
-    std::vector<seastar::promise<Status>> proms; // ditto for the pending promises
+    std::vector<seastar::promise<std::tuple<Status, LogPosition>>> proms; // ditto for the pending promises
     proms.swap(_pendingProms);
 
     _lastFlush = Clock::now();
+    ++_inflight;
+    ++_sends;
+    K2LOG_D(log::skvsvr, "sending new flush with {} proms, inflight={}, fid={}, seq={}", proms.size(), _inflight, _flushId, request.sequence);
+    // The sends go out right away and over the same connection, so persistence appends them in order. If one of
+    // them fails, persistence rejects all later ones based on their sequence numbers, so the log has no gaps. The
+    // results are processed in order as well, so that a batch is only reported as persisted after all earlier ones
+    auto sent = RPC().callRPC<dto::K23SI_PersistenceRequest<Payload>, dto::K23SI_PersistenceResponse>
+        (dto::Verbs::K23SI_Persist, request, *_remoteEndpoint, _config.persistenceTimeout())
+        .finally([this] {
+            --_inflight;
+            // there is room for one more send now
+            _sendWaiting();
+        });
+
     _flushFut = _flushFut
-    .then([this, request=std::move(request), fid=_flushId] (auto&& status) mutable {
+    .then_wrapped([sent=std::move(sent), fid=_flushId] (auto&& prevFut) mutable {
+            if (prevFut.failed()) {
+                auto exc = prevFut.get_exception();
+                return sent.then_wrapped([exc] (auto&& fut) {
+                    fut.ignore_ready_future();
+                    return seastar::make_exception_future<std::tuple<Status, dto::K23SI_PersistenceResponse>>(exc);
+                });
+            }
+            auto status = prevFut.get();
             if (!status.is2xxOK()) {
                 // previous flush did not succeed. just pass this along
                 K2LOG_D(log::skvsvr, "previous flush was unsuccessful with status {}, fid={}", status, fid);
-                return RPCResponse(std::move(status), dto::K23SI_PersistenceResponse{});
+                return sent.then_wrapped([status=std::move(status)] (auto&& fut) mutable {
+                    fut.ignore_ready_future();
+                    return RPCResponse(std::move(status), dto::K23SI_PersistenceResponse{});
+                });
             }
-            K2LOG_D(log::skvsvr, "sending new flush, fid={}", fid);
-
-            return RPC().callRPC<dto::K23SI_PersistenceRequest<Payload>, dto::K23SI_PersistenceResponse>
-            (dto::Verbs::K23SI_Persist, request, *_remoteEndpoint, _config.persistenceTimeout());
+            return std::move(sent);
     })
-    .then_wrapped([proms=std::move(proms), fid=_flushId] (auto&& fut) mutable {
+    .then_wrapped([this, proms=std::move(proms), fid=_flushId] (auto&& fut) mutable {
             if (fut.failed()) {
                 auto exc = fut.get_exception();
                 K2LOG_W_EXC(log::skvsvr, exc, "flushed found exception, fid={}", fid);
@@ -114,26 +197,139 @@ seastar::future<Status> Persistence::flush() {
                 return seastar::make_exception_future<Status>(exc);
             }
 
-            auto [status, _] = fut.get();
+            auto [status, response] = fut.get();
+            if (status.is2xxOK()) {
+                _endPosition = LogPosition{.segment=response.segment, .offset=response.offset};
+            }
             // extract the RPC status and send it down the chain
             K2LOG_D(log::skvsvr, "flushed with status: {}. Notifying {} promises, fid={}", status, proms.size(), fid);
-            for (auto& prom: proms) prom.set_value(status);
+            for (auto& prom: proms) prom.set_value(std::make_tuple(status, _endPosition));
             return seastar::make_ready_future<Status>(std::move(status));
         });
-    return _chainFlushResponse()
-            .then([this, reporter=std::move(reporter)](auto&& response) mutable{
-                    reporter.report();
-                    return std::move(response);
-            });
 }
 
-seastar::future<Status> Persistence::_chainFlushResponse() {
-    seastar::promise<Status> prom;
+void Persistence::_sendWaiting() {
+    if (_flushWaiting && _buffer && _inflight < _config.persistenceMaxInflightFlushes()) {
+        _send();
+    }
+}
+
+void Persistence::_adjustBatchTarget(Duration latency) {
+    auto target = _config.persistenceTargetFlushLatency();
+    if (nsec(target).count() == 0) {
+        return;
+    }
+    // smooth out single slow or fast flushes
+    _latencyEstimate = (_latencyEstimate * 7 + latency) / 8;
+    const uint64_t minTarget = 4 * 1024;
+    const uint64_t maxTarget = _config.persistenceFlushBytes();
+    if (_latencyEstimate > target) {
+        if (_inflight >= _config.persistenceMaxInflightFlushes()) {
+            // persistence can't keep up with the sends. Make them bigger
+            _batchTarget = std::min(std::max(_batchTarget * 2, minTarget), maxTarget);
+        }
+        else {
+            // flushes are waiting for batches to fill up. Send them sooner, in parallel
+            _batchTarget = std::max(_batchTarget / 2, minTarget);
+        }
+    }
+    else if (_latencyEstimate < target / 2) {
+        // there is latency to spare. Grow the batches slowly to save on sends under load
+        _batchTarget = std::min(std::max(_batchTarget + _batchTarget / 8, minTarget), maxTarget);
+    }
+}
+
+void Persistence::rollover() {
+    _newSegment = true;
+}
+
+LogPosition Persistence::getEndPosition() const {
+    return _endPosition;
+}
+
+seastar::future<Status> Persistence::truncate(uint64_t segment) {
+    if (!_remoteEndpoint) {
+        return seastar::make_ready_future<Status>(dto::K23SIStatus::OperationNotAllowed("persistence is not available"));
+    }
+    dto::K23SI_PersistenceTruncateRequest request{
+        .collectionName=_collectionName,
+        .partitionId=_partitionId,
+        .stream=_stream,
+        .segment=segment
+    };
+    K2LOG_D(log::skvsvr, "truncating persisted stream: {}", request);
+    return RPC().callRPC<dto::K23SI_PersistenceTruncateRequest, dto::K23SI_PersistenceTruncateResponse>
+        (dto::Verbs::K23SI_PERSISTENCE_TRUNCATE, request, *_remoteEndpoint, _config.persistenceTimeout())
+    .then([] (auto&& result) {
+        auto& [status, _] = result;
+        return std::move(status);
+    });
+}
+
+seastar::future<dto::K23SI_PersistenceRecoveryResponse>
+Persistence::_readPage(const dto::K23SI_PersistenceRecoveryRequest& request) {
+    K2LOG_D(log::skvsvr, "reading persisted page: {}", request);
+    return RPC().callRPC<dto::K23SI_PersistenceRecoveryRequest, dto::K23SI_PersistenceRecoveryResponse>
+        (dto::Verbs::K23SI_PERSISTENCE_RECOVERY, request, *_remoteEndpoint, _config.persistenceTimeout())
+    .then([] (auto&& result) {
+        auto& [status, response] = result;
+        if (!status.is2xxOK()) {
+            return seastar::make_exception_future<dto::K23SI_PersistenceRecoveryResponse>(
+                std::runtime_error(fmt::format("unable to read from persistence: {}", status)));
+        }
+        return seastar::make_ready_future<dto::K23SI_PersistenceRecoveryResponse>(std::move(response));
+    });
+}
+
+seastar::future<> Persistence::replay(LogPosition from, std::function<seastar::future<seastar::stop_iteration>(Payload&&)> consumer) {
+    if (!_remoteEndpoint) {
+        K2LOG_W(log::skvsvr, "No configured remote endpoint. Nothing to replay");
+        return seastar::make_ready_future();
+    }
+    dto::K23SI_PersistenceRecoveryRequest request{
+        .collectionName=_collectionName,
+        .partitionId=_partitionId,
+        .stream=_stream,
+        .segment=from.segment,
+        .offset=from.offset,
+        .maxBytes=_config.recoveryPageSize()
+    };
+    auto firstPage = _readPage(request);
+    return seastar::do_with(std::move(consumer), std::move(request), std::move(firstPage), false,
+        [this] (auto& consumer, auto& request, auto& nextPage, auto& done) {
+        return seastar::do_until(
+            [&done] { return done; },
+            [this, &consumer, &request, &nextPage, &done] {
+                return std::exchange(nextPage, seastar::make_ready_future<dto::K23SI_PersistenceRecoveryResponse>())
+                .then([this, &consumer, &request, &nextPage, &done] (auto&& response) {
+                    done = response.done;
+                    if (!done) {
+                        // start fetching the next page before we process this one
+                        request.segment = response.segment;
+                        request.offset = response.offset;
+                        nextPage = _readPage(request);
+                    }
+                    return consumer(std::move(response.records))
+                    .then([&done] (seastar::stop_iteration stop) {
+                        done = done || stop == seastar::stop_iteration::yes;
+                    });
+                });
+            })
+        .finally([&nextPage] {
+            // don't leave a prefetch failure unhandled if we stopped early
+            return std::move(nextPage).discard_result().handle_exception([] (auto) {});
+        });
+    });
+}
+
+seastar::future<std::tuple<Status, LogPosition>> Persistence::_chainFlushResponse() {
+    seastar::promise<std::tuple<Status, LogPosition>> prom;
     auto fut = prom.get_future();
-    _flushFut = _flushFut.then([prom = std::move(prom), fid=_flushId] (auto&& status) mutable {
+    _flushFut = _flushFut.then([this, prom = std::move(prom), fid=_flushId] (auto&& status) mutable {
         K2LOG_D(log::skvsvr, "notifying promise from fid={}", fid);
-        // set status for the captured promise as well as chained futures
-        prom.set_value(status);
+        // set status for the captured promise as well as chained futures. We run right after the send we're
+        // chained to, so the end position is the one it reached
+        prom.set_value(std::make_tuple(status, _endPosition));
         return seastar::make_ready_future<Status>(std::move(status));
     });
     return fut;
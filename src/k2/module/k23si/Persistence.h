@@ -30,9 +30,36 @@ Copyright(c) 2020 Futurewei Cloud
 #include "Log.h"
 
 namespace k2 {
+class PersistenceTest;
+
+// The types of records a partition writes to persistence. Each record in the log is preceded by its type
+K2_DEF_ENUM(PersistedRecordType,
+    WriteIntent,    // a new WI: the key, followed by the dto::WriteIntent
+    WIFinalized,    // a single WI finalized outside of txn finalization(e.g. after a PUSH): the key, txn id and action
+    TxnRecord,      // a TxnRecord, persisted by the TRH
+    TxnWIMeta,      // a TxnWIMeta, persisted by each participant
+    SnapshotBegin,  // the start of an indexer snapshot. No fields
+    SnapshotVersion, // a committed version in an indexer snapshot: the key and the dto::DataRecord
+    SnapshotEnd,    // the end of a complete indexer snapshot: the LogPosition in the WAL from which to replay after loading it
+    WriteIntentBatch // the WIs placed by one multi-write: the vector of keys, followed by the vector of dto::WriteIntent
+);
+
+// A position in one of our persisted log streams
+struct LogPosition {
+    uint64_t segment = 0;
+    uint64_t offset = 0;
+    K2_PAYLOAD_FIELDS(segment, offset);
+    K2_DEF_FMT(LogPosition, segment, offset);
+};
+
+// Maps a persisted type to its record type. Specialized next to each type which can be persisted
+template <typename T>
+struct PersistedRecordTraits;
+
 class Persistence {
 public:
-    Persistence();
+    // The log we write to is identified by the collection name, partition id and the stream
+    Persistence(String collectionName, uint64_t partitionId, dto::LogStreamType stream=dto::LogStreamType::WAL);
 
     // start the persistence subsystem
     seastar::future<> start();
@@ -40,9 +67,25 @@ public:
     // flush all pending writes and prevent further writes
     seastar::future<> stop();
 
-    // flush all pending writes to persistence.
+    // flush all pending writes to persistence. The data is sent right away if there are no other flushes in
+    // flight. Otherwise it may wait a bit to go out together with more data (group commit)
     seastar::future<Status> flush();
 
+    // Same as flush(), but also returns the end of the persisted stream right after the data flushed by this call.
+    // Appends made after this call don't move the returned position. It is only meaningful with a successful status
+    seastar::future<std::tuple<Status, LogPosition>> flushWithPosition();
+
+    // the data sent with the next flush starts a new segment in the persisted stream, so that
+    // everything before it can be truncated separately
+    void rollover();
+
+    // the end of the persisted stream as of the last successful flush. Everything appended before that flush is
+    // persisted before this position
+    LogPosition getEndPosition() const;
+
+    // drop all persisted segments before the given one
+    seastar::future<Status> truncate(uint64_t segment);
+
     // TODO: Appending data may have to consider current plog allocation (plogID and current offset).
     // TODO: We may also want to return the new plog allocation after successful append for future in-memory indexing
     // Appends are always asynchronous (buffered locally) until an explicit call to flush()
@@ -59,10 +102,13 @@ public:
         }
         K2LOG_D(log::skvsvr, "appending new write");
 
-        append(val);
+        // the promise goes in first, so that it goes out with the data if the append triggers a send
         _pendingProms.emplace_back();
-        return _pendingProms.back().get_future().then([fid=_flushId] (auto&& status) {
+        auto fut = _pendingProms.back().get_future();
+        append(val);
+        return fut.then([fid=_flushId] (auto&& result) {
             K2LOG_D(log::skvsvr, "Notifying promise from fid={}", fid);
+            auto& [status, _] = result;
             return seastar::make_ready_future<Status>(std::move(status));
         });
     }
@@ -70,6 +116,12 @@ public:
     // Append the given value to the persistence buffer. An explicit call to flush() is needed to send the data out
     template<typename ValueType>
     void append(const ValueType& val) {
+        appendRecord(PersistedRecordTraits<ValueType>::type, val);
+    }
+
+    // Append a record of the given type, made up of the given fields
+    template<typename... Fields>
+    void appendRecord(PersistedRecordType type, const Fields&... fields) {
         if (_stopped) {
             K2LOG_W(log::skvsvr, "Attempt to append while stopped");
             return;
@@ -77,20 +129,65 @@ public:
         if (!_buffer) {
             _buffer = _remoteEndpoint->newPayload();
         }
-        _buffer->write(val);
+        _buffer->write(type);
+        (_buffer->write(fields), ...);
+        if (_buffer->getSize() >= _config.persistenceFlushBytes() && _inflight < _config.persistenceMaxInflightFlushes()) {
+            _send();
+        }
     }
 
+    // Read back everything we've persisted from the given position on. The given function is called with each page of
+    // records, in the order in which they were appended, until it asks us to stop or we reach the end of the stream.
+    // We fetch the next page while the current one is being processed.
+    seastar::future<> replay(LogPosition from, std::function<seastar::future<seastar::stop_iteration>(Payload&&)> consumer);
+
     void _registerMetrics();
 
 private:
+    friend class k2::PersistenceTest;
+
+    String _collectionName;
+    uint64_t _partitionId;
+    dto::LogStreamType _stream;
     bool _stopped{false};
+    bool _newSegment{false};
+    LogPosition _endPosition;
     std::unique_ptr<Payload> _buffer;
     std::unique_ptr<TXEndpoint> _remoteEndpoint;
     K23SIConfig _config;
     seastar::future<Status> _flushFut = seastar::make_ready_future<Status>(dto::K23SIStatus::OK);
-    std::vector<seastar::promise<Status>> _pendingProms;
-    seastar::future<Status> _chainFlushResponse();
-    PeriodicTimer _flushTimer; // TODO consider also flushing based on accumulated data size
+    // the pending promises are given the flush status and the end of the stream once their data is persisted
+    std::vector<seastar::promise<std::tuple<Status, LogPosition>>> _pendingProms;
+    seastar::future<std::tuple<Status, LogPosition>> _chainFlushResponse();
+
+    // send the buffered data to persistence. The pending promises are notified once this and all earlier sends
+    // complete
+    void _send();
+
+    // send the buffered data if anyone is waiting for it and there is room in flight
+    void _sendWaiting();
+
+    // tune the size of the flush batches based on the latency of a completed flush
+    void _adjustBatchTarget(Duration latency);
+
+    // Persistence takes our sends in order and rejects any which come after a gap, e.g. after an earlier send failed.
+    // We identify ourselves with a random writer ID, and number the sends from 1
+    uint64_t _writerId{0};
+    uint64_t _sequence{0};
+    // the number of sends in flight
+    uint32_t _inflight{0};
+    // While other sends are in flight, buffered data is sent once it reaches this size. Otherwise it waits for a
+    // send to complete or for the target latency to pass
+    uint64_t _batchTarget{0};
+    // smoothed latency of the recent flushes
+    Duration _latencyEstimate{0};
+    // set when someone is waiting for the buffered data to be flushed
+    bool _flushWaiting{false};
+    // sends the buffered data once a waiting flush has waited for the target latency
+    seastar::timer<> _groupTimer;
+    uint64_t _sends{0};
+    seastar::future<dto::K23SI_PersistenceRecoveryResponse> _readPage(const dto::K23SI_PersistenceRecoveryRequest& request);
+    PeriodicTimer _flushTimer;
     TimePoint _lastFlush{Clock::now()};
     uint64_t _flushId{0};
     sm::metric_groups _metric_groups;
@@ -0,0 +1,224 @@
+/*
+MIT License
+
+Copyright(c) 2022 Futurewei Cloud
+
+    Permission is hereby granted,
+    free of charge, to any person obtaining a copy of this software and associated documentation files(the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
+
+    The above copyright notice and this permission notice shall be included in all copies
+    or
+    substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS",
+    WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER
+    LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+*/
+
+
+#include "ReadCache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "Log.h"
+
+namespace k2 {
+
+// *********************** ReadCacheBound API
+int ReadCacheBound::compare(const ReadCacheBound& o) const noexcept {
+    if (schemaId != o.schemaId) {
+        return schemaId < o.schemaId ? -1 : 1;
+    }
+    return key.compare(o.key);
+}
+
+ReadCacheBound ReadCacheBound::pointStart(uint32_t schemaId, std::string_view key) {
+    return ReadCacheBound{.schemaId = schemaId, .key = String(key.data(), key.size())};
+}
+
+ReadCacheBound ReadCacheBound::pointEnd(uint32_t schemaId, std::string_view key) {
+    // the smallest key which is bigger than the given one
+    String next(String::initialized_later(), key.size() + 1);
+    std::memcpy(next.data(), key.data(), key.size());
+    next[key.size()] = '\0';
+    return ReadCacheBound{.schemaId = schemaId, .key = std::move(next)};
+}
+
+ReadCacheBound ReadCacheBound::schemaStart(uint32_t schemaId) {
+    return ReadCacheBound{.schemaId = schemaId, .key = String()};
+}
+
+ReadCacheBound ReadCacheBound::schemaEnd(uint32_t schemaId) {
+    // all keys of the schema sort before the start of the next schema
+    return ReadCacheBound{.schemaId = schemaId + 1, .key = String()};
+}
+// *********************** end ReadCacheBound API
+
+// *********************** ReadCache API
+ReadCache::ReadCache(dto::Timestamp lowWaterMark, size_t memoryBudget):
+    _lowWaterMark(lowWaterMark), _memoryBudget(memoryBudget) {
+}
+
+void ReadCache::add(const ReadCacheBound& start, const ReadCacheBound& end, dto::Timestamp ts) {
+    if (!(start < end) || ts.compareCertain(_lowWaterMark) != dto::Timestamp::GT) {
+        // nothing to add, or we already assume a read at least this recent everywhere
+        return;
+    }
+
+    // find the first range which overlaps [start, end)
+    auto it = _ranges.upper_bound(start);
+    if (it != _ranges.begin()) {
+        if (auto prev = std::prev(it); start < prev->second.end) {
+            it = prev;
+        }
+    }
+    // Walk the overlapping ranges. Ranges read at least as recently keep their part of [start, end) and we fill in
+    // the gaps between them. Older ranges are cut down to their parts outside of [start, end)
+    ReadCacheBound cur = start;
+    while (it != _ranges.end() && it->first < end) {
+        if (it->second.ts.compareCertain(ts) != dto::Timestamp::LT) {
+            if (cur < it->first) {
+                _insert(cur, it->first, ts);
+            }
+            if (cur < it->second.end) {
+                cur = it->second.end;
+            }
+            ++it;
+        }
+        else {
+            auto oldStart = it->first;
+            auto old = it->second;
+            it = _erase(it);
+            if (oldStart < start) {
+                _insert(std::move(oldStart), start, old.ts);
+            }
+            if (end < old.end) {
+                _insert(end, std::move(old.end), old.ts);
+            }
+        }
+    }
+    if (cur < end) {
+        _insert(std::move(cur), end, ts);
+    }
+    _coalesce(start, end);
+
+    if (_memoryBudget > 0 && _stats.bytes > _memoryBudget) {
+        _evict();
+    }
+}
+
+dto::Timestamp ReadCache::getMax(const ReadCacheBound& start, const ReadCacheBound& end) const {
+    auto result = _lowWaterMark;
+    auto it = _ranges.upper_bound(start);
+    if (it != _ranges.begin()) {
+        if (auto prev = std::prev(it); start < prev->second.end) {
+            it = prev;
+        }
+    }
+    for (; it != _ranges.end() && it->first < end; ++it) {
+        result.maxEq(it->second.ts);
+    }
+    return result;
+}
+
+void ReadCache::expire(dto::Timestamp retentionTs) {
+    for (auto it = _ranges.begin(); it != _ranges.end();) {
+        if (it->second.ts.compareCertain(retentionTs) == dto::Timestamp::LT) {
+            it = _erase(it);
+            _stats.expiredRanges++;
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+void ReadCache::setMemoryBudget(size_t memoryBudget) {
+    _memoryBudget = memoryBudget;
+    if (_memoryBudget > 0 && _stats.bytes > _memoryBudget) {
+        _evict();
+    }
+}
+
+ReadCacheStats ReadCache::getStats() const {
+    auto stats = _stats;
+    stats.ranges = _ranges.size();
+    return stats;
+}
+
+void ReadCache::_insert(ReadCacheBound start, ReadCacheBound end, dto::Timestamp ts) {
+    _stats.bytes += _rangeBytes(start, end);
+    _ranges.emplace(std::move(start), Range{.end = std::move(end), .ts = ts});
+}
+
+ReadCache::RangeMap::iterator ReadCache::_erase(RangeMap::iterator it) {
+    _stats.bytes -= _rangeBytes(it->first, it->second.end);
+    return _ranges.erase(it);
+}
+
+size_t ReadCache::_rangeBytes(const ReadCacheBound& start, const ReadCacheBound& end) {
+    // the map node (roughly 4 pointers of overhead), plus the key bytes
+    return sizeof(RangeMap::value_type) + 4 * sizeof(void*) + start.key.size() + end.key.size();
+}
+
+void ReadCache::_coalesce(const ReadCacheBound& start, const ReadCacheBound& end) {
+    auto it = _ranges.lower_bound(start);
+    if (it != _ranges.begin()) {
+        --it;
+    }
+    while (it != _ranges.end() && !(end < it->first)) {
+        auto next = std::next(it);
+        if (next == _ranges.end()) {
+            break;
+        }
+        if (it->second.end == next->first && it->second.ts == next->second.ts) {
+            _stats.bytes -= _rangeBytes(it->first, it->second.end) + _rangeBytes(next->first, next->second.end);
+            it->second.end = std::move(next->second.end);
+            _ranges.erase(next);
+            _stats.bytes += _rangeBytes(it->first, it->second.end);
+            // check the merged range against its new neighbor
+            continue;
+        }
+        it = next;
+    }
+}
+
+void ReadCache::_evict() {
+    // Drop at least a quarter of the ranges, starting with the oldest ones. Keys in the dropped ranges are then
+    // covered by the low water mark, which moves up to the newest timestamp we dropped
+    std::vector<dto::Timestamp> timestamps;
+    timestamps.reserve(_ranges.size());
+    for (auto& [_, range] : _ranges) {
+        timestamps.push_back(range.ts);
+    }
+    if (timestamps.empty()) {
+        return;
+    }
+    auto nth = timestamps.begin() + timestamps.size() / 4;
+    std::nth_element(timestamps.begin(), nth, timestamps.end(), [] (const auto& a, const auto& b) {
+        return a.compareCertain(b) == dto::Timestamp::LT;
+    });
+    auto threshold = *nth;
+    for (auto it = _ranges.begin(); it != _ranges.end();) {
+        if (it->second.ts.compareCertain(threshold) != dto::Timestamp::GT) {
+            it = _erase(it);
+            _stats.evictedRanges++;
+        }
+        else {
+            ++it;
+        }
+    }
+    _lowWaterMark.maxEq(threshold);
+    K2LOG_D(log::skvsvr, "read cache evicted ranges up to {}, stats={}", threshold, getStats());
+}
+// *********************** end ReadCache API
+
+} // namespace k2
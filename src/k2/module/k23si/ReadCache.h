@@ -0,0 +1,123 @@
+/*
+MIT License
+
+Copyright(c) 2022 Futurewei Cloud
+
+    Permission is hereby granted,
+    free of charge, to any person obtaining a copy of this software and associated documentation files(the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
+
+    The above copyright notice and this permission notice shall be included in all copies
+    or
+    substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS",
+    WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER
+    LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <map>
+
+#include <k2/common/Common.h>
+#include <k2/dto/Timestamp.h>
+
+namespace k2 {
+
+// A bound of a key range in the read cache: a position in the encoded key space (see IndexerKey) of a schema.
+// Schemas are identified by the ids the Indexer assigns to them, so the ranges of all schemas can share one cache
+struct ReadCacheBound {
+    uint32_t schemaId{0};
+    // the encoded key bytes
+    String key;
+
+    int compare(const ReadCacheBound& o) const noexcept;
+    bool operator<(const ReadCacheBound& o) const noexcept { return compare(o) < 0; }
+    bool operator==(const ReadCacheBound& o) const noexcept { return compare(o) == 0; }
+
+    // the bounds of the range which holds just the given key, i.e. [key, key+'\0')
+    static ReadCacheBound pointStart(uint32_t schemaId, std::string_view key);
+    static ReadCacheBound pointEnd(uint32_t schemaId, std::string_view key);
+    // the bounds of the range which holds all keys of a schema
+    static ReadCacheBound schemaStart(uint32_t schemaId);
+    static ReadCacheBound schemaEnd(uint32_t schemaId);
+
+    K2_DEF_FMT(ReadCacheBound, schemaId, key);
+};
+
+struct ReadCacheStats {
+    // number of ranges in the cache
+    uint64_t ranges{0};
+    // the estimated memory used by the ranges
+    uint64_t bytes{0};
+    // number of ranges dropped to stay within the memory budget, and raising the low water mark
+    uint64_t evictedRanges{0};
+    // number of ranges dropped since they were older than the retention window
+    uint64_t expiredRanges{0};
+    K2_DEF_FMT(ReadCacheStats, ranges, bytes, evictedRanges, expiredRanges);
+};
+
+// The read timestamp cache. It tracks the latest time at which each key range was read, so that writes can be
+// checked against reads of the same keys (including keys which didn't exist at the time of the read).
+// The cache holds a set of disjoint, half-open key ranges, each with the timestamp of the latest read in it.
+// Adjacent ranges with the same timestamp are coalesced, so a scan is a single range regardless of how many keys
+// it visited. Keys which aren't in any range were last read at or before the low water mark.
+// The memory for the ranges is bounded. When over budget, the oldest ranges are evicted and the low water
+// mark is raised to cover them.
+class ReadCache {
+public:
+    // A memoryBudget of 0 means unbounded
+    ReadCache(dto::Timestamp lowWaterMark=dto::Timestamp::ZERO, size_t memoryBudget=0);
+
+    // register a read at the given timestamp over the range [start, end)
+    void add(const ReadCacheBound& start, const ReadCacheBound& end, dto::Timestamp ts);
+
+    // the latest read timestamp over the range [start, end)
+    dto::Timestamp getMax(const ReadCacheBound& start, const ReadCacheBound& end) const;
+
+    // Drop the ranges which were last read before the given retention timestamp. Writes older than the
+    // retention timestamp are rejected anyway, so these ranges can't cause any further rejections
+    void expire(dto::Timestamp retentionTs);
+
+    void setMemoryBudget(size_t memoryBudget);
+
+    dto::Timestamp getLowWaterMark() const { return _lowWaterMark; }
+
+    ReadCacheStats getStats() const;
+
+private:
+    struct Range {
+        ReadCacheBound end;
+        dto::Timestamp ts;
+    };
+    typedef std::map<ReadCacheBound, Range> RangeMap;
+
+    // add a range which doesn't overlap any other range
+    void _insert(ReadCacheBound start, ReadCacheBound end, dto::Timestamp ts);
+    RangeMap::iterator _erase(RangeMap::iterator it);
+
+    // the estimated memory for a range
+    static size_t _rangeBytes(const ReadCacheBound& start, const ReadCacheBound& end);
+
+    // merge ranges with the same timestamp which touch each other, from the range before the given one up to
+    // and including the first range which starts at or after the given end bound
+    void _coalesce(const ReadCacheBound& start, const ReadCacheBound& end);
+
+    // drop the oldest quarter (at least) of the ranges and raise the low water mark over them
+    void _evict();
+
+    // the ranges, keyed by their start bound
+    RangeMap _ranges;
+    dto::Timestamp _lowWaterMark;
+    size_t _memoryBudget{0};
+    ReadCacheStats _stats;
+};
+
+} // namespace k2
@@ -0,0 +1,187 @@
+/*
+MIT License
+
+Copyright(c) 2022 Futurewei Cloud
+
+    Permission is hereby granted,
+    free of charge, to any person obtaining a copy of this software and associated documentation files(the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
+
+    The above copyright notice and this permission notice shall be included in all copies
+    or
+    substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS",
+    WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER
+    LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+*/
+
+
+#include "RecordArena.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+#include "Log.h"
+
+namespace k2 {
+
+RecordArena::RecordArena(size_t slabSize, double compactionOccupancy):
+    _slabSize(slabSize),
+    _compactionOccupancy(compactionOccupancy),
+    _registry(seastar::make_lw_shared<SlabRegistry>()) {
+}
+
+dto::SKVRecord::Storage RecordArena::copy(dto::SKVRecord::Storage& value) {
+    dto::SKVRecord::Storage result;
+    // an empty bitmap means that no fields are excluded, so there is no need to keep an all-false one around
+    if (std::find(value.excludedFields.begin(), value.excludedFields.end(), true) != value.excludedFields.end()) {
+        result.excludedFields = value.excludedFields;
+    }
+    result.fieldData = _copyPayload(value.fieldData);
+    result.schemaVersion = value.schemaVersion;
+    return result;
+}
+
+Payload RecordArena::_copyPayload(Payload& payload) {
+    auto size = payload.getSize();
+    Payload result;
+    if (size == 0) {
+        return result;
+    }
+
+    Binary data;
+    if (_slabSize == 0 || size > _slabSize / 8) {
+        // big values would waste too much of the slab they don't fit in
+        data = Binary(size);
+        if (_slabSize > 0) {
+            _stats.largeValues++;
+            _stats.largeBytes += size;
+        }
+    }
+    else {
+        if (_current.empty() || _current.size() - _currentOffset < size) {
+            _newSlab();
+        }
+        data = _current.share(_currentOffset, size);
+        _currentOffset += size;
+    }
+
+    auto pos = payload.getCurrentPosition();
+    payload.seek(0);
+    payload.read(data.get_write(), size);
+    payload.seek(pos);
+
+    result.appendBinary(std::move(data));
+    return result;
+}
+
+void RecordArena::_newSlab() {
+    if (!_current.empty()) {
+        auto it = _registry->slabs.find(_current.get());
+        if (it != _registry->slabs.end()) {
+            it->second.sealed = true;
+            it->second.sealedPass = _pass;
+        }
+    }
+
+    char* mem = static_cast<char*>(std::malloc(_slabSize));
+    if (mem == nullptr) {
+        throw std::bad_alloc();
+    }
+    _registry->slabs.emplace(mem, Slab{.size = _slabSize});
+    _registry->slabBytes += _slabSize;
+    K2LOG_D(log::skvsvr, "new arena slab of size {}, total slabs={}", _slabSize, _registry->slabs.size());
+
+    // The slab is freed when the last value in it goes away, which may be after the arena is gone
+    _current = Binary(mem, _slabSize, seastar::make_deleter([registry=_registry, mem] {
+        auto it = registry->slabs.find(mem);
+        if (it != registry->slabs.end()) {
+            registry->slabBytes -= it->second.size;
+            registry->slabs.erase(it);
+        }
+        registry->freedSlabs++;
+        std::free(mem);
+    }));
+    _currentOffset = 0;
+}
+
+RecordArena::Slab* RecordArena::_findSlab(const Payload& payload) {
+    auto& buffers = payload.getBuffers();
+    if (buffers.size() != 1) {
+        return nullptr;
+    }
+    const char* data = buffers[0].get();
+    auto it = _registry->slabs.upper_bound(data);
+    if (it == _registry->slabs.begin()) {
+        return nullptr;
+    }
+    --it;
+    if (data >= it->first + it->second.size) {
+        return nullptr;
+    }
+    return &it->second;
+}
+
+void RecordArena::beginPass() {
+    _pass++;
+    _passRunning = true;
+    for (auto& [_, slab] : _registry->slabs) {
+        slab.passLive = 0;
+    }
+}
+
+void RecordArena::visit(dto::SKVRecord::Storage& value) {
+    if (!_passRunning) {
+        return;
+    }
+    auto* slab = _findSlab(value.fieldData);
+    if (slab == nullptr) {
+        return;
+    }
+    if (slab->sparse) {
+        // NB: the slab may be freed as soon as we replace the value
+        _stats.relocatedValues++;
+        _stats.relocatedBytes += value.fieldData.getSize();
+        value.fieldData = _copyPayload(value.fieldData);
+        return;
+    }
+    slab->passLive += value.fieldData.getSize();
+}
+
+void RecordArena::endPass() {
+    if (!_passRunning) {
+        return;
+    }
+    _passRunning = false;
+    _stats.liveBytes = 0;
+    for (auto& [_, slab] : _registry->slabs) {
+        if (slab.sealed && slab.sealedPass < _pass) {
+            // the slab was full for the entire pass, so we've seen every value in it
+            slab.live = slab.passLive;
+            slab.sparse = slab.live < slab.size * _compactionOccupancy;
+        }
+        else {
+            // still being written to while we were measuring. Count it as full
+            slab.live = slab.size;
+        }
+        _stats.liveBytes += slab.live;
+    }
+    K2LOG_D(log::skvsvr, "arena pass {} done with stats {}", _pass, getStats());
+}
+
+RecordArenaStats RecordArena::getStats() const {
+    RecordArenaStats stats = _stats;
+    stats.slabs = _registry->slabs.size();
+    stats.slabBytes = _registry->slabBytes;
+    stats.freedSlabs = _registry->freedSlabs;
+    return stats;
+}
+
+} // namespace k2
@@ -0,0 +1,125 @@
+/*
+MIT License
+
+Copyright(c) 2022 Futurewei Cloud
+
+    Permission is hereby granted,
+    free of charge, to any person obtaining a copy of this software and associated documentation files(the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
+
+    The above copyright notice and this permission notice shall be included in all copies
+    or
+    substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS",
+    WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER
+    LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <map>
+
+#include <k2/common/Common.h>
+#include <k2/dto/SKVRecord.h>
+#include <seastar/core/shared_ptr.hh>
+
+namespace k2 {
+
+// Statistics for the memory arena which holds the record values of a partition
+struct RecordArenaStats {
+    // number of slabs currently allocated
+    uint64_t slabs{0};
+    // total memory held in slabs
+    uint64_t slabBytes{0};
+    // size of the live values in the slabs, as measured by the last complete GC pass
+    uint64_t liveBytes{0};
+    // number of values (and their total size) which were too big for a slab and got their own allocation
+    uint64_t largeValues{0};
+    uint64_t largeBytes{0};
+    // number of values (and their total size) which were moved out of sparse slabs
+    uint64_t relocatedValues{0};
+    uint64_t relocatedBytes{0};
+    // number of slabs which have been freed
+    uint64_t freedSlabs{0};
+    K2_DEF_FMT(RecordArenaStats, slabs, slabBytes, liveBytes, largeValues, largeBytes, relocatedValues,
+               relocatedBytes, freedSlabs);
+};
+
+// A log-structured arena for the values of the records held in the indexer. Values are appended to large slabs
+// instead of getting a heap allocation each, which keeps the memory overhead of small records low and avoids
+// fragmenting the heap. Each value is a shared view of its slab, and a slab is freed once no value (or a share
+// of one, e.g. in a query response) refers to it anymore.
+// The arena doesn't see values getting dropped, so the occupancy of the slabs is measured by the version GC,
+// which visits every live value during each pass. Values found in sparse slabs are moved to the current slab
+// during the following pass, so that the sparse slabs can be freed.
+class RecordArena {
+public:
+    // Slabs are slabSize bytes. Slabs with less than compactionOccupancy of their memory in use are compacted.
+    // A slabSize of 0 disables the arena and values are copied into their own allocations
+    RecordArena(size_t slabSize=0, double compactionOccupancy=0.5);
+
+    // copy the given value into the arena
+    dto::SKVRecord::Storage copy(dto::SKVRecord::Storage& value);
+
+    // Called by the version GC at the start and at the end of a complete pass over all values
+    void beginPass();
+    void endPass();
+
+    // Called by the version GC for each live value during a pass. If the value is in a sparse slab, it is
+    // moved to the current slab
+    void visit(dto::SKVRecord::Storage& value);
+
+    RecordArenaStats getStats() const;
+
+private:
+    struct Slab {
+        size_t size{0};
+        // the memory in use at the end of the last complete GC pass
+        size_t live{0};
+        // the memory in use found so far in the current GC pass
+        size_t passLive{0};
+        // the GC pass during which we stopped allocating from this slab. Only slabs which were full for an
+        // entire pass have their occupancy measured
+        uint64_t sealedPass{0};
+        bool sealed{false};
+        // set when the slab should be compacted
+        bool sparse{false};
+    };
+
+    // The slabs are shared with their deleters, since a slab may outlive the arena through the values in it
+    struct SlabRegistry {
+        // slab start address -> slab
+        std::map<const char*, Slab> slabs;
+        uint64_t slabBytes{0};
+        uint64_t freedSlabs{0};
+    };
+
+    // copy the data of the given payload into a new payload, allocated from the current slab if possible
+    Payload _copyPayload(Payload& payload);
+
+    // find the slab which holds the given payload, or nullptr if the payload doesn't live in a slab
+    Slab* _findSlab(const Payload& payload);
+
+    // allocate a new current slab
+    void _newSlab();
+
+    size_t _slabSize;
+    double _compactionOccupancy;
+    seastar::lw_shared_ptr<SlabRegistry> _registry;
+    // the slab we're currently allocating from, and the next free position in it
+    Binary _current;
+    size_t _currentOffset{0};
+    // the number of GC passes which have begun
+    uint64_t _pass{0};
+    bool _passRunning{false};
+    RecordArenaStats _stats;
+};
+
+} // namespace k2
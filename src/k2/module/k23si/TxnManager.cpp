@@ -24,6 +24,7 @@ Copyright(c) 2020 Futurewei Cloud
 #include "TxnManager.h"
 
 #include <boost/range/irange.hpp>
+#include <seastar/core/with_timeout.hh>
 
 namespace k2 {
 
@@ -71,6 +72,10 @@ void TxnManager::_registerMetrics() {
         sm::make_counter("committed_txns", _committedTxns, sm::description("Number of commited transactions"), labels),
         sm::make_counter("aborted_txns", _abortedTxns, sm::description("Number of aborted transactions"), labels),
         sm::make_counter("conflict_aborts", _conflictAborts, sm::description("Number of conflict aborts (incumbent abort due to push)"), labels),
+        sm::make_counter("one_phase_txns", _onePhaseTxns, sm::description("Number of transactions finalized in place at their TRH, without finalize RPCs"), labels),
+        sm::make_counter("one_phase_fallbacks", _onePhaseFallbacks, sm::description("Number of single-partition transactions which could not be finalized in place and were finalized with RPCs"), labels),
+        sm::make_counter("finalizations", _finalizations, sm::description("Number of (transaction, partition) finalizations completed"), labels),
+        sm::make_counter("finalize_messages", _finalizeMessages, sm::description("Number of finalize messages sent, each for one or more transactions"), labels),
         sm::make_histogram("finalization_latency", [this]{ return _finalizationLatency.getHistogram();},
                 sm::description("Latency of Finalizations"), labels)
     });
@@ -78,6 +83,17 @@ void TxnManager::_registerMetrics() {
 
 seastar::future<> TxnManager::start(const String& collectionName, dto::Timestamp rts, Duration hbDeadline, std::shared_ptr<Persistence> persistence, const String& cpoEndpoint) {
     K2LOG_D(log::skvsvr, "start");
+    _finalizeGroupTimer.set_callback([this] {
+        std::vector<std::tuple<String, dto::PVID>> pending;
+        for (auto& [cname, groups]: _finalizeGroups) {
+            for (auto& [pvid, group]: groups) {
+                pending.emplace_back(cname, pvid);
+            }
+        }
+        for (auto& [cname, pvid]: pending) {
+            _sendFinalizeGroup(cname, pvid);
+        }
+    });
     _cpo.init(cpoEndpoint);
     _collectionName = collectionName;
     _hbDeadline = hbDeadline;
@@ -149,6 +165,10 @@ seastar::future<> TxnManager::gracefulStop() {
     return _hbTimer.stop()
         .then([this] {
             K2LOG_I(log::skvsvr, "hb stopped. stopping with {} active transactions", _transactions.size());
+            // don't wait for the group window with finalizations which are pending
+            if (_finalizeGroupTimer.cancel()) {
+                _finalizeGroupTimer.arm(0ns);
+            }
             std::vector<seastar::future<>> bgFuts;
             for (auto& [_, txn]: _transactions) {
                 bgFuts.push_back(std::move(txn.bgTaskFut));
@@ -164,6 +184,10 @@ seastar::future<> TxnManager::gracefulStop() {
         });
 }
 
+void TxnManager::setLocalFinalizer(LocalFinalizer finalizer) {
+    _localFinalizer = std::move(finalizer);
+}
+
 void TxnManager::updateRetentionTimestamp(dto::Timestamp rts) {
     K2LOG_D(log::skvsvr, "retention ts now={}", rts)
     _retentionTs = rts;
@@ -210,6 +234,73 @@ seastar::future<std::tuple<Status, dto::K23SIInspectTxnResponse>> TxnManager::in
     return RPCResponse(dto::K23SIStatus::OK("Inspect txn success"), std::move(response));
 }
 
+void TxnManager::replay(TxnRecord&& rec) {
+    K2LOG_D(log::skvsvr, "replaying txn record {}", rec);
+    if (rec.state == dto::TxnRecordState::FinalizedPIP) {
+        // the transaction was fully finalized. There is nothing left to do for it
+        _transactions.erase(rec.mtr.timestamp);
+        return;
+    }
+    // Only the end of the transaction is persisted, so the record is either in CommittedPIP or AbortedPIP.
+    // These records are not linked for heartbeat or retention window expiry
+    auto& existing = _transactions[rec.mtr.timestamp];
+    existing.mtr = std::move(rec.mtr);
+    existing.writeRanges = std::move(rec.writeRanges);
+    existing.trh = std::move(rec.trh);
+    existing.state = rec.state;
+    existing.finalizeAction = rec.finalizeAction;
+    existing.hasAttemptedCommit = rec.hasAttemptedCommit;
+    // the client which asked for sync finalization is gone
+    existing.syncFinalize = false;
+}
+
+seastar::future<> TxnManager::finishReplay() {
+    K2LOG_I(log::skvsvr, "Recovered {} transactions which need finalization", _transactions.size());
+    std::vector<dto::Timestamp> txnIds;
+    txnIds.reserve(_transactions.size());
+    for (auto& [txnId, _]: _transactions) {
+        txnIds.push_back(txnId);
+    }
+    return seastar::do_with(std::move(txnIds), [this] (auto& txnIds) {
+        return seastar::do_for_each(txnIds, [this] (auto& txnId) {
+            auto it = _transactions.find(txnId);
+            if (it == _transactions.end()) {
+                return seastar::make_ready_future();
+            }
+            // the end action was persisted. Continue as if the persist just completed
+            return _onAction(TxnRecord::Action::onPersistSucceed, it->second)
+                .then([txnId] (auto&& status) {
+                    if (!status.is2xxOK()) {
+                        K2LOG_E(log::skvsvr, "Unable to resume recovered txn {} due to: {}", txnId, status);
+                    }
+                });
+        });
+    });
+}
+
+void TxnManager::snapshot(Persistence& snapshot) {
+    for (auto& [_, rec]: _transactions) {
+        switch (rec.state) {
+            case dto::TxnRecordState::AbortedPIP:
+            case dto::TxnRecordState::Aborted:
+            case dto::TxnRecordState::CommittedPIP:
+            case dto::TxnRecordState::Committed:
+            case dto::TxnRecordState::FinalizedPIP: {
+                // Write the record in the state in which its end was persisted so that a replay resumes finalization.
+                // Finalizing again after the FinalizedPIP record made it to persistence is harmless
+                auto state = rec.state;
+                rec.state = rec.finalizeAction == dto::EndAction::Commit ? dto::TxnRecordState::CommittedPIP : dto::TxnRecordState::AbortedPIP;
+                snapshot.append(rec);
+                rec.state = state;
+                break;
+            }
+            default:
+                // nothing was persisted for this transaction
+                break;
+        }
+    }
+}
+
 TxnRecord& TxnManager::getTxnRecord(dto::K23SI_MTR&& mtr, dto::Key trhKey) {
     // we don't persist the record on create. If we have a sudden failure, we'd
     // just abort the transaction when it comes to commit.
@@ -240,6 +331,44 @@ seastar::future<Status> TxnManager::heartbeat(dto::K23SI_MTR&& mtr, dto::Key trh
     return _onAction(TxnRecord::Action::onHeartbeat, getTxnRecord(std::move(mtr), std::move(trhKey)));
 }
 
+seastar::future<std::vector<Status>>
+TxnManager::heartbeat(std::vector<dto::K23SI_MTR>&& mtrs, std::vector<dto::Key>&& trhKeys) {
+    std::vector<Status> statuses(mtrs.size());
+    // the heartbeats for transactions which are not in progress, which have to go through the state machine
+    std::vector<size_t> pending;
+    auto hbExpiry = CachedSteadyClock::now() + 2 * _hbDeadline;
+    for (size_t i = 0; i < mtrs.size(); ++i) {
+        auto it = _transactions.find(mtrs[i].timestamp);
+        if (it == _transactions.end() || it->second.state != dto::TxnRecordState::InProgress) {
+            pending.push_back(i);
+            continue;
+        }
+        // same as onHeartbeat in the InProgress state, with one expiry for the whole batch
+        TxnRecord& rec = it->second;
+        rec.unlinkHB(_hblist);
+        rec.hbExpiry = hbExpiry;
+        _hblist.push_back(rec);
+        statuses[i] = dto::K23SIStatus::OK;
+    }
+    K2LOG_D(log::skvsvr, "Processed {} heartbeats in batch, {} pending", mtrs.size() - pending.size(), pending.size());
+    if (pending.empty()) {
+        return seastar::make_ready_future<std::vector<Status>>(std::move(statuses));
+    }
+
+    return seastar::do_with(std::move(statuses), std::move(pending), std::move(mtrs), std::move(trhKeys),
+        [this] (auto& statuses, auto& pending, auto& mtrs, auto& trhKeys) {
+        return seastar::parallel_for_each(pending, [this, &statuses, &mtrs, &trhKeys] (size_t i) {
+            return heartbeat(std::move(mtrs[i]), std::move(trhKeys[i]))
+                .then([&statuses, i] (auto&& status) {
+                    statuses[i] = std::move(status);
+                });
+        })
+        .then([&statuses] {
+            return std::move(statuses);
+        });
+    });
+}
+
 // return true if the challenge was successful (challenger wins over incumbent)
 bool _evaluateChallenge(TxnRecord& incumbent, dto::K23SI_MTR& challengerMTR) {
     // Calculate if the incumbent would lose the challenge based on conflict resolution
@@ -350,7 +479,7 @@ TxnManager::push(dto::K23SI_MTR&& incumbentMTR, dto::K23SI_MTR&& challengerMTR,
 }
 
 seastar::future<std::tuple<Status, dto::K23SITxnEndResponse>>
-TxnManager::endTxn(dto::K23SITxnEndRequest&& request) {
+TxnManager::endTxn(dto::K23SITxnEndRequest&& request, bool onePhase) {
     // this action always needs to be executed against the transaction to see what would happen.
     // If we can successfully execute the action, then it's a success response. Otherwise, the user
     // receives an error response which is telling them that the transaction has been aborted
@@ -374,6 +503,11 @@ TxnManager::endTxn(dto::K23SITxnEndRequest&& request) {
         return RPCResponse(dto::K23SIStatus::AbortRequestTooOld("request is outside retention window"), dto::K23SITxnEndResponse{});
     }
 
+    if (request.action == dto::EndAction::Commit && rec.state == dto::TxnRecordState::InProgress &&
+        request.asyncWrites > rec.asyncWriteIds.size()) {
+        return _endTxnAfterAsyncWrites(rec, std::move(request), onePhase);
+    }
+
     rec.writeRanges = std::move(request.writeRanges);
     rec.syncFinalize = request.syncFinalize;
     rec.timeToFinalize = request.timeToFinalize;
@@ -381,6 +515,8 @@ TxnManager::endTxn(dto::K23SITxnEndRequest&& request) {
     if (request.action == dto::EndAction::Commit) {
         rec.hasAttemptedCommit = true;
     }
+    // a requested finalization delay (used in testing) needs the regular, background finalization
+    rec.onePhase = onePhase && _localFinalizer && nsec(rec.timeToFinalize).count() == 0;
 
     // and just execute the transition
     return _onAction(action, rec)
@@ -393,6 +529,85 @@ TxnManager::endTxn(dto::K23SITxnEndRequest&& request) {
         });
 }
 
+seastar::future<std::tuple<Status, dto::K23SITxnEndResponse>>
+TxnManager::_endTxnAfterAsyncWrites(TxnRecord& rec, dto::K23SITxnEndRequest&& request, bool onePhase) {
+    if (rec.asyncWritesWaiter) {
+        // a retry of an end request which is still waiting
+        return RPCResponse(dto::K23SIStatus::ServiceUnavailable("retry: waiting for async writes"), dto::K23SITxnEndResponse{});
+    }
+    K2LOG_D(log::skvsvr, "waiting for {} async writes, have {} in txn {}", request.asyncWrites, rec.asyncWriteIds.size(), rec);
+    // the mtr and key were consumed to look up the record
+    request.mtr = rec.mtr;
+    request.key = rec.trh;
+    rec.asyncWritesExpected = request.asyncWrites;
+    rec.asyncWritesWaiter.emplace();
+
+    auto timeout = seastar::timer<>::clock::now() + _config.writeTimeout();
+    return seastar::with_timeout(timeout, rec.asyncWritesWaiter->get_future())
+        .handle_exception_type([] (seastar::timed_out_error&) {})
+        .then([this, request=std::move(request), onePhase] () mutable {
+            auto it = _transactions.find(request.mtr.timestamp);
+            if (it == _transactions.end()) {
+                return RPCResponse(dto::K23SIStatus::KeyNotFound("transaction ended while waiting for async writes"), dto::K23SITxnEndResponse{});
+            }
+            auto& rec = it->second;
+            rec.asyncWritesWaiter.reset();
+            request.asyncWrites = 0;
+            if (rec.asyncWriteIds.size() >= rec.asyncWritesExpected || rec.state != dto::TxnRecordState::InProgress) {
+                // Either all writes made it, or the txn cannot commit anyway (e.g. it was force-aborted due to a
+                // failed write). The regular end processing handles both
+                return endTxn(std::move(request), onePhase);
+            }
+
+            // some writes never reported back. We can't tell if they were applied so the txn cannot commit
+            K2LOG_W(log::skvsvr, "only {} of {} async writes reported in txn {}. Aborting", rec.asyncWriteIds.size(), rec.asyncWritesExpected, rec);
+            request.action = dto::EndAction::Abort;
+            return endTxn(std::move(request), onePhase)
+                .then([] (auto&& response) {
+                    auto& [status, _] = response;
+                    if (!status.is2xxOK()) {
+                        return std::move(response);
+                    }
+                    return std::make_tuple(dto::K23SIStatus::OperationNotAllowed("cannot commit transaction since some async writes did not complete"), dto::K23SITxnEndResponse{});
+                });
+        });
+}
+
+void TxnManager::_wakeAsyncWritesWaiter(TxnRecord& rec) {
+    if (rec.asyncWritesWaiter) {
+        rec.asyncWritesWaiter->set_value();
+        rec.asyncWritesWaiter.reset();
+    }
+}
+
+seastar::future<std::tuple<Status, dto::K23SITxnWriteOutcomeResponse>>
+TxnManager::writeOutcome(dto::K23SITxnWriteOutcomeRequest&& request) {
+    auto it = _transactions.find(request.mtr.timestamp);
+    if (it == _transactions.end()) {
+        // the transaction has ended already. If it committed, it must have heard from this write
+        return RPCResponse(dto::K23SIStatus::KeyNotFound("transaction not found for write outcome"), dto::K23SITxnWriteOutcomeResponse{});
+    }
+    auto& rec = it->second;
+    if (request.success) {
+        rec.asyncWriteIds.insert(request.request_id);
+        if (rec.asyncWriteIds.size() >= rec.asyncWritesExpected) {
+            _wakeAsyncWritesWaiter(rec);
+        }
+        return RPCResponse(dto::K23SIStatus::OK("write outcome recorded"), dto::K23SITxnWriteOutcomeResponse{});
+    }
+
+    // The write was not applied so the transaction cannot commit. Abort it right away, so that the client finds out
+    // with its next heartbeat, and so that a waiting commit can fail without waiting for the rest of the writes
+    K2LOG_D(log::skvsvr, "async write {} failed in txn {}", request.request_id, rec);
+    return _onAction(TxnRecord::Action::onForceAbort, rec)
+        .then([this, ts=request.mtr.timestamp] (auto&& status) {
+            if (auto it = _transactions.find(ts); it != _transactions.end()) {
+                _wakeAsyncWritesWaiter(it->second);
+            }
+            return RPCResponse(std::move(status), dto::K23SITxnWriteOutcomeResponse{});
+        });
+}
+
 seastar::future<std::tuple<Status, dto::K23SITxnEndResponse>>
 TxnManager::_endTxnRetry(TxnRecord& rec, dto::K23SITxnEndRequest&& request) {
     K2LOG_D(log::skvsvr, "duplicate end request {}, have= {}", request, rec);
@@ -627,9 +842,10 @@ seastar::future<Status> TxnManager::_endPIPHelper(TxnRecord& rec) {
                 }
                 return _onAction(TxnRecord::Action::onPersistSucceed, rec);
             });
-    if (rec.syncFinalize) {
+    if (rec.syncFinalize || rec.onePhase) {
         // flush manually here in order to complete the append operation above. Only then can we
-        // return the continuation of append
+        // return the continuation of append.
+        // One-phase transactions are always finalized before we respond since there are no RPCs to wait for
         return _persistence->flush().then([finfut=std::move(finfut)] (auto&& flushStatus) mutable {
             if (!flushStatus.is2xxOK()) {
                 return seastar::make_ready_future<Status>(std::move(flushStatus));
@@ -658,6 +874,10 @@ seastar::future<Status> TxnManager::_abort(TxnRecord& rec) {
 seastar::future<Status> TxnManager::_endHelper(TxnRecord& rec) {
     K2LOG_D(log::skvsvr, "Processing END for {}", rec);
 
+    if (rec.onePhase) {
+        return _finalizeOnePhase(rec);
+    }
+
     auto timeout = (10s + _config.writeTimeout() * rec.writeRanges.size()) / _config.finalizeBatchSize();
 
     if (rec.syncFinalize) {
@@ -680,6 +900,25 @@ seastar::future<Status> TxnManager::_endHelper(TxnRecord& rec) {
     return seastar::make_ready_future<Status>(dto::K23SIStatus::OK);
 }
 
+seastar::future<Status> TxnManager::_finalizeOnePhase(TxnRecord& rec) {
+    K2LOG_D(log::skvsvr, "Finalizing in place {}", rec);
+    auto status = _localFinalizer(rec.mtr.timestamp, rec.finalizeAction);
+    // KeyNotFound is acceptable, same as with a finalize RPC. It means that none of the writes made it
+    if (!status.is2xxOK() && status != dto::K23SIStatus::KeyNotFound) {
+        // e.g. the local txn metadata is still being persisted. The regular finalization can take care of it
+        K2LOG_W(log::skvsvr, "Unable to finalize txn {} in place due to {}. Finalizing with RPCs", rec, status);
+        rec.onePhase = false;
+        _onePhaseFallbacks++;
+        return _endHelper(rec);
+    }
+    _onePhaseTxns++;
+    // The persisted end action is the only record of this transaction we need. If we recover, it is finalized
+    // again from there since its WIs come back as well
+    K2LOG_D(log::skvsvr, "Erasing txn record: {}", rec);
+    _transactions.erase(rec.mtr.timestamp);
+    return seastar::make_ready_future<Status>(dto::K23SIStatus::OK);
+}
+
 seastar::future<Status> TxnManager::_finalizedPIP(TxnRecord& rec) {
     K2LOG_D(log::skvsvr, "Setting status to FinalizedPIP for {}", rec);
     // set state
@@ -749,6 +988,85 @@ void TxnManager::_genFinalizeReqsAfterPMAPUpdate(dto::K23SITxnFinalizeRequest&&
     }
 }
 
+seastar::future<Status> TxnManager::_groupFinalize(dto::K23SITxnFinalizeRequest& request, FastDeadline deadline) {
+    if (_config.finalizeGroupSize() <= 1 || nsec(_config.finalizeGroupWindow()).count() == 0) {
+        _finalizeMessages++;
+        return _cpo.partitionRequestByPVID<dto::K23SITxnFinalizeRequest,
+                                           dto::K23SITxnFinalizeResponse,
+                                           dto::Verbs::K23SI_TXN_FINALIZE>
+            (deadline, request)
+            .then([] (auto&& responsePair) {
+                auto& [status, response] = responsePair;
+                return std::move(status);
+            });
+    }
+
+    auto& group = _finalizeGroups[request.collectionName][request.pvid];
+    if (group.promises.empty()) {
+        group.request.pvid = request.pvid;
+        group.request.collectionName = request.collectionName;
+        group.deadline = deadline;
+    }
+    auto [eit, inserted] = group.entries.try_emplace(request.txnTimestamp, group.promises.size());
+    if (!inserted) {
+        // this txn is already queued for the partition, e.g. after a remap produced the same pvid twice
+        K2LOG_D(log::skvsvr, "Txn {} already queued in finalize group for pvid {}", request.txnTimestamp, request.pvid);
+        return group.promises[eit->second].get_shared_future();
+    }
+    group.request.txnTimestamps.push_back(request.txnTimestamp);
+    group.request.actions.push_back(request.action);
+    group.promises.emplace_back();
+    auto fut = group.promises.back().get_shared_future();
+
+    if (_stopping || group.promises.size() >= _config.finalizeGroupSize()) {
+        _sendFinalizeGroup(request.collectionName, request.pvid);
+    }
+    else if (!_finalizeGroupTimer.armed()) {
+        _finalizeGroupTimer.arm(_config.finalizeGroupWindow());
+    }
+    return fut;
+}
+
+void TxnManager::_sendFinalizeGroup(const String& collectionName, const dto::PVID& pvid) {
+    auto cit = _finalizeGroups.find(collectionName);
+    if (cit == _finalizeGroups.end()) {
+        return;
+    }
+    auto git = cit->second.find(pvid);
+    if (git == cit->second.end()) {
+        return;
+    }
+    FinalizeGroup group = std::move(git->second);
+    cit->second.erase(git);
+    if (cit->second.empty()) {
+        _finalizeGroups.erase(cit);
+    }
+
+    K2LOG_D(log::skvsvr, "Sending finalize group {}", group.request);
+    _finalizeMessages++;
+    auto deadline = group.deadline;
+    (void)seastar::do_with(std::move(group), [this, deadline] (auto& group) {
+        return _cpo.partitionRequestByPVID<dto::K23SITxnMultiFinalizeRequest,
+                                           dto::K23SITxnMultiFinalizeResponse,
+                                           dto::Verbs::K23SI_TXN_MULTI_FINALIZE>
+        (deadline, group.request)
+        .then([&group] (auto&& responsePair) {
+            auto& [status, response] = responsePair;
+            if (status.is2xxOK() && response.statuses.size() != group.promises.size()) {
+                status = dto::K23SIStatus::InternalError("multi-finalize response does not match the request");
+            }
+            for (size_t i = 0; i < group.promises.size(); ++i) {
+                group.promises[i].set_value(status.is2xxOK() ? std::move(response.statuses[i]) : status);
+            }
+        })
+        .handle_exception([&group] (auto exc) {
+            for (auto& promise: group.promises) {
+                promise.set_exception(exc);
+            }
+        });
+    });
+}
+
 seastar::future<Status> TxnManager::_finalizeTransaction(TxnRecord& rec, FastDeadline deadline) {
     K2LOG_D(log::skvsvr, "Finalizing {}", rec);
     //TODO we need to keep trying to finalize in cases of failures.
@@ -768,13 +1086,8 @@ seastar::future<Status> TxnManager::_finalizeTransaction(TxnRecord& rec, FastDea
 
                     k2::OperationLatencyReporter reporter(_finalizationLatency); // for reporting metrics
 
-                    return _cpo.partitionRequestByPVID<dto::K23SITxnFinalizeRequest,
-                                                dto::K23SITxnFinalizeResponse,
-                                                dto::Verbs::K23SI_TXN_FINALIZE>
-                    (deadline, request)
-                    .then([this, idx, &requests, reporter=std::move(reporter)](auto&& responsePair) mutable {
-
-                        auto& [status, response] = responsePair;
+                    return _groupFinalize(request, deadline)
+                    .then([this, idx, &requests, reporter=std::move(reporter)](Status&& status) mutable {
                         auto& [request, krv] = requests[idx];
 
                         K2LOG_D(log::skvsvr, "Request {} completed with status {}, in krv {}", request, status, krv);
@@ -798,6 +1111,7 @@ seastar::future<Status> TxnManager::_finalizeTransaction(TxnRecord& rec, FastDea
                             }
                         }
                         reporter.report();
+                        _finalizations++;
 
                         K2LOG_D(log::skvsvr, "Finalize request succeeded for {}", request);
                         return seastar::make_ready_future<>();
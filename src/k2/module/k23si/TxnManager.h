@@ -23,6 +23,10 @@ Copyright(c) 2020 Futurewei Cloud
 
 #pragma once
 #include <deque>
+#include <functional>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
 
 #include <k2/common/Timer.h>
 #include <k2/cpo/client/Client.h>
@@ -30,6 +34,8 @@ Copyright(c) 2020 Futurewei Cloud
 #include <k2/dto/K23SIInspect.h>
 
 #include <boost/intrusive/list.hpp>
+#include <seastar/core/future.hh>
+#include <seastar/core/shared_future.hh>
 #include <seastar/core/shared_ptr.hh>
 
 #include "Config.h"
@@ -81,8 +87,20 @@ struct TxnRecord {
     // if this transaction ever attempts to commit, we set this flag.
     bool hasAttemptedCommit{false};
 
+    // Set when all writes of the transaction are in the partition which holds this record. The WIs are then
+    // finalized in place once the end action is persisted, and the record is dropped without further persistence.
+    // This is not persisted: a recovered record is finalized the regular way
+    bool onePhase{false};
+
+    // The request_ids of the async writes which have reported success for this transaction. The end request tells us
+    // how many to expect, and a commit waits for the missing ones with asyncWritesWaiter.
+    // These are not persisted: a recovered transaction cannot commit with async writes it does not know about
+    std::unordered_set<uint64_t> asyncWriteIds;
+    uint64_t asyncWritesExpected{0};
+    std::optional<seastar::promise<>> asyncWritesWaiter;
+
     K2_PAYLOAD_FIELDS(mtr, writeRanges, trh, syncFinalize, state, finalizeAction, hasAttemptedCommit);
-    K2_DEF_FMT(TxnRecord, mtr, writeRanges, trh, rwExpiry, hbExpiry, syncFinalize, timeToFinalize, state, finalizeAction, hasAttemptedCommit);
+    K2_DEF_FMT(TxnRecord, mtr, writeRanges, trh, rwExpiry, hbExpiry, syncFinalize, timeToFinalize, state, finalizeAction, hasAttemptedCommit, onePhase, asyncWritesExpected);
 
     // The last action on this TR (the action that put us into the above state)
     K2_DEF_ENUM_IC(Action,
@@ -110,6 +128,11 @@ struct TxnRecord {
     void unlinkRW(RWList& rwlist);
 };  // class TxnRecord
 
+template <>
+struct PersistedRecordTraits<TxnRecord> {
+    static constexpr PersistedRecordType type = PersistedRecordType::TxnRecord;
+};
+
 
 // Manage K23SI transaction records.
 class TxnManager {
@@ -138,18 +161,41 @@ public: // lifecycle
     // process a heartbeat for the given transaction. Returns 2xx code on success or other codes on failure
     seastar::future<Status> heartbeat(dto::K23SI_MTR&& mtr, dto::Key incumbentTRHKey);
 
+    // process the heartbeats of a batch of transactions in a single pass. Returns a status for each transaction
+    seastar::future<std::vector<Status>> heartbeat(std::vector<dto::K23SI_MTR>&& mtrs, std::vector<dto::Key>&& trhKeys);
+
     // executes a push of the given challenger against the given incumbent.
     seastar::future<std::tuple<Status, dto::K23SITxnPushResponse>>
     push(dto::K23SI_MTR&& incumbentMTR, dto::K23SI_MTR&& challengerMTR, dto::Key incumbentTRHKey);
 
-    // process a client's request to end a transaction
+    // process a client's request to end a transaction. If onePhase is set, the caller has checked that all writes
+    // of the transaction are in this partition, and the WIs are finalized with the local finalizer
     seastar::future<std::tuple<Status, dto::K23SITxnEndResponse>>
-    endTxn(dto::K23SITxnEndRequest&& request);
+    endTxn(dto::K23SITxnEndRequest&& request, bool onePhase=false);
+
+    // process the outcome of an async write in the given transaction. A failed write force-aborts the transaction
+    seastar::future<std::tuple<Status, dto::K23SITxnWriteOutcomeResponse>>
+    writeOutcome(dto::K23SITxnWriteOutcomeRequest&& request);
+
+    // Finalizes the WIs of the given transaction in this partition, without going through any RPCs
+    typedef std::function<Status(dto::Timestamp txnId, dto::EndAction action)> LocalFinalizer;
+    void setLocalFinalizer(LocalFinalizer finalizer);
 
     // inspect transactions
     seastar::future<std::tuple<Status, dto::K23SIInspectAllTxnsResponse>> inspectTxns();
     seastar::future<std::tuple<Status, dto::K23SIInspectTxnResponse>> inspectTxn(dto::Timestamp txnTimestamp);
 
+public: // recovery
+    // apply a txn record read back from persistence. Only used during recovery, before we start serving requests
+    void replay(TxnRecord&& rec);
+
+    // called once all persisted records have been replayed. Resumes finalization for the recovered transactions
+    seastar::future<> finishReplay();
+
+    // Append the transactions which need to survive a restart to the given indexer snapshot. These are the
+    // transactions whose end action has been persisted but which have not been fully finalized yet
+    void snapshot(Persistence& snapshot);
+
 private:  // methods driving the state machine
     // delivers the given action for the given transaction and returns the status of executing the action
     // Returns the response from the execution of the newly entered state
@@ -174,6 +220,23 @@ private:  // methods driving the state machine
     // Helper method which finalizes a transaction
     seastar::future<Status> _finalizeTransaction(TxnRecord& rec, FastDeadline deadline);
 
+    // Send the given finalize request, coalesced with the finalizations of other transactions for the same
+    // partition. Returns the finalize status for this transaction
+    seastar::future<Status> _groupFinalize(dto::K23SITxnFinalizeRequest& request, FastDeadline deadline);
+
+    // send the pending finalizations for the given partition in one K23SI_TXN_MULTI_FINALIZE message
+    void _sendFinalizeGroup(const String& collectionName, const dto::PVID& pvid);
+
+    // Helper method which finalizes a one-phase transaction in place and drops its record
+    seastar::future<Status> _finalizeOnePhase(TxnRecord& rec);
+
+    // helper handler for commits which have to wait for the outcome of some of their async writes
+    seastar::future<std::tuple<Status, dto::K23SITxnEndResponse>>
+    _endTxnAfterAsyncWrites(TxnRecord& rec, dto::K23SITxnEndRequest&& request, bool onePhase);
+
+    // wake up the commit which is waiting for async writes in the given transaction, if any
+    void _wakeAsyncWritesWaiter(TxnRecord& rec);
+
     // helper handler for retries of endTxn requests
     seastar::future<std::tuple<Status, dto::K23SITxnEndResponse>>
     _endTxnRetry(TxnRecord& rec, dto::K23SITxnEndRequest&& request);
@@ -221,12 +284,33 @@ private: // fields
 
     std::shared_ptr<Persistence> _persistence;
 
+    // used to finalize one-phase transactions
+    LocalFinalizer _localFinalizer;
+
+    // finalizations waiting to be sent to the same partition
+    struct FinalizeGroup {
+        dto::K23SITxnMultiFinalizeRequest request;
+        // one promise per entry in the request; callers finalizing the same txn share it
+        std::vector<seastar::shared_promise<Status>> promises;
+        // index of each txn's entry in the request
+        std::unordered_map<dto::Timestamp, size_t> entries;
+        FastDeadline deadline{0ns};
+    };
+    // pending finalization groups by collection name and partition
+    std::unordered_map<String, std::unordered_map<dto::PVID, FinalizeGroup>> _finalizeGroups;
+    // sends all pending finalization groups once the group window passes
+    seastar::timer<> _finalizeGroupTimer;
+
     sm::metric_groups _metric_groups;
 
     //metrics
     uint64_t _committedTxns{0}; // for committed txn rate
     uint64_t _abortedTxns{0}; // for aborts rate
     uint64_t _conflictAborts{0}; // for conflict abort rate
+    uint64_t _onePhaseTxns{0}; // for the rate of txns ended without finalize RPCs
+    uint64_t _onePhaseFallbacks{0}; // for the rate of one-phase txns which had to be finalized with RPCs
+    uint64_t _finalizations{0}; // for the finalize throughput, in finalized (txn, partition) pairs
+    uint64_t _finalizeMessages{0}; // for the rate of finalize messages sent
     k2::ExponentialHistogram _finalizationLatency;
 }; // class TxnManager
 
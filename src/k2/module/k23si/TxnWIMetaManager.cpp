@@ -205,6 +205,60 @@ Status TxnWIMetaManager::finalizedTxn(dto::Timestamp txnId) {
     return _onAction(Action::onFinalized, it->second);
 }
 
+Status TxnWIMetaManager::finalizedInPlace(dto::Timestamp txnId) {
+    auto it = _twims.find(txnId);
+    if (it == _twims.end()) {
+        return Statuses::S404_Not_Found(fmt::format("transaction ID {} not found in finalized in place", txnId));
+    }
+    return _onAction(Action::onFinalizedInPlace, it->second);
+}
+
+void TxnWIMetaManager::replay(TxnWIMeta&& twim) {
+    K2LOG_D(log::skvsvr, "replaying twim {}", twim);
+    auto txnId = twim.mtr.timestamp;
+    if (twim.state == dto::TxnWIMetaState::FinalizedPIP) {
+        // all WIs for the txn have been finalized
+        if (auto it = _twims.find(txnId); it != _twims.end()) {
+            it->second.unlinkRW(_rwlist);
+            _twims.erase(it);
+        }
+        return;
+    }
+
+    // The twim is persisted when the first write arrives. We don't know if the txn ended after that, so we treat it as
+    // in progress. Either the TRH will finalize it, or we'll ask the TRH about it once the retention window expires
+    auto& rec = _twims[txnId];
+    if (rec.state == dto::TxnWIMetaState::Created) {
+        rec.mtr = std::move(twim.mtr);
+        rec.trh = std::move(twim.trh);
+        rec.trhCollection = std::move(twim.trhCollection);
+        rec.state = dto::TxnWIMetaState::InProgress;
+        _rwlist.push_back(rec);
+    }
+    rec.writeKeys.merge(twim.writeKeys);
+}
+
+void TxnWIMetaManager::replayWrite(dto::Timestamp txnId, dto::Key&& key) {
+    auto it = _twims.find(txnId);
+    if (it == _twims.end()) {
+        // expected for WIs in an indexer snapshot whose twim was created after the snapshot started. The twim is
+        // in the WAL after the snapshot and it gets the key when we replay the WI again from there
+        K2LOG_D(log::skvsvr, "No twim found for recovered WI in txn {}, key {}", txnId, key);
+        return;
+    }
+    it->second.writeKeys.insert(std::move(key));
+}
+
+void TxnWIMetaManager::snapshot(Persistence& snapshot) {
+    for (auto& [_, twim]: _twims) {
+        // Created twims were never persisted. FinalizedPIP twims have already been appended to the WAL, so the
+        // WAL we replay after the snapshot removes them anyway
+        if (twim.state != dto::TxnWIMetaState::Created && twim.state != dto::TxnWIMetaState::FinalizedPIP) {
+            snapshot.append(twim);
+        }
+    }
+}
+
 Status TxnWIMetaManager::_onAction(Action action, TxnWIMeta& twim) {
     K2LOG_D(log::skvsvr, "Processing action: ({})---({})--> in twim {}", twim.state, action, twim);
     switch (twim.state) {
@@ -216,6 +270,7 @@ Status TxnWIMetaManager::_onAction(Action action, TxnWIMeta& twim) {
             case Action::onAbort:
             case Action::onFinalize:
             case Action::onFinalized:
+            case Action::onFinalizedInPlace:
             case Action::onRetentionWindowExpire:
             case Action::onPersistSucceed:
             case Action::onPersistFail:
@@ -239,6 +294,7 @@ Status TxnWIMetaManager::_onAction(Action action, TxnWIMeta& twim) {
             case Action::onCommit:
             case Action::onFinalize:
             case Action::onFinalized:
+            case Action::onFinalizedInPlace:
             case Action::onRetentionWindowExpire:
             default: {
                 return Statuses::S500_Internal_Server_Error(fmt::format("Action {} not supported in state {}", action, twim.state));
@@ -256,6 +312,7 @@ Status TxnWIMetaManager::_onAction(Action action, TxnWIMeta& twim) {
             case Action::onCommit:
             case Action::onFinalize:
             case Action::onFinalized:
+            case Action::onFinalizedInPlace:
             case Action::onRetentionWindowExpire:
             default: {
                 return Statuses::S500_Internal_Server_Error(fmt::format("Action {} not supported in state {}", action, twim.state));
@@ -276,6 +333,7 @@ Status TxnWIMetaManager::_onAction(Action action, TxnWIMeta& twim) {
             }
             case Action::onFinalize:
             case Action::onFinalized:
+            case Action::onFinalizedInPlace:
             case Action::onPersistSucceed:
             case Action::onPersistFail:
             default: {
@@ -291,6 +349,7 @@ Status TxnWIMetaManager::_onAction(Action action, TxnWIMeta& twim) {
                 return _committed(twim);
             }
             case Action::onFinalized:
+            case Action::onFinalizedInPlace:
             case Action::onCreate:
             case Action::onAbort:
             case Action::onPersistSucceed:
@@ -310,6 +369,7 @@ Status TxnWIMetaManager::_onAction(Action action, TxnWIMeta& twim) {
             case Action::onCreate:
             case Action::onCommit:
             case Action::onFinalized:
+            case Action::onFinalizedInPlace:
             case Action::onPersistSucceed:
             case Action::onPersistFail:
             default: {
@@ -326,6 +386,7 @@ Status TxnWIMetaManager::_onAction(Action action, TxnWIMeta& twim) {
             case Action::onCreate:
             case Action::onFinalize:
             case Action::onFinalized:
+            case Action::onFinalizedInPlace:
             case Action::onRetentionWindowExpire:
             case Action::onPersistSucceed:
             case Action::onPersistFail:
@@ -337,6 +398,10 @@ Status TxnWIMetaManager::_onAction(Action action, TxnWIMeta& twim) {
             case Action::onFinalized: {
                 return _finalizedPIP(twim);
             }
+            case Action::onFinalizedInPlace: {
+                // the end of the txn is persisted in its TxnRecord in this partition
+                return _finalized(twim, true);
+            }
             case Action::onFinalize: {
                 return _finalizing(twim);
             }
@@ -363,6 +428,7 @@ Status TxnWIMetaManager::_onAction(Action action, TxnWIMeta& twim) {
             case Action::onAbort:
             case Action::onFinalize:
             case Action::onFinalized:
+            case Action::onFinalizedInPlace:
             case Action::onRetentionWindowExpire:
             default: {
                 return Statuses::S500_Internal_Server_Error(fmt::format("Action {} not supported in state {}", action, twim.state));
@@ -74,6 +74,11 @@ struct TxnWIMeta {
     seastar::future<> bgTaskFut = seastar::make_ready_future();
 }; // struct TxnWIMeta
 
+template <>
+struct PersistedRecordTraits<TxnWIMeta> {
+    static constexpr PersistedRecordType type = PersistedRecordType::TxnWIMeta;
+};
+
 class TxnWIMetaManager {
 public:
     TxnWIMetaManager();
@@ -112,6 +117,19 @@ public:
     // Set the state to finalized
     Status finalizedTxn(dto::Timestamp txnId);
 
+    // Stop tracking a txn whose WIs were finalized at its TRH in this partition (one-phase commit). Unlike
+    // finalizedTxn(), nothing is persisted: the TxnRecord which holds the end action finalizes the txn again on recovery
+    Status finalizedInPlace(dto::Timestamp txnId);
+
+    // Apply a twim read back from persistence. Only used during recovery, before we start serving requests
+    void replay(TxnWIMeta&& twim);
+
+    // Register a recovered WI with the twim for its transaction
+    void replayWrite(dto::Timestamp txnId, dto::Key&& key);
+
+    // Append the twims which need to survive a restart to the given indexer snapshot
+    void snapshot(Persistence& snapshot);
+
 private:
     // timer to check for retention window expiry
     PeriodicTimer _rwTimer;
@@ -123,6 +141,7 @@ private:
         onAbort,
         onFinalize,
         onFinalized,
+        onFinalizedInPlace,
         onRetentionWindowExpire,
         onPersistSucceed,
         onPersistFail
@@ -24,6 +24,14 @@ Copyright(c) 2020 Futurewei Cloud
 #include "k23si_client.h"
 #include "query.h"
 
+#include <algorithm>
+#include <optional>
+#include <queue>
+#include <utility>
+
+#include <seastar/core/queue.hh>
+#include <seastar/core/semaphore.hh>
+
 namespace k2 {
 
 K2TxnHandle::K2TxnHandle(dto::K23SI_MTR&& mtr, K2TxnOptions options, cpo::CPOClient* cpo, K23SIClient* client, Duration d) noexcept : _mtr(std::move(mtr)), _options(std::move(options)), _cpo_client(cpo), _client(client), _valid(true), _failed(false),    _failed_status(Statuses::S200_OK("default fail status")), _txn_end_deadline(d), _start_time(Clock::now()),
@@ -31,6 +39,55 @@ K2TxnHandle::K2TxnHandle(dto::K23SI_MTR&& mtr, K2TxnOptions options, cpo::CPOCli
     K2LOG_D(log::skvclient, "ctor, mtr={}", _mtr);
 }
 
+K2TxnHandle::K2TxnHandle(K2TxnHandle&& o) noexcept {
+    *this = std::move(o);
+}
+
+K2TxnHandle& K2TxnHandle::operator=(K2TxnHandle&& o) noexcept {
+    if (this == &o) {
+        return *this;
+    }
+    // the txn of this handle, if any, is abandoned
+    if (_client && _heartbeat_started) {
+        _client->_unregisterHeartbeat(this);
+    }
+    bool heartbeat = o._client && o._heartbeat_started;
+    if (heartbeat) {
+        o._client->_unregisterHeartbeat(&o);
+    }
+
+    _mtr = std::move(o._mtr);
+    _options = std::move(o._options);
+    _cpo_client = o._cpo_client;
+    _client = o._client;
+    _valid = std::exchange(o._valid, false);
+    _failed = o._failed;
+    _failed_status = std::move(o._failed_status);
+    _txn_end_deadline = o._txn_end_deadline;
+    _start_time = o._start_time;
+    _ongoing_ops = o._ongoing_ops;
+    _async_writes = o._async_writes;
+    _async_sends = std::exchange(o._async_sends, seastar::make_ready_future());
+    _write_ranges = std::move(o._write_ranges);
+    _trh_key = std::move(o._trh_key);
+    _trh_collection = std::move(o._trh_collection);
+    _trh_created = o._trh_created;
+    _startTime = o._startTime;
+
+    if (heartbeat) {
+        _heartbeat_started = true;
+        _client->_registerHeartbeat(this);
+    }
+    return *this;
+}
+
+K2TxnHandle::~K2TxnHandle() {
+    // ended txns are not heartbeated, so the client is only touched for txns which were abandoned
+    if (_client && _heartbeat_started) {
+        _client->_unregisterHeartbeat(this);
+    }
+}
+
 void K2TxnHandle::_checkResponseStatus(Status& status) {
     if (status == dto::K23SIStatus::AbortConflict ||
         status == dto::K23SIStatus::AbortRequestTooOld ||
@@ -50,34 +107,14 @@ void K2TxnHandle::_checkResponseStatus(Status& status) {
     }
 }
 
-void K2TxnHandle::_makeHeartbeatTimer() {
-    K2LOG_D(log::skvclient, "makehb, mtr={}", _mtr);
-    _heartbeat_timer.setCallback([this] {
-        _client->heartbeats++;
-
-        auto request = std::make_unique<dto::K23SITxnHeartbeatRequest>(
-            dto::K23SITxnHeartbeatRequest {
-                .pvid{}, // will be filled by PartitionRequest
-                .collectionName=_trh_collection,
-                .key=_trh_key.value(),
-                .mtr=_mtr
-            });
-
-        K2LOG_D(log::skvclient, "send hb for mtr={}", _mtr);
-
-        return _cpo_client->partitionRequest<dto::K23SITxnHeartbeatRequest, dto::K23SITxnHeartbeatResponse, dto::Verbs::K23SI_TXN_HEARTBEAT>(Deadline(_heartbeat_interval), *request)
-        .then([this] (auto&& response) {
-            auto& [status, k2response] = response;
-            _checkResponseStatus(status);
-            if (_failed) {
-                K2LOG_D(log::skvclient, "txn failed: cancelling hb in mtr={}", _mtr);
-                _heartbeat_timer.cancel();
-            }
-        }).finally([request=std::move(request)] {
-            (void)request;
-            // Memory freed after request is out of scope
-        });
-    });
+void K2TxnHandle::_startHeartbeat() {
+    if (_heartbeat_started) {
+        return;
+    }
+    K2ASSERT(log::skvclient, _cpo_client->collections.find(_trh_collection) != _cpo_client->collections.end(), "collection not present after successful write");
+    K2LOG_D(log::skvclient, "Starting hb, mtr={}", _mtr);
+    _heartbeat_started = true;
+    _client->_registerHeartbeat(this);
 }
 
 std::unique_ptr<dto::K23SIReadRequest> K2TxnHandle::_makeReadRequest(
@@ -123,9 +160,13 @@ seastar::future<ReadResult<dto::SKVRecord>> K2TxnHandle::read(dto::Key key, Stri
     _client->read_ops++;
     _ongoing_ops++;
 
-    return _cpo_client->partitionRequest
-        <dto::K23SIReadRequest, dto::K23SIReadResponse, dto::Verbs::K23SI_READ>
-        (_options.deadline, *request).
+    auto* req = request.get();
+    return _asyncSendsBarrier()
+        .then([this, req] {
+            return _cpo_client->partitionRequest
+                <dto::K23SIReadRequest, dto::K23SIReadResponse, dto::Verbs::K23SI_READ>
+                (_options.deadline, *req);
+        }).
         then([this, schemaName=std::move(key.schemaName), &collName=request->collectionName] (auto&& response) {
             auto& [status, k2response] = response;
             _checkResponseStatus(status);
@@ -137,29 +178,409 @@ seastar::future<ReadResult<dto::SKVRecord>> K2TxnHandle::read(dto::Key key, Stri
                             ReadResult<dto::SKVRecord>(std::move(status), dto::SKVRecord()));
             }
 
-            return _client->getSchema(collName, schemaName, k2response.value.schemaVersion)
-            .then([s=std::move(status), storage=std::move(k2response.value), &collName] (auto&& response) mutable {
-                auto& [status, schema_ptr] = response;
-                K2LOG_D(log::skvclient, "got status for getSchema: {}", status);
+            return _makeReadResult(std::move(status), std::move(k2response.value), collName, std::move(schemaName));
+        }).finally([r = std::move(request), reporter=std::move(reporter)] () mutable {
+            (void)r;
+            reporter.report();
+        });
+}
 
-                if (!status.is2xxOK()) {
-                    return seastar::make_ready_future<ReadResult<dto::SKVRecord>>(
-                        ReadResult<dto::SKVRecord>(
-                        dto::K23SIStatus::OperationNotAllowed("Matching schema could not be found"),
-                        dto::SKVRecord()));
+seastar::future<ReadResult<dto::SKVRecord>>
+K2TxnHandle::_makeReadResult(Status status, dto::SKVRecord::Storage&& storage, String collection, String schemaName) {
+    auto schemaVersion = storage.schemaVersion;
+    return _client->getSchema(collection, schemaName, schemaVersion)
+    .then([s=std::move(status), storage=std::move(storage), collName=std::move(collection)] (auto&& response) mutable {
+        auto& [status, schema_ptr] = response;
+        K2LOG_D(log::skvclient, "got status for getSchema: {}", status);
+
+        if (!status.is2xxOK()) {
+            return seastar::make_ready_future<ReadResult<dto::SKVRecord>>(
+                ReadResult<dto::SKVRecord>(
+                dto::K23SIStatus::OperationNotAllowed("Matching schema could not be found"),
+                dto::SKVRecord()));
+        }
+
+        dto::SKVRecord skv_record(collName, schema_ptr, std::move(storage), true);
+        return seastar::make_ready_future<ReadResult<dto::SKVRecord>>(
+                ReadResult<dto::SKVRecord>(std::move(s), std::move(skv_record)));
+    });
+}
+
+seastar::future<std::vector<ReadResult<dto::SKVRecord>>> K2TxnHandle::multiRead(std::vector<dto::Key> keys, String collection) {
+    k2::OperationLatencyReporter reporter(_client->_multiReadLatency);
+    if (!_valid) {
+        return seastar::make_exception_future<std::vector<ReadResult<dto::SKVRecord>>>(
+                K23SIClientException("Invalid use of K2TxnHandle"));
+    }
+
+    std::vector<String> schemaNames;
+    schemaNames.reserve(keys.size());
+    for (auto& key : keys) {
+        schemaNames.push_back(key.schemaName);
+    }
+
+    return _multiRead(std::move(keys), collection)
+        .then([this, collection, schemaNames=std::move(schemaNames)] (auto&& results) mutable {
+            std::vector<seastar::future<ReadResult<dto::SKVRecord>>> futs;
+            futs.reserve(results.size());
+            for (size_t i = 0; i < results.size(); ++i) {
+                auto& result = results[i];
+                if (!result.status.is2xxOK()) {
+                    futs.push_back(seastar::make_ready_future<ReadResult<dto::SKVRecord>>(
+                        ReadResult<dto::SKVRecord>(std::move(result.status), dto::SKVRecord())));
+                    continue;
                 }
+                futs.push_back(_makeReadResult(std::move(result.status), std::move(result.value), collection, std::move(schemaNames[i])));
+            }
+            return seastar::when_all_succeed(futs.begin(), futs.end());
+        }).finally([reporter=std::move(reporter)] () mutable {
+            reporter.report();
+        });
+}
 
-                dto::SKVRecord skv_record(collName, schema_ptr, std::move(storage), true);
-                return seastar::make_ready_future<ReadResult<dto::SKVRecord>>(
-                        ReadResult<dto::SKVRecord>(std::move(s), std::move(skv_record)));
+seastar::future<std::vector<ReadResult<dto::SKVRecord::Storage>>>
+K2TxnHandle::_multiRead(std::vector<dto::Key> keys, String collection) {
+    using Result = ReadResult<dto::SKVRecord::Storage>;
+    if (_failed) {
+        std::vector<Result> results;
+        for (size_t i = 0; i < keys.size(); ++i) {
+            results.emplace_back(_failed_status, dto::SKVRecord::Storage{});
+        }
+        return seastar::make_ready_future<std::vector<Result>>(std::move(results));
+    }
+    if (keys.empty()) {
+        return seastar::make_ready_future<std::vector<Result>>();
+    }
+
+    K2LOG_D(log::skvclient, "making multi-read request for {} keys, collection={}", keys.size(), collection);
+    _client->multi_read_ops++;
+    _client->read_ops += keys.size();
+    _ongoing_ops++;
+
+    auto routingKey = keys[0];
+    return _asyncSendsBarrier()
+    .then([this, collection, routingKey=std::move(routingKey)] {
+        return _cpo_client->getPartitionGetterWithRetry(_options.deadline, collection, routingKey);
+    })
+    .then([this, keys=std::move(keys), collection=std::move(collection)] (auto&& result) mutable {
+        auto& [status, pgetter] = result;
+        std::vector<std::optional<Result>> results(keys.size());
+        std::vector<MultiReadGroup> groups;
+        if (!status.is2xxOK()) {
+            _checkResponseStatus(status);
+            for (auto& r : results) {
+                r.emplace(status, dto::SKVRecord::Storage{});
+            }
+        }
+        else {
+            // group the keys by the partition which owns them
+            std::unordered_map<dto::Partition*, size_t> groupIndex;
+            for (size_t i = 0; i < keys.size(); ++i) {
+                auto* partition = pgetter->getPartitionForKey(keys[i]).partition;
+                auto [it, inserted] = groupIndex.try_emplace(partition, groups.size());
+                if (inserted) {
+                    groups.push_back(MultiReadGroup{
+                        .request = dto::K23SIMultiReadRequest{
+                            .pvid = dto::PVID{}, // Will be filled in by PartitionRequest
+                            .collectionName = collection,
+                            .mtr = _mtr,
+                            .key = keys[i],
+                            .keys = {}
+                        },
+                        .indexes = {}
+                    });
+                }
+                auto& group = groups[it->second];
+                group.request.keys.push_back(std::move(keys[i]));
+                group.indexes.push_back(i);
+            }
+        }
+
+        return seastar::do_with(std::move(groups), std::move(results), std::move(collection),
+            [this] (auto& groups, auto& results, auto& collection) {
+            return seastar::parallel_for_each(groups, [this, &results, &collection] (MultiReadGroup& group) {
+                return _cpo_client->partitionRequest
+                    <dto::K23SIMultiReadRequest, dto::K23SIMultiReadResponse, dto::Verbs::K23SI_MULTI_READ>
+                    (_options.deadline, group.request)
+                .then([this, &group, &results, &collection] (auto&& response) {
+                    auto& [status, k2response] = response;
+                    K2LOG_D(log::skvclient, "got multi-read status={} for {} keys", status, group.indexes.size());
+                    _checkResponseStatus(status);
+                    if (status.is2xxOK() && k2response.statuses.size() != group.indexes.size()) {
+                        status = dto::K23SIStatus::InternalError("multi-read response does not match the request");
+                    }
+
+                    std::vector<seastar::future<>> rereads;
+                    for (size_t i = 0; i < group.indexes.size(); ++i) {
+                        auto idx = group.indexes[i];
+                        if (!status.is2xxOK()) {
+                            results[idx].emplace(status, dto::SKVRecord::Storage{});
+                            continue;
+                        }
+                        auto& keyStatus = k2response.statuses[i];
+                        if (keyStatus == dto::K23SIStatus::RefreshCollection) {
+                            // The partition map changed since we grouped the keys. Read this key on its own,
+                            // which refreshes the map
+                            rereads.push_back(_readStorage(group.request.keys[i], collection)
+                                .then([&results, idx] (Result&& result) {
+                                    results[idx].emplace(std::move(result));
+                                }));
+                            continue;
+                        }
+                        _checkResponseStatus(keyStatus);
+                        results[idx].emplace(std::move(keyStatus), std::move(k2response.values[i]));
+                    }
+                    return seastar::when_all_succeed(rereads.begin(), rereads.end()).discard_result();
+                });
+            })
+            .then([&results] {
+                std::vector<Result> ordered;
+                ordered.reserve(results.size());
+                for (auto& result : results) {
+                    ordered.push_back(std::move(*result));
+                }
+                return ordered;
             });
-        }).finally([r = std::move(request), reporter=std::move(reporter)] () mutable {
+        });
+    }).finally([this] {
+        _ongoing_ops--;
+    });
+}
+
+seastar::future<ReadResult<dto::SKVRecord::Storage>> K2TxnHandle::_readStorage(const dto::Key& key, const String& collection) {
+    std::unique_ptr<dto::K23SIReadRequest> request = _makeReadRequest(key, collection);
+    return _cpo_client->partitionRequest
+        <dto::K23SIReadRequest, dto::K23SIReadResponse, dto::Verbs::K23SI_READ>
+        (_options.deadline, *request).
+        then([this] (auto&& response) {
+            auto& [status, k2response] = response;
+            _checkResponseStatus(status);
+            return ReadResult<dto::SKVRecord::Storage>(std::move(status), std::move(k2response.value));
+        }).finally([r = std::move(request)] () mutable {
             (void)r;
-            reporter.report();
         });
 }
 
 
+seastar::future<std::vector<WriteResult>> K2TxnHandle::_multiWrite(std::vector<dto::K23SIWriteRequest>&& requests) {
+    if (requests.empty()) {
+        return seastar::make_ready_future<std::vector<WriteResult>>();
+    }
+
+    K2LOG_D(log::skvclient, "making multi-write request for {} records", requests.size());
+    _client->multi_write_ops++;
+    _ongoing_ops++;
+
+    // the positions of the requests in each collection
+    std::unordered_map<String, std::vector<size_t>> collections;
+    for (size_t i = 0; i < requests.size(); ++i) {
+        collections[requests[i].collectionName].push_back(i);
+    }
+    std::vector<std::optional<WriteResult>> results(requests.size());
+
+    return seastar::do_with(std::move(requests), std::move(results), std::move(collections), std::vector<MultiWriteGroup>(),
+        [this] (auto& requests, auto& results, auto& collections, auto& groups) {
+        return seastar::parallel_for_each(collections, [this, &requests, &results, &groups] (auto& entry) {
+            auto& indexes = entry.second;
+            return _cpo_client->getPartitionGetterWithRetry(_options.deadline, entry.first, requests[indexes[0]].key)
+            .then([this, &requests, &results, &groups, &indexes] (auto&& result) {
+                auto& [status, pgetter] = result;
+                if (!status.is2xxOK()) {
+                    _checkResponseStatus(status);
+                    for (auto idx : indexes) {
+                        results[idx].emplace(status, dto::K23SIWriteResponse{});
+                    }
+                    return;
+                }
+
+                // group the writes by the partition which owns them
+                std::unordered_map<dto::Partition*, size_t> groupIndex;
+                for (auto idx : indexes) {
+                    auto& request = requests[idx];
+                    auto* partition = pgetter->getPartitionForKey(request.key).partition;
+                    auto [it, inserted] = groupIndex.try_emplace(partition, groups.size());
+                    if (inserted) {
+                        groups.push_back(MultiWriteGroup{
+                            .request = dto::K23SIMultiWriteRequest{
+                                .pvid = dto::PVID{}, // Will be filled in by PartitionRequest
+                                .collectionName = request.collectionName,
+                                .mtr = _mtr,
+                                .trh = request.trh,
+                                .trhCollection = request.trhCollection,
+                                .designateTRH = false,
+                                .key = request.key,
+                                .writes = {}
+                            },
+                            .indexes = {}
+                        });
+                    }
+                    auto& group = groups[it->second];
+                    if (request.designateTRH) {
+                        // the server creates the TR for the routing key
+                        group.request.designateTRH = true;
+                        group.request.key = request.key;
+                    }
+                    group.request.writes.push_back(dto::K23SIMultiWriteRecord{
+                        .isDelete = request.isDelete,
+                        .precondition = request.precondition,
+                        .request_id = request.request_id,
+                        .key = request.key,
+                        .value = request.value.share(),
+                        .fieldsForPartialUpdate = request.fieldsForPartialUpdate
+                    });
+                    group.indexes.push_back(idx);
+                }
+            });
+        })
+        .then([this] {
+            return _asyncSendsBarrier();
+        })
+        .then([this, &requests, &results, &groups] {
+            // The TR must exist before any of our WIs can be pushed, so the group which creates it goes first
+            auto trhGroup = std::find_if(groups.begin(), groups.end(), [] (auto& group) { return group.request.designateTRH; });
+            auto trhFut = trhGroup == groups.end() ? seastar::make_ready_future<>() :
+                                                     _sendMultiWriteGroup(*trhGroup, requests, results);
+            return trhFut.then([this, &requests, &results, &groups] {
+                return seastar::parallel_for_each(groups, [this, &requests, &results] (MultiWriteGroup& group) {
+                    if (group.request.designateTRH) {
+                        return seastar::make_ready_future<>();
+                    }
+                    return _sendMultiWriteGroup(group, requests, results);
+                });
+            });
+        })
+        .then([this, &results] {
+            std::vector<WriteResult> ordered;
+            ordered.reserve(results.size());
+            bool anyWritten = false;
+            for (auto& result : results) {
+                anyWritten |= result->status.is2xxOK() || result->status == dto::K23SIStatus::ConditionFailed;
+                ordered.push_back(std::move(*result));
+            }
+
+            if (anyWritten) {
+                _startHeartbeat();
+            }
+            return ordered;
+        });
+    }).finally([this] {
+        _ongoing_ops--;
+    });
+}
+
+seastar::future<> K2TxnHandle::_sendMultiWriteGroup(MultiWriteGroup& group, std::vector<dto::K23SIWriteRequest>& requests,
+                                                    std::vector<std::optional<WriteResult>>& results) {
+    return _cpo_client->partitionRequest
+        <dto::K23SIMultiWriteRequest, dto::K23SIMultiWriteResponse, dto::Verbs::K23SI_MULTI_WRITE>
+        (_options.deadline, group.request)
+    .then([this, &group, &requests, &results] (auto&& response) {
+        auto& [status, k2response] = response;
+        K2LOG_D(log::skvclient, "got multi-write status={} for {} writes", status, group.indexes.size());
+        if (status.is2xxOK() && k2response.statuses.size() != group.indexes.size()) {
+            status = dto::K23SIStatus::InternalError("multi-write response does not match the request");
+        }
+        _checkTRHCreated(status, group.request);
+        if (!status.is2xxOK()) {
+            _registerRangeForWrite(status, group.request);
+            _checkResponseStatus(status);
+            for (auto idx : group.indexes) {
+                results[idx].emplace(status, dto::K23SIWriteResponse{});
+            }
+            return seastar::make_ready_future<>();
+        }
+
+        std::vector<seastar::future<>> rewrites;
+        for (size_t i = 0; i < group.indexes.size(); ++i) {
+            auto idx = group.indexes[i];
+            auto& writeStatus = k2response.statuses[i];
+            if (writeStatus == dto::K23SIStatus::RefreshCollection) {
+                // The partition map changed since we grouped the writes. Send this one on its own,
+                // which refreshes the map
+                rewrites.push_back(_writeRequest(requests[idx])
+                    .then([&results, idx] (WriteResult&& result) {
+                        results[idx].emplace(std::move(result));
+                    }));
+                continue;
+            }
+            _registerRangeForWrite(writeStatus, group.request);
+            _checkResponseStatus(writeStatus);
+            results[idx].emplace(std::move(writeStatus), dto::K23SIWriteResponse{});
+        }
+        return seastar::when_all_succeed(rewrites.begin(), rewrites.end()).discard_result();
+    });
+}
+
+seastar::future<WriteResult> K2TxnHandle::_writeRequest(dto::K23SIWriteRequest& request) {
+    return _cpo_client->partitionRequest
+        <dto::K23SIWriteRequest, dto::K23SIWriteResponse, dto::Verbs::K23SI_WRITE>
+        (_options.deadline, request).
+        then([this, &request] (auto&& response) {
+            auto& [status, k2response] = response;
+            _registerRangeForWrite(status, request);
+            _checkTRHCreated(status, request);
+            _checkResponseStatus(status);
+            return WriteResult(std::move(status), std::move(k2response));
+        });
+}
+
+seastar::future<WriteResult> K2TxnHandle::_asyncWrite(std::unique_ptr<dto::K23SIWriteRequest> request) {
+    _client->async_write_ops++;
+    _async_writes++;
+    // chain the sends so that the writes reach each partition in the order in which they were issued
+    _async_sends = _async_sends.then([this, request=std::move(request)] () mutable {
+        return _sendAsyncWrite(*request).finally([request=std::move(request)] {
+            (void)request;
+        });
+    });
+    return seastar::make_ready_future<WriteResult>(WriteResult(dto::K23SIStatus::Created("async write sent"), dto::K23SIWriteResponse{}));
+}
+
+seastar::future<> K2TxnHandle::_asyncSendsBarrier() {
+    if (_async_sends.available()) {
+        return seastar::make_ready_future();
+    }
+    // keep the chain going so that later async writes are still sent after the current ones
+    seastar::promise<> sent;
+    auto fut = sent.get_future();
+    _async_sends = _async_sends.then([sent=std::move(sent)] () mutable {
+        sent.set_value();
+    });
+    return fut;
+}
+
+seastar::future<> K2TxnHandle::_sendAsyncWrite(dto::K23SIWriteRequest& request) {
+    return _cpo_client->getPartitionGetterWithRetry(_options.deadline, request.collectionName, request.key)
+        .then([this, &request] (auto&& result) {
+            auto& [status, pgetter] = result;
+            if (!status.is2xxOK()) {
+                K2LOG_D(log::skvclient, "unable to find partition for async write in mtr={} due to {}", _mtr, status);
+                _failed = true;
+                _failed_status = std::move(status);
+                return seastar::make_ready_future();
+            }
+            auto& partition = pgetter->getPartitionForKey(request.key);
+            if (!partition.partition || partition.partition->astate != dto::AssignmentState::Assigned) {
+                K2LOG_D(log::skvclient, "partition not assigned for async write in mtr={}", _mtr);
+                _failed = true;
+                _failed_status = Statuses::S503_Service_Unavailable("partition not assigned for async write");
+                return seastar::make_ready_future();
+            }
+            request.pvid = partition.partition->keyRangeV.pvid;
+            // a failed write does not leave a WI, but we can't tell here so we always finalize its range
+            _write_ranges[request.collectionName].insert(partition.partition->keyRangeV);
+
+            auto payload = partition.preferredEndpoint->newPayload();
+            payload->write(request);
+            K2LOG_D(log::skvclient, "sending async write to url={}, request={}", partition.preferredEndpoint->url, request);
+            return RPC().send(dto::Verbs::K23SI_ASYNC_WRITE, std::move(payload), *partition.preferredEndpoint);
+        })
+        .handle_exception([this] (auto exc) {
+            K2LOG_W_EXC(log::skvclient, exc, "unable to send async write in mtr={}", _mtr);
+            _failed = true;
+            _failed_status = dto::K23SIStatus::InternalError("unable to send async write");
+        });
+}
+
 std::unique_ptr<dto::K23SIWriteRequest> K2TxnHandle::_makeWriteRequest(dto::SKVRecord& record, bool erase,
                                                                     dto::ExistencePrecondition precondition) {
     for (const String& key : record.partitionKeys) {
@@ -221,12 +642,19 @@ std::unique_ptr<dto::K23SIWriteRequest> K2TxnHandle::_makePartialUpdateRequest(d
 }
 
 seastar::future<EndResult> K2TxnHandle::end(bool shouldCommit) {
+    if (_valid && !_async_sends.available()) {
+        // the ranges of async writes are registered as they are sent
+        return std::exchange(_async_sends, seastar::make_ready_future()).then([this, shouldCommit] {
+            return end(shouldCommit);
+        });
+    }
     k2::OperationLatencyReporter reporter(_client->_txnEndLatency);
     if (!_valid) {
         return seastar::make_exception_future<EndResult>(K23SIClientException("Tried to end() an invalid TxnHandle"));
     }
     // User is not allowed to call anything else on this TxnHandle after end()
     _valid = false;
+    _client->_unregisterHeartbeat(this);
 
     if (_ongoing_ops != 0) {
         return seastar::make_exception_future<EndResult>(K23SIClientException("Tried to end() with ongoing ops"));
@@ -265,9 +693,7 @@ seastar::future<EndResult> K2TxnHandle::end(bool shouldCommit) {
         std::move(_write_ranges),
         _options.syncFinalize
     };
-
-    K2LOG_D(log::skvclient, "Cancel hb for {}", _mtr);
-    _heartbeat_timer.cancel();
+    request->asyncWrites = _async_writes;
 
     K2LOG_D(log::skvclient, "Cancelled hb for {} and now ending txn", _mtr);
     return _cpo_client->partitionRequest
@@ -293,18 +719,16 @@ seastar::future<EndResult> K2TxnHandle::end(bool shouldCommit) {
             }
 
             K2LOG_D(log::skvclient, "txn {} end request was accepted", _mtr);
-            return _heartbeat_timer.stop().then([this, s=std::move(status)] () {
-                auto time_spent = Clock::now() - _start_time;
-                K2LOG_D(log::skvclient, "time {}, spent: {}", _mtr, time_spent);
-                auto minTransTime = _client->getTSOErrorbound();
-                if (time_spent < minTransTime) {
-                    auto sleep = minTransTime - time_spent;
-                    return seastar::sleep(sleep).then([s=std::move(s)] () {
-                        return seastar::make_ready_future<EndResult>(EndResult(std::move(s)));
-                    });
-                }
-                return seastar::make_ready_future<EndResult>(EndResult(std::move(s)));
-            });
+            auto time_spent = Clock::now() - _start_time;
+            K2LOG_D(log::skvclient, "time {}, spent: {}", _mtr, time_spent);
+            auto minTransTime = _client->getTSOErrorbound();
+            if (time_spent < minTransTime) {
+                auto sleep = minTransTime - time_spent;
+                return seastar::sleep(sleep).then([s=std::move(status)] () {
+                    return seastar::make_ready_future<EndResult>(EndResult(std::move(s)));
+                });
+            }
+            return seastar::make_ready_future<EndResult>(EndResult(std::move(status)));
         }).finally([this, request, reporter=std::move(reporter)] () mutable {
             delete request;
             reporter.report();
@@ -319,15 +743,21 @@ K23SIClient::K23SIClient(const K23SIClientConfig &) :
     std::vector<sm::label_instance> labels;
     _metric_groups.add_group("K23SI_client", {
         sm::make_counter("read_ops", read_ops, sm::description("Total K23SI Read operations"), labels),
+        sm::make_counter("multi_read_ops", multi_read_ops, sm::description("Total K23SI Multi-key Read operations"), labels),
         sm::make_counter("write_ops", write_ops, sm::description("Total K23SI Write/Delete operations"), labels),
+        sm::make_counter("multi_write_ops", multi_write_ops, sm::description("Total K23SI Multi-key Write operations"), labels),
+        sm::make_counter("async_write_ops", async_write_ops, sm::description("Total K23SI Write operations sent without waiting for a response"), labels),
         sm::make_counter("total_txns", total_txns, sm::description("Total K23SI transactions began"), labels),
         sm::make_counter("successful_txns", successful_txns, sm::description("Total K23SI transactions ended successfully (committed or user aborted)"), labels),
         sm::make_counter("abort_conflicts", abort_conflicts, sm::description("Total K23SI transactions aborted due to conflict"), labels),
         sm::make_counter("abort_too_old", abort_too_old, sm::description("Total K23SI transactions aborted due to retention window expiration"), labels),
         sm::make_counter("heartbeats", heartbeats, sm::description("Total K23SI transaction heartbeats sent"), labels),
+        sm::make_counter("multi_heartbeats", multi_heartbeats, sm::description("Total K23SI heartbeat messages sent for multiple transactions"), labels),
 
         sm::make_histogram("read_latency", [this]{ return _readLatency.getHistogram();}, sm::description("Latency of reads"), labels),
+        sm::make_histogram("multi_read_latency", [this]{ return _multiReadLatency.getHistogram();}, sm::description("Latency of multi-key reads"), labels),
         sm::make_histogram("write_latency", [this]{ return _writeLatency.getHistogram();}, sm::description("Latency of writes"), labels),
+        sm::make_histogram("multi_write_latency", [this]{ return _multiWriteLatency.getHistogram();}, sm::description("Latency of multi-key writes"), labels),
         sm::make_histogram("partial_update_latency", [this]{ return _partialUpdateLatency.getHistogram();}, sm::description("Latency of writes"), labels),
         sm::make_histogram("txn_begin_latency", [this]{ return _txnBeginLatency.getHistogram();}, sm::description("Latency of txn begin request"), labels),
         sm::make_histogram("txn_end_latency", [this]{ return _txnEndLatency.getHistogram();}, sm::description("Latency of txn end request"), labels),
@@ -347,7 +777,142 @@ seastar::future<> K23SIClient::start() {
 }
 
 seastar::future<> K23SIClient::gracefulStop() {
-    return seastar::make_ready_future<>();
+    std::vector<seastar::future<>> futs;
+    for (auto& [cname, batch] : _heartbeatBatches) {
+        batch->txns.clear();
+        futs.push_back(batch->timer.stop());
+    }
+    return seastar::when_all_succeed(futs.begin(), futs.end()).discard_result();
+}
+
+void K23SIClient::_registerHeartbeat(K2TxnHandle* txn) {
+    auto& batch = _heartbeatBatches[txn->_trh_collection];
+    if (!batch) {
+        batch = std::make_unique<HeartbeatBatch>();
+        batch->interval = cpo_client.collections[txn->_trh_collection]->collection.metadata.heartbeatDeadline / 2;
+        batch->timer.setCallback([this, cname=txn->_trh_collection, batch=batch.get()] {
+            return _sendHeartbeats(cname, *batch);
+        });
+        batch->timer.armPeriodic(batch->interval);
+    }
+    batch->txns.insert(txn);
+}
+
+void K23SIClient::_unregisterHeartbeat(K2TxnHandle* txn) {
+    if (!txn->_heartbeat_started) {
+        return;
+    }
+    txn->_heartbeat_started = false;
+    if (auto it = _heartbeatBatches.find(txn->_trh_collection); it != _heartbeatBatches.end()) {
+        it->second->txns.erase(txn);
+    }
+}
+
+void K23SIClient::_onHeartbeatStatus(HeartbeatBatch& batch, K2TxnHandle* txn, const dto::K23SI_MTR& mtr, Status& status) {
+    // the txn may have ended while the heartbeat was in flight, and its handle may have been reused
+    if (batch.txns.find(txn) == batch.txns.end() || !(txn->_mtr == mtr)) {
+        return;
+    }
+    txn->_checkResponseStatus(status);
+    if (txn->_failed) {
+        K2LOG_D(log::skvclient, "txn failed: cancelling hb in mtr={}", mtr);
+        _unregisterHeartbeat(txn);
+    }
+}
+
+seastar::future<> K23SIClient::_sendHeartbeats(const String& collectionName, HeartbeatBatch& batch) {
+    if (batch.txns.empty()) {
+        return seastar::make_ready_future<>();
+    }
+    auto routingKey = (*batch.txns.begin())->_trh_key.value();
+    return cpo_client.getPartitionGetterWithRetry(Deadline(batch.interval), collectionName, routingKey)
+    .then([this, &batch, collectionName] (auto&& result) {
+        auto& [status, pgetter] = result;
+        if (!status.is2xxOK()) {
+            K2LOG_W(log::skvclient, "unable to get partitions for hb in collection {}: {}", collectionName, status);
+            return seastar::make_ready_future<>();
+        }
+
+        // group the txns by the partition which owns their TRH
+        std::vector<HeartbeatGroup> groups;
+        std::unordered_map<dto::Partition*, size_t> groupIndex;
+        for (K2TxnHandle* txn : batch.txns) {
+            auto& trhKey = txn->_trh_key.value();
+            auto* partition = pgetter->getPartitionForKey(trhKey).partition;
+            auto [it, inserted] = groupIndex.try_emplace(partition, groups.size());
+            if (inserted) {
+                groups.push_back(HeartbeatGroup{
+                    .request = dto::K23SITxnMultiHeartbeatRequest{
+                        .pvid = dto::PVID{}, // Will be filled in by PartitionRequest
+                        .collectionName = collectionName,
+                        .key = trhKey,
+                        .trhKeys = {},
+                        .mtrs = {}
+                    },
+                    .txns = {}
+                });
+            }
+            auto& group = groups[it->second];
+            group.request.trhKeys.push_back(trhKey);
+            group.request.mtrs.push_back(txn->_mtr);
+            group.txns.push_back(txn);
+        }
+
+        return seastar::do_with(std::move(groups), [this, &batch] (auto& groups) {
+            return seastar::parallel_for_each(groups, [this, &batch] (HeartbeatGroup& group) {
+                multi_heartbeats++;
+                heartbeats += group.txns.size();
+                K2LOG_D(log::skvclient, "send hb for {} txns", group.txns.size());
+                return cpo_client.partitionRequest
+                    <dto::K23SITxnMultiHeartbeatRequest, dto::K23SITxnMultiHeartbeatResponse, dto::Verbs::K23SI_TXN_MULTI_HEARTBEAT>
+                    (Deadline(batch.interval), group.request)
+                .then([this, &batch, &group] (auto&& response) {
+                    auto& [status, k2response] = response;
+                    if (status.is2xxOK() && k2response.statuses.size() != group.txns.size()) {
+                        status = dto::K23SIStatus::InternalError("multi-hb response does not match the request");
+                    }
+
+                    // the txns whose TRH was not owned by the partition are heartbeated separately
+                    std::vector<seastar::future<>> retries;
+                    for (size_t i = 0; i < group.txns.size(); ++i) {
+                        Status& txnStatus = status.is2xxOK() ? k2response.statuses[i] : status;
+                        if (txnStatus == dto::K23SIStatus::RefreshCollection) {
+                            retries.push_back(_sendHeartbeat(group.request.collectionName, batch, group.txns[i],
+                                                             group.request.mtrs[i], group.request.trhKeys[i]));
+                            continue;
+                        }
+                        _onHeartbeatStatus(batch, group.txns[i], group.request.mtrs[i], txnStatus);
+                    }
+                    return seastar::when_all_succeed(retries.begin(), retries.end()).discard_result();
+                });
+            });
+        });
+    });
+}
+
+seastar::future<> K23SIClient::_sendHeartbeat(const String& collectionName, HeartbeatBatch& batch, K2TxnHandle* txn,
+                                              const dto::K23SI_MTR& mtr, const dto::Key& trhKey) {
+    // the txn may have ended while the batch heartbeat was in flight
+    if (batch.txns.find(txn) == batch.txns.end() || !(txn->_mtr == mtr)) {
+        return seastar::make_ready_future<>();
+    }
+    auto request = std::make_unique<dto::K23SITxnHeartbeatRequest>(
+        dto::K23SITxnHeartbeatRequest {
+            .pvid{}, // will be filled by PartitionRequest
+            .collectionName=collectionName,
+            .key=trhKey,
+            .mtr=mtr
+        });
+
+    K2LOG_D(log::skvclient, "send single hb for mtr={}", mtr);
+    return cpo_client.partitionRequest<dto::K23SITxnHeartbeatRequest, dto::K23SITxnHeartbeatResponse, dto::Verbs::K23SI_TXN_HEARTBEAT>(Deadline(batch.interval), *request)
+    .then([this, &batch, txn, &mtr=request->mtr] (auto&& response) {
+        auto& [status, k2response] = response;
+        _onHeartbeatStatus(batch, txn, mtr, status);
+    }).finally([request=std::move(request)] {
+        (void)request;
+        // Memory freed after request is out of scope
+    });
 }
 
 seastar::future<Status> K23SIClient::makeCollection(dto::CollectionMetadata&& metadata, std::vector<String>&& rangeEnds) {
@@ -582,9 +1147,193 @@ void K2TxnHandle::_prepareQueryRequest(Query& query) {
     }
 
     query.request.mtr = _mtr;
+    query.aggregator = dto::Aggregator(query.request.aggregation);
     query.inprogress = true;
 }
 
+seastar::future<Status> K2TxnHandle::_initQueryCursors(Query& query) {
+    return _cpo_client->getPartitionGetterWithRetry(_options.deadline, query.request.collectionName)
+    .then([&query] (auto&& result) {
+        auto& [status, pgetter] = result;
+        if (!status.is2xxOK()) {
+            return std::move(status);
+        }
+        if (pgetter->collection.metadata.hashScheme != dto::HashScheme::Range) {
+            // Every partition may hold keys in the query range, so each one is scanned from the start key
+            query.scatter = true;
+            for (const dto::Partition& partition : pgetter->getAllPartitions()) {
+                query.cursors.push_back(Query::PartitionCursor{
+                    .pvid = partition.keyRangeV.pvid,
+                    .key = query.request.key,
+                    .exclusiveKey = query.request.exclusiveKey,
+                    .cursorId = 0,
+                    .done = false
+                });
+            }
+        }
+        return std::move(status);
+    });
+}
+
+seastar::future<QueryResult> K2TxnHandle::_scatterQuery(Query& query) {
+    if (query.ordered && !query.keysProjected) {
+        return seastar::make_exception_future<QueryResult>(
+            K23SIClientException("Ordered query on a hash partitioned collection must project the key fields"));
+    }
+
+    // An unordered page only needs to visit some of the partitions, so we take at most query_scatter_inflight of
+    // them. An ordered page needs results from every partition which isn't done in order to merge them
+    const uint32_t maxInflight = std::max(1u, _client->query_scatter_inflight());
+    std::vector<ScatterPage> pages;
+    for (size_t i = 0; i < query.cursors.size(); ++i) {
+        auto& cursor = query.cursors[i];
+        if (cursor.done) {
+            continue;
+        }
+        if (!query.ordered && pages.size() == maxInflight) {
+            break;
+        }
+        pages.push_back(ScatterPage{
+            .cursor = i,
+            .request = dto::K23SIQueryRequest{
+                .pvid = cursor.pvid,
+                .collectionName = query.request.collectionName,
+                .mtr = query.request.mtr,
+                .key = cursor.key,
+                .endKey = query.request.endKey,
+                .exclusiveKey = cursor.exclusiveKey,
+                .recordLimit = query.request.recordLimit,
+                .includeVersionMismatch = query.request.includeVersionMismatch,
+                .reverseDirection = query.request.reverseDirection,
+                .filterExpression = query.request.filterExpression.share(),
+                .projection = query.request.projection,
+                .aggregation = query.request.aggregation,
+                .cursorId = cursor.cursorId
+            },
+            .result = QueryResult(Statuses::S200_OK(""))
+        });
+    }
+    K2LOG_D(log::skvclient, "scatter query page over {} of {} partitions", pages.size(), query.cursors.size());
+
+    auto inflight = seastar::make_lw_shared<seastar::semaphore>(maxInflight);
+    return seastar::do_with(std::move(pages), [this, &query, inflight] (auto& pages) {
+        return seastar::parallel_for_each(pages, [this, &query, inflight] (ScatterPage& page) {
+            return seastar::with_semaphore(*inflight, 1, [this, &query, &page] {
+                return _cpo_client->partitionRequestByPVID
+                    <dto::K23SIQueryRequest, dto::K23SIQueryResponse, dto::Verbs::K23SI_QUERY>
+                    (_options.deadline, page.request)
+                .then([this, &query, &page] (auto&& response) {
+                    auto& [status, k2response] = response;
+                    _checkResponseStatus(status);
+                    if (!status.is2xxOK()) {
+                        page.result = QueryResult(std::move(status));
+                        return seastar::make_ready_future<>();
+                    }
+
+                    auto& cursor = query.cursors[page.cursor];
+                    if (k2response.nextToScan.partitionKey == "") {
+                        cursor.done = true;
+                    } else {
+                        cursor.key = std::move(k2response.nextToScan);
+                        cursor.exclusiveKey = k2response.exclusiveToken;
+                        cursor.cursorId = k2response.cursorId;
+                    }
+                    query.aggregator.merge(std::move(k2response.aggregates));
+                    return QueryResult::makeQueryResult(_client, query, std::move(status), std::move(k2response))
+                    .then([&page] (QueryResult&& result) {
+                        page.result = std::move(result);
+                    });
+                });
+            });
+        })
+        .then([this, &query, &pages] {
+            for (auto& page : pages) {
+                if (!page.result.status.is2xxOK()) {
+                    query.done = true;
+                    return QueryResult(std::move(page.result.status));
+                }
+            }
+
+            QueryResult result(dto::K23SIStatus::OK("Query success"));
+            if (query.ordered) {
+                result.records = _mergeScatterPages(query, pages);
+            } else {
+                for (auto& page : pages) {
+                    std::move(page.result.records.begin(), page.result.records.end(), std::back_inserter(result.records));
+                }
+            }
+
+            if (query.request.recordLimit >= 0) {
+                // each partition was allowed to return up to the limit
+                if (result.records.size() > (size_t)query.request.recordLimit) {
+                    result.records.resize(query.request.recordLimit);
+                }
+                query.request.recordLimit -= result.records.size();
+            }
+            query.done = query.request.recordLimit == 0 ||
+                std::all_of(query.cursors.begin(), query.cursors.end(), [] (const auto& cursor) { return cursor.done; });
+            if (query.done) {
+                result.aggregates = query.aggregator.release();
+            }
+            return result;
+        });
+    });
+}
+
+std::vector<dto::SKVRecord> K2TxnHandle::_mergeScatterPages(Query& query, std::vector<ScatterPage>& pages) {
+    const bool reverse = query.request.reverseDirection;
+    auto before = [reverse] (const dto::Key& a, const dto::Key& b) { return reverse ? b < a : a < b; };
+
+    // A partition which isn't done will not return keys before its continuation token, so records up to the
+    // smallest such token are in their final order
+    std::optional<dto::Key> bound;
+    std::vector<std::vector<dto::Key>> keys(pages.size());
+    for (size_t i = 0; i < pages.size(); ++i) {
+        auto& cursor = query.cursors[pages[i].cursor];
+        if (!cursor.done && (!bound || before(cursor.key, *bound))) {
+            bound = cursor.key;
+        }
+        for (auto& record : pages[i].result.records) {
+            keys[i].push_back(record.getKey());
+        }
+    }
+
+    // k-way merge of the pages by their next key
+    std::vector<size_t> positions(pages.size(), 0);
+    auto later = [&] (size_t a, size_t b) { return before(keys[b][positions[b]], keys[a][positions[a]]); };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(later)> heads(later);
+    for (size_t i = 0; i < pages.size(); ++i) {
+        if (!keys[i].empty()) {
+            heads.push(i);
+        }
+    }
+
+    std::vector<dto::SKVRecord> merged;
+    while (!heads.empty()) {
+        auto i = heads.top();
+        if (bound && before(*bound, keys[i][positions[i]])) {
+            break;
+        }
+        heads.pop();
+        merged.push_back(std::move(pages[i].result.records[positions[i]]));
+        if (++positions[i] < keys[i].size()) {
+            heads.push(i);
+        }
+    }
+
+    // rewind the partitions whose records didn't make it into this page
+    for (size_t i = 0; i < pages.size(); ++i) {
+        if (positions[i] < keys[i].size()) {
+            auto& cursor = query.cursors[pages[i].cursor];
+            cursor.key = std::move(keys[i][positions[i]]);
+            cursor.exclusiveKey = false;
+            cursor.cursorId = 0;
+            cursor.done = false;
+        }
+    }
+    return merged;
+}
+
 // Get one set of paginated results for a query. User may need to call again with same query
 // object to get more results
 seastar::future<QueryResult> K2TxnHandle::query(Query& query) {
@@ -599,48 +1348,131 @@ seastar::future<QueryResult> K2TxnHandle::query(Query& query) {
     if (query.done) {
         return seastar::make_exception_future<QueryResult>(K23SIClientException("Tried to use Query that is done"));
     }
+
+    auto init = seastar::make_ready_future<Status>(Statuses::S200_OK(""));
     if (!query.inprogress) {
         _prepareQueryRequest(query);
+        init = _initQueryCursors(query);
     }
 
     _client->query_ops++;
     _ongoing_ops++;
 
-    return _cpo_client->partitionRequest
-        <dto::K23SIQueryRequest, dto::K23SIQueryResponse, dto::Verbs::K23SI_QUERY>
-        (_options.deadline, query.request, query.request.reverseDirection, query.request.exclusiveKey)
-    .then([this, &query] (auto&& response) {
-        auto& [status, k2response] = response;
-        _checkResponseStatus(status);
-        _ongoing_ops--;
-
+    return _asyncSendsBarrier()
+    .then([init=std::move(init)] () mutable {
+        return std::move(init);
+    })
+    .then([this, &query] (Status&& status) {
         if (!status.is2xxOK()) {
+            _checkResponseStatus(status);
             query.done = true;
-            return seastar::make_ready_future<QueryResult>(QueryResult(status));
+            return seastar::make_ready_future<QueryResult>(QueryResult(std::move(status)));
         }
-
-        if (k2response.nextToScan.partitionKey == "") {
-            query.done = true;
-        } else {
-            query.request.key = std::move(k2response.nextToScan);
-            query.request.exclusiveKey = std::move(k2response.exclusiveToken);
+        if (query.scatter) {
+            return _scatterQuery(query);
         }
 
-        if (query.request.recordLimit >= 0) {
-            query.request.recordLimit -= k2response.results.size();
-            if (query.request.recordLimit == 0) {
+        return _cpo_client->partitionRequest
+            <dto::K23SIQueryRequest, dto::K23SIQueryResponse, dto::Verbs::K23SI_QUERY>
+            (_options.deadline, query.request, query.request.reverseDirection, query.request.exclusiveKey)
+        .then([this, &query] (auto&& response) {
+            auto& [status, k2response] = response;
+            _checkResponseStatus(status);
+
+            if (!status.is2xxOK()) {
                 query.done = true;
+                return seastar::make_ready_future<QueryResult>(QueryResult(status));
+            }
+
+            if (k2response.nextToScan.partitionKey == "") {
+                query.done = true;
+            } else {
+                query.request.key = std::move(k2response.nextToScan);
+                query.request.exclusiveKey = std::move(k2response.exclusiveToken);
+                query.request.cursorId = k2response.cursorId;
+            }
+
+            if (query.request.recordLimit >= 0) {
+                query.request.recordLimit -= k2response.results.size();
+                if (query.request.recordLimit == 0) {
+                    query.done = true;
+                }
             }
-        }
 
-        return QueryResult::makeQueryResult(_client, query, std::move(status), std::move(k2response));
+            query.aggregator.merge(std::move(k2response.aggregates));
+            return QueryResult::makeQueryResult(_client, query, std::move(status), std::move(k2response))
+            .then([&query] (QueryResult&& result) {
+                if (query.done) {
+                    result.aggregates = query.aggregator.release();
+                }
+                return std::move(result);
+            });
+        });
     })
-    .finally([reporter=std::move(reporter)] () mutable{
+    .finally([this, reporter=std::move(reporter)] () mutable{
+        _ongoing_ops--;
         reporter.report();
     });
 
 }
 
+seastar::future<Status> K2TxnHandle::queryStream(Query& query, QueryPageConsumer consumer, uint32_t prefetchDepth) {
+    if (prefetchDepth == 0) {
+        prefetchDepth = std::max(1u, _client->query_prefetch_depth());
+    }
+
+    // The fetched pages which the consumer hasn't taken yet. An empty optional marks the end of the stream
+    struct StreamState {
+        StreamState(uint32_t depth, QueryPageConsumer&& consumer) : pages(depth), consumer(std::move(consumer)) {}
+        seastar::queue<std::optional<QueryResult>> pages;
+        QueryPageConsumer consumer;
+        Status status{Statuses::S200_OK("")};
+    };
+    auto state = seastar::make_lw_shared<StreamState>(prefetchDepth, std::move(consumer));
+
+    // The producer fetches the next page as soon as the previous one arrived, as long as there is room for it
+    auto producer = seastar::do_until(
+        [&query, state] { return query.isDone() || !state->status.is2xxOK(); },
+        [this, &query, state] {
+            return this->query(query).then([state] (QueryResult&& result) {
+                if (!result.status.is2xxOK()) {
+                    state->status = std::move(result.status);
+                    return seastar::make_ready_future();
+                }
+                return state->pages.push_eventually(std::move(result));
+            });
+        })
+        .then([state] {
+            return state->pages.push_eventually(std::nullopt);
+        })
+        .handle_exception([state] (auto exc) {
+            // unblock the consumer, which reports the failure
+            state->pages.abort(exc);
+        });
+
+    auto consumerLoop = seastar::repeat([state] {
+            return state->pages.pop_eventually()
+            .then([state] (std::optional<QueryResult>&& page) {
+                if (!page) {
+                    return seastar::make_ready_future<seastar::stop_iteration>(seastar::stop_iteration::yes);
+                }
+                return state->consumer(std::move(*page)).then([] {
+                    return seastar::stop_iteration::no;
+                });
+            });
+        })
+        .handle_exception([state] (auto exc) {
+            // unblock the producer
+            state->pages.abort(exc);
+            return seastar::make_exception_future<>(exc);
+        });
+
+    return seastar::when_all_succeed(std::move(producer), std::move(consumerLoop)).discard_result()
+        .then([state] {
+            return std::move(state->status);
+        });
+}
+
 const dto::K23SI_MTR& K2TxnHandle::mtr() const {
     return _mtr;
 }
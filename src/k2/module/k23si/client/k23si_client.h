@@ -37,10 +37,12 @@ Copyright(c) 2020 Futurewei Cloud
 #include <k2/transport/Status.h>
 #include <k2/tso/client/Client.h>
 
+#include <optional>
 #include <random>
 #include <seastar/core/future-util.hh>
 #include <seastar/core/future.hh>
 #include <seastar/core/shared_ptr.hh>
+#include <unordered_set>
 #include <vector>
 
 #include "Log.h"
@@ -59,7 +61,15 @@ public:
     Deadline<> deadline = Deadline<>(Duration(1s));
     dto::TxnPriority priority{dto::TxnPriority::Medium};
     bool syncFinalize = false;
-    K2_DEF_FMT(K2TxnOptions, deadline, priority, syncFinalize);
+    // If set, writes are sent as one-way messages once the first write of the txn has created its record at the TRH,
+    // and write() completes as soon as the write is queued. The partitions report the outcome of each write to the
+    // TRH, and the commit fails if any of the writes failed (including ConditionFailed), or did not report back in
+    // time. Partial updates and multi-writes are still sent as regular writes.
+    // Reads, queries and regular writes in the txn are sent after the async writes issued before them, and each
+    // partition applies its pending async writes of the txn before it serves them, so they observe the async writes.
+    // They do not wait for the outcome at the TRH: a failed async write is only reported by the commit
+    bool asyncWrites = false;
+    K2_DEF_FMT(K2TxnOptions, deadline, priority, syncFinalize, asyncWrites);
 };
 
 template<typename ValueType>
@@ -143,18 +153,28 @@ public:
     ConfigDuration create_collection_deadline{"create_collection_deadline", 1s};
     ConfigDuration retention_window{"retention_window", 600s};
     ConfigDuration txn_end_deadline{"txn_end_deadline", 60s};
+    // max number of partitions queried in parallel by a query on a hash partitioned collection
+    ConfigVar<uint32_t> query_scatter_inflight{"query_scatter_inflight", 8};
+    // default number of pages a streamed query fetches ahead of its consumer
+    ConfigVar<uint32_t> query_prefetch_depth{"query_prefetch_depth", 2};
 
     uint64_t read_ops{0};
+    uint64_t multi_read_ops{0};
     uint64_t write_ops{0};
+    uint64_t multi_write_ops{0};
+    uint64_t async_write_ops{0};
     uint64_t query_ops{0};
     uint64_t total_txns{0};
     uint64_t successful_txns{0};
     uint64_t abort_conflicts{0};
     uint64_t abort_too_old{0};
     uint64_t heartbeats{0};
+    uint64_t multi_heartbeats{0};
 
     k2::ExponentialHistogram _readLatency;
+    k2::ExponentialHistogram _multiReadLatency;
     k2::ExponentialHistogram _writeLatency;
+    k2::ExponentialHistogram _multiWriteLatency;
     k2::ExponentialHistogram _partialUpdateLatency;
     k2::ExponentialHistogram _txnBeginLatency;
     k2::ExponentialHistogram _txnEndLatency;
@@ -169,6 +189,40 @@ public:
     std::unordered_map<String, std::unordered_map<String, std::unordered_map<uint32_t, std::shared_ptr<dto::Schema>>>> schemas;
 
 private:
+    friend class K2TxnHandle;
+
+    // The live transactions with a TRH in the same collection, which are heartbeated together. On each tick, the
+    // transactions whose TRH is in the same partition are heartbeated with one K23SI_TXN_MULTI_HEARTBEAT message
+    struct HeartbeatBatch {
+        Duration interval;
+        PeriodicTimer timer;
+        std::unordered_set<K2TxnHandle*> txns;
+    };
+
+    // the transactions of one HeartbeatBatch whose TRH is in the same partition
+    struct HeartbeatGroup {
+        dto::K23SITxnMultiHeartbeatRequest request;
+        std::vector<K2TxnHandle*> txns;
+    };
+
+    void _registerHeartbeat(K2TxnHandle* txn);
+    void _unregisterHeartbeat(K2TxnHandle* txn);
+
+    // Send one heartbeat tick for all the transactions in the given batch
+    seastar::future<> _sendHeartbeats(const String& collectionName, HeartbeatBatch& batch);
+
+    // Heartbeat a single txn with K23SI_TXN_HEARTBEAT, e.g. when the partition map used for the batch was stale.
+    // The txn is skipped if it is no longer in the batch
+    seastar::future<> _sendHeartbeat(const String& collectionName, HeartbeatBatch& batch, K2TxnHandle* txn,
+                                     const dto::K23SI_MTR& mtr, const dto::Key& trhKey);
+
+    // Apply the heartbeat status to the given txn if it is still heartbeated. The txn stops being heartbeated if
+    // the status failed it
+    void _onHeartbeatStatus(HeartbeatBatch& batch, K2TxnHandle* txn, const dto::K23SI_MTR& mtr, Status& status);
+
+    // heartbeat batches by TRH collection name. Batches are kept until the client is stopped
+    std::unordered_map<String, std::unique_ptr<HeartbeatBatch>> _heartbeatBatches;
+
     seastar::future<Status> refreshSchemaCache(const String& collectionName);
     seastar::future<std::tuple<Status, std::shared_ptr<dto::Schema>>> getSchemaInternal(const String& collectionName, const String& schemaName, int64_t schemaVersion, bool doCPORefresh = true);
 
@@ -178,7 +232,10 @@ private:
 
 class K2TxnHandle {
 private:
-    void _makeHeartbeatTimer();
+    friend class K23SIClient;
+
+    // Register this txn with the client's heartbeat scheduler, once the txn record exists at the TRH
+    void _startHeartbeat();
     void _checkResponseStatus(Status& status);
 
     std::unique_ptr<dto::K23SIReadRequest> _makeReadRequest(const dto::Key& key,
@@ -199,6 +256,69 @@ private:
 
     void _prepareQueryRequest(Query& query);
 
+    // Called on the first page of a query. Sets up a cursor for each partition if the collection is hash partitioned
+    seastar::future<Status> _initQueryCursors(Query& query);
+
+    // One partition's page of a query on a hash partitioned collection
+    struct ScatterPage {
+        size_t cursor;
+        dto::K23SIQueryRequest request;
+        QueryResult result{Statuses::S200_OK("")};
+    };
+
+    // Get the next page of a query on a hash partitioned collection. The partitions are scanned in parallel, and
+    // their results are either concatenated, or merged in key order if the query is ordered
+    seastar::future<QueryResult> _scatterQuery(Query& query);
+
+    // Merge the pages of an ordered scatter query. Records past the smallest continuation token of the partitions
+    // which are not done are not returned, and their partitions are rewound so that they are fetched again
+    std::vector<dto::SKVRecord> _mergeScatterPages(Query& query, std::vector<ScatterPage>& pages);
+
+    // the keys of a multi-read which are owned by the same partition, and their positions in the multi-read
+    struct MultiReadGroup {
+        dto::K23SIMultiReadRequest request;
+        std::vector<size_t> indexes;
+    };
+
+    // Read the given keys with one K23SI_MULTI_READ request per partition. The results are the raw record storage,
+    // in the order of the keys
+    seastar::future<std::vector<ReadResult<dto::SKVRecord::Storage>>>
+    _multiRead(std::vector<dto::Key> keys, String collection);
+
+    // Read a single key with K23SI_READ, returning the raw record storage
+    seastar::future<ReadResult<dto::SKVRecord::Storage>> _readStorage(const dto::Key& key, const String& collection);
+
+    // Build an SKVRecord read result from the storage returned by the server, looking up its schema
+    seastar::future<ReadResult<dto::SKVRecord>>
+    _makeReadResult(Status status, dto::SKVRecord::Storage&& storage, String collection, String schemaName);
+
+    // the writes of a multi-write which are owned by the same partition, and their positions in the multi-write
+    struct MultiWriteGroup {
+        dto::K23SIMultiWriteRequest request;
+        std::vector<size_t> indexes;
+    };
+
+    // Send the given write requests with one K23SI_MULTI_WRITE request per partition. The results are in the
+    // order of the requests
+    seastar::future<std::vector<WriteResult>> _multiWrite(std::vector<dto::K23SIWriteRequest>&& requests);
+
+    // Send one group of a multi-write and fill in the results for its writes
+    seastar::future<> _sendMultiWriteGroup(MultiWriteGroup& group, std::vector<dto::K23SIWriteRequest>& requests,
+                                           std::vector<std::optional<WriteResult>>& results);
+
+    // Send a single write with K23SI_WRITE
+    seastar::future<WriteResult> _writeRequest(dto::K23SIWriteRequest& request);
+
+    // Queue the given write to be sent with K23SI_ASYNC_WRITE. Its range is registered once it is sent
+    seastar::future<WriteResult> _asyncWrite(std::unique_ptr<dto::K23SIWriteRequest> request);
+
+    // Send an async write to the partition which owns its key
+    seastar::future<> _sendAsyncWrite(dto::K23SIWriteRequest& request);
+
+    // Resolves once the async writes issued so far have been sent. Other requests to the partitions go out after
+    // this, so that they reach each partition after the async writes which they have to observe
+    seastar::future<> _asyncSendsBarrier();
+
     // Utility method used to register the range for a given write request, after we receive a response for it.
     // We track these ranges so that we can tell the TRH to finalize WIs in them when the transaction ends.
     template <class T>
@@ -224,11 +344,24 @@ private:
         }
     }
 
+    // Utility method used to note that the txn record exists at the TRH, after we receive the response to the write
+    // which designated the TRH. Async writes report their outcome to the TRH, so they are only sent after this point
+    template <class T>
+    void _checkTRHCreated(Status& status, T& request) {
+        if (request.designateTRH && (status.is2xxOK() || status == dto::K23SIStatus::ConditionFailed)) {
+            _trh_created = true;
+        }
+    }
+
 public:
     K2TxnHandle() = default;
-    K2TxnHandle(K2TxnHandle&& o) noexcept = default;
-    K2TxnHandle& operator=(K2TxnHandle&& o) noexcept = default;
+    // The client heartbeats the txn through a pointer to its handle, so a move hands the heartbeat over to the new
+    // handle. A handle must not be moved while any of its operations are in flight
+    K2TxnHandle(K2TxnHandle&& o) noexcept;
+    K2TxnHandle& operator=(K2TxnHandle&& o) noexcept;
     K2TxnHandle(dto::K23SI_MTR&& mtr, K2TxnOptions options, cpo::CPOClient* cpo, K23SIClient* client, Duration d) noexcept;
+    // The txn stops being heartbeated when its handle is destroyed
+    ~K2TxnHandle();
 
     // The dto::Key oriented interface for read. The key should be one obtained from SKVRecord::getKey()
     // and not directly created by the user
@@ -253,9 +386,13 @@ public:
         _client->read_ops++;
         _ongoing_ops++;
 
-        return _cpo_client->partitionRequest
-            <dto::K23SIReadRequest, dto::K23SIReadResponse, dto::Verbs::K23SI_READ>
-            (_options.deadline, *request).
+        auto* req = request.get();
+        return _asyncSendsBarrier()
+            .then([this, req] {
+                return _cpo_client->partitionRequest
+                    <dto::K23SIReadRequest, dto::K23SIReadResponse, dto::Verbs::K23SI_READ>
+                    (_options.deadline, *req);
+            }).
             then([this, request_schema=record.schema, &collName=request->collectionName] (auto&& response) {
                 auto& [status, k2response] = response;
                 _checkResponseStatus(status);
@@ -275,6 +412,53 @@ public:
             });
     }
 
+    // Read a batch of keys from the given collection. The keys are grouped by the partition which owns them, and
+    // each partition is read with a single request. The results are in the order of the keys
+    seastar::future<std::vector<ReadResult<dto::SKVRecord>>> multiRead(std::vector<dto::Key> keys, String collection);
+
+    // The multi-key read interface for user-defined classes with the SKV_RECORD_FIELDS macro defined.
+    // All records must be in the same collection
+    template <class T>
+    seastar::future<std::vector<ReadResult<T>>> multiRead(std::vector<T> records) {
+        k2::OperationLatencyReporter reporter(_client->_multiReadLatency);
+        if (!_valid) {
+            return seastar::make_exception_future<std::vector<ReadResult<T>>>(K23SIClientException("Invalid use of K2TxnHandle"));
+        }
+        if (records.empty()) {
+            return seastar::make_ready_future<std::vector<ReadResult<T>>>();
+        }
+
+        std::vector<dto::Key> keys;
+        keys.reserve(records.size());
+        for (const T& user_record : records) {
+            if (user_record.collectionName != records[0].collectionName) {
+                return seastar::make_exception_future<std::vector<ReadResult<T>>>(
+                    K23SIClientException("All records in a multi-read must be in the same collection"));
+            }
+            dto::SKVRecord record(user_record.collectionName, user_record.schema);
+            user_record.__writeFields(record);
+            keys.push_back(record.getKey());
+        }
+
+        return _multiRead(std::move(keys), records[0].collectionName)
+            .then([collName=records[0].collectionName, request_schema=records[0].schema] (auto&& results) {
+                std::vector<ReadResult<T>> userResults;
+                userResults.reserve(results.size());
+                for (auto& result : results) {
+                    T userResponseRecord{};
+
+                    if (result.status.is2xxOK()) {
+                        dto::SKVRecord skv_record(collName, request_schema, std::move(result.value), true);
+                        userResponseRecord.__readFields(skv_record);
+                    }
+                    userResults.emplace_back(std::move(result.status), std::move(userResponseRecord));
+                }
+                return userResults;
+            }).finally([reporter=std::move(reporter)] () mutable {
+                reporter.report();
+            });
+    }
+
     template <class T>
     seastar::future<WriteResult> write(T& record, bool erase=false,
                                        dto::ExistencePrecondition precondition=dto::ExistencePrecondition::None) {
@@ -295,6 +479,11 @@ public:
             request = _makeWriteRequest(skv_record, erase, precondition);
         }
 
+        if (_options.asyncWrites && _trh_created) {
+            reporter.report();
+            return _asyncWrite(std::move(request));
+        }
+
         _ongoing_ops++;
 
         return _cpo_client->partitionRequest
@@ -304,17 +493,13 @@ public:
                 auto& [status, k2response] = response;
 
                 _registerRangeForWrite(status, *request);
+                _checkTRHCreated(status, *request);
 
                 _checkResponseStatus(status);
                 _ongoing_ops--;
 
-                if ((status.is2xxOK() || status == dto::K23SIStatus::ConditionFailed) &&
-                    !_heartbeat_timer.isArmed()) {
-                    K2ASSERT(log::skvclient, _cpo_client->collections.find(_trh_collection) != _cpo_client->collections.end(), "collection not present after successful write");
-                    K2LOG_D(log::skvclient, "Starting hb, mtr={}", _mtr);
-                    _heartbeat_interval = _cpo_client->collections[_trh_collection]->collection.metadata.heartbeatDeadline / 2;
-                    _makeHeartbeatTimer();
-                    _heartbeat_timer.armPeriodic(_heartbeat_interval);
+                if (status.is2xxOK() || status == dto::K23SIStatus::ConditionFailed) {
+                    _startHeartbeat();
                 }
 
                 return seastar::make_ready_future<WriteResult>(WriteResult(std::move(status), std::move(k2response)));
@@ -324,6 +509,41 @@ public:
             });
     }
 
+    // Write a batch of records. The records are grouped by the partition which owns them, and each partition
+    // receives all of its records in a single request. The results are in the order of the records
+    template <class T>
+    seastar::future<std::vector<WriteResult>> multiWrite(std::vector<T>& records, bool erase=false,
+                                                         dto::ExistencePrecondition precondition=dto::ExistencePrecondition::None) {
+        k2::OperationLatencyReporter reporter(_client->_multiWriteLatency);
+        if (!_valid) {
+            return seastar::make_exception_future<std::vector<WriteResult>>(K23SIClientException("Invalid use of K2TxnHandle"));
+        }
+        if (_failed) {
+            std::vector<WriteResult> results;
+            for (size_t i = 0; i < records.size(); ++i) {
+                results.emplace_back(_failed_status, dto::K23SIWriteResponse());
+            }
+            return seastar::make_ready_future<std::vector<WriteResult>>(std::move(results));
+        }
+
+        std::vector<dto::K23SIWriteRequest> requests;
+        requests.reserve(records.size());
+        for (T& record : records) {
+            if constexpr (std::is_same<T, dto::SKVRecord>()) {
+                requests.push_back(std::move(*_makeWriteRequest(record, erase, precondition)));
+            } else {
+                dto::SKVRecord skv_record(record.collectionName, record.schema);
+                record.__writeFields(skv_record);
+                requests.push_back(std::move(*_makeWriteRequest(skv_record, erase, precondition)));
+            }
+        }
+
+        return _multiWrite(std::move(requests))
+            .finally([reporter=std::move(reporter)] () mutable {
+                reporter.report();
+            });
+    }
+
     template <typename T>
     seastar::future<PartialUpdateResult> partialUpdate(T& record, std::vector<k2::String> fieldsName,
                                                        dto::Key key=dto::Key()) {
@@ -379,23 +599,24 @@ public:
                     PartialUpdateResult(dto::K23SIStatus::BadParameter("error _makePartialUpdateRequest()")) );
         }
 
-        return _cpo_client->partitionRequest
-            <dto::K23SIWriteRequest, dto::K23SIWriteResponse, dto::Verbs::K23SI_WRITE>
-            (_options.deadline, *request).
+        auto* req = request.get();
+        return _asyncSendsBarrier()
+            .then([this, req] {
+                return _cpo_client->partitionRequest
+                    <dto::K23SIWriteRequest, dto::K23SIWriteResponse, dto::Verbs::K23SI_WRITE>
+                    (_options.deadline, *req);
+            }).
             then([this, request=std::move(request)] (auto&& response) {
                 auto& [status, k2response] = response;
 
                 _registerRangeForWrite(status, *request);
+                _checkTRHCreated(status, *request);
 
                 _checkResponseStatus(status);
                 _ongoing_ops--;
 
-                if ((status.is2xxOK() || status == dto::K23SIStatus::ConditionFailed) && !_heartbeat_timer.isArmed()) {
-                    K2ASSERT(log::skvclient, _cpo_client->collections.find(_trh_collection) != _cpo_client->collections.end(), "collection not present after successful partial update");
-                    K2LOG_D(log::skvclient, "Starting hb, mtr={}", _mtr)
-                    _heartbeat_interval = _cpo_client->collections[_trh_collection]->collection.metadata.heartbeatDeadline / 2;
-                    _makeHeartbeatTimer();
-                    _heartbeat_timer.armPeriodic(_heartbeat_interval);
+                if (status.is2xxOK() || status == dto::K23SIStatus::ConditionFailed) {
+                    _startHeartbeat();
                 }
 
                 return seastar::make_ready_future<PartialUpdateResult>(PartialUpdateResult(std::move(status)));
@@ -410,6 +631,15 @@ public:
     // object to get more results
     seastar::future<QueryResult> query(Query& query);
 
+    // Called with each page of a streamed query. The next page is handed over once the returned future resolves
+    typedef std::function<seastar::future<>(QueryResult&&)> QueryPageConsumer;
+
+    // Get all remaining results of a query as a stream of pages. Up to prefetchDepth pages are fetched ahead of
+    // the consumer, so that the requests for the next pages overlap with the processing of the current one.
+    // A prefetchDepth of 0 uses the client's query_prefetch_depth. The consumer only sees successful pages.
+    // Returns the status of the page which failed, or OK once the query is done
+    seastar::future<Status> queryStream(Query& query, QueryPageConsumer consumer, uint32_t prefetchDepth=0);
+
     // Must be called exactly once by application code and after all ongoing read and write
     // operations are completed
     seastar::future<EndResult> end(bool shouldCommit);
@@ -420,7 +650,10 @@ public:
     K2_DEF_FMT(K2TxnHandle, _mtr);
 
     seastar::future<> kill() {
-        return _heartbeat_timer.stop();
+        if (_client) {
+            _client->_unregisterHeartbeat(this);
+        }
+        return seastar::make_ready_future<>();
     }
 
 private:
@@ -435,8 +668,12 @@ private:
     TimePoint _start_time;
     uint64_t _ongoing_ops = 0; // Used to track if there are operations in flight when end() is called
 
-    Duration _heartbeat_interval;
-    PeriodicTimer _heartbeat_timer;
+    // number of async writes in this txn, and the chain which sends them in order
+    uint64_t _async_writes = 0;
+    seastar::future<> _async_sends = seastar::make_ready_future();
+
+    // set while this txn is heartbeated by the client
+    bool _heartbeat_started = false;
 
     // affected write ranges per collection
     std::unordered_map<String, std::unordered_set<dto::KeyRangeVersion>> _write_ranges;
@@ -444,6 +681,8 @@ private:
     // the trh key and home collection for this transaction
     std::optional<dto::Key> _trh_key;
     String _trh_collection;
+    // set once we know that the txn record has been created at the TRH
+    bool _trh_created = false;
     // calculate Total txn duration
     k2::TimePoint _startTime;
 };
@@ -43,6 +43,10 @@ void Query::setLimit(int32_t limit) {
     request.recordLimit = limit;
 }
 
+void Query::setOrdered(bool ordered) {
+    this->ordered = ordered;
+}
+
 void Query::addProjection(const String& fieldName) {
     request.projection.push_back(fieldName);
     checkKeysProjected();
@@ -55,6 +59,14 @@ void Query::addProjection(const std::vector<String>& fieldNames) {
     checkKeysProjected();
 }
 
+void Query::addAggregate(dto::AggregateFunction function, const String& fieldName) {
+    request.aggregation.aggregates.push_back(dto::Aggregate{.function = function, .fieldName = fieldName});
+}
+
+void Query::addGroupBy(const String& fieldName) {
+    request.aggregation.groupBy.push_back(fieldName);
+}
+
 void Query::checkKeysProjected() {
     keysProjected = false;
     for (uint32_t idx : schema->partitionKeyFields) {
@@ -97,6 +109,8 @@ void Query::resetPaginationToken(dto::Key paginationKey, bool exclusiveKey) {
         done = false;
         request.key = std::move(paginationKey);
         request.exclusiveKey = exclusiveKey;
+        // the server-side cursor is positioned for the previous token
+        request.cursorId = 0;
     }
 }
 
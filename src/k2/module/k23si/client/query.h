@@ -39,10 +39,19 @@ public:
     void setReverseDirection(bool reverseDirection);
     void setIncludeVersionMismatch(bool includeVersionMismatch);
     void setLimit(int32_t limit);
+    // Only applies to hash partitioned collections, whose partitions are scanned in parallel. By default the
+    // results are returned in no particular order. If set, the results are merged in key order instead
+    void setOrdered(bool ordered);
 
     void addProjection(const String& fieldName);
     void addProjection(const std::vector<String>& fieldNames);
 
+    // Have the server compute the aggregate over the matching records instead of returning them. An empty
+    // field name with COUNT counts the records. The aggregates are returned in QueryResult::aggregates
+    void addAggregate(dto::AggregateFunction function, const String& fieldName="");
+    // Compute the aggregates per distinct value of the given field(s), instead of over all records
+    void addGroupBy(const String& fieldName);
+
     bool isDone(); // If false, more results may be available
 
     // Recursively copies the payloads if the expression's values and children. This is used so that the
@@ -51,6 +60,7 @@ public:
 
     // The native K23SI client will handle retries and pagination automatically through the query call,
     // but for use cases such as the skvhttp client, we might need to manually "rewind" the query.
+    // The token does not cover queries on hash partitioned collections, which keep one token per partition
     void resetPaginationToken(dto::Key paginationKey, bool exclusiveKey);
     std::tuple<dto::Key, bool> getPaginationToken();
 
@@ -75,6 +85,20 @@ private:
     bool keysProjected = true;
     dto::K23SIQueryRequest request;
 
+    // The scan position in one partition of a hash partitioned collection
+    struct PartitionCursor {
+        dto::PVID pvid;
+        dto::Key key;
+        bool exclusiveKey = false;
+        uint64_t cursorId = 0; // the server-side cursor the partition kept for the next page
+        bool done = false;
+    };
+    bool scatter = false; // true if the collection is hash partitioned and we scan all partitions in parallel
+    bool ordered = false;
+    std::vector<PartitionCursor> cursors;
+    // combines the partial aggregates from each page and partition
+    dto::Aggregator aggregator;
+
     friend class K2TxnHandle;
     friend class K23SIClient;
     friend class QueryResult;
@@ -89,6 +113,9 @@ public:
 
     Status status;
     std::vector<dto::SKVRecord> records;
+    // The result of an aggregation query. It is set on the last page (once the query is done) and combines the
+    // partial aggregates of all pages and partitions
+    std::vector<dto::AggregateGroup> aggregates;
     K2_DEF_FMT(QueryResult, status);
 };
 
@@ -41,10 +41,9 @@ namespace log {
 inline thread_local k2::logging::Logger lgbase("k2::logstream_base");
 }
 
-K2_DEF_ENUM(LogStreamType,
-    WAL,
-    IndexerSnapshot,
-    Aux);
+using dto::LogStreamType;
+using dto::LogStreamTypeNames;
+using dto::LogStreamTypeFromStr;
 
 // This is a base class that provide common plog operations for both logstream and metadata manager.
 // Provide public APIs: append_data_to_plogs, read_data_from_plogs
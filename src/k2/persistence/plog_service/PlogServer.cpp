@@ -1,183 +1,586 @@
-/*
-MIT License
-
-Copyright(c) 2020 Futurewei Cloud
-
-    Permission is hereby granted,
-    free of charge, to any person obtaining a copy of this software and associated documentation files(the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
-
-    The above copyright notice and this permission notice shall be included in all copies
-    or
-    substantial portions of the Software.
-
-    THE SOFTWARE IS PROVIDED "AS IS",
-    WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
-    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
-    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
-    DAMAGES OR OTHER
-    LIABILITY,
-    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
-    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
-    SOFTWARE.
-*/
-
-#include "PlogServer.h"
-#include <k2/transport/PayloadSerialization.h>
-#include <seastar/core/sharded.hh>
-#include <k2/transport/Payload.h>
-#include <k2/transport/Status.h>
-#include <k2/dto/Persistence.h>
-#include <k2/common/Common.h>
-#include <k2/config/Config.h>
-#include <k2/cpo/client/Client.h>
-#include <k2/transport/BaseTypes.h>
-#include <k2/transport/TXEndpoint.h>
-#include <k2/appbase/AppEssentials.h>
-#include <k2/appbase/Appbase.h>
-
-
-namespace k2 {
-
-PlogServer::PlogServer() {
-    K2LOG_I(log::plogsvr, "ctor");
-}
-
-PlogServer::~PlogServer() {
-    K2LOG_I(log::plogsvr, "dtor");
-}
-
-seastar::future<> PlogServer::gracefulStop() {
-    K2LOG_I(log::plogsvr, "stop");
-    _plogMap.clear();
-    return seastar::make_ready_future<>();
-}
-
-seastar::future<> PlogServer::start() {
-    K2LOG_I(log::plogsvr, "Registering message handlers");
-    RPC().registerRPCObserver<dto::PlogCreateRequest, dto::PlogCreateResponse>(dto::Verbs::PLOG_CREATE, [this](dto::PlogCreateRequest&& request) {
-        return _handleCreate(std::move(request));
-    });
-
-    RPC().registerRPCObserver<dto::PlogAppendRequest, dto::PlogAppendResponse>(dto::Verbs::PLOG_APPEND, [this](dto::PlogAppendRequest&& request) {
-        return _handleAppend(std::move(request));
-    });
-
-    RPC().registerRPCObserver<dto::PlogReadRequest, dto::PlogReadResponse>(dto::Verbs::PLOG_READ, [this](dto::PlogReadRequest&& request) {
-        return _handleRead(std::move(request));
-    });
-
-    RPC().registerRPCObserver<dto::PlogSealRequest, dto::PlogSealResponse>(dto::Verbs::PLOG_SEAL, [this](dto::PlogSealRequest&& request) {
-        return _handleSeal(std::move(request));
-    });
-
-    RPC().registerRPCObserver<dto::PlogGetStatusRequest, dto::PlogGetStatusResponse>(dto::Verbs::PLOG_GET_STATUS, [this](dto::PlogGetStatusRequest&& request) {
-        return _handleGetStatus(std::move(request));
-    });
-    _plogMap.clear();
-
-    return seastar::make_ready_future<>();
-}
-
-seastar::future<std::tuple<Status, dto::PlogCreateResponse>>
-PlogServer::_handleCreate(dto::PlogCreateRequest&& request){
-    K2LOG_D(log::plogsvr, "Received create request for {}", request.plogId);
-    auto iter = _plogMap.find(request.plogId);
-    if (iter != _plogMap.end()) {
-        return RPCResponse(Statuses::S409_Conflict("plog id already exists"), dto::PlogCreateResponse{});
-    }
-    _plogMap.insert(std::pair<String,InternalPlog >(std::move(request.plogId), InternalPlog()));
-    return RPCResponse(Statuses::S201_Created("plog created"), dto::PlogCreateResponse{});
-};
-
-seastar::future<std::tuple<Status, dto::PlogAppendResponse>>
-PlogServer::_handleAppend(dto::PlogAppendRequest&& request){
-    K2LOG_D(log::plogsvr, "Received append request {}", request);
-    auto iter = _plogMap.find(request.plogId);
-    if (iter == _plogMap.end()) {
-        return RPCResponse(Statuses::S404_Not_Found("plog does not exist"), dto::PlogAppendResponse{.newOffset=0, .return_payload = std::move(request.payload)});
-    }
-    if (iter->second.sealed){
-         return RPCResponse(Statuses::S409_Conflict("plog is sealed"), dto::PlogAppendResponse{.newOffset=0, .return_payload = std::move(request.payload)});
-    }
-    if (iter->second.offset != request.offset){
-        return RPCResponse(Statuses::S403_Forbidden("offset inconsistent"), dto::PlogAppendResponse{.newOffset=0, .return_payload = std::move(request.payload)});
-    }
-    if (iter->second.offset + request.payload.getSize() > PLOG_MAX_SIZE){
-         return RPCResponse(Statuses::S413_Payload_Too_Large("exceeds pLog limit"), dto::PlogAppendResponse{.newOffset=0, .return_payload = std::move(request.payload)});
-    }
-
-    dto::PlogAppendResponse response;
-    response.newOffset = iter->second.offset + request.payload.getSize();
-
-    iter->second.offset += request.payload.getSize();
-    // We want to use copy in order to prevent memory fragmentation. If we use shareAll() instead of copy, the payload we obtained will occupy a entire 8K block
-    iter->second.payload.copyFromPayload(request.payload, request.payload.getSize());
-
-    return RPCResponse(Statuses::S200_OK("append success"), std::move(response));
-};
-
-
-seastar::future<std::tuple<Status, dto::PlogReadResponse>>
-PlogServer::_handleRead(dto::PlogReadRequest&& request){
-    K2LOG_D(log::plogsvr, "Received read request for {}", request);
-    auto iter = _plogMap.find(request.plogId);
-    if (iter == _plogMap.end()) {
-        return RPCResponse(Statuses::S404_Not_Found("plog does not exist"), dto::PlogReadResponse{});
-    }
-    if (iter->second.offset < request.offset){
-        return RPCResponse(Statuses::S413_Payload_Too_Large("exceed the maximun length"), dto::PlogReadResponse{});
-    }
-    if (iter->second.offset < request.offset + request.size){
-        return RPCResponse(Statuses::S413_Payload_Too_Large("exceed the maximun length"), dto::PlogReadResponse{.payload=iter->second.payload.shareRegion(request.offset, iter->second.offset-request.offset)});
-    }
-
-    dto::PlogReadResponse response{.payload=iter->second.payload.shareRegion(request.offset, request.size)};
-    return RPCResponse(Statuses::S200_OK("read success"), std::move(response));
-};
-
-
-seastar::future<std::tuple<Status, dto::PlogSealResponse>>
-PlogServer::_handleSeal(dto::PlogSealRequest&& request){
-    K2LOG_D(log::plogsvr, "Received seal request for {}", request);
-    dto::PlogSealResponse response;
-    auto iter = _plogMap.find(request.plogId);
-    if (iter == _plogMap.end()) {
-        return RPCResponse(Statuses::S404_Not_Found("plog does not exist"), std::move(response));
-    }
-    if (iter->second.sealed){
-        response.sealedOffset = iter->second.offset;
-        if (request.truncateOffset == iter->second.offset){
-            return RPCResponse(Statuses::S200_OK("sealed success"), std::move(response));
-        }
-        else{
-            return RPCResponse(Statuses::S409_Conflict("plog already sealed"), std::move(response));
-        }
-    }
-
-    iter->second.sealed = true;
-    if (iter->second.offset < request.truncateOffset){
-        response.sealedOffset = iter->second.offset;
-        return RPCResponse(Statuses::S200_OK("sealed offset inconsistent"), std::move(response));
-    }
-
-    _plogMap[request.plogId].offset = request.truncateOffset;
-    _plogMap[request.plogId].payload.seek(request.truncateOffset);
-    _plogMap[request.plogId].payload.truncateToCurrent();
-
-    response.sealedOffset = request.truncateOffset;
-    return RPCResponse(Statuses::S200_OK("sealed success"), std::move(response));
-};
-
-seastar::future<std::tuple<Status, dto::PlogGetStatusResponse>>
-PlogServer::_handleGetStatus(dto::PlogGetStatusRequest&& request){
-    K2LOG_D(log::plogsvr, "Received GetStatus request for {}", request);
-    auto iter = _plogMap.find(request.plogId);
-    if (iter == _plogMap.end()) {
-        return RPCResponse(Statuses::S404_Not_Found("plog does not exist"), dto::PlogGetStatusResponse{});
-    }
-
-    dto::PlogGetStatusResponse response{.currentOffset=iter->second.offset, .sealed=iter->second.sealed};
-    return RPCResponse(Statuses::S200_OK("read success"), std::move(response));
-};
-
-} // namespace k2
+/*
+MIT License
+
+Copyright(c) 2020 Futurewei Cloud
+
+    Permission is hereby granted,
+    free of charge, to any person obtaining a copy of this software and associated documentation files(the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
+
+    The above copyright notice and this permission notice shall be included in all copies
+    or
+    substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS",
+    WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER
+    LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+*/
+
+#include "PlogServer.h"
+
+#include <charconv>
+
+#include <crc32c/crc32c.h>
+#include <seastar/core/align.hh>
+#include <seastar/core/loop.hh>
+#include <seastar/core/seastar.hh>
+
+#include <k2/transport/PayloadSerialization.h>
+#include <seastar/core/sharded.hh>
+#include <k2/transport/Payload.h>
+#include <k2/transport/Status.h>
+#include <k2/dto/Persistence.h>
+#include <k2/common/Common.h>
+#include <k2/config/Config.h>
+#include <k2/cpo/client/Client.h>
+#include <k2/transport/BaseTypes.h>
+#include <k2/transport/TXEndpoint.h>
+#include <k2/appbase/AppEssentials.h>
+#include <k2/appbase/Appbase.h>
+
+
+namespace k2 {
+
+PlogServer::PlogServer() {
+    K2LOG_I(log::plogsvr, "ctor");
+}
+
+PlogServer::~PlogServer() {
+    K2LOG_I(log::plogsvr, "dtor");
+}
+
+seastar::future<> PlogServer::gracefulStop() {
+    K2LOG_I(log::plogsvr, "stop");
+    RPC().registerMessageObserver(dto::Verbs::PLOG_CREATE, nullptr);
+    RPC().registerMessageObserver(dto::Verbs::PLOG_APPEND, nullptr);
+    RPC().registerMessageObserver(dto::Verbs::PLOG_READ, nullptr);
+    RPC().registerMessageObserver(dto::Verbs::PLOG_SEAL, nullptr);
+    RPC().registerMessageObserver(dto::Verbs::PLOG_GET_STATUS, nullptr);
+
+    return _gate.close()
+    .then([this] {
+        return seastar::parallel_for_each(_plogMap, [] (auto& entry) {
+            auto plog = entry.second;
+            // write failures were already reported to the appenders
+            return std::exchange(plog->writeFut, seastar::make_ready_future())
+            .handle_exception([] (auto) {})
+            .then([plog] {
+                return plog->file ? plog->file.close() : seastar::make_ready_future();
+            });
+        });
+    })
+    .then([this] {
+        _plogMap.clear();
+    });
+}
+
+seastar::future<> PlogServer::start() {
+    _shardDir = fmt::format("{}/shard_{}", _dataDir(), seastar::this_shard_id());
+    return _loadPlogs()
+    .then([this] {
+        K2LOG_I(log::plogsvr, "Registering message handlers");
+        RPC().registerRPCObserver<dto::PlogCreateRequest, dto::PlogCreateResponse>(dto::Verbs::PLOG_CREATE, [this](dto::PlogCreateRequest&& request) {
+            return seastar::with_gate(_gate, [this, request=std::move(request)] () mutable {
+                return _handleCreate(std::move(request));
+            });
+        });
+
+        RPC().registerRPCObserver<dto::PlogAppendRequest, dto::PlogAppendResponse>(dto::Verbs::PLOG_APPEND, [this](dto::PlogAppendRequest&& request) {
+            return seastar::with_gate(_gate, [this, request=std::move(request)] () mutable {
+                return _handleAppend(std::move(request));
+            });
+        });
+
+        RPC().registerRPCObserver<dto::PlogReadRequest, dto::PlogReadResponse>(dto::Verbs::PLOG_READ, [this](dto::PlogReadRequest&& request) {
+            return seastar::with_gate(_gate, [this, request=std::move(request)] () mutable {
+                return _handleRead(std::move(request));
+            });
+        });
+
+        RPC().registerRPCObserver<dto::PlogSealRequest, dto::PlogSealResponse>(dto::Verbs::PLOG_SEAL, [this](dto::PlogSealRequest&& request) {
+            return seastar::with_gate(_gate, [this, request=std::move(request)] () mutable {
+                return _handleSeal(std::move(request));
+            });
+        });
+
+        RPC().registerRPCObserver<dto::PlogGetStatusRequest, dto::PlogGetStatusResponse>(dto::Verbs::PLOG_GET_STATUS, [this](dto::PlogGetStatusRequest&& request) {
+            return seastar::with_gate(_gate, [this, request=std::move(request)] () mutable {
+                return _handleGetStatus(std::move(request));
+            });
+        });
+    });
+}
+
+String PlogServer::_plogPath(const String& plogId) const {
+    String hex;
+    hex.reserve(2 * plogId.size());
+    for (unsigned char c: plogId) {
+        hex += fmt::format("{:02x}", c);
+    }
+    return fmt::format("{}/plog_{}.plog", _shardDir, hex);
+}
+
+bool PlogServer::_parsePlogName(const String& name, String& plogId) {
+    static constexpr std::string_view prefix = "plog_";
+    static constexpr std::string_view suffix = ".plog";
+    std::string_view sv(name);
+    if (sv.size() <= prefix.size() + suffix.size() || !sv.starts_with(prefix) || !sv.ends_with(suffix)) {
+        return false;
+    }
+    auto hex = sv.substr(prefix.size(), sv.size() - prefix.size() - suffix.size());
+    if (hex.size() % 2 != 0) {
+        return false;
+    }
+    plogId = String(hex.size() / 2, '\0');
+    for (size_t i = 0; i < plogId.size(); ++i) {
+        uint8_t c = 0;
+        auto [ptr, ec] = std::from_chars(hex.data() + 2 * i, hex.data() + 2 * i + 2, c, 16);
+        if (ec != std::errc() || ptr != hex.data() + 2 * i + 2) {
+            return false;
+        }
+        plogId[i] = (char)c;
+    }
+    return true;
+}
+
+seastar::future<> PlogServer::_loadPlogs() {
+    _plogMap.clear();
+    return seastar::recursive_touch_directory(_shardDir)
+    .then([this] {
+        return seastar::open_directory(_shardDir);
+    })
+    .then([this] (seastar::file dir) {
+        return seastar::do_with(std::move(dir), std::vector<std::pair<String, String>>(), [this] (auto& dir, auto& found) {
+            return dir.list_directory([this, &found] (seastar::directory_entry de) {
+                String plogId;
+                if (_parsePlogName(de.name, plogId)) {
+                    found.emplace_back(std::move(plogId), fmt::format("{}/{}", _shardDir, de.name));
+                }
+                return seastar::make_ready_future();
+            }).done()
+            .then([&dir] {
+                return dir.close();
+            })
+            .then([this, &found] {
+                return seastar::parallel_for_each(found, [this] (auto& entry) {
+                    return _loadPlog(entry.first, entry.second);
+                });
+            })
+            .then([this] {
+                K2LOG_I(log::plogsvr, "Loaded {} plogs from {}", _plogMap.size(), _shardDir);
+            });
+        });
+    });
+}
+
+seastar::future<> PlogServer::_loadPlog(String plogId, String path) {
+    auto plog = seastar::make_lw_shared<InternalPlog>();
+    plog->path = path;
+    return seastar::open_file_dma(path, seastar::open_flags::rw)
+    .then([plog] (seastar::file file) {
+        plog->file = std::move(file);
+        return plog->file.dma_read<char>(0, plog::HEADER_SIZE);
+    })
+    .then([plog] (Binary buf) {
+        // take the newest of the valid header slots
+        std::optional<plog::FileHeader> newest;
+        for (uint32_t slot = 0; slot < plog::HEADER_SLOTS; ++slot) {
+            plog::FileHeader header;
+            if (buf.size() < slot * plog::HEADER_SLOT_SIZE + sizeof(header)) {
+                break;
+            }
+            std::memcpy(&header, buf.get() + slot * plog::HEADER_SLOT_SIZE, sizeof(header));
+            if (header.magic != plog::FILE_MAGIC || header.version != plog::FORMAT_VERSION ||
+                header.headerCrc != crc32c::Crc32c((const char*)&header, offsetof(plog::FileHeader, headerCrc)) ||
+                header.commit % plog::HEADER_SLOTS != slot ||
+                header.prevOffset > header.offset || header.offset > PLOG_MAX_SIZE) {
+                K2LOG_D(log::plogsvr, "Header slot {} of {} is not valid", slot, plog->path);
+                continue;
+            }
+            if (!newest || header.commit > newest->commit) {
+                newest = header;
+            }
+        }
+        if (!newest) {
+            throw std::runtime_error("the plog has no valid header");
+        }
+        auto header = *newest;
+        plog->commit = header.commit;
+        plog->sealed = header.sealed != 0;
+        if (header.prevOffset == header.offset) {
+            return seastar::make_ready_future<uint32_t>(header.offset);
+        }
+        // make sure the data of the last commit made it to disk
+        auto blockStart = seastar::align_down(header.prevOffset, BLOCK_SIZE);
+        auto blockEnd = seastar::align_up(header.offset, BLOCK_SIZE);
+        return plog->file.dma_read<char>(plog::HEADER_SIZE + blockStart, blockEnd - blockStart)
+        .then([plog, header, blockStart] (Binary data) {
+            auto skip = header.prevOffset - blockStart;
+            auto len = header.offset - header.prevOffset;
+            if (data.size() < skip + len || crc32c::Crc32c(data.get() + skip, len) != header.dataCrc) {
+                K2LOG_W(log::plogsvr, "The last commit in {} is incomplete. Recovering to offset {} instead of {}",
+                    plog->path, header.prevOffset, header.offset);
+                return header.prevOffset;
+            }
+            return header.offset;
+        });
+    })
+    .then([plog] (uint32_t offset) {
+        plog->offset = offset;
+        plog->durableOffset = offset;
+        auto blockStart = seastar::align_down(offset, BLOCK_SIZE);
+        if (plog->sealed || blockStart == offset) {
+            return seastar::make_ready_future();
+        }
+        // the next append rewrites the last partial block
+        return plog->file.dma_read<char>(plog::HEADER_SIZE + blockStart, BLOCK_SIZE)
+        .then([plog, blockStart, offset] (Binary block) {
+            if (block.size() < offset - blockStart) {
+                throw std::runtime_error("unable to read the last block");
+            }
+            plog->tailBlock = Binary(block.get(), offset - blockStart);
+        });
+    })
+    .then([this, plog, plogId] {
+        K2LOG_D(log::plogsvr, "Loaded plog {} from {}, offset={}, sealed={}", plogId, plog->path, plog->offset, plog->sealed);
+        plog->ready = true;
+        _plogMap[plogId] = plog;
+    })
+    .handle_exception([plog] (auto exc) {
+        K2LOG_W_EXC(log::plogsvr, exc, "Skipping plog file {}", plog->path);
+        return (plog->file ? plog->file.close() : seastar::make_ready_future())
+        .handle_exception([] (auto) {});
+    });
+}
+
+seastar::future<std::tuple<Status, dto::PlogCreateResponse>>
+PlogServer::_handleCreate(dto::PlogCreateRequest&& request){
+    K2LOG_D(log::plogsvr, "Received create request for {}", request.plogId);
+    auto iter = _plogMap.find(request.plogId);
+    if (iter != _plogMap.end()) {
+        return RPCResponse(Statuses::S409_Conflict("plog id already exists"), dto::PlogCreateResponse{});
+    }
+    // the plog is in the map while we create the file, so that concurrent creates with the same id are rejected
+    auto plog = seastar::make_lw_shared<InternalPlog>();
+    plog->path = _plogPath(request.plogId);
+    _plogMap.emplace(request.plogId, plog);
+
+    auto flags = seastar::open_flags::rw | seastar::open_flags::create | seastar::open_flags::exclusive;
+    return seastar::open_file_dma(plog->path, flags)
+    .then([plog] (seastar::file file) {
+        plog->file = std::move(file);
+        // preallocate the plog so that appends don't have to update file metadata
+        return plog->file.allocate(0, plog::HEADER_SIZE + PLOG_MAX_SIZE)
+        .handle_exception([plog] (auto exc) {
+            K2LOG_W_EXC(log::plogsvr, exc, "Unable to preallocate plog file {}", plog->path);
+        });
+    })
+    .then([this, plog] {
+        return _writeHeader(*plog, false, 0, 0, 0);
+    })
+    .then([plog] {
+        return plog->file.flush();
+    })
+    .then([this] {
+        // make sure the new plog file itself survives a crash
+        return seastar::sync_directory(_shardDir);
+    })
+    .then_wrapped([this, plog, plogId=std::move(request.plogId)] (auto&& fut) {
+        if (fut.failed()) {
+            K2LOG_W_EXC(log::plogsvr, fut.get_exception(), "Unable to create plog file {}", plog->path);
+            auto iter = _plogMap.find(plogId);
+            if (iter != _plogMap.end() && iter->second == plog) {
+                _plogMap.erase(iter);
+            }
+            return (plog->file ? plog->file.close() : seastar::make_ready_future())
+            .handle_exception([] (auto) {})
+            .then([] {
+                return RPCResponse(Statuses::S500_Internal_Server_Error("unable to create plog"), dto::PlogCreateResponse{});
+            });
+        }
+        fut.get();
+        plog->ready = true;
+        return RPCResponse(Statuses::S201_Created("plog created"), dto::PlogCreateResponse{});
+    });
+};
+
+seastar::future<std::tuple<Status, dto::PlogAppendResponse>>
+PlogServer::_handleAppend(dto::PlogAppendRequest&& request){
+    K2LOG_D(log::plogsvr, "Received append request {}", request);
+    auto iter = _plogMap.find(request.plogId);
+    if (iter == _plogMap.end()) {
+        return RPCResponse(Statuses::S404_Not_Found("plog does not exist"), dto::PlogAppendResponse{.newOffset=0, .return_payload = std::move(request.payload)});
+    }
+    auto plog = iter->second;
+    if (!plog->ready) {
+        return RPCResponse(Statuses::S503_Service_Unavailable("plog is being created"), dto::PlogAppendResponse{.newOffset=0, .return_payload = std::move(request.payload)});
+    }
+    if (plog->sealed){
+         return RPCResponse(Statuses::S409_Conflict("plog is sealed"), dto::PlogAppendResponse{.newOffset=0, .return_payload = std::move(request.payload)});
+    }
+    if (plog->failure) {
+        return RPCResponse(Statuses::S500_Internal_Server_Error("plog write failed"), dto::PlogAppendResponse{.newOffset=0, .return_payload = std::move(request.payload)});
+    }
+    if (plog->offset != request.offset){
+        return RPCResponse(Statuses::S403_Forbidden("offset inconsistent"), dto::PlogAppendResponse{.newOffset=0, .return_payload = std::move(request.payload)});
+    }
+    if (plog->offset + request.payload.getSize() > PLOG_MAX_SIZE){
+         return RPCResponse(Statuses::S413_Payload_Too_Large("exceeds pLog limit"), dto::PlogAppendResponse{.newOffset=0, .return_payload = std::move(request.payload)});
+    }
+
+    // The append is accepted right away so that the next one can be pipelined behind it. All appends which arrive
+    // while a commit is in progress are written and flushed together with the next commit
+    plog->offset += request.payload.getSize();
+    if (!plog->openBatch) {
+        plog->openBatch = std::make_unique<AppendBatch>();
+    }
+    plog->openBatch->bytes += request.payload.getSize();
+    plog->openBatch->records.push_back(request.payload.shareAll());
+    auto fut = plog->openBatch->prom.get_shared_future();
+    if (!plog->writing) {
+        plog->writing = true;
+        plog->writeFut = _writeLoop(plog);
+    }
+
+    return fut.then_wrapped([newOffset=plog->offset, payload=std::move(request.payload)] (auto&& fut) mutable {
+        if (fut.failed()) {
+            K2LOG_W_EXC(log::plogsvr, fut.get_exception(), "Append failed");
+            return RPCResponse(Statuses::S500_Internal_Server_Error("plog write failed"), dto::PlogAppendResponse{.newOffset=0, .return_payload = std::move(payload)});
+        }
+        fut.get();
+        return RPCResponse(Statuses::S200_OK("append success"), dto::PlogAppendResponse{.newOffset=newOffset});
+    });
+};
+
+seastar::future<> PlogServer::_writeLoop(seastar::lw_shared_ptr<InternalPlog> plog) {
+    return seastar::do_until(
+        [plog] { return !plog->openBatch || plog->failure; },
+        [this, plog] {
+            // take everything which is pending. Appends from here on go into the next batch
+            return seastar::do_with(std::move(plog->openBatch), [this, plog] (auto& batch) {
+                return seastar::futurize_invoke([this, plog, &batch] { return _commit(*plog, *batch); })
+                .then_wrapped([plog, &batch] (auto&& fut) {
+                    if (fut.failed()) {
+                        plog->failure = fut.get_exception();
+                        K2LOG_W_EXC(log::plogsvr, plog->failure, "Unable to write to plog file {}", plog->path);
+                        batch->prom.set_exception(plog->failure);
+                    }
+                    else {
+                        fut.get();
+                        batch->prom.set_value();
+                    }
+                });
+            });
+        })
+    .finally([plog] {
+        plog->writing = false;
+        if (plog->openBatch) {
+            // we stopped due to a failure. Fail anyone still waiting
+            plog->openBatch->prom.set_exception(plog->failure);
+            plog->openBatch.reset();
+        }
+    });
+}
+
+seastar::future<> PlogServer::_commit(InternalPlog& plog, AppendBatch& batch) {
+    // the batch is written starting at the block which contains the durable offset, so the tail of that block
+    // is written again together with the new data
+    uint32_t start = plog.durableOffset;
+    uint32_t end = start + batch.bytes;
+    auto blockStart = seastar::align_down(start, BLOCK_SIZE);
+    auto tailLen = plog.tailBlock.size();
+    auto writeLen = seastar::align_up(tailLen + batch.bytes, (size_t)BLOCK_SIZE);
+    auto buf = Binary::aligned(BLOCK_SIZE, writeLen);
+    std::memcpy(buf.get_write(), plog.tailBlock.get(), tailLen);
+    size_t pos = tailLen;
+    for (auto& record: batch.records) {
+        auto size = record.getSize();
+        record.seek(0);
+        record.read(buf.get_write() + pos, size);
+        pos += size;
+    }
+    std::memset(buf.get_write() + pos, 0, writeLen - pos);
+    auto dataCrc = crc32c::Crc32c(buf.get() + tailLen, batch.bytes);
+
+    return seastar::do_with(std::move(buf), [this, &plog, start, end, blockStart, dataCrc] (auto& buf) {
+        return plog.file.dma_write(plog::HEADER_SIZE + blockStart, buf.get(), buf.size())
+        .then([this, &plog, &buf, start, end, dataCrc] (size_t written) {
+            if (written != buf.size()) {
+                throw std::runtime_error(fmt::format("short write: {} of {} bytes", written, buf.size()));
+            }
+            return _writeHeader(plog, false, end, start, dataCrc);
+        })
+        .then([&plog] {
+            // a single flush covers both the data and the header
+            return plog.file.flush();
+        })
+        .then([&plog, &buf, end, blockStart] {
+            plog.durableOffset = end;
+            auto newBlockStart = seastar::align_down(end, BLOCK_SIZE);
+            plog.tailBlock = Binary(buf.get() + (newBlockStart - blockStart), end - newBlockStart);
+        });
+    });
+}
+
+seastar::future<> PlogServer::_writeHeader(InternalPlog& plog, bool sealed, uint32_t offset, uint32_t prevOffset, uint32_t dataCrc) {
+    plog::FileHeader header{
+        .magic = plog::FILE_MAGIC,
+        .version = plog::FORMAT_VERSION,
+        .sealed = sealed ? 1u : 0u,
+        .offset = offset,
+        .prevOffset = prevOffset,
+        .dataCrc = dataCrc,
+        .commit = plog.commit + 1,
+        .headerCrc = 0
+    };
+    header.headerCrc = crc32c::Crc32c((const char*)&header, offsetof(plog::FileHeader, headerCrc));
+    auto buf = Binary::aligned(BLOCK_SIZE, plog::HEADER_SLOT_SIZE);
+    std::memset(buf.get_write(), 0, buf.size());
+    std::memcpy(buf.get_write(), &header, sizeof(header));
+    // never overwrite the header of the last commit, in case this write doesn't make it in one piece
+    uint64_t pos = (header.commit % plog::HEADER_SLOTS) * plog::HEADER_SLOT_SIZE;
+    return seastar::do_with(std::move(buf), [&plog, pos, commit=header.commit] (auto& buf) {
+        return plog.file.dma_write(pos, buf.get(), buf.size())
+        .then([&plog, &buf, commit] (size_t written) {
+            if (written != buf.size()) {
+                throw std::runtime_error(fmt::format("short header write: {} of {} bytes", written, buf.size()));
+            }
+            plog.commit = commit;
+        });
+    });
+}
+
+seastar::future<std::tuple<Status, dto::PlogReadResponse>>
+PlogServer::_handleRead(dto::PlogReadRequest&& request){
+    K2LOG_D(log::plogsvr, "Received read request for {}", request);
+    auto iter = _plogMap.find(request.plogId);
+    if (iter == _plogMap.end()) {
+        return RPCResponse(Statuses::S404_Not_Found("plog does not exist"), dto::PlogReadResponse{});
+    }
+    auto plog = iter->second;
+    if (!plog->ready) {
+        return RPCResponse(Statuses::S503_Service_Unavailable("plog is being created"), dto::PlogReadResponse{});
+    }
+    if (plog->durableOffset < request.offset){
+        return RPCResponse(Statuses::S413_Payload_Too_Large("exceed the maximun length"), dto::PlogReadResponse{});
+    }
+    auto status = Statuses::S200_OK("read success");
+    auto size = request.size;
+    if (plog->durableOffset < request.offset + request.size){
+        status = Statuses::S413_Payload_Too_Large("exceed the maximun length");
+        size = plog->durableOffset - request.offset;
+    }
+    if (size == 0) {
+        return RPCResponse(std::move(status), dto::PlogReadResponse{});
+    }
+
+    // Read the covering blocks straight from the file and hand the buffer to the response. The data is neither
+    // cached nor copied on the way out
+    auto blockStart = seastar::align_down(request.offset, BLOCK_SIZE);
+    auto blockEnd = seastar::align_up(request.offset + size, BLOCK_SIZE);
+    return plog->file.dma_read<char>(plog::HEADER_SIZE + blockStart, blockEnd - blockStart)
+    .then([plog, status=std::move(status), skip=request.offset - blockStart, size] (Binary buf) mutable {
+        if (buf.size() < skip + size) {
+            throw std::runtime_error(fmt::format("short read: {} of {} bytes", buf.size(), skip + size));
+        }
+        buf.trim_front(skip);
+        buf.trim(size);
+        std::vector<Binary> buffers;
+        buffers.push_back(std::move(buf));
+        return RPCResponse(std::move(status), dto::PlogReadResponse{.payload=Payload(std::move(buffers), size)});
+    })
+    .handle_exception([plog] (auto exc) {
+        K2LOG_W_EXC(log::plogsvr, exc, "Unable to read from plog file {}", plog->path);
+        return RPCResponse(Statuses::S500_Internal_Server_Error("plog read failed"), dto::PlogReadResponse{});
+    });
+};
+
+
+seastar::future<std::tuple<Status, dto::PlogSealResponse>>
+PlogServer::_handleSeal(dto::PlogSealRequest&& request){
+    K2LOG_D(log::plogsvr, "Received seal request for {}", request);
+    auto iter = _plogMap.find(request.plogId);
+    if (iter == _plogMap.end()) {
+        return RPCResponse(Statuses::S404_Not_Found("plog does not exist"), dto::PlogSealResponse{});
+    }
+    auto plog = iter->second;
+    if (!plog->ready) {
+        return RPCResponse(Statuses::S503_Service_Unavailable("plog is being created"), dto::PlogSealResponse{});
+    }
+    if (plog->sealed){
+        // wait for a seal in progress to become durable
+        auto fut = plog->sealFut ? plog->sealFut->get_future() : seastar::make_ready_future();
+        return fut.then_wrapped([plog, truncateOffset=request.truncateOffset] (auto&& fut) {
+            if (fut.failed()) {
+                K2LOG_W_EXC(log::plogsvr, fut.get_exception(), "Seal failed for plog file {}", plog->path);
+                return RPCResponse(Statuses::S500_Internal_Server_Error("plog write failed"), dto::PlogSealResponse{});
+            }
+            fut.get();
+            dto::PlogSealResponse response{.sealedOffset = plog->offset};
+            if (truncateOffset == plog->offset){
+                return RPCResponse(Statuses::S200_OK("sealed success"), std::move(response));
+            }
+            else{
+                return RPCResponse(Statuses::S409_Conflict("plog already sealed"), std::move(response));
+            }
+        });
+    }
+
+    // no appends are accepted from here on. Wait for the ones in progress before we write the seal
+    plog->sealed = true;
+    auto sealed = std::exchange(plog->writeFut, seastar::make_ready_future())
+    .then([this, plog, truncateOffset=request.truncateOffset] {
+        if (plog->failure) {
+            std::rethrow_exception(plog->failure);
+        }
+        if (truncateOffset < plog->offset) {
+            plog->offset = truncateOffset;
+        }
+        return _writeHeader(*plog, true, plog->offset, plog->offset, 0);
+    })
+    .then([plog] {
+        return plog->file.flush();
+    })
+    .then([plog] {
+        plog->durableOffset = plog->offset;
+        plog->tailBlock = Binary();
+    });
+    plog->sealFut = seastar::shared_future<>(std::move(sealed));
+    plog->writeFut = plog->sealFut->get_future();
+
+    return plog->sealFut->get_future()
+    .then_wrapped([plog, truncateOffset=request.truncateOffset] (auto&& fut) {
+        if (fut.failed()) {
+            K2LOG_W_EXC(log::plogsvr, fut.get_exception(), "Seal failed for plog file {}", plog->path);
+            return RPCResponse(Statuses::S500_Internal_Server_Error("plog write failed"), dto::PlogSealResponse{});
+        }
+        fut.get();
+        dto::PlogSealResponse response{.sealedOffset = plog->offset};
+        if (plog->offset < truncateOffset){
+            return RPCResponse(Statuses::S200_OK("sealed offset inconsistent"), std::move(response));
+        }
+        return RPCResponse(Statuses::S200_OK("sealed success"), std::move(response));
+    });
+};
+
+seastar::future<std::tuple<Status, dto::PlogGetStatusResponse>>
+PlogServer::_handleGetStatus(dto::PlogGetStatusRequest&& request){
+    K2LOG_D(log::plogsvr, "Received GetStatus request for {}", request);
+    auto iter = _plogMap.find(request.plogId);
+    if (iter == _plogMap.end()) {
+        return RPCResponse(Statuses::S404_Not_Found("plog does not exist"), dto::PlogGetStatusResponse{});
+    }
+    if (!iter->second->ready) {
+        return RPCResponse(Statuses::S503_Service_Unavailable("plog is being created"), dto::PlogGetStatusResponse{});
+    }
+
+    dto::PlogGetStatusResponse response{.currentOffset=iter->second->offset, .sealed=iter->second->sealed};
+    return RPCResponse(Statuses::S200_OK("read success"), std::move(response));
+};
+
+} // namespace k2
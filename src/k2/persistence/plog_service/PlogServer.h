@@ -1,97 +1,188 @@
-/*
-MIT License
-
-Copyright(c) 2020 Futurewei Cloud
-
-    Permission is hereby granted,
-    free of charge, to any person obtaining a copy of this software and associated documentation files(the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
-
-    The above copyright notice and this permission notice shall be included in all copies
-    or
-    substantial portions of the Software.
-
-    THE SOFTWARE IS PROVIDED "AS IS",
-    WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
-    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
-    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
-    DAMAGES OR OTHER
-    LIABILITY,
-    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
-    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
-    SOFTWARE.
-*/
-
-#pragma once
-
-#include <k2/transport/PayloadSerialization.h>
-#include <seastar/core/sharded.hh>
-#include <k2/transport/Payload.h>
-#include <k2/transport/Status.h>
-#include <k2/dto/Persistence.h>
-#include <k2/common/Common.h>
-#include <k2/config/Config.h>
-#include <k2/cpo/client/Client.h>
-#include <k2/appbase/AppEssentials.h>
-#include <k2/appbase/Appbase.h>
-#include <k2/transport/BaseTypes.h>
-#include <k2/transport/TXEndpoint.h>
-
-namespace k2
-{
-namespace log {
-inline thread_local k2::logging::Logger plogsvr("k2::plog_server");
-}
-
-class PlogServer
-{
-private:
-    // the maximum size of each plog
-    constexpr static uint32_t PLOG_MAX_SIZE = 16 * 1024 * 1024;
-
-    // each InternalPlog is a plog. It uses payload to store the data, and contains the sealed and offest as metadata
-    struct InternalPlog {
-        InternalPlog(){
-            sealed=false;
-            offset=0;
-            payload = Payload(Payload::DefaultAllocator(PLOG_MAX_SIZE));
-       }
-
-        bool sealed;
-        uint32_t offset;
-        Payload payload;
-    };
-
-    // a map to store all the plogs based on plog id
-    std::unordered_map<String, InternalPlog> _plogMap;
-
-    //handle the create request
-    seastar::future<std::tuple<Status, dto::PlogCreateResponse>>
-    _handleCreate(dto::PlogCreateRequest&& request);
-
-    //handle the read request
-    seastar::future<std::tuple<Status, dto::PlogAppendResponse>>
-    _handleAppend(dto::PlogAppendRequest&& request);
-
-    //handle the read request
-    seastar::future<std::tuple<Status, dto::PlogReadResponse>>
-    _handleRead(dto::PlogReadRequest&& request);
-
-    //handle the seal request
-    seastar::future<std::tuple<Status, dto::PlogSealResponse>>
-    _handleSeal(dto::PlogSealRequest&& request);
-
-    //handle the seal request
-    seastar::future<std::tuple<Status, dto::PlogGetStatusResponse>>
-    _handleGetStatus(dto::PlogGetStatusRequest&& request);
-
-public:
-     PlogServer();
-    ~PlogServer();
-
-    // required for seastar::distributed interface
-    seastar::future<> gracefulStop();
-    seastar::future<> start();
-
-};//  class PlogServer
-
-} //  namespace k2
+/*
+MIT License
+
+Copyright(c) 2020 Futurewei Cloud
+
+    Permission is hereby granted,
+    free of charge, to any person obtaining a copy of this software and associated documentation files(the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
+
+    The above copyright notice and this permission notice shall be included in all copies
+    or
+    substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS",
+    WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER
+    LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+*/
+
+#pragma once
+
+#include <k2/transport/PayloadSerialization.h>
+#include <seastar/core/file.hh>
+#include <seastar/core/gate.hh>
+#include <seastar/core/sharded.hh>
+#include <seastar/core/shared_future.hh>
+#include <k2/transport/Payload.h>
+#include <k2/transport/Status.h>
+#include <k2/dto/Persistence.h>
+#include <k2/common/Common.h>
+#include <k2/config/Config.h>
+#include <k2/cpo/client/Client.h>
+#include <k2/appbase/AppEssentials.h>
+#include <k2/appbase/Appbase.h>
+#include <k2/transport/BaseTypes.h>
+#include <k2/transport/TXEndpoint.h>
+
+namespace k2
+{
+namespace log {
+inline thread_local k2::logging::Logger plogsvr("k2::plog_server");
+}
+
+// On-disk format of a plog.
+// Each plog is a separate preallocated file. The first HEADER_SIZE bytes hold the header, and the plog data
+// starts right after it, so plog offset X is at file offset HEADER_SIZE + X.
+// A FileHeader is written with every commit. It records the offset covered by this commit, together with a crc
+// of the data appended by it. If the data didn't make it to disk before a crash, the crc won't match and we fall
+// back to the offset of the previous commit, which was made durable by an earlier flush.
+// The header has two slots and commits alternate between them, so a crash in the middle of a header write leaves
+// the header of the previous commit intact. On load we take the newest slot which is valid.
+namespace plog {
+constexpr uint32_t FILE_MAGIC = 0x474F4C50;
+constexpr uint32_t FORMAT_VERSION = 2;
+constexpr uint32_t HEADER_SLOT_SIZE = 4096;
+constexpr uint32_t HEADER_SLOTS = 2;
+constexpr uint32_t HEADER_SIZE = HEADER_SLOT_SIZE * HEADER_SLOTS;
+
+struct FileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t sealed;
+    // the plog offset covered by the last commit
+    uint32_t offset;
+    // the plog offset before the last commit
+    uint32_t prevOffset;
+    // crc32c of the data in [prevOffset, offset)
+    uint32_t dataCrc;
+    // the number of this commit. It goes in slot commit % HEADER_SLOTS
+    uint32_t commit;
+    // crc32c of the fields above
+    uint32_t headerCrc;
+};
+static_assert(sizeof(FileHeader) == 32);
+} // namespace plog
+
+class PlogServer
+{
+private:
+    // the maximum size of each plog
+    constexpr static uint32_t PLOG_MAX_SIZE = 16 * 1024 * 1024;
+    // the unit of DMA reads and writes. This is a multiple of the DMA alignment of any device we run on
+    constexpr static uint32_t BLOCK_SIZE = 4096;
+
+    // appends which are written and flushed together
+    struct AppendBatch {
+        std::vector<Payload> records;
+        // the total size of the records
+        size_t bytes{0};
+        seastar::shared_promise<> prom;
+    };
+
+    // each InternalPlog is a plog, backed by a file. Appends are written with DMA and the data is read back
+    // from the file. The last partial block of the data is kept in memory, so that it can be rewritten together
+    // with the next append
+    struct InternalPlog {
+        String path;
+        seastar::file file;
+        // set once the file is created and ready for use
+        bool ready{false};
+        bool sealed{false};
+        // the offset up to which appends have been accepted
+        uint32_t offset{0};
+        // the offset up to which the data is durable. Reads are served up to here
+        uint32_t durableOffset{0};
+        // the number of the last header we wrote. The next one goes in the other slot
+        uint32_t commit{0};
+        // the data in the block which contains durableOffset
+        Binary tailBlock;
+        // the appends waiting for the next commit
+        std::unique_ptr<AppendBatch> openBatch;
+        bool writing{false};
+        seastar::future<> writeFut = seastar::make_ready_future();
+        // completes once a seal is durable
+        std::optional<seastar::shared_future<>> sealFut;
+        // set after a failed write. The state of the file is unknown so we refuse further appends
+        std::exception_ptr failure;
+    };
+
+    // The plogs are stored in a separate directory for each shard
+    ConfigVar<String> _dataDir{"plog_data_dir", "/tmp/___k2_plog"};
+
+    // a map to store all the plogs based on plog id
+    std::unordered_map<String, seastar::lw_shared_ptr<InternalPlog>> _plogMap;
+
+    // the directory of this shard
+    String _shardDir;
+
+    // keeps track of the requests in progress, so that we can stop cleanly
+    seastar::gate _gate;
+
+    //handle the create request
+    seastar::future<std::tuple<Status, dto::PlogCreateResponse>>
+    _handleCreate(dto::PlogCreateRequest&& request);
+
+    //handle the read request
+    seastar::future<std::tuple<Status, dto::PlogAppendResponse>>
+    _handleAppend(dto::PlogAppendRequest&& request);
+
+    //handle the read request
+    seastar::future<std::tuple<Status, dto::PlogReadResponse>>
+    _handleRead(dto::PlogReadRequest&& request);
+
+    //handle the seal request
+    seastar::future<std::tuple<Status, dto::PlogSealResponse>>
+    _handleSeal(dto::PlogSealRequest&& request);
+
+    //handle the seal request
+    seastar::future<std::tuple<Status, dto::PlogGetStatusResponse>>
+    _handleGetStatus(dto::PlogGetStatusRequest&& request);
+
+    // rebuild the plog map from the files in the shard directory
+    seastar::future<> _loadPlogs();
+
+    // open the given plog file and recover its offset and sealed state
+    seastar::future<> _loadPlog(String plogId, String path);
+
+    // commit batches until there are no more pending appends
+    seastar::future<> _writeLoop(seastar::lw_shared_ptr<InternalPlog> plog);
+
+    // write the batch after the durable data, followed by the header, and flush the file
+    seastar::future<> _commit(InternalPlog& plog, AppendBatch& batch);
+
+    // write the header for the given state of the plog, in the slot of the next commit. The caller is responsible
+    // for flushing the file
+    seastar::future<> _writeHeader(InternalPlog& plog, bool sealed, uint32_t offset, uint32_t prevOffset, uint32_t dataCrc);
+
+    // the file name for the given plog id. The id is hex-encoded since it can contain any character
+    String _plogPath(const String& plogId) const;
+
+    // extract the plog id from a plog file name. Returns false if this isn't a plog file name
+    static bool _parsePlogName(const String& name, String& plogId);
+
+public:
+     PlogServer();
+    ~PlogServer();
+
+    // required for seastar::distributed interface
+    seastar::future<> gracefulStop();
+    seastar::future<> start();
+
+};//  class PlogServer
+
+} //  namespace k2
@@ -25,7 +25,6 @@ Copyright(c) 2020 Futurewei Cloud
 #include <k2/dto/MessageVerbs.h>
 #include <k2/dto/K23SI.h>
 
-#include <k2/logging/Log.h>
 #include <k2/transport/RPCDispatcher.h>  // for RPC
 
 namespace k2 {
@@ -40,15 +39,164 @@ PersistenceService::~PersistenceService() {
 
 seastar::future<> PersistenceService::gracefulStop() {
     K2LOG_I(log::psvc, "stop");
-    return seastar::make_ready_future();
+    RPC().registerMessageObserver(dto::Verbs::K23SI_Persist, nullptr);
+    RPC().registerMessageObserver(dto::Verbs::K23SI_PERSISTENCE_RECOVERY, nullptr);
+    RPC().registerMessageObserver(dto::Verbs::K23SI_PERSISTENCE_TRUNCATE, nullptr);
+    _metricGroups.clear();
+    return seastar::parallel_for_each(_logs, [] (auto& kv) {
+        auto& entry = kv.second;
+        return entry.started.get_future()
+        .then([&entry] {
+            return entry.wal->stop();
+        })
+        .handle_exception([&dir=kv.first] (auto exc) {
+            K2LOG_W_EXC(log::psvc, exc, "Unable to stop log in {}", dir);
+        });
+    });
+}
+
+uint64_t PersistenceService::_sumStats(uint64_t WALStats::* stat) const {
+    uint64_t result = 0;
+    for (auto& [_, entry]: _logs) {
+        result += entry.wal->getStats().*stat;
+    }
+    return result;
+}
+
+void PersistenceService::_registerMetrics() {
+    _metricGroups.clear();
+    std::vector<sm::label_instance> labels;
+    labels.push_back(sm::label_instance("total_cores", seastar::smp::count));
+
+    _metricGroups.add_group("Persistence", {
+        sm::make_gauge("wal_logs", [this]{ return _logs.size();},
+                        sm::description("Number of open write-ahead logs"), labels),
+        sm::make_counter("wal_records", [this]{ return _sumStats(&WALStats::records);},
+                        sm::description("Number of records appended to the write-ahead logs"), labels),
+        sm::make_counter("wal_bytes", [this]{ return _sumStats(&WALStats::bytes);},
+                        sm::description("Number of record bytes appended to the write-ahead logs"), labels),
+        sm::make_counter("wal_commits", [this]{ return _sumStats(&WALStats::commits);},
+                        sm::description("Number of group commits (write+flush) in the write-ahead logs"), labels),
+        sm::make_counter("wal_segments", [this]{ return _sumStats(&WALStats::segments);},
+                        sm::description("Number of write-ahead log segments created"), labels),
+        sm::make_counter("wal_truncated_segments", [this]{ return _sumStats(&WALStats::truncatedSegments);},
+                        sm::description("Number of write-ahead log segments removed by truncation"), labels),
+        sm::make_histogram("wal_commit_latency", [this]{ return _commitLatency.getHistogram();},
+                sm::description("Latency of write-ahead log group commits"), labels),
+        sm::make_counter("rejected_requests", _rejectedRequests,
+                        sm::description("Number of persist requests rejected because they would leave a gap in the log"), labels),
+    });
+}
+
+seastar::future<PersistenceService::LogEntry*> PersistenceService::_getLog(const String& collectionName, uint64_t partitionId, dto::LogStreamType stream) {
+    auto streamIdx = to_integral(stream);
+    if (streamIdx >= std::size(dto::LogStreamTypeNames)) {
+        return seastar::make_exception_future<LogEntry*>(std::invalid_argument(fmt::format("invalid log stream {}", streamIdx)));
+    }
+    auto dir = fmt::format("{}/{}/partition_{}/{}", _walDir(), collectionName, partitionId, dto::LogStreamTypeNames[streamIdx]);
+    auto it = _logs.find(dir);
+    if (it == _logs.end()) {
+        K2LOG_I(log::psvc, "Opening log for collection={}, partition={}, stream={} in {}", collectionName, partitionId, stream, dir);
+        auto wal = std::make_unique<WriteAheadLog>(dir, _walSegmentSize(), _commitLatency);
+        auto started = wal->start();
+        it = _logs.emplace(std::move(dir), LogEntry{.wal=std::move(wal), .started=std::move(started)}).first;
+    }
+    return it->second.started.get_future()
+    .then([entry=&it->second] {
+        return entry;
+    });
+}
+
+Status PersistenceService::_checkSequence(LogEntry& entry, uint64_t writerId, uint64_t sequence) {
+    if (writerId != entry.writerId) {
+        // a new writer, e.g. the partition was reassigned. It takes over the log from its first request on
+        if (sequence != 1) {
+            return Statuses::S409_Conflict(fmt::format("request {} of new writer {} is not its first", sequence, writerId));
+        }
+        entry.writerId = writerId;
+        entry.nextSequence = 2;
+        entry.failed = false;
+        return Statuses::S200_OK("");
+    }
+    if (entry.failed) {
+        return Statuses::S409_Conflict(fmt::format("an earlier request of writer {} failed", writerId));
+    }
+    if (sequence != entry.nextSequence) {
+        return Statuses::S409_Conflict(fmt::format("expected request {} of writer {} but got {}", entry.nextSequence, writerId, sequence));
+    }
+    ++entry.nextSequence;
+    return Statuses::S200_OK("");
 }
 
 seastar::future<> PersistenceService::start() {
+    _registerMetrics();
+
     K2LOG_I(log::psvc, "Registering message handlers");
     RPC().registerRPCObserver<dto::K23SI_PersistenceRequest<Payload>, dto::K23SI_PersistenceResponse>
     (dto::Verbs::K23SI_Persist, [this](dto::K23SI_PersistenceRequest<Payload>&& request) {
-        (void) request;
-        return RPCResponse(Statuses::S200_OK("persistence success"), dto::K23SI_PersistenceResponse{});
+        return _getLog(request.collectionName, request.partitionId, request.stream)
+        .then([this, request=std::move(request)] (LogEntry* entry) mutable {
+            // the requests of a writer are checked in the order they arrive, which is the order they were sent in
+            if (auto status = _checkSequence(*entry, request.writerId, request.sequence); !status.is2xxOK()) {
+                K2LOG_W(log::psvc, "Rejecting request {} due to {}", request, status);
+                _rejectedRequests++;
+                return RPCResponse(std::move(status), dto::K23SI_PersistenceResponse{});
+            }
+            return entry->wal->append(std::move(request.value.val), request.newSegment)
+            .then([] (WALPosition end) {
+                return RPCResponse(Statuses::S200_OK("persistence success"),
+                                   dto::K23SI_PersistenceResponse{.segment=end.segment, .offset=end.offset});
+            })
+            .handle_exception([entry, writerId=request.writerId] (auto exc) {
+                K2LOG_W_EXC(log::psvc, exc, "Unable to persist request");
+                // the later requests of this writer may already be on their way. Don't let them in after a gap
+                if (entry->writerId == writerId) {
+                    entry->failed = true;
+                }
+                return RPCResponse(Statuses::S500_Internal_Server_Error("unable to persist"), dto::K23SI_PersistenceResponse{});
+            });
+        })
+        .handle_exception([] (auto exc) {
+            K2LOG_W_EXC(log::psvc, exc, "Unable to persist request");
+            return RPCResponse(Statuses::S500_Internal_Server_Error("unable to persist"), dto::K23SI_PersistenceResponse{});
+        });
+    });
+
+    RPC().registerRPCObserver<dto::K23SI_PersistenceRecoveryRequest, dto::K23SI_PersistenceRecoveryResponse>
+    (dto::Verbs::K23SI_PERSISTENCE_RECOVERY, [this](dto::K23SI_PersistenceRecoveryRequest&& request) {
+        K2LOG_D(log::psvc, "Received recovery request {}", request);
+        return _getLog(request.collectionName, request.partitionId, request.stream)
+        .then([request=std::move(request)] (LogEntry* entry) {
+            return entry->wal->read(WALPosition{.segment=request.segment, .offset=request.offset}, std::max<uint64_t>(request.maxBytes, 1));
+        })
+        .then([] (WALReadResult&& result) {
+            return RPCResponse(Statuses::S200_OK("recovery read success"), dto::K23SI_PersistenceRecoveryResponse{
+                .records=std::move(result.data),
+                .segment=result.next.segment,
+                .offset=result.next.offset,
+                .done=result.done
+            });
+        })
+        .handle_exception([] (auto exc) {
+            K2LOG_W_EXC(log::psvc, exc, "Unable to read for recovery");
+            return RPCResponse(Statuses::S500_Internal_Server_Error("unable to read log"), dto::K23SI_PersistenceRecoveryResponse{});
+        });
+    });
+
+    RPC().registerRPCObserver<dto::K23SI_PersistenceTruncateRequest, dto::K23SI_PersistenceTruncateResponse>
+    (dto::Verbs::K23SI_PERSISTENCE_TRUNCATE, [this](dto::K23SI_PersistenceTruncateRequest&& request) {
+        K2LOG_D(log::psvc, "Received truncate request {}", request);
+        return _getLog(request.collectionName, request.partitionId, request.stream)
+        .then([segment=request.segment] (LogEntry* entry) {
+            return entry->wal->truncate(segment);
+        })
+        .then([] {
+            return RPCResponse(Statuses::S200_OK("truncate success"), dto::K23SI_PersistenceTruncateResponse{});
+        })
+        .handle_exception([] (auto exc) {
+            K2LOG_W_EXC(log::psvc, exc, "Unable to truncate log");
+            return RPCResponse(Statuses::S500_Internal_Server_Error("unable to truncate log"), dto::K23SI_PersistenceTruncateResponse{});
+        });
     });
 
     return seastar::make_ready_future();
@@ -26,13 +26,15 @@ Copyright(c) 2020 Futurewei Cloud
 // third-party
 #include <seastar/core/distributed.hh>  // for distributed<>
 #include <seastar/core/future.hh>       // for future stuff
-#include <k2/logging/Log.h>
 
-namespace k2 {
-namespace log {
-inline thread_local k2::logging::Logger psvc("k2::persistence_svc");
-}
+#include <k2/appbase/AppEssentials.h>
+#include <k2/dto/Persistence.h>
+#include <k2/transport/Prometheus.h>
+
+#include "Log.h"
+#include "WriteAheadLog.h"
 
+namespace k2 {
 class PersistenceService {
 public :  // application lifespan
     PersistenceService();
@@ -41,6 +43,41 @@ public :  // application lifespan
     // required for seastar::distributed interface
     seastar::future<> gracefulStop();
     seastar::future<> start();
+
+private:
+    void _registerMetrics();
+
+    struct LogEntry;
+    // Returns the log for the given stream of a partition, opening it if needed
+    seastar::future<LogEntry*> _getLog(const String& collectionName, uint64_t partitionId, dto::LogStreamType stream);
+
+    // Checks that the given request of a writer is the next one we expect in the log, and records it as such
+    Status _checkSequence(LogEntry& entry, uint64_t writerId, uint64_t sequence);
+
+    // sum up the given stat over all logs
+    uint64_t _sumStats(uint64_t WALStats::* stat) const;
+
+    // the directory under which we keep the write-ahead logs. Each partition has its own log for each of its streams
+    ConfigVar<String> _walDir{"persistence_wal_dir", "/tmp/___k2_persistence_wal"};
+    // the size at which a log rolls over to a new segment file
+    ConfigVar<uint64_t> _walSegmentSize{"persistence_wal_segment_size", 64 * 1024 * 1024};
+
+    struct LogEntry {
+        std::unique_ptr<WriteAheadLog> wal;
+        // resolves once the log is ready for use
+        seastar::shared_future<> started;
+        // the current writer of the log, and the sequence number of its next request
+        uint64_t writerId{0};
+        uint64_t nextSequence{0};
+        // set when an append of the current writer failed. Its later requests would leave a gap
+        bool failed{false};
+    };
+    // the open logs, keyed by directory
+    std::unordered_map<String, LogEntry> _logs;
+
+    sm::metric_groups _metricGroups;
+    ExponentialHistogram _commitLatency;
+    uint64_t _rejectedRequests{0};
 };  // class PersistenceService
 
 } // namespace k2
@@ -0,0 +1,555 @@
+/*
+MIT License
+
+Copyright(c) 2022 Futurewei Cloud
+
+    Permission is hereby granted,
+    free of charge, to any person obtaining a copy of this software and associated documentation files(the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
+
+    The above copyright notice and this permission notice shall be included in all copies
+    or
+    substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS",
+    WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER
+    LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+*/
+
+#include "WriteAheadLog.h"
+
+#include <charconv>
+#include <limits>
+#include <optional>
+
+#include <boost/range/irange.hpp>
+#include <crc32c/crc32c.h>
+#include <seastar/core/align.hh>
+#include <seastar/core/loop.hh>
+#include <seastar/core/seastar.hh>
+
+#include "Log.h"
+
+namespace k2 {
+
+// How much we read from a segment at a time during recovery
+constexpr size_t WAL_READ_CHUNK = 1024 * 1024;
+
+namespace {
+// The data frames a reader has seen in a segment, to check against the segment footer
+struct SegmentTally {
+    uint64_t frames{0};
+    uint32_t dataCrc{0};
+    // set if the reader started at the first frame of the segment, so the tally covers all of its frames
+    bool complete{false};
+    // the offset of the SegmentEnd frame, if the reader reached it
+    uint64_t footerAt{0};
+    wal::SegmentFooter footer{};
+};
+
+// throws if the data frames counted in the tally don't match the footer of the segment
+void checkFooter(const String& dir, uint64_t seq, const SegmentTally& tally) {
+    if (tally.frames != tally.footer.frames || tally.dataCrc != tally.footer.dataCrc) {
+        K2LOG_W(log::wal, "Footer mismatch in segment {} in {}: found {} frames with crc {}, footer has {} frames with crc {}",
+            seq, dir, tally.frames, tally.dataCrc, tally.footer.frames, tally.footer.dataCrc);
+        throw std::runtime_error(fmt::format("footer mismatch in segment {} in {}", seq, dir));
+    }
+}
+} // namespace
+
+WriteAheadLog::WriteAheadLog(String dir, uint64_t segmentSize, ExponentialHistogram& commitLatency) :
+    _dir(std::move(dir)), _segmentSize(segmentSize), _commitLatency(commitLatency) {
+}
+
+String WriteAheadLog::segmentName(const String& dir, uint64_t seq) {
+    return fmt::format("{}/segment_{:020}.wal", dir, seq);
+}
+
+bool WriteAheadLog::parseSegmentName(const String& name, uint64_t& seq) {
+    static constexpr std::string_view prefix = "segment_";
+    static constexpr std::string_view suffix = ".wal";
+    std::string_view sv(name);
+    if (sv.size() <= prefix.size() + suffix.size() || !sv.starts_with(prefix) || !sv.ends_with(suffix)) {
+        return false;
+    }
+    auto digits = sv.substr(prefix.size(), sv.size() - prefix.size() - suffix.size());
+    auto [ptr, ec] = std::from_chars(digits.data(), digits.data() + digits.size(), seq);
+    return ec == std::errc() && ptr == digits.data() + digits.size();
+}
+
+const WALStats& WriteAheadLog::getStats() const {
+    return _stats;
+}
+
+seastar::future<> WriteAheadLog::start() {
+    K2LOG_I(log::wal, "Starting WAL in {} with segment size {}", _dir, _segmentSize);
+    return seastar::recursive_touch_directory(_dir)
+    .then([this] {
+        return seastar::open_directory(_dir);
+    })
+    .then([this] (seastar::file dir) {
+        return seastar::do_with(std::move(dir), uint64_t(0), [this] (auto& dir, auto& nextSeq) {
+            _firstSeq = std::numeric_limits<uint64_t>::max();
+            // never append to an existing segment. We start a new one after the last segment on disk
+            return dir.list_directory([this, &nextSeq] (seastar::directory_entry de) {
+                uint64_t seq = 0;
+                if (parseSegmentName(de.name, seq)) {
+                    nextSeq = std::max(nextSeq, seq + 1);
+                    _firstSeq = std::min(_firstSeq, seq);
+                }
+                return seastar::make_ready_future();
+            }).done()
+            .then([&dir] {
+                return dir.close();
+            })
+            .then([this, &nextSeq] {
+                _firstSeq = std::min(_firstSeq, nextSeq);
+                K2LOG_I(log::wal, "Opening segment {} in {}, first segment is {}", nextSeq, _dir, _firstSeq);
+                return _openSegment(nextSeq);
+            });
+        });
+    });
+}
+
+seastar::future<> WriteAheadLog::stop() {
+    K2LOG_I(log::wal, "Stopping WAL in {}, stats={}", _dir, _stats);
+    _stopping = true;
+    return std::exchange(_writeFut, seastar::make_ready_future())
+    .then([this] {
+        if (!_segmentOpen) {
+            return seastar::make_ready_future();
+        }
+        if (_failure) {
+            // don't touch a segment in unknown state. Just close it
+            _segmentOpen = false;
+            return _file.close();
+        }
+        return _sealSegment();
+    });
+}
+
+seastar::future<WALPosition> WriteAheadLog::append(Payload&& data, bool newSegment) {
+    if (_failure) {
+        return seastar::make_exception_future<WALPosition>(_failure);
+    }
+    if (_stopping || !_segmentOpen) {
+        return seastar::make_exception_future<WALPosition>(std::runtime_error("write-ahead log is not running"));
+    }
+    if (!_openBatch) {
+        _openBatch = std::make_unique<Batch>();
+    }
+    _openBatch->newSegment |= newSegment;
+    _openBatch->bytes += sizeof(wal::FrameHeader) + data.getSize();
+    _openBatch->records.push_back(std::move(data));
+    auto fut = _openBatch->prom.get_shared_future();
+
+    if (!_writing) {
+        _writing = true;
+        _writeFut = _writeLoop();
+    }
+    return fut;
+}
+
+seastar::future<> WriteAheadLog::truncate(uint64_t segment) {
+    // the segment we're appending to is never removed
+    auto end = std::min(segment, _segmentSeq);
+    if (end <= _firstSeq) {
+        return seastar::make_ready_future();
+    }
+    K2LOG_D(log::wal, "Truncating segments [{}, {}) in {}", _firstSeq, end, _dir);
+    auto segments = boost::irange(std::exchange(_firstSeq, end), end);
+    return seastar::do_for_each(segments.begin(), segments.end(), [this] (uint64_t seq) {
+        auto name = segmentName(_dir, seq);
+        return seastar::file_exists(name)
+        .then([this, name] (bool exists) {
+            if (!exists) {
+                return seastar::make_ready_future();
+            }
+            return seastar::remove_file(name)
+            .then([this] {
+                _stats.truncatedSegments++;
+            });
+        });
+    })
+    .then([this] {
+        return seastar::sync_directory(_dir);
+    });
+}
+
+seastar::future<WALReadResult> WriteAheadLog::read(WALPosition from, size_t maxBytes) {
+    if (!_segmentOpen) {
+        return seastar::make_exception_future<WALReadResult>(std::runtime_error("write-ahead log is not running"));
+    }
+    if (from.segment < _firstSeq) {
+        from = WALPosition{.segment = _firstSeq, .offset = 0};
+    }
+    K2LOG_D(log::wal, "Reading from {} in {}, maxBytes={}", from, _dir, maxBytes);
+
+    return seastar::do_with(WALReadResult{.next = from}, [this, maxBytes] (auto& result) {
+        return seastar::repeat([this, &result, maxBytes] {
+            if (result.next.segment > _segmentSeq) {
+                result.done = true;
+            }
+            if (result.done || result.data.getSize() >= maxBytes) {
+                return seastar::make_ready_future<seastar::stop_iteration>(seastar::stop_iteration::yes);
+            }
+            return _readSegment(result, maxBytes)
+            .then([] {
+                return seastar::stop_iteration::no;
+            });
+        })
+        .then([&result] {
+            K2LOG_D(log::wal, "Read {} records, {} bytes, next={}, done={}",
+                result.records, result.data.getSize(), result.next, result.done);
+            return std::move(result);
+        });
+    });
+}
+
+seastar::future<> WriteAheadLog::_readSegment(WALReadResult& result, size_t maxBytes) {
+    auto seq = result.next.segment;
+    auto name = segmentName(_dir, seq);
+    return seastar::file_exists(name)
+    .then([this, &result, name] (bool exists) {
+        if (!exists) {
+            K2LOG_W(log::wal, "Segment {} is missing in {}", result.next.segment, _dir);
+            _endOfSegment(result);
+            return seastar::make_ready_future<std::optional<seastar::file>>();
+        }
+        return seastar::open_file_dma(name, seastar::open_flags::ro)
+        .then([] (seastar::file file) {
+            return std::optional<seastar::file>(std::move(file));
+        });
+    })
+    .then([this, &result, maxBytes, seq] (std::optional<seastar::file> file) {
+        if (!file) {
+            return seastar::make_ready_future();
+        }
+        SegmentTally tally{.complete = result.next.offset <= sizeof(wal::SegmentHeader)};
+        return seastar::do_with(std::move(*file), WAL_READ_CHUNK, tally, [this, &result, maxBytes, seq] (auto& file, auto& readLen, auto& tally) {
+            return seastar::repeat([this, &file, &readLen, &tally, &result, maxBytes, seq] {
+                if (result.next.segment != seq || result.done || result.data.getSize() >= maxBytes) {
+                    return seastar::make_ready_future<seastar::stop_iteration>(seastar::stop_iteration::yes);
+                }
+                auto offset = result.next.offset;
+                return file.template dma_read<char>(offset, readLen)
+                .then([this, &readLen, &tally, &result, offset, maxBytes, seq] (seastar::temporary_buffer<char> buf) {
+                    size_t pos = 0;
+                    if (offset == 0) {
+                        wal::SegmentHeader header;
+                        if (buf.size() < sizeof(header)) {
+                            _endOfSegment(result);
+                            return seastar::stop_iteration::yes;
+                        }
+                        std::memcpy(&header, buf.get(), sizeof(header));
+                        if (header.magic != wal::SEGMENT_MAGIC || header.version != wal::FORMAT_VERSION ||
+                            header.headerCrc != crc32c::Crc32c((const char*)&header, offsetof(wal::SegmentHeader, headerCrc))) {
+                            K2LOG_W(log::wal, "Invalid header in segment {} in {}", result.next.segment, _dir);
+                            _endOfSegment(result);
+                            return seastar::stop_iteration::yes;
+                        }
+                        pos = sizeof(header);
+                        result.next.offset = pos;
+                    }
+
+                    while (result.data.getSize() < maxBytes && buf.size() - pos >= sizeof(wal::FrameHeader)) {
+                        wal::FrameHeader header;
+                        std::memcpy(&header, buf.get() + pos, sizeof(header));
+                        if (header.magic != wal::FRAME_MAGIC ||
+                            header.headerCrc != crc32c::Crc32c((const char*)&header, offsetof(wal::FrameHeader, headerCrc))) {
+                            // we reached the end of the written data, or a torn write
+                            _endOfSegment(result);
+                            return seastar::stop_iteration::yes;
+                        }
+                        if (buf.size() - pos - sizeof(header) < header.size) {
+                            // the frame continues past this buffer
+                            break;
+                        }
+                        const char* data = buf.get() + pos + sizeof(header);
+                        if (header.dataCrc != crc32c::Crc32c(data, header.size)) {
+                            K2LOG_W(log::wal, "Checksum mismatch in segment {} at offset {} in {}",
+                                result.next.segment, offset + pos, _dir);
+                            _endOfSegment(result);
+                            return seastar::stop_iteration::yes;
+                        }
+                        if (header.type == (uint32_t)wal::FrameType::SegmentEnd) {
+                            if (header.size != sizeof(wal::SegmentFooter)) {
+                                throw std::runtime_error(fmt::format("invalid footer in segment {} in {}", seq, _dir));
+                            }
+                            std::memcpy(&tally.footer, data, sizeof(tally.footer));
+                            tally.footerAt = offset + pos;
+                            if (tally.complete) {
+                                checkFooter(_dir, seq, tally);
+                            }
+                            result.next = WALPosition{.segment = result.next.segment + 1, .offset = 0};
+                            return seastar::stop_iteration::yes;
+                        }
+                        tally.frames++;
+                        tally.dataCrc = crc32c::Extend(tally.dataCrc, (const uint8_t*)data, header.size);
+                        result.data.write(data, header.size);
+                        result.records++;
+                        pos += sizeof(header) + header.size;
+                        result.next.offset = offset + pos;
+                    }
+
+                    if (result.data.getSize() >= maxBytes) {
+                        return seastar::stop_iteration::yes;
+                    }
+                    if (buf.size() < readLen) {
+                        // we reached the end of the file and there are no more complete frames
+                        _endOfSegment(result);
+                        return seastar::stop_iteration::yes;
+                    }
+                    if (pos == 0) {
+                        // no progress. The next frame is bigger than our read size
+                        readLen *= 2;
+                    }
+                    return seastar::stop_iteration::no;
+                });
+            })
+            .then([this, &file, &tally, seq] {
+                if (tally.footerAt == 0 || tally.complete) {
+                    return seastar::make_ready_future();
+                }
+                // we started in the middle of the segment, so the frames before that have to be counted as well
+                return _checkSegment(file, seq, tally.footerAt, tally.footer);
+            })
+            .finally([&file] {
+                return file.close();
+            });
+        });
+    });
+}
+
+seastar::future<> WriteAheadLog::_checkSegment(seastar::file& file, uint64_t seq, uint64_t footerAt, wal::SegmentFooter footer) {
+    return seastar::do_with(SegmentTally{.footer = footer}, (uint64_t)sizeof(wal::SegmentHeader), WAL_READ_CHUNK,
+        [this, &file, seq, footerAt] (auto& tally, auto& offset, auto& readLen) {
+        return seastar::repeat([this, &file, &tally, &offset, &readLen, seq, footerAt] {
+            if (offset >= footerAt) {
+                return seastar::make_ready_future<seastar::stop_iteration>(seastar::stop_iteration::yes);
+            }
+            auto len = std::min<uint64_t>(readLen, footerAt - offset);
+            return file.template dma_read<char>(offset, len)
+            .then([this, &tally, &offset, &readLen, seq, len] (seastar::temporary_buffer<char> buf) {
+                size_t pos = 0;
+                while (buf.size() - pos >= sizeof(wal::FrameHeader)) {
+                    wal::FrameHeader header;
+                    std::memcpy(&header, buf.get() + pos, sizeof(header));
+                    if (header.magic != wal::FRAME_MAGIC || header.type != (uint32_t)wal::FrameType::Data ||
+                        header.headerCrc != crc32c::Crc32c((const char*)&header, offsetof(wal::FrameHeader, headerCrc))) {
+                        throw std::runtime_error(fmt::format("invalid frame at offset {} in segment {} in {}", offset + pos, seq, _dir));
+                    }
+                    if (buf.size() - pos - sizeof(header) < header.size) {
+                        break;
+                    }
+                    tally.frames++;
+                    tally.dataCrc = crc32c::Extend(tally.dataCrc, (const uint8_t*)buf.get() + pos + sizeof(header), header.size);
+                    pos += sizeof(header) + header.size;
+                }
+                if (pos == 0) {
+                    if (buf.size() < len) {
+                        throw std::runtime_error(fmt::format("segment {} in {} ends before its footer", seq, _dir));
+                    }
+                    readLen *= 2;
+                }
+                offset += pos;
+                return seastar::stop_iteration::no;
+            });
+        })
+        .then([this, &tally, seq] {
+            checkFooter(_dir, seq, tally);
+        });
+    });
+}
+
+void WriteAheadLog::_endOfSegment(WALReadResult& result) {
+    if (result.next.segment == _segmentSeq) {
+        // this is the segment we're currently appending to. The reader is at the tail of the log
+        result.done = true;
+    }
+    else {
+        // an older segment which was not closed cleanly. Continue with the next one
+        result.next = WALPosition{.segment = result.next.segment + 1, .offset = 0};
+    }
+}
+
+seastar::future<> WriteAheadLog::_writeLoop() {
+    return seastar::do_until(
+        [this] { return !_openBatch || _failure; },
+        [this] {
+            // take everything which is pending. Records appended from here on go into the next batch
+            return seastar::do_with(std::move(_openBatch), [this] (auto& batch) {
+                return seastar::futurize_invoke([this, &batch] { return _commit(*batch); })
+                .then_wrapped([this, &batch] (auto&& fut) {
+                    if (fut.failed()) {
+                        _failure = fut.get_exception();
+                        K2LOG_W_EXC(log::wal, _failure, "Unable to write to segment {} in {}", _segmentSeq, _dir);
+                        batch->prom.set_exception(_failure);
+                    }
+                    else {
+                        batch->prom.set_value(fut.get());
+                    }
+                });
+            });
+        })
+    .finally([this] {
+        _writing = false;
+        if (_openBatch) {
+            // we stopped due to a failure. Fail anyone still waiting
+            _openBatch->prom.set_exception(_failure);
+            _openBatch.reset();
+        }
+    });
+}
+
+seastar::future<WALPosition> WriteAheadLog::_commit(Batch& batch) {
+    auto start = Clock::now();
+    auto fut = seastar::make_ready_future();
+    // leave room for the footer frame so that we can always seal the segment in place
+    auto required = _writeOffset + _stagingLen + batch.bytes + sizeof(wal::FrameHeader) + sizeof(wal::SegmentFooter);
+    if (_segmentFrames > 0 && (batch.newSegment || required > _segmentSize)) {
+        auto nextSeq = _segmentSeq + 1;
+        K2LOG_D(log::wal, "Rotating from segment {} to {}", _segmentSeq, nextSeq);
+        fut = _sealSegment().then([this, nextSeq] { return _openSegment(nextSeq); });
+    }
+
+    return fut.then([this, &batch, start] {
+        for (auto& record: batch.records) {
+            _stats.bytes += record.getSize();
+            _stageFrame(wal::FrameType::Data, record);
+        }
+        _stats.records += batch.records.size();
+        _segmentFrames += batch.records.size();
+        return _writeStaged().then([this, start] {
+            _stats.commits++;
+            _commitLatency.add(Clock::now() - start);
+            return WALPosition{.segment = _segmentSeq, .offset = _writeOffset + _stagingLen};
+        });
+    });
+}
+
+seastar::future<> WriteAheadLog::_openSegment(uint64_t seq) {
+    auto name = segmentName(_dir, seq);
+    auto flags = seastar::open_flags::wo | seastar::open_flags::create | seastar::open_flags::exclusive;
+    return seastar::open_file_dma(name, flags)
+    .then([this, seq] (seastar::file file) {
+        _file = std::move(file);
+        _segmentOpen = true;
+        _segmentSeq = seq;
+        _segmentFrames = 0;
+        _segmentCrc = 0;
+        _writeOffset = 0;
+        _stagingLen = 0;
+        _alignment = _file.disk_write_dma_alignment();
+        _stats.segments++;
+        // preallocate the segment so that appends don't have to update file metadata
+        return _file.allocate(0, _segmentSize)
+        .handle_exception([this] (auto exc) {
+            K2LOG_W_EXC(log::wal, exc, "Unable to preallocate segment {} in {}", _segmentSeq, _dir);
+        });
+    })
+    .then([this] {
+        wal::SegmentHeader header{
+            .magic = wal::SEGMENT_MAGIC,
+            .version = wal::FORMAT_VERSION,
+            .segmentSeq = _segmentSeq,
+            .createdAt = (uint64_t)nsec(std::chrono::system_clock::now().time_since_epoch()).count(),
+            .headerCrc = 0,
+            .reserved = 0
+        };
+        header.headerCrc = crc32c::Crc32c((const char*)&header, offsetof(wal::SegmentHeader, headerCrc));
+        _ensureStaging(sizeof(header));
+        std::memcpy(_staging.get_write() + _stagingLen, &header, sizeof(header));
+        _stagingLen += sizeof(header);
+        return _writeStaged();
+    })
+    .then([this] {
+        // make sure the new segment file itself survives a crash
+        return seastar::sync_directory(_dir);
+    });
+}
+
+seastar::future<> WriteAheadLog::_sealSegment() {
+    wal::SegmentFooter footer{.frames = _segmentFrames, .dataCrc = _segmentCrc, .reserved = 0};
+    _stageFrame(wal::FrameType::SegmentEnd, (const char*)&footer, sizeof(footer));
+    return _writeStaged()
+    .then([this] {
+        K2LOG_D(log::wal, "Sealed segment {} with {} frames", _segmentSeq, _segmentFrames);
+        _segmentOpen = false;
+        return _file.close();
+    });
+}
+
+void WriteAheadLog::_stageFrame(wal::FrameType type, Payload& data) {
+    auto size = data.getSize();
+    _ensureStaging(sizeof(wal::FrameHeader) + size);
+    data.seek(0);
+    data.read(_staging.get_write() + _stagingLen + sizeof(wal::FrameHeader), size);
+    _stageFrameHeader(type, size);
+}
+
+void WriteAheadLog::_stageFrame(wal::FrameType type, const char* data, size_t size) {
+    _ensureStaging(sizeof(wal::FrameHeader) + size);
+    std::memcpy(_staging.get_write() + _stagingLen + sizeof(wal::FrameHeader), data, size);
+    _stageFrameHeader(type, size);
+}
+
+void WriteAheadLog::_stageFrameHeader(wal::FrameType type, size_t size) {
+    const char* data = _staging.get() + _stagingLen + sizeof(wal::FrameHeader);
+    wal::FrameHeader header{
+        .magic = wal::FRAME_MAGIC,
+        .type = (uint32_t)type,
+        .size = (uint32_t)size,
+        .dataCrc = crc32c::Crc32c(data, size),
+        .headerCrc = 0
+    };
+    header.headerCrc = crc32c::Crc32c((const char*)&header, offsetof(wal::FrameHeader, headerCrc));
+    if (type == wal::FrameType::Data) {
+        _segmentCrc = crc32c::Extend(_segmentCrc, (const uint8_t*)data, size);
+    }
+    std::memcpy(_staging.get_write() + _stagingLen, &header, sizeof(header));
+    _stagingLen += sizeof(header) + size;
+}
+
+void WriteAheadLog::_ensureStaging(size_t size) {
+    // reserve room for the zero padding up to the next aligned boundary
+    auto required = seastar::align_up(_stagingLen + size, _alignment);
+    if (required <= _staging.size()) {
+        return;
+    }
+    auto newBuf = seastar::temporary_buffer<char>::aligned(_alignment, std::max(required, 2 * _staging.size()));
+    if (_stagingLen > 0) {
+        std::memcpy(newBuf.get_write(), _staging.get(), _stagingLen);
+    }
+    _staging = std::move(newBuf);
+}
+
+seastar::future<> WriteAheadLog::_writeStaged() {
+    auto writeLen = seastar::align_up(_stagingLen, _alignment);
+    _ensureStaging(0);
+    std::memset(_staging.get_write() + _stagingLen, 0, writeLen - _stagingLen);
+    return _file.dma_write(_writeOffset, _staging.get(), writeLen)
+    .then([this, writeLen] (size_t written) {
+        if (written != writeLen) {
+            throw std::runtime_error(fmt::format("short write: {} of {} bytes", written, writeLen));
+        }
+        return _file.flush();
+    })
+    .then([this] {
+        // Keep the last partial block at the front of the staging buffer. It is rewritten, together with the
+        // next frames, at the new write offset
+        auto fullBlocks = seastar::align_down(_stagingLen, _alignment);
+        if (fullBlocks > 0) {
+            std::memmove(_staging.get_write(), _staging.get() + fullBlocks, _stagingLen - fullBlocks);
+            _stagingLen -= fullBlocks;
+            _writeOffset += fullBlocks;
+        }
+    });
+}
+
+} // namespace k2
@@ -0,0 +1,237 @@
+/*
+MIT License
+
+Copyright(c) 2022 Futurewei Cloud
+
+    Permission is hereby granted,
+    free of charge, to any person obtaining a copy of this software and associated documentation files(the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
+
+    The above copyright notice and this permission notice shall be included in all copies
+    or
+    substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS",
+    WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER
+    LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+*/
+
+#pragma once
+
+#include <seastar/core/file.hh>
+#include <seastar/core/future.hh>
+#include <seastar/core/shared_future.hh>
+#include <seastar/core/temporary_buffer.hh>
+
+#include <k2/common/Common.h>
+#include <k2/transport/Payload.h>
+#include <k2/transport/Prometheus.h>
+
+namespace k2 {
+
+// On-disk format of the write-ahead log.
+// The log is a sequence of segment files, named by increasing sequence number. Each segment starts with a
+// WALSegmentHeader, followed by frames. A frame is a WALFrameHeader, followed by `size` bytes of data.
+// A segment which was closed cleanly ends with a SegmentEnd frame, carrying a WALSegmentFooter.
+// Segments are preallocated and zero-filled, so a frame header with no magic marks the end of the log.
+namespace wal {
+constexpr uint32_t SEGMENT_MAGIC = 0x4C41574B;
+constexpr uint32_t FRAME_MAGIC = 0x454D4152;
+constexpr uint32_t FORMAT_VERSION = 1;
+
+enum class FrameType : uint32_t {
+    Data = 1,       // a record appended by the user
+    SegmentEnd = 2  // the last frame in a closed segment
+};
+
+struct SegmentHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t segmentSeq;
+    // wall-clock creation time, in nanoseconds since epoch
+    uint64_t createdAt;
+    // crc32c of the fields above
+    uint32_t headerCrc;
+    uint32_t reserved;
+};
+static_assert(sizeof(SegmentHeader) == 32);
+
+struct FrameHeader {
+    uint32_t magic;
+    uint32_t type;
+    uint32_t size;
+    // crc32c of the frame data
+    uint32_t dataCrc;
+    // crc32c of the fields above
+    uint32_t headerCrc;
+};
+static_assert(sizeof(FrameHeader) == 20);
+
+struct SegmentFooter {
+    // number of data frames in the segment
+    uint64_t frames;
+    // crc32c over the data of all data frames in the segment, in order
+    uint32_t dataCrc;
+    uint32_t reserved;
+};
+static_assert(sizeof(SegmentFooter) == 16);
+} // namespace wal
+
+// Cumulative statistics for a WriteAheadLog
+struct WALStats {
+    // number of records appended
+    uint64_t records{0};
+    // number of data bytes appended, excluding framing
+    uint64_t bytes{0};
+    // number of write+flush cycles. Each commit covers all records which arrived while the previous commit was running
+    uint64_t commits{0};
+    // number of segments created
+    uint64_t segments{0};
+    // number of segments removed by truncation
+    uint64_t truncatedSegments{0};
+    K2_DEF_FMT(WALStats, records, bytes, commits, segments, truncatedSegments);
+};
+
+// A position in the log
+struct WALPosition {
+    uint64_t segment{0};
+    // byte offset in the segment file. Zero means the start of the segment
+    uint64_t offset{0};
+    K2_DEF_FMT(WALPosition, segment, offset);
+};
+
+// The result of reading from the log
+struct WALReadResult {
+    // the data of all records which were read, concatenated in log order
+    Payload data{Payload::DefaultAllocator()};
+    uint64_t records{0};
+    // the position from which to continue reading
+    WALPosition next;
+    // set when we've reached the end of the log
+    bool done{false};
+};
+
+// A local-disk write-ahead log.
+// Records are buffered in an aligned staging buffer and written with DMA. Appends which arrive while a write is
+// in progress are grouped together and committed with the next write and flush (group commit).
+// The log rolls over to a new segment file once the current one grows past the configured segment size.
+class WriteAheadLog {
+public:
+    // The segments are stored in the given directory. The latency of each commit is reported in the given histogram
+    WriteAheadLog(String dir, uint64_t segmentSize, ExponentialHistogram& commitLatency);
+
+    // Create the log directory if needed and open a new segment after any segments which already exist
+    seastar::future<> start();
+
+    // Wait for pending appends and close the current segment
+    seastar::future<> stop();
+
+    // Append the data in the given payload as a single record. If newSegment is set, the batch which contains the
+    // record is written at the start of a new segment.
+    // The returned future completes once the record is durable, with the end position of the log after the record
+    seastar::future<WALPosition> append(Payload&& data, bool newSegment=false);
+
+    // Remove all closed segments before the given one. Reads from a removed position start at the oldest remaining segment
+    seastar::future<> truncate(uint64_t segment);
+
+    // Read the records starting at the given position, until we've read at least maxBytes of record data or
+    // we reach the end of the log. The records which were appended before the call are guaranteed to be visible.
+    // Segments which were not closed cleanly (e.g. after a crash) are read up to the first invalid frame.
+    // The read fails if it reaches the footer of a sealed segment which doesn't match the frames in that segment.
+    seastar::future<WALReadResult> read(WALPosition from, size_t maxBytes);
+
+    const WALStats& getStats() const;
+
+    // the file name for the segment with the given sequence number
+    static String segmentName(const String& dir, uint64_t seq);
+
+    // extract the sequence number from a segment file name. Returns false if this isn't a segment file name
+    static bool parseSegmentName(const String& name, uint64_t& seq);
+
+private:
+    // records waiting to be committed together
+    struct Batch {
+        std::vector<Payload> records;
+        // the total size of the records, including framing
+        size_t bytes{0};
+        // set if the batch has to start a new segment
+        bool newSegment{false};
+        seastar::shared_promise<WALPosition> prom;
+    };
+
+    // commit batches until there are no more pending records
+    seastar::future<> _writeLoop();
+
+    // write and flush all records in the batch, rotating the segment first if the batch doesn't fit.
+    // Returns the end position of the log after the batch
+    seastar::future<WALPosition> _commit(Batch& batch);
+
+    seastar::future<> _openSegment(uint64_t seq);
+
+    // read frames from the given segment file into the result, starting at result.next
+    seastar::future<> _readSegment(WALReadResult& result, size_t maxBytes);
+
+    // Count the data frames of a sealed segment up to its SegmentEnd frame at footerAt, and check them against the footer.
+    // Used when a reader reaches the footer after starting in the middle of the segment
+    seastar::future<> _checkSegment(seastar::file& file, uint64_t seq, uint64_t footerAt, wal::SegmentFooter footer);
+
+    // called when a reader reaches the end of the data in a segment
+    void _endOfSegment(WALReadResult& result);
+
+    // write out the segment footer and close the segment file
+    seastar::future<> _sealSegment();
+
+    // copy the given frame into the staging buffer
+    void _stageFrame(wal::FrameType type, Payload& data);
+    void _stageFrame(wal::FrameType type, const char* data, size_t size);
+    // fill in the header for the frame whose data was just copied into the staging buffer
+    void _stageFrameHeader(wal::FrameType type, size_t size);
+
+    // make sure the staging buffer can hold the given number of bytes
+    void _ensureStaging(size_t size);
+
+    // write the staging buffer at the current write offset and flush the file
+    seastar::future<> _writeStaged();
+
+    String _dir;
+    uint64_t _segmentSize;
+
+    // the oldest segment we have on disk
+    uint64_t _firstSeq{0};
+
+    // the current segment
+    seastar::file _file;
+    bool _segmentOpen{false};
+    uint64_t _segmentSeq{0};
+    // number of data frames in the current segment
+    uint64_t _segmentFrames{0};
+    // running crc over the data frames in the current segment
+    uint32_t _segmentCrc{0};
+    // DMA alignment for the segment file
+    size_t _alignment{4096};
+
+    // The staging buffer holds the data to be written at _writeOffset, which is always aligned.
+    // After each write, the last partial block is kept at the front of the buffer and rewritten with the next batch.
+    seastar::temporary_buffer<char> _staging;
+    size_t _stagingLen{0};
+    uint64_t _writeOffset{0};
+
+    // the batch which is accepting new records
+    std::unique_ptr<Batch> _openBatch;
+    // set while the write loop is running
+    bool _writing{false};
+    seastar::future<> _writeFut = seastar::make_ready_future();
+    bool _stopping{false};
+    // set after a failed write. The state of the segment is unknown so we refuse further appends
+    std::exception_ptr _failure;
+
+    WALStats _stats;
+    ExponentialHistogram& _commitLatency;
+}; // class WriteAheadLog
+
+} // namespace k2
@@ -69,6 +69,10 @@ size_t Payload::getCapacity() const {
     return _capacity;
 }
 
+const std::vector<Binary>& Payload::getBuffers() const {
+    return _buffers;
+}
+
 void Payload::ensureCapacity(size_t totalCapacity) {
     if (totalCapacity <= _capacity) return;
     // we're asked to make sure there is certain total capacity. Make sure we have it allocated
@@ -145,6 +145,9 @@ public: // memory management
     // returns the total memory allocated in this Payload
     size_t getCapacity() const;
 
+    // returns the buffers which hold the data of this Payload
+    const std::vector<Binary>& getBuffers() const;
+
     // makes sure that the payload has enough total capacity to hold the given totalCapacity
     void ensureCapacity(size_t totalCapacity);
 
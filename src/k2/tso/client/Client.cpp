@@ -44,7 +44,11 @@ void TSOClient::_registerMetrics() {
         sm::make_histogram("get_timestamp_latency", [this]{ return _latency.getHistogram();},
                 sm::description("Observed latency for get_timestamp calls"), labels),
         sm::make_histogram("discovery_latency", [this]{ return _discoveryLatency.getHistogram();},
-                sm::description("Observed latency for performing worker discovery"), labels)
+                sm::description("Observed latency for performing worker discovery"), labels),
+        sm::make_counter("local_timestamps", _localTimestamps,
+                sm::description("Number of timestamps handed out from a batch without a request to the TSO"), labels),
+        sm::make_counter("timestamp_requests", _timestampRequests,
+                sm::description("Number of timestamp requests sent to the TSO"), labels)
     });
 }
 
@@ -123,7 +127,14 @@ seastar::future<> TSOClient::gracefulStop() {
     }
     _pendingClientRequests.clear();
 
-    return std::move(_pendingRequestsWaiter);
+    for (auto& waiter : _waiters) {
+        waiter.prom.set_exception(TSOClientShutdownException());
+    }
+    _waiters.clear();
+
+    return std::move(_refillFut).then([this] {
+        return std::move(_pendingRequestsWaiter);
+    });
 }
 
 seastar::future<Timestamp> TSOClient::getTimestamp() {
@@ -138,24 +149,103 @@ seastar::future<Timestamp> TSOClient::getTimestamp() {
         // if not ready to serve yet
         _pendingClientRequests.emplace_back();
         return _pendingClientRequests.back().get_future()
-            .then([this, reporter=std::move(reporter)] () mutable {
-                return _getTimestampWithLatency(std::move(reporter));
+            .then([this, requestTime=Clock::now()] {
+                return _getTimestamp(requestTime);
+            })
+            .finally([reporter=std::move(reporter)] () mutable {
+                reporter.report();
             });
     }
 
-    return _getTimestampWithLatency(std::move(reporter));
+    return _getTimestamp(Clock::now())
+        .finally([reporter=std::move(reporter)] () mutable {
+            reporter.report();
+        });
+}
+
+seastar::future<Timestamp> TSOClient::_getTimestamp(TimePoint requestTime) {
+    // callers which are already waiting go first
+    if (_waiters.empty()) {
+        if (auto ts = _takeFromBatch(requestTime); ts) {
+            _localTimestamps++;
+            return seastar::make_ready_future<Timestamp>(std::move(*ts));
+        }
+    }
+
+    _waiters.push_back(Waiter{.requestTime=requestTime, .prom={}});
+    auto fut = _waiters.back().prom.get_future();
+    if (!_refilling) {
+        _refill();
+    }
+    return fut;
+}
+
+std::optional<Timestamp> TSOClient::_takeFromBatch(TimePoint requestTime) {
+    // A timestamp from the batch contains the true time for anyone who asked before the batch expired. Callers
+    // who asked before we sent the request are fine since the batch was generated after they asked
+    if (_batch.remaining == 0 || requestTime > _batch.validUntil) {
+        return std::nullopt;
+    }
+    Timestamp ts = _batch.next;
+    _batch.next.endCount++;
+    _batch.remaining--;
+    return ts;
 }
 
-seastar::future<Timestamp> TSOClient::_getTimestampWithLatency(OperationLatencyReporter&& reporter) {
+void TSOClient::_refill() {
+    _refilling = true;
+    _refillFut = seastar::do_until(
+        [this] { return _waiters.empty() || _stopped; },
+        [this] {
+            // ask for enough timestamps for everyone waiting now, and some for those who come next
+            uint32_t count = std::max<size_t>(_waiters.size(), _batchSize());
+            auto sendTime = Clock::now();
+            _timestampRequests++;
+            return _requestTimestamps(count)
+            .then_wrapped([this, sendTime] (auto&& fut) {
+                if (fut.failed()) {
+                    // everyone waiting on this request fails with it
+                    auto exc = fut.get_exception();
+                    for (auto& waiter : _waiters) {
+                        waiter.prom.set_exception(exc);
+                    }
+                    _waiters.clear();
+                    return;
+                }
+
+                auto resp = fut.get();
+                K2LOG_D(log::tsoclient, "got timestamp batch: {}", resp);
+                _batch = TimestampBatch{
+                    .next = resp.timestamp,
+                    .remaining = resp.count,
+                    .validUntil = sendTime + resp.validFor
+                };
+                while (!_waiters.empty()) {
+                    auto ts = _takeFromBatch(_waiters.front().requestTime);
+                    if (!ts) {
+                        // the rest of the waiters asked too late for this batch. Get them another one
+                        break;
+                    }
+                    _waiters.front().prom.set_value(std::move(*ts));
+                    _waiters.pop_front();
+                }
+            });
+        })
+        .finally([this] {
+            _refilling = false;
+        });
+}
+
+seastar::future<GetTimestampResponse> TSOClient::_requestTimestamps(uint32_t count) {
     // ExponentialBackoffStrategy doesn't support returning values.
     constexpr int retries=5;
 
     return seastar::do_with(
         ExponentialBackoffStrategy().withRetries(retries).withBaseBackoffTime(10ms).withRate(2),
-        GetTimestampRequest{},
-        Timestamp(),
-        [this, retries] (auto& retryStrategy, auto& request, auto& timestamp) mutable {
-        return retryStrategy.run([this, &request, &timestamp, retries] (int retriesLeft, Duration timeout)  mutable {
+        GetTimestampRequest{.count=count},
+        GetTimestampResponse(),
+        [this, retries] (auto& retryStrategy, auto& request, auto& batch) mutable {
+        return retryStrategy.run([this, &request, &batch, retries] (int retriesLeft, Duration timeout)  mutable {
             if (_stopped) {
                 K2LOG_D(log::tsoclient, "Stopping retry since we were stopped");
                 return seastar::make_exception_future<>(TSOClientShutdownException());
@@ -169,35 +259,36 @@ seastar::future<Timestamp> TSOClient::_getTimestampWithLatency(OperationLatencyR
             }
             auto& myRemote = _curTSOServiceNodes[_curWorkerIdx % _curTSOServiceNodes.size()];
 
-            K2LOG_D(log::tsoclient, "Requesting timestamp with retriesLeft:{} and timeout:{} to node:{}", retriesLeft, timeout, *myRemote);
+            K2LOG_D(log::tsoclient, "Requesting {} timestamps with retriesLeft:{} and timeout:{} to node:{}", request.count, retriesLeft, timeout, *myRemote);
 
             return RPC().callRPC<dto::GetTimestampRequest, dto::GetTimestampResponse>(dto::Verbs::GET_TSO_TIMESTAMP, request, *myRemote, timeout)
-            .then([this, &timestamp] (auto&& result) {
+            .then([this, &batch] (auto&& result) {
                 auto& [status, resp] = result;
                 if (!status.is2xxOK()) {
                     K2LOG_D(log::tsoclient, "Error during getTimestamp, status:{}", status);
                     return seastar::make_exception_future<>(std::runtime_error(status.message));
                 }
+                if (resp.count == 0) {
+                    K2LOG_D(log::tsoclient, "Received an empty timestamp batch");
+                    return seastar::make_exception_future<>(std::runtime_error("empty timestamp batch"));
+                }
 
                 K2LOG_D(log::tsoclient, "got timestamp:{}", resp.timestamp);
 
                 // this is our way of returning a value out of the RetryStrategy
-                timestamp = std::move(resp.timestamp);
+                batch = std::move(resp);
                 return seastar::make_ready_future<>();
             });
         })
-        .then_wrapped([&timestamp] (auto&& doneFut) mutable {
+        .then_wrapped([&batch] (auto&& doneFut) mutable {
             if (doneFut.failed()) {
                 K2LOG_W(log::tsoclient, "Failed to get timestamp");
-                return seastar::make_exception_future<Timestamp>(doneFut.get_exception());
+                return seastar::make_exception_future<GetTimestampResponse>(doneFut.get_exception());
             }
             // in the happy case, ignore the future from the loop and give out our value future
             doneFut.ignore_ready_future();
-            return seastar::make_ready_future<Timestamp>(std::move(timestamp));
+            return seastar::make_ready_future<GetTimestampResponse>(std::move(batch));
         });
-    })
-    .finally([reporter=std::move(reporter)] () mutable {
-        reporter.report();
     });
 }
 
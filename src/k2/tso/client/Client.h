@@ -24,6 +24,8 @@ Copyright(c) 2020 Futurewei Cloud
 #pragma once
 #include <chrono>
 #include <climits>
+#include <deque>
+#include <optional>
 #include <tuple>
 
 // third-party
@@ -48,7 +50,8 @@ public:
     seastar::future<> gracefulStop();
     seastar::future<> bootstrap(const String& cpoEndpoint);
 
-    // get a K2 timestamp
+    // get a K2 timestamp. Concurrent callers share a single request to the TSO, which returns a batch of
+    // timestamps. Later callers are served from the batch without a round trip for as long as it remains valid
     seastar::future<dto::Timestamp> getTimestamp();
 
     // get the TSO assigned errorbounds
@@ -57,6 +60,8 @@ public:
 private: // metrics
     ExponentialHistogram _latency;
     ExponentialHistogram _discoveryLatency;
+    uint64_t _localTimestamps{0};
+    uint64_t _timestampRequests{0};
 
     // used to register metrics
     sm::metric_groups _metricGroups;
@@ -65,8 +70,18 @@ private: // metrics
     void _registerMetrics();
 
 private: // methods
-    // Helper used to obtain the timestamp from server and report latency
-    seastar::future<dto::Timestamp> _getTimestampWithLatency(OperationLatencyReporter&& reporter);
+    // Helper used to obtain a timestamp for a caller who asked at the given time, from the current batch if possible
+    seastar::future<dto::Timestamp> _getTimestamp(TimePoint requestTime);
+
+    // Helper used to take the next timestamp from the current batch for a caller who asked at the given time.
+    // Returns nullopt if the batch is used up or is no longer valid for the caller
+    std::optional<dto::Timestamp> _takeFromBatch(TimePoint requestTime);
+
+    // Helper used to keep requesting batches of timestamps from the server until all waiters are served
+    void _refill();
+
+    // Helper used to obtain a batch of timestamps from server
+    seastar::future<dto::GetTimestampResponse> _requestTimestamps(uint32_t count);
 
     // Helper to send the RPC GET_TSO_ENDPOINT
     seastar::future<> _doGetTSOEndpoints(dto::GetTSOEndpointsRequest &request, std::unique_ptr<TXEndpoint> cpoEP, Duration timeout);
@@ -78,6 +93,8 @@ private: // fields
     ConfigVar<int> _maxTSORetries{"max_tso_retries", 10};
     ConfigDuration _tsoTimeout{"tso_timeout", 10ms};
     Duration _tsoErrorBound{50us};
+    // the number of timestamps to ask for in each request, when there are fewer callers waiting
+    ConfigVar<uint32_t> _batchSize{"tso_batch_size", 64};
     // to tell if we've been signaled to stop
     bool _stopped{true};
 
@@ -88,6 +105,25 @@ private: // fields
     std::deque<seastar::promise<>> _pendingClientRequests;
     seastar::future<> _pendingRequestsWaiter = seastar::make_ready_future<>();
 
+    // The timestamps left from the last batch we received
+    struct TimestampBatch {
+        dto::Timestamp next;   // the next timestamp to hand out
+        uint32_t remaining{0}; // the number of timestamps left in the batch
+        TimePoint validUntil;  // callers who asked after this time cannot get a timestamp from this batch
+    };
+    TimestampBatch _batch;
+
+    // callers waiting for a timestamp from the request in flight, and the time at which they asked
+    struct Waiter {
+        TimePoint requestTime;
+        seastar::promise<dto::Timestamp> prom;
+    };
+    std::deque<Waiter> _waiters;
+
+    // set while we're requesting timestamps for the waiters
+    bool _refilling{false};
+    seastar::future<> _refillFut = seastar::make_ready_future<>();
+
     // all URLs of workers of current TSO server
     std::vector<std::unique_ptr<TXEndpoint>> _curTSOServiceNodes;
 
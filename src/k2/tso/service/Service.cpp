@@ -20,6 +20,8 @@ Copyright(c) 2020 Futurewei Cloud
     OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
     SOFTWARE.
 */
+#include <algorithm>
+
 #include <k2/appbase/Appbase.h>
 #include <k2/dto/MessageVerbs.h>
 #include <k2/dto/Timestamp.h>
@@ -43,6 +45,8 @@ seastar::future<> TSOService::start() {
         sm::make_histogram("timestamp_error", [this]{ return _timestampErrors.getHistogram();},
                 sm::description("Errors in returned timestamp in nanoseconds"), labels),
         sm::make_counter("timestamp_errorbound_count", [this]{ return _failedErrorBounds;}),
+        sm::make_histogram("timestamp_batch_size", [this]{ return _batchSizes.getHistogram();},
+                sm::description("Number of timestamps returned for each timestamp request"), labels),
     });
 
     K2LOG_I(log::tsoserver, "initializing GPS clock");
@@ -186,7 +190,6 @@ TSOService::_handleAssignment(dto::AssignTSORequest&& request) {
 
 seastar::future<std::tuple<Status, dto::GetTimestampResponse>>
 TSOService::_handleGetTimestamp(dto::GetTimestampRequest&& request) {
-    (void)request; // nothing is passed in
     if (_tsoId == 0) {
         return RPCResponse(Statuses::S410_Gone("this server is not authorized to generate timestamps"), dto::GetTimestampResponse{});
     }
@@ -234,9 +237,19 @@ TSOService::_handleGetTimestamp(dto::GetTimestampRequest&& request) {
         return RPCResponse(Statuses::S503_Service_Unavailable("gps error too high at the moment"), dto::GetTimestampResponse{});
     }
 
-    // we're done generating a new timestamp. Remember the end count for next time
-    _lastGeneratedEndCount = endCount;
-    return RPCResponse(Statuses::S200_OK("OK"), dto::GetTimestampResponse{.timestamp{.endCount=endCount, .tsoId=_tsoId,.startDelta=(uint32_t)delta}});
+    // The client may ask for a batch of timestamps, which are the consecutive end counts after this one. Each of them
+    // has to contain the gps time as of now, so the batch cannot extend past the lower bound of the gps time
+    uint64_t lowSlack = (uint64_t)nsec(now.real - now.error).count() - (endCount - delta);
+    uint32_t count = std::min<uint64_t>({std::max<uint32_t>(request.count, 1), _maxBatchSize(), lowSlack + 1});
+    // and the batch remains valid until the true time may have passed the upper bound of the gps time
+    Duration validFor = nsec(endCount - (uint64_t)nsec(now.real + now.error).count());
+
+    // we're done generating new timestamps. Remember the last end count for next time
+    _lastGeneratedEndCount = endCount + count - 1;
+    _batchSizes.add(count);
+    return RPCResponse(Statuses::S200_OK("OK"),
+                       dto::GetTimestampResponse{.timestamp{.endCount=endCount, .tsoId=_tsoId,.startDelta=(uint32_t)delta},
+                                                 .count=count, .validFor=validFor});
 }
 
 }
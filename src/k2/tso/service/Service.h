@@ -86,6 +86,7 @@ private: // members
     // metrics
     sm::metric_groups _metricGroups;
     k2::ExponentialHistogram _timestampErrors;
+    k2::ExponentialHistogram _batchSizes;
     uint32_t _failedErrorBounds{0};
     
 
@@ -94,6 +95,8 @@ private: // config
     ConfigVar<int16_t> _clockPollerCPU{"tso.clock_poller_cpu", -1};
     ConfigDuration _clockErrorBound{"tso.hw_error_bound", 100us};
     ConfigDuration _assignTimeout{"tso.assign_timeout", 500ms};
+    // the max number of timestamps we return for a single request
+    ConfigVar<uint32_t> _maxBatchSize{"tso.max_batch_size", 1000};
 };
 
 }
@@ -24,6 +24,7 @@ Copyright(c) 2020 Futurewei Cloud
 #pragma once
 #include <k2/logging/Chrono.h>
 #include <k2/logging/FormattingUtils.h>
+#include <k2/logging/LogRing.h>
 #include <pthread.h>
 
 #include <cassert>
@@ -39,20 +40,27 @@ Copyright(c) 2020 Futurewei Cloud
 // For comparison, stderr's performance is ~6000-7000ns
 #define K2LOG_STREAM stdout
 
-#define DO_K2LOG_LEVEL_FMT(level, module, fmt_str, ...)                            \
-    {                                                                              \
-        fmt::print(K2LOG_STREAM,                                                   \
-                   FMT_STRING("[{}]-{}-[{}]-({}) [{}] [{}:{} @{}] " fmt_str "\n"), \
-                   std::chrono::steady_clock::now(),                               \
-                   k2::logging::Logger::procName,                                  \
-                   k2::logging::Logger::threadId,                                  \
-                   module,                                                         \
-                   k2::logging::LogLevelNames[k2::to_integral(level)],             \
-                   __FILE__,                                                       \
-                   __LINE__,                                                       \
-                   __FUNCTION__,                                                   \
-                   ##__VA_ARGS__);                                                 \
-        ::fflush(K2LOG_STREAM);                                                    \
+// The line is formatted into a stack buffer and handed off to the per-thread log ring. The actual write to
+// K2LOG_STREAM happens on the LogWriter thread so that we never block the calling (reactor) thread on IO.
+// Fatal lines are flushed synchronously so that they are not lost if the process is about to die.
+#define DO_K2LOG_LEVEL_FMT(level, module, fmt_str, ...)                                   \
+    {                                                                                     \
+        fmt::memory_buffer _k2log_buf_;                                                   \
+        fmt::format_to(std::back_inserter(_k2log_buf_),                                   \
+                       FMT_STRING("[{}]-{}-[{}]-({}) [{}] [{}:{} @{}] " fmt_str "\n"),    \
+                       std::chrono::steady_clock::now(),                                  \
+                       k2::logging::Logger::procName,                                     \
+                       k2::logging::Logger::threadId,                                     \
+                       module,                                                            \
+                       k2::logging::LogLevelNames[k2::to_integral(level)],                \
+                       __FILE__,                                                          \
+                       __LINE__,                                                          \
+                       __FUNCTION__,                                                      \
+                       ##__VA_ARGS__);                                                    \
+        k2::logging::Logger::write(_k2log_buf_.data(), _k2log_buf_.size());               \
+        if ((level) >= k2::logging::LogLevel::Fatal) {                                    \
+            k2::logging::Logger::flush();                                                 \
+        }                                                                                 \
     }
 
 #define K2LOG_LEVEL_FMT(level, logger, fmt_str, ...)                     \
@@ -89,6 +97,7 @@ Copyright(c) 2020 Futurewei Cloud
     {                                                \
         if (!(cond)) {                               \
             K2LOG_E(logger, fmt_str, ##__VA_ARGS__); \
+            k2::logging::Logger::flush();            \
             assert((cond));                          \
         }                                            \
     }
@@ -148,6 +157,39 @@ public:
     // the log level changes for the particular module
     static inline thread_local std::unordered_map<std::string, Logger*> moduleLoggers;
 
+    // When set, log lines are handed off to a per-thread ring and written out by a background writer thread.
+    // Otherwise, each line is written and flushed synchronously by the calling thread.
+    static inline std::atomic<bool> asyncOutput{true};
+
+    // the size in bytes of the per-thread log ring. Lines which do not fit in the ring are dropped and counted
+    static inline size_t ringSize{1 << 20};
+
+    // write a formatted log line to the output
+    static void write(const char* data, size_t size) {
+        if (!asyncOutput.load(std::memory_order_relaxed)) {
+            ::fwrite(data, 1, size, K2LOG_STREAM);
+            ::fflush(K2LOG_STREAM);
+            return;
+        }
+        if (!_ring.ring) {
+            _ring.ring = LogWriter::instance().makeRing(ringSize, threadId);
+        }
+        _ring.ring->push(data, size);
+    }
+
+    // synchronously write out any pending log lines from all threads
+    static void flush() {
+        if (asyncOutput.load(std::memory_order_relaxed)) {
+            LogWriter::instance().drainAll();
+        }
+        ::fflush(K2LOG_STREAM);
+    }
+
+    // the number of log lines dropped so far due to full log rings
+    static uint64_t droppedLines() {
+        return LogWriter::instance().dropped();
+    }
+
     // create logger for a given unique(per-thread) name
     Logger(const char* moduleName) : name(moduleName) {
         assert(moduleLoggers.find(name) == moduleLoggers.end());
@@ -172,6 +214,16 @@ public:
 
     std::string name; // the name for this logger
     LogLevel moduleLevel = LogLevel::NotSet; // the module level isn't set by default - use the global level
+
+private:
+    // holder for this thread's log ring. Marks the ring closed on thread exit so that the writer can release it
+    struct ThreadRing {
+        ~ThreadRing() {
+            if (ring) ring->closed = true;
+        }
+        std::shared_ptr<LogRing> ring;
+    };
+    static inline thread_local ThreadRing _ring;
 };
 
 }  // namespace logging
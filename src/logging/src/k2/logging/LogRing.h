@@ -0,0 +1,234 @@
+/*
+MIT License
+
+Copyright(c) 2020 Futurewei Cloud
+
+    Permission is hereby granted,
+    free of charge, to any person obtaining a copy of this software and associated documentation files(the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
+
+    The above copyright notice and this permission notice shall be included in all copies
+    or
+    substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS",
+    WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER
+    LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+*/
+
+#pragma once
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// This file contains the asynchronous output path for the K2LOG_* macros.
+// Each thread which logs owns a single-producer/single-consumer byte ring. The logging thread formats the
+// line into a stack buffer and copies it into its ring without taking any locks or making any syscalls.
+// A dedicated writer thread drains all rings and performs the actual write(2)/fflush on the output stream.
+
+namespace k2 {
+namespace logging {
+
+// A lock-free SPSC ring of log lines. Each entry is laid out as [uint32_t length][bytes]
+// The owning (logging) thread is the only producer, and the LogWriter is the only consumer.
+class LogRing {
+public:
+    LogRing(size_t capacity) {
+        // round up to power of 2 so that we can mask positions instead of dividing
+        _capacity = 1;
+        while (_capacity < capacity) _capacity <<= 1;
+        _data = std::make_unique<char[]>(_capacity);
+    }
+
+    // Producer side. Returns false (and counts a drop) if the ring doesn't have room for the line
+    bool push(const char* data, size_t size) {
+        const size_t entrySize = sizeof(uint32_t) + size;
+        auto head = _head.load(std::memory_order_relaxed);
+        auto tail = _tail.load(std::memory_order_acquire);
+        if (entrySize > _capacity - (head - tail)) {
+            _dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        uint32_t len = (uint32_t)size;
+        _copyIn(head, reinterpret_cast<const char*>(&len), sizeof(len));
+        _copyIn(head + sizeof(len), data, size);
+        _head.store(head + entrySize, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side. Appends all available lines to the given output and returns the number of lines drained
+    size_t drain(std::string& out) {
+        size_t count = 0;
+        auto tail = _tail.load(std::memory_order_relaxed);
+        auto head = _head.load(std::memory_order_acquire);
+        while (tail < head) {
+            uint32_t len;
+            _copyOut(tail, reinterpret_cast<char*>(&len), sizeof(len));
+            auto offset = out.size();
+            out.resize(offset + len);
+            _copyOut(tail + sizeof(len), out.data() + offset, len);
+            tail += sizeof(len) + len;
+            ++count;
+        }
+        _tail.store(tail, std::memory_order_release);
+
+        auto dropped = _dropped.load(std::memory_order_relaxed);
+        if (dropped > _reportedDropped) {
+            fmt::format_to(std::back_inserter(out), "[LogRing] dropped {} log lines (total {}) for thread {}\n",
+                           dropped - _reportedDropped, dropped, threadId);
+            _reportedDropped = dropped;
+        }
+        return count;
+    }
+
+    // total number of lines dropped so far due to a full ring
+    uint64_t dropped() const { return _dropped.load(std::memory_order_relaxed); }
+
+    bool empty() const {
+        return _head.load(std::memory_order_acquire) == _tail.load(std::memory_order_acquire);
+    }
+
+    // the id of the producer thread (as known to the Logger at the time the ring was created)
+    uint64_t threadId{0};
+
+    // set when the producer thread exits. The writer releases the ring once it drains it
+    std::atomic<bool> closed{false};
+
+private:
+    void _copyIn(uint64_t pos, const char* src, size_t size) {
+        auto start = pos & (_capacity - 1);
+        auto first = std::min(size, _capacity - start);
+        std::memcpy(_data.get() + start, src, first);
+        std::memcpy(_data.get(), src + first, size - first);
+    }
+
+    void _copyOut(uint64_t pos, char* dst, size_t size) {
+        auto start = pos & (_capacity - 1);
+        auto first = std::min(size, _capacity - start);
+        std::memcpy(dst, _data.get() + start, first);
+        std::memcpy(dst + first, _data.get(), size - first);
+    }
+
+    std::unique_ptr<char[]> _data;
+    size_t _capacity;
+    // monotonic positions. Kept on separate cache lines to avoid false sharing between producer and consumer
+    alignas(64) std::atomic<uint64_t> _head{0};
+    alignas(64) std::atomic<uint64_t> _tail{0};
+    alignas(64) std::atomic<uint64_t> _dropped{0};
+    uint64_t _reportedDropped{0}; // consumer-only
+};
+
+// The process-wide consumer for all log rings. The writer thread is started lazily when the first ring is created
+class LogWriter {
+public:
+    static LogWriter& instance() {
+        static LogWriter writer;
+        return writer;
+    }
+
+    ~LogWriter() {
+        _stop = true;
+        if (_thread.joinable()) {
+            _thread.join();
+        }
+        drainAll();
+    }
+
+    std::shared_ptr<LogRing> makeRing(size_t capacity, uint64_t threadId) {
+        auto ring = std::make_shared<LogRing>(capacity);
+        ring->threadId = threadId;
+        std::lock_guard lock(_ringsMutex);
+        _rings.push_back(ring);
+        if (!_thread.joinable()) {
+            _thread = std::thread([this] { _run(); });
+        }
+        return ring;
+    }
+
+    // Drain all rings and write them out to the stream. Safe to call from any thread (e.g. on fatal errors) as
+    // draining is serialized with the writer thread.
+    // Returns the number of lines written
+    size_t drainAll() {
+        std::lock_guard drainLock(_drainMutex);
+        std::vector<std::shared_ptr<LogRing>> rings;
+        {
+            std::lock_guard lock(_ringsMutex);
+            rings = _rings;
+        }
+
+        size_t count = 0;
+        _out.clear();
+        for (auto& ring : rings) {
+            count += ring->drain(_out);
+        }
+        if (!_out.empty()) {
+            ::fwrite(_out.data(), 1, _out.size(), stream);
+            ::fflush(stream);
+        }
+
+        // release rings for threads which have exited. Their drops still count towards the total
+        std::lock_guard lock(_ringsMutex);
+        std::erase_if(_rings, [this](auto& ring) {
+            if (ring->closed.load() && ring->empty()) {
+                _releasedDropped += ring->dropped();
+                return true;
+            }
+            return false;
+        });
+        return count;
+    }
+
+    // total number of lines dropped across all rings, including the ones already released
+    uint64_t dropped() {
+        std::lock_guard lock(_ringsMutex);
+        uint64_t total = _releasedDropped;
+        for (auto& ring : _rings) {
+            total += ring->dropped();
+        }
+        return total;
+    }
+
+    // the stream where we write the log lines
+    FILE* stream = stdout;
+
+    // how long the writer sleeps when there is nothing to write
+    std::chrono::microseconds idleSleep{1000};
+
+private:
+    LogWriter() = default;
+
+    void _run() {
+        while (!_stop) {
+            if (drainAll() == 0) {
+                std::this_thread::sleep_for(idleSleep);
+            }
+        }
+    }
+
+    std::mutex _ringsMutex;
+    std::vector<std::shared_ptr<LogRing>> _rings;
+    uint64_t _releasedDropped{0}; // lines dropped by the rings we released. Protected by the _ringsMutex
+    std::mutex _drainMutex;
+    std::string _out;  // reusable output buffer. Protected by the _drainMutex
+    std::atomic<bool> _stop{false};
+    std::thread _thread;
+};
+
+}  // namespace logging
+}  // namespace k2
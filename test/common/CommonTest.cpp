@@ -24,6 +24,10 @@ Copyright(c) 2021 Futurewei Cloud
 #define CATCH_CONFIG_MAIN
 // std
 #include <k2/common/Common.h>
+#include <k2/logging/LogRing.h>
+#include <cstdio>
+#include <memory>
+#include <thread>
 // catch
 #include "catch2/catch.hpp"
 
@@ -100,3 +104,85 @@ SCENARIO("test encode large binary") {
     String decoded = HexCodec::decode(encoded);
     REQUIRE(s == decoded);
 }
+
+SCENARIO("test log ring wraparound") {
+    logging::LogRing ring(64);
+    std::string expected;
+    std::string out;
+    // The lines have different sizes, so entries and their length prefixes get split at the end of the buffer.
+    // We drain every third line, before the ring fills up
+    for (int i = 0; i < 500; ++i) {
+        auto line = fmt::format("{}{}\n", i % 10, std::string(i % 11, 'x'));
+        REQUIRE(ring.push(line.data(), line.size()));
+        expected += line;
+        if (i % 3 == 2) {
+            REQUIRE(ring.drain(out) == 3);
+            REQUIRE(ring.empty());
+        }
+    }
+    REQUIRE(ring.drain(out) == 2);
+    REQUIRE(out == expected);
+    REQUIRE(ring.dropped() == 0);
+}
+
+SCENARIO("test log ring drops lines when full") {
+    logging::LogRing ring(64);
+    ring.threadId = 7;
+    // each entry takes 15 bytes with its length, so four of them fit
+    std::string line = "0123456789\n";
+    size_t pushed = 0;
+    while (ring.push(line.data(), line.size())) {
+        ++pushed;
+    }
+    REQUIRE(pushed == 4);
+    REQUIRE(ring.dropped() == 1);
+    REQUIRE_FALSE(ring.push(line.data(), line.size()));
+    REQUIRE(ring.dropped() == 2);
+
+    std::string out;
+    REQUIRE(ring.drain(out) == 4);
+    REQUIRE(out == line + line + line + line + "[LogRing] dropped 2 log lines (total 2) for thread 7\n");
+
+    // there is room again, and the drops are only reported once
+    REQUIRE(ring.push(line.data(), line.size()));
+    out.clear();
+    REQUIRE(ring.drain(out) == 1);
+    REQUIRE(out == line);
+
+    // a line which is bigger than the ring is dropped too
+    std::string big(100, 'x');
+    REQUIRE_FALSE(ring.push(big.data(), big.size()));
+    out.clear();
+    REQUIRE(ring.drain(out) == 0);
+    REQUIRE(out == "[LogRing] dropped 1 log lines (total 3) for thread 7\n");
+    REQUIRE(ring.dropped() == 3);
+}
+
+SCENARIO("test log writer counts the drops of released rings") {
+    auto& writer = logging::LogWriter::instance();
+    // keep the output of the test rings out of stdout. No rings exist before this, so the writer thread isn't
+    // running yet
+    writer.stream = std::tmpfile();
+    REQUIRE(writer.stream != nullptr);
+    auto before = writer.dropped();
+
+    std::weak_ptr<logging::LogRing> released;
+    std::thread producer([&writer, &released] {
+        auto ring = writer.makeRing(64, 42);
+        released = ring;
+        std::string line = "0123456789\n";
+        std::string big(100, 'x');
+        for (int i = 0; i < 10; ++i) {
+            ring->push(line.data(), line.size());
+            ring->push(big.data(), big.size());
+        }
+        // same as a thread which exits
+        ring->closed = true;
+    });
+    producer.join();
+
+    // the ring is released once it is drained, but its drops still count
+    writer.drainAll();
+    REQUIRE(released.expired());
+    REQUIRE(writer.dropped() >= before + 10);
+}
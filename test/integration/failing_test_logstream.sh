@@ -9,12 +9,13 @@ cd ${topname}/../..
 cpo_child_pid=$!
 
 # start plog
-./build/src/k2/cmd/plog/plog_main ${COMMON_ARGS} -c3 -m500M --tcp_endpoints 10000 10001 10002 --prometheus_port=63001 &
+./build/src/k2/cmd/plog/plog_main ${COMMON_ARGS} -c3 -m500M --tcp_endpoints 10000 10001 10002 --plog_data_dir ${PLOGDIR} --prometheus_port=63001 &
 plog_child_pid=$!
 
 function finish {
   # cleanup code
   rm -rf ${CPODIR}
+  rm -rf ${PLOGDIR}
 
   kill ${cpo_child_pid}
   echo "Waiting for cpo child pid: ${cpo_child_pid}"
@@ -4,6 +4,8 @@ set -e
 
 CPODIR=${CPODIR:=/tmp/___cpo_integ_test}
 rm -rf ${CPODIR}
+WALDIR=${WALDIR:=/tmp/___wal_integ_test}
+rm -rf ${WALDIR}
 DEFAULT_EPS=("tcp+k2rpc://0.0.0.0:10000" "tcp+k2rpc://0.0.0.0:10001" "tcp+k2rpc://0.0.0.0:10002" "tcp+k2rpc://0.0.0.0:10003" "tcp+k2rpc://0.0.0.0:10004")
 EPS=( ${EPS:=${DEFAULT_EPS[@]}} )
 NUMCORES=${NUMCORES:=`nproc`}
@@ -28,7 +30,7 @@ nodepool ${COMMON_ARGS} -c${#EPS[@]} --tcp_endpoints ${EPS[@]} --k23si_persisten
 nodepool_child_pid=$!
 
 # start persistence
-persistence ${COMMON_ARGS} -c1 --tcp_endpoints ${PERSISTENCE} --prometheus_port $(($PROMETHEUS_PORT_START+2)) &
+persistence ${COMMON_ARGS} -c1 --tcp_endpoints ${PERSISTENCE} --persistence_wal_dir ${WALDIR} --prometheus_port $(($PROMETHEUS_PORT_START+2)) &
 persistence_child_pid=$!
 
 # start tso
@@ -43,7 +45,7 @@ function finish {
   echo "Cleaning up..."
   rv=$?
   # cleanup code
-  rm -rf ${CPODIR}
+  rm -rf ${CPODIR} ${WALDIR}
 
   kill ${nodepool_child_pid}
   echo "Waiting for nodepool child pid: ${nodepool_child_pid}"
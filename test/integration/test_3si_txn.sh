@@ -9,7 +9,7 @@ cd ${topname}/../..
 nodepool_child_pid=$!
 
 # start persistence
-./build/src/k2/cmd/persistence/persistence ${COMMON_ARGS} -c1 --tcp_endpoints ${PERSISTENCE} --prometheus_port 63002 &
+./build/src/k2/cmd/persistence/persistence ${COMMON_ARGS} -c1 --tcp_endpoints ${PERSISTENCE} --persistence_wal_dir ${WALDIR} --prometheus_port 63002 &
 persistence_child_pid=$!
 
 # start tso
@@ -24,7 +24,7 @@ cpo_child_pid=$!
 function finish {
   rv=$?
   # cleanup code
-  rm -rf ${CPODIR}
+  rm -rf ${CPODIR} ${WALDIR}
 
   kill ${cpo_child_pid}
   echo "Waiting for cpo child pid: ${cpo_child_pid}"
@@ -0,0 +1,56 @@
+#!/usr/bin/env python3
+
+'''
+MIT License
+
+Copyright (c) 2022 Futurewei Cloud
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+'''
+
+import argparse, unittest, sys
+import requests
+
+parser = argparse.ArgumentParser()
+parser.add_argument("--prometheus_port", help="nodepool prometheus_port")
+args = parser.parse_args()
+url = "http://127.0.0.1:" + args.prometheus_port + "/metrics"
+
+# the totals across all nodepool cores for each of the given metrics
+def get_counters(names):
+    r = requests.get(url)
+    counts = {name: 0 for name in names}
+    for line in r.text.splitlines():
+        if line.startswith("#"):
+            continue
+        for name in names:
+            if name + "{" in line:
+                counts[name] += int(float(line.split()[-1]))
+    return counts
+
+class TestK23SIOnePhase(unittest.TestCase):
+    def test_onePhaseMetrics(self):
+        # k23si_test scenario 07 commits and aborts a txn in one phase, and ends a force-aborted txn
+        # whose finalization falls back to RPCs
+        counts = get_counters(["Nodepool_one_phase_txns", "Nodepool_one_phase_fallbacks"])
+        self.assertGreaterEqual(counts["Nodepool_one_phase_txns"], 2)
+        self.assertGreaterEqual(counts["Nodepool_one_phase_fallbacks"], 1)
+
+del sys.argv[1:]
+unittest.main()
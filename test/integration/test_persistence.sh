@@ -0,0 +1,25 @@
+#!/bin/bash
+set -e
+topname=$(dirname "$0")
+source ${topname}/common_defs.sh
+cd ${topname}/../..
+
+# start persistence
+./build/src/k2/cmd/persistence/persistence ${COMMON_ARGS} -c1 --tcp_endpoints ${PERSISTENCE} --persistence_wal_dir ${WALDIR} --prometheus_port 63002 &
+persistence_child_pid=$!
+
+function finish {
+  rv=$?
+  # cleanup code
+  rm -rf ${CPODIR} ${WALDIR}
+
+  kill ${persistence_child_pid}
+  echo "Waiting for persistence child pid: ${persistence_child_pid}"
+  wait ${persistence_child_pid}
+  echo ">>>> Test ${0} finished with code ${rv}"
+}
+trap finish EXIT
+
+sleep 1
+
+./build/test/k23si/persistence_test ${COMMON_ARGS} -c1 --k23si_persistence_endpoints ${PERSISTENCE} --k23si_persistence_max_inflight_flushes 2 --k23si_persistence_flush_bytes 65536 --k23si_persistence_target_flush_latency 1ms --prometheus_port 63100
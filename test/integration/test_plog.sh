@@ -9,13 +9,14 @@ cd ${topname}/../..
 cpo_child_pid=$!
 
 # start plog
-./build/src/k2/cmd/plog/plog_main ${COMMON_ARGS} -c3 --tcp_endpoints 10000 10001 10002 --prometheus_port=63001 &
+./build/src/k2/cmd/plog/plog_main ${COMMON_ARGS} -c3 --tcp_endpoints 10000 10001 10002 --plog_data_dir ${PLOGDIR} --prometheus_port=63001 &
 plog_child_pid=$!
 
 function finish {
   rv=$?
   # cleanup code
   rm -rf ${CPODIR}
+  rm -rf ${PLOGDIR}
 
   kill ${cpo_child_pid}
   echo "Waiting for cpo child pid: ${cpo_child_pid}"
@@ -30,4 +31,14 @@ trap finish EXIT
 
 sleep 1
 
-./build/test/plog/plog_test ${COMMON_ARGS} --cpo_url ${CPO} --tcp_endpoints 12345 --plog_server_endpoints tcp+k2rpc://0.0.0.0:10000 tcp+k2rpc://0.0.0.0:10001 tcp+k2rpc://0.0.0.0:10002 --prometheus_port=63002
+./build/test/plog/plog_test ${COMMON_ARGS} --cpo_url ${CPO} --tcp_endpoints 12345 --plog_server_endpoints tcp+k2rpc://0.0.0.0:10000 tcp+k2rpc://0.0.0.0:10001 tcp+k2rpc://0.0.0.0:10002 --plog_data_dir ${PLOGDIR} --prometheus_port=63002
+
+# restart plog, so that it reloads the plogs from disk
+kill ${plog_child_pid}
+wait ${plog_child_pid} || true
+./build/src/k2/cmd/plog/plog_main ${COMMON_ARGS} -c3 --tcp_endpoints 10000 10001 10002 --plog_data_dir ${PLOGDIR} --prometheus_port=63001 &
+plog_child_pid=$!
+
+sleep 1
+
+./build/test/plog/plog_test ${COMMON_ARGS} --cpo_url ${CPO} --tcp_endpoints 12345 --plog_server_endpoints tcp+k2rpc://0.0.0.0:10000 tcp+k2rpc://0.0.0.0:10001 tcp+k2rpc://0.0.0.0:10002 --plog_data_dir ${PLOGDIR} --plog_test_phase 2 --prometheus_port=63002
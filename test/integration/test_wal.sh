@@ -0,0 +1,18 @@
+#!/bin/bash
+set -e
+topname=$(dirname "$0")
+source ${topname}/common_defs.sh
+cd ${topname}/../..
+
+WALTESTDIR=/tmp/___wal_unit_test
+rm -rf ${WALTESTDIR}
+
+function finish {
+  rv=$?
+  # cleanup code
+  rm -rf ${WALTESTDIR}
+  echo ">>>> Test ${0} finished with code ${rv}"
+}
+trap finish EXIT
+
+./build/test/persistence/wal_test ${COMMON_ARGS} -c1 --wal_test_dir ${WALTESTDIR} --prometheus_port 63100
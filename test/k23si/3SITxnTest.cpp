@@ -33,6 +33,7 @@ Copyright(c) 2020 Futurewei Cloud
 #include <k2/transport/RPCDispatcher.h>  // for RPC
 #include <k2/tso/client/Client.h>
 
+#include <boost/range/irange.hpp>
 #include <seastar/core/reactor.hh>
 #include <seastar/core/sleep.hh>
 
@@ -130,6 +131,7 @@ public: // application
             .then([this] { return testScenario06(); })
             .then([this] { return testScenario07(); })
             .then([this] { return testScenario08(); })
+            .then([this] { return testScenario09(); })
             .then([this] {
                 K2LOG_I(log::k23si, "======= All tests passed ========");
                 exitcode = 0;
@@ -396,6 +398,22 @@ private:
                 (dto::Verbs::K23SI_TXN_FINALIZE, request, *part.preferredEndpoint, 100ms);
     }
 
+    // finalizes the given txns in one message to the partition which owns the key
+    seastar::future<std::tuple<Status, dto::K23SITxnMultiFinalizeResponse>>
+    doMultiFinalize(dto::Key key, std::vector<dto::K23SI_MTR> mtrs, String cname, std::vector<bool> isCommits) {
+        K2LOG_D(log::k23si, "key={}, phash={}, cname={}, txns={}", key, key.partitionHash(), cname, mtrs.size());
+        auto& part = _pgetter.getPartitionForKey(key);
+        dto::K23SITxnMultiFinalizeRequest request;
+        request.pvid = part.partition->keyRangeV.pvid;
+        request.collectionName = cname;
+        for (size_t i = 0; i < mtrs.size(); ++i) {
+            request.txnTimestamps.push_back(mtrs[i].timestamp);
+            request.actions.push_back(isCommits[i] ? dto::EndAction::Commit : dto::EndAction::Abort);
+        }
+        return RPC().callRPC<dto::K23SITxnMultiFinalizeRequest, dto::K23SITxnMultiFinalizeResponse>
+                (dto::Verbs::K23SI_TXN_MULTI_FINALIZE, request, *part.preferredEndpoint, 100ms);
+    }
+
     seastar::future<std::tuple<Status, dto::K23SITxnHeartbeatResponse>>
     doHeartbeat(dto::Key key, dto::K23SI_MTR mtr, String cname, ErrorCaseOpt errOpt) {
         K2LOG_D(log::k23si, "key={}, phash={}, mtr={}, cname={}", key, key.partitionHash(), mtr, cname);
@@ -2976,6 +2994,108 @@ seastar::future<> testScenario08() {
     }); // end sc-08
 }
 
+seastar::future<> testScenario09() {
+    K2LOG_I(log::k23si, "+++++++ TestScenario 09: multi-finalize +++++++");
+
+    return seastar::make_ready_future()
+    .then([this] {
+        return getTimestamps(4);
+    })
+    .then([this](auto&& timestamps) {
+        return seastar::do_with(
+            std::vector<dto::K23SI_MTR> {
+                { .timestamp = timestamps[0], .priority = dto::TxnPriority::Medium },
+                { .timestamp = timestamps[1], .priority = dto::TxnPriority::Medium },
+                { .timestamp = timestamps[2], .priority = dto::TxnPriority::Medium }
+            },
+            dto::K23SI_MTR { .timestamp = timestamps[3], .priority = dto::TxnPriority::Medium },
+            // each txn has its own TRH, and all of them write to the partition of SC09_shared
+            std::vector<dto::Key> {
+                {.schemaName = "schema", .partitionKey = "SC09_pkey1", .rangeKey = "rKey1"},
+                {.schemaName = "schema", .partitionKey = "SC09_pkey2", .rangeKey = "rKey1"},
+                {.schemaName = "schema", .partitionKey = "SC09_pkey3", .rangeKey = "rKey1"}
+            },
+            std::vector<dto::Key> {
+                {.schemaName = "schema", .partitionKey = "SC09_shared", .rangeKey = "rKey1"},
+                {.schemaName = "schema", .partitionKey = "SC09_shared", .rangeKey = "rKey2"},
+                {.schemaName = "schema", .partitionKey = "SC09_shared", .rangeKey = "rKey3"}
+            },
+            std::vector<bool> {true, false, true},
+            DataRec {.f1="SC09_f1_zero", .f2="SC09_f2_zero"},
+            [this](auto& mtrs, auto& readMtr, auto& trhs, auto& keys, auto& isCommits, auto& v0) {
+            return seastar::do_for_each(boost::irange((size_t)0, mtrs.size()), [&] (size_t i) {
+                return doWrite(trhs[i], v0, mtrs[i], trhs[i], collname, false, true, ErrorCaseOpt::NoInjection)
+                .then([&, i](auto&& response) {
+                    auto& [status, val] = response;
+                    K2EXPECT(log::k23si, status, dto::K23SIStatus::Created);
+                    return doWrite(keys[i], v0, mtrs[i], trhs[i], collname, false, false, ErrorCaseOpt::NoInjection);
+                })
+                .then([](auto&& response) {
+                    auto& [status, val] = response;
+                    K2EXPECT(log::k23si, status, dto::K23SIStatus::Created);
+                });
+            })
+            .then([&] {
+                K2LOG_I(log::k23si, "------- SC09.case01 ( Commit and abort the WIs of several txns with one message ) -------");
+                return doMultiFinalize(keys[0], mtrs, collname, isCommits)
+                .then([&](auto&& response) {
+                    auto& [status, resp] = response;
+                    K2EXPECT(log::k23si, status, dto::K23SIStatus::OK);
+                    K2EXPECT(log::k23si, resp.statuses.size(), mtrs.size());
+                    for (auto& txnStatus: resp.statuses) {
+                        K2EXPECT(log::k23si, txnStatus, dto::K23SIStatus::OK);
+                    }
+                });
+            })
+            .then([&] {
+                K2LOG_I(log::k23si, "------- SC09.case02 ( Other transactions read the finalized records ) -------");
+                return seastar::do_for_each(boost::irange((size_t)0, keys.size()), [&] (size_t i) {
+                    return doRead(keys[i], readMtr, collname, ErrorCaseOpt::NoInjection)
+                    .then([&, i](auto&& response) {
+                        auto& [status, val] = response;
+                        if (isCommits[i]) {
+                            K2EXPECT(log::k23si, status, dto::K23SIStatus::OK);
+                            K2EXPECT(log::k23si, val, v0);
+                        }
+                        else {
+                            K2EXPECT(log::k23si, status, dto::K23SIStatus::KeyNotFound);
+                        }
+                    });
+                });
+            })
+            .then([&] {
+                K2LOG_I(log::k23si, "------- SC09.case03 ( Finalizing the same txns again finds no txn metadata ) -------");
+                return doMultiFinalize(keys[0], mtrs, collname, isCommits)
+                .then([&](auto&& response) {
+                    auto& [status, resp] = response;
+                    K2EXPECT(log::k23si, status, dto::K23SIStatus::OK);
+                    K2EXPECT(log::k23si, resp.statuses.size(), mtrs.size());
+                    for (auto& txnStatus: resp.statuses) {
+                        K2EXPECT(log::k23si, txnStatus, dto::K23SIStatus::KeyNotFound);
+                    }
+                });
+            })
+            .then([&] {
+                K2LOG_I(log::k23si, "------- SC09.case04 ( The txns end after their WIs in the shared partition were finalized ) -------");
+                return seastar::do_for_each(boost::irange((size_t)0, mtrs.size()), [&] (size_t i) {
+                    return doEnd(trhs[i], mtrs[i], collname, isCommits[i], {trhs[i], keys[i]}, Duration{0s}, ErrorCaseOpt::NoInjection)
+                    .then([](auto&& response) {
+                        auto& [status, val] = response;
+                        K2EXPECT(log::k23si, status, dto::K23SIStatus::OK);
+                    })
+                    .then([&, i] {
+                        return doInspectTxn(trhs[i], mtrs[i], collname);
+                    })
+                    .then([](auto&& response) {
+                        auto& [status, val] = response;
+                        K2EXPECT(log::k23si, status, dto::K23SIStatus::KeyNotFound);
+                    });
+                });
+            });
+        }); // end do-with
+    }); // end sc-09
+}
+
 
 }; // class k23si_testing
 } // ns k2
@@ -41,7 +41,11 @@ struct TestCase {
     k2d::SKVRecord rec;
     std::optional<bool> expectedResult;
     std::exception_ptr expectedException;
-    bool run() {
+    bool run(bool compiled) {
+        if (compiled) {
+            // compiled expressions must behave exactly like the interpreted ones
+            return k2e::CompiledExpression(expr, *rec.schema).evaluate(rec);
+        }
         return expr.evaluate(rec);
     }
 };
@@ -128,44 +132,46 @@ k2d::SKVRecord makeRec() {
 }
 
 void runner(std::vector<TestCase>& tcases) {
-    for (auto& tcase: tcases) {
-        K2LOG_I(log::k23si, "tcase name: {}", tcase.name);
-        try {
-            bool result = tcase.run();
-            if (tcase.expectedResult.has_value()) {
-                REQUIRE(tcase.expectedResult.value() == result);
+    for (bool compiled : {false, true}) {
+        for (auto& tcase: tcases) {
+            K2LOG_I(log::k23si, "tcase name: {}, compiled: {}", tcase.name, compiled);
+            try {
+                bool result = tcase.run(compiled);
+                if (tcase.expectedResult.has_value()) {
+                    REQUIRE(tcase.expectedResult.value() == result);
+                }
+                else {
+                    REQUIRE(false);
+                }
+            }
+            catch(k2d::NoFieldFoundException&) {
+                REQUIRE(tcase.expectedException);
+                try{ std::rethrow_exception(tcase.expectedException); }
+                catch(k2d::NoFieldFoundException&) {}
+                catch(...){ REQUIRE(false); }
+            }
+            catch(k2d::TypeMismatchException&) {
+                REQUIRE(tcase.expectedException);
+                try{ std::rethrow_exception(tcase.expectedException); }
+                catch(k2d::TypeMismatchException&) {}
+                catch(...){ REQUIRE(false); }
+            }
+            catch (k2d::DeserializationError&) {
+                REQUIRE(tcase.expectedException);
+                try{ std::rethrow_exception(tcase.expectedException); }
+                catch(k2d::DeserializationError&) {}
+                catch(...){ REQUIRE(false); }
+            }
+            catch (k2d::InvalidExpressionException&) {
+                REQUIRE(tcase.expectedException);
+                try{ std::rethrow_exception(tcase.expectedException); }
+                catch(k2d::InvalidExpressionException&) {}
+                catch(...){ REQUIRE(false); }
             }
-            else {
+            catch (...) {
                 REQUIRE(false);
             }
         }
-        catch(k2d::NoFieldFoundException&) {
-            REQUIRE(tcase.expectedException);
-            try{ std::rethrow_exception(tcase.expectedException); }
-            catch(k2d::NoFieldFoundException&) {}
-            catch(...){ REQUIRE(false); }
-        }
-        catch(k2d::TypeMismatchException&) {
-            REQUIRE(tcase.expectedException);
-            try{ std::rethrow_exception(tcase.expectedException); }
-            catch(k2d::TypeMismatchException&) {}
-            catch(...){ REQUIRE(false); }
-        }
-        catch (k2d::DeserializationError&) {
-            REQUIRE(tcase.expectedException);
-            try{ std::rethrow_exception(tcase.expectedException); }
-            catch(k2d::DeserializationError&) {}
-            catch(...){ REQUIRE(false); }
-        }
-        catch (k2d::InvalidExpressionException&) {
-            REQUIRE(tcase.expectedException);
-            try{ std::rethrow_exception(tcase.expectedException); }
-            catch(k2d::InvalidExpressionException&) {}
-            catch(...){ REQUIRE(false); }
-        }
-        catch (...) {
-            REQUIRE(false);
-        }
     }
 }
 
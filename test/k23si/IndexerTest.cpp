@@ -23,6 +23,8 @@ Copyright(c) 2020 Futurewei Cloud
 
 #define CATCH_CONFIG_MAIN
 
+#include <random>
+
 #include <k2/module/k23si/Indexer.h>
 #include "Log.h"
 #include "catch2/catch.hpp"
@@ -417,8 +419,10 @@ SCENARIO("test 06 multi-key iterate and observation") {
     }
 
     {
-        // expected observations at edges, and actual data in-between
-        // observations:  t0| t0, t0, t0 | t0
+        // Observations are recorded for the exact key the iterator is on, whether it exists or not. Past the
+        // last key, they cover the rest of the schema in the direction of iteration. Unobserved keys report
+        // the low water mark of the read cache, which starts at the creation time of the indexer
+        // observations:  k0:t0 | k1:t0, k2:t0, k3:t0 | end:t0
         // iterate forward
         auto iter = indexer.find(k0);
         REQUIRE(!iter.hasData());
@@ -426,15 +430,16 @@ SCENARIO("test 06 multi-key iterate and observation") {
         REQUIRE(iter.getWI() == nullptr);
         REQUIRE(iter.getLastReadTime() == ts[0]);
         iter.observeAt(ts[1]);
-        // observations:  t1| t1, t0, t0 | t0
+        // observations:  k0:t1 | k1:t0, k2:t0, k3:t0 | end:t0
 
         iter.next();
         REQUIRE(iter.hasData());
         REQUIRE(!iter.atEnd());
         REQUIRE(iter.getKey() == k1);
-        REQUIRE(iter.getLastReadTime() == ts[1]);
+        // the miss on k0 doesn't affect its neighbor
+        REQUIRE(iter.getLastReadTime() == ts[0]);
         iter.observeAt(ts[2]);
-        // observations:  t1| t2, t0, t0 | t0
+        // observations:  k0:t1 | k1:t2, k2:t0, k3:t0 | end:t0
 
         iter.next();
         REQUIRE(iter.hasData());
@@ -442,7 +447,7 @@ SCENARIO("test 06 multi-key iterate and observation") {
         REQUIRE(iter.getKey() == k2);
         REQUIRE(iter.getLastReadTime() == ts[0]);
         iter.observeAt(ts[3]);
-        // observations:  t1| t2, t3, t0 | t0
+        // observations:  k0:t1 | k1:t2, k2:t3, k3:t0 | end:t0
 
         iter.next();
         REQUIRE(iter.hasData());
@@ -450,14 +455,14 @@ SCENARIO("test 06 multi-key iterate and observation") {
         REQUIRE(iter.getKey() == k3);
         REQUIRE(iter.getLastReadTime() == ts[0]);
         iter.observeAt(ts[4]);
-        // observations:  t1| t2, t3, t4 | t0
+        // observations:  k0:t1 | k1:t2, k2:t3, k3:t4 | end:t0
 
         iter.next();
         REQUIRE(!iter.hasData());
         REQUIRE(iter.atEnd());
         REQUIRE(iter.getLastReadTime() == ts[0]);
         iter.observeAt(ts[5]);
-        // observations:  t1| t2, t3, t4 | t5
+        // observations:  k0:t1 | k1:t2, k2:t3, k3:t4 | end:t5
     }
 
     {
@@ -474,17 +479,18 @@ SCENARIO("test 06 multi-key iterate and observation") {
         REQUIRE(!iter.hasData());
         REQUIRE(!iter.atEnd());
         REQUIRE(iter.getWI() == nullptr);
+        // k3_p is past the last key, which we observed at t5
         REQUIRE(iter.getLastReadTime() == ts[5]);
         iter.observeAt(ts[6]);
-        // observations:  t1| t2, t3, t6 | t6
+        // observations:  k0:t1 | k1:t2, k2:t3, k3:t4 | k3_p:t6, end:t5
 
         iter.next();
         REQUIRE(iter.hasData());
         REQUIRE(!iter.atEnd());
         REQUIRE(iter.getKey() == k3);
-        REQUIRE(iter.getLastReadTime() == ts[6]);
+        REQUIRE(iter.getLastReadTime() == ts[4]);
         iter.observeAt(ts[7]);
-        // observations:  t1| t2, t3, t7 | t6
+        // observations:  k0:t1 | k1:t2, k2:t3, k3:t7 | k3_p:t6, end:t5
 
         iter.next();
         REQUIRE(iter.hasData());
@@ -492,7 +498,7 @@ SCENARIO("test 06 multi-key iterate and observation") {
         REQUIRE(iter.getKey() == k2);
         REQUIRE(iter.getLastReadTime() == ts[3]);
         iter.observeAt(ts[8]);
-        // observations:  t1| t2, t8, t7 | t6
+        // observations:  k0:t1 | k1:t2, k2:t8, k3:t7 | k3_p:t6, end:t5
 
         iter.next();
         REQUIRE(iter.hasData());
@@ -500,14 +506,15 @@ SCENARIO("test 06 multi-key iterate and observation") {
         REQUIRE(iter.getKey() == k1);
         REQUIRE(iter.getLastReadTime() == ts[2]);
         iter.observeAt(ts[9]);
-        // observations:  t1| t9, t8, t7 | t6
+        // observations:  k0:t1 | k1:t9, k2:t8, k3:t7 | k3_p:t6, end:t5
 
         iter.next();
         REQUIRE(!iter.hasData());
         REQUIRE(iter.atEnd());
+        // everything before k1, which includes k0
         REQUIRE(iter.getLastReadTime() == ts[1]);
         iter.observeAt(ts[10]);
-        // observations:  t10| t10, t8, t7 | t6
+        // observations:  start:t10 | k1:t9, k2:t8, k3:t7 | k3_p:t6, end:t5
     }
 
     {
@@ -518,11 +525,12 @@ SCENARIO("test 06 multi-key iterate and observation") {
         }
         {
             auto iter = indexer.find(k1);
-            REQUIRE(iter.getLastReadTime() == ts[10]);
+            REQUIRE(iter.getLastReadTime() == ts[9]);
         }
         {
+            // never observed
             auto iter = indexer.find(k1_p);
-            REQUIRE(iter.getLastReadTime() == ts[8]);
+            REQUIRE(iter.getLastReadTime() == ts[0]);
         }
         {
             auto iter = indexer.find(k2);
@@ -530,7 +538,7 @@ SCENARIO("test 06 multi-key iterate and observation") {
         }
         {
             auto iter = indexer.find(k2_p);
-            REQUIRE(iter.getLastReadTime() == ts[7]);
+            REQUIRE(iter.getLastReadTime() == ts[0]);
         }
         {
             auto iter = indexer.find(k3);
@@ -540,10 +548,624 @@ SCENARIO("test 06 multi-key iterate and observation") {
             auto iter = indexer.find(k3_p);
             REQUIRE(iter.getLastReadTime() == ts[6]);
         }
+    }
+
+    {
+        // a scan from k1_p to the end is recorded as a single range, which covers the keys in-between
+        auto iter = indexer.find(k1_p);
+        while (!iter.atEnd()) {
+            iter.next();
+        }
+        iter.observeScanFrom(k1_p, ts[11]);
+        REQUIRE(indexer.find(k1).getLastReadTime() == ts[9]);
+        REQUIRE(indexer.find(k1_p).getLastReadTime() == ts[11]);
+        REQUIRE(indexer.find(k2_p).getLastReadTime() == ts[11]);
+        REQUIRE(indexer.find(k3).getLastReadTime() == ts[11]);
+        dto::Key k4{.schemaName = sch.name, .partitionKey = "KeyZZZ", .rangeKey = "rKey1"};
+        REQUIRE(indexer.find(k4).getLastReadTime() == ts[11]);
+        REQUIRE(indexer.getReadCacheStats().ranges == 3);
+    }
+}
+
+SCENARIO("test07 version garbage collection") {
+    auto indexer = Indexer();
+    std::vector<dto::Timestamp> ts;
+    for (uint32_t i = 1000; i < 1020; ++i) {
+        ts.push_back(dto::Timestamp{.endCount=i, .tsoId=1, .startDelta=0});
+    }
+    indexer.start(ts[0]).get();
+    // force multiple slices
+    indexer.setGCSliceLimits(1, 1s);
+    dto::Schema sch;
+    sch.name = "schema1";
+    indexer.createSchema(sch);
+
+    dto::Key k1{.schemaName = sch.name, .partitionKey = "KeyAAA", .rangeKey = "rKey1"};
+    dto::Key k2{.schemaName = sch.name, .partitionKey = "KeyABA", .rangeKey = "rKey1"};
+    dto::Key k3{.schemaName = sch.name, .partitionKey = "KeyACA", .rangeKey = "rKey1"};
+
+    auto commit = [&indexer] (const dto::Key& key, dto::Timestamp ts, bool isTombstone) {
+        auto iter = indexer.find(key);
+        dto::DataRecord rec;
+        rec.isTombstone = isTombstone;
+        rec.timestamp = ts;
+        iter.addWI(key, std::move(rec), 10);
+        iter.commitWI();
+    };
+    // k1: versions at t1, t2, t3, t4, t5
+    for (int i = 1; i <= 5; ++i) {
+        commit(k1, ts[i], false);
+    }
+    // k2: value at t1, tombstone at t2, observed at t8
+    commit(k2, ts[1], false);
+    commit(k2, ts[2], true);
+    indexer.find(k2).observeAt(ts[8]);
+    // k3: value at t1, tombstone at t6 and a pending WI at t7
+    commit(k3, ts[1], false);
+    commit(k3, ts[6], true);
+
+    // nothing is older than the retention timestamp
+    indexer.collectGarbage(ts[0]);
+    REQUIRE(indexer.getGCStats().reclaimedVersions == 0);
+    REQUIRE(indexer.getGCStats().completedPasses == 1);
+    REQUIRE(indexer.size() == 3);
+
+    // retention at t3: k1 keeps t5, t4, t3 and t2(the newest version below the retention timestamp).
+    // k2 is only left with a tombstone at t2 and should be removed
+    dto::Timestamp rts = ts[3];
+    indexer.collectGarbage(rts);
+    REQUIRE(indexer.getGCStats().completedPasses == 2);
+    REQUIRE(indexer.getGCStats().removedKeys == 1);
+    REQUIRE(indexer.getGCStats().reclaimedVersions == 3);
+    REQUIRE(indexer.size() == 2);
+    {
+        auto iter = indexer.find(k1);
+        auto recs = iter.getAllDataRecords();
+        REQUIRE(recs.size() == 4);
+        REQUIRE(recs[0].timestamp == ts[5]);
+        REQUIRE(recs[3].timestamp == ts[2]);
+        // reads at the retention timestamp still find the correct version
+        auto [rec, conflict] = iter.getDataRecordAt(rts);
+        REQUIRE(rec->timestamp == ts[3]);
+        REQUIRE(!conflict);
+    }
+    {
+        // the observation on the removed key is kept in the read cache
+        auto iter = indexer.find(k2);
+        REQUIRE(!iter.hasData());
+        REQUIRE(iter.getLastReadTime() == ts[8]);
+    }
+    {
+        // k3 still has both versions since the tombstone is newer than the retention timestamp
+        auto iter = indexer.find(k3);
+        REQUIRE(iter.getAllDataRecords().size() == 2);
+        dto::DataRecord rec;
+        rec.isTombstone = false;
+        rec.timestamp = ts[7];
+        iter.addWI(k3, std::move(rec), 10);
+    }
+
+    // retention past everything: k1 keeps only the latest version. k3 keeps its WI only
+    indexer.collectGarbage(ts[10]);
+    REQUIRE(indexer.getGCStats().reclaimedVersions == 8);
+    // the observation on k2 is older than the retention timestamp
+    REQUIRE(indexer.getReadCacheStats().expiredRanges == 1);
+    REQUIRE(indexer.getReadCacheStats().ranges == 0);
+    REQUIRE(indexer.getGCStats().removedKeys == 1);
+    REQUIRE(indexer.size() == 2);
+    {
+        auto iter = indexer.find(k1);
+        REQUIRE(iter.getAllDataRecords().size() == 1);
+        REQUIRE(iter.getLastCommittedTime() == ts[5]);
+    }
+    {
+        auto iter = indexer.find(k3);
+        REQUIRE(iter.getAllDataRecords().size() == 1);
+        REQUIRE(iter.getWI() != nullptr);
+        // once the WI aborts, the key has no data and is removed
+        iter.abortWI();
+    }
+    REQUIRE(indexer.size() == 1);
+}
+
+SCENARIO("test08 indexer types") {
+    // Run the same sequence of operations against each indexer type, with enough keys to exercise node splits
+    for (auto [type, hashIndex] : {std::make_pair(dto::IndexerType::BPTree, true), std::make_pair(dto::IndexerType::BPTree, false),
+                                   std::make_pair(dto::IndexerType::Map, true), std::make_pair(dto::IndexerType::Map, false)}) {
+        auto indexer = Indexer();
+        dto::Timestamp start{.endCount=60000, .tsoId=1, .startDelta=1000};
+        dto::Timestamp wts{.endCount=70000, .tsoId=1, .startDelta=1000};
+        dto::Timestamp rts{.endCount=80000, .tsoId=1, .startDelta=1000};
+        indexer.start(start, type, hashIndex).get();
+        dto::Schema sch;
+        sch.name = "schema1";
+        indexer.createSchema(sch);
+
+        // keys share a long prefix, and are added out of order
+        auto makeKey = [&sch] (uint32_t i) {
+            String pkey(30, '~');
+            return dto::Key{.schemaName = sch.name, .partitionKey = pkey + std::to_string(10000 + (i * 7919) % 1000), .rangeKey = ""};
+        };
+        for (uint32_t i = 0; i < 1000; ++i) {
+            auto key = makeKey(i);
+            auto iter = indexer.find(key);
+            dto::DataRecord rec;
+            rec.timestamp = wts;
+            iter.addWI(key, std::move(rec), 10);
+            REQUIRE(iter.getKey() == key);
+            // only commit every other key. Abort the rest
+            if (i % 2 == 0) {
+                iter.commitWI();
+            } else {
+                iter.abortWI();
+                REQUIRE(!iter.hasData());
+            }
+        }
+        REQUIRE(indexer.size() == 500);
+
+        // forward scan sees all committed keys in order
+        {
+            auto iter = indexer.find(dto::Key{.schemaName = sch.name, .partitionKey = "", .rangeKey = ""});
+            std::vector<dto::Key> keys;
+            for (; !iter.atEnd(); iter.next()) {
+                if (iter.hasData()) {
+                    keys.push_back(iter.getKey());
+                }
+            }
+            REQUIRE(keys.size() == 500);
+            REQUIRE(std::is_sorted(keys.begin(), keys.end()));
+        }
+        // reverse scan
+        {
+            auto iter = indexer.find(dto::Key{.schemaName = sch.name, .partitionKey = String(31, '~'), .rangeKey = ""}, true);
+            size_t count = 0;
+            dto::Key last;
+            for (; !iter.atEnd(); iter.next()) {
+                if (iter.hasData()) {
+                    if (count > 0) {
+                        REQUIRE(iter.getKey() < last);
+                    }
+                    last = iter.getKey();
+                    ++count;
+                }
+            }
+            REQUIRE(count == 500);
+        }
+        // observation of a missing key is kept for that key
+        {
+            auto missing = makeKey(1);
+            auto iter = indexer.find(missing);
+            REQUIRE(!iter.hasData());
+            iter.observeAt(rts);
+            REQUIRE(indexer.find(missing).getLastReadTime() == rts);
+        }
+        // scans starting at an existing key continue in key order in both directions
+        {
+            auto key = makeKey(0);
+            auto iter = indexer.find(key);
+            REQUIRE(iter.hasData());
+            REQUIRE(!iter.atEnd());
+            iter.next();
+            REQUIRE(key < iter.getKey());
+            auto riter = indexer.find(key, true);
+            riter.next();
+            REQUIRE(riter.getKey() < key);
+        }
+        // removing a key through an Iterator which was found by exact match keeps its observations
+        {
+            auto key = makeKey(2);
+            dto::Timestamp wts2{.endCount=90000, .tsoId=1, .startDelta=1000};
+            dto::Timestamp rts2{.endCount=95000, .tsoId=1, .startDelta=1000};
+            auto added = makeKey(3);
+            auto iter = indexer.find(added);
+            dto::DataRecord rec;
+            rec.timestamp = wts2;
+            iter.addWI(added, std::move(rec), 11);
+            auto found = indexer.find(added);
+            REQUIRE(found.hasData());
+            found.observeAt(rts2);
+            found.abortWI();
+            REQUIRE(!found.hasData());
+            REQUIRE(indexer.find(added).getLastReadTime() == rts2);
+            REQUIRE(indexer.find(key).hasData());
+            REQUIRE(indexer.size() == 500);
+        }
+    }
+}
+
+SCENARIO("test09 sliced scan and restored versions") {
+    auto indexer = Indexer();
+    std::vector<dto::Timestamp> ts;
+    for (uint32_t i = 1000; i < 1010; ++i) {
+        ts.push_back(dto::Timestamp{.endCount=i, .tsoId=1, .startDelta=0});
+    }
+    indexer.start(ts[0]).get();
+    indexer.createSchema(String("schema1"));
+    indexer.createSchema(String("schema2"));
+
+    // restore versions out of order, including a duplicate
+    dto::Key k1{.schemaName = "schema1", .partitionKey = "KeyA", .rangeKey = ""};
+    for (auto i : {3, 1, 5, 3}) {
+        dto::DataRecord rec;
+        rec.timestamp = ts[i];
+        indexer.find(k1).addCommitted(k1, std::move(rec));
+    }
+    {
+        auto recs = indexer.find(k1).getAllDataRecords();
+        REQUIRE(recs.size() == 3);
+        REQUIRE(recs[0].timestamp == ts[5]);
+        REQUIRE(recs[1].timestamp == ts[3]);
+        REQUIRE(recs[2].timestamp == ts[1]);
+    }
+    for (uint32_t i = 0; i < 5; ++i) {
+        for (auto schemaName : {"schema1", "schema2"}) {
+            dto::Key key{.schemaName = schemaName, .partitionKey = "KeyB" + std::to_string(i), .rangeKey = ""};
+            dto::DataRecord rec;
+            rec.timestamp = ts[1];
+            indexer.find(key).addCommitted(key, std::move(rec));
+        }
+    }
+    REQUIRE(indexer.size() == 11);
 
+    // scan two keys at a time, adding a key behind the scan and one ahead of it half way through
+    auto cursor = indexer.startScan();
+    std::vector<dto::Key> visited;
+    auto visitor = [&visited] (const String& schemaName, const IndexerKey& key, const VersionSet& vset) {
+        REQUIRE(!vset.empty());
+        visited.push_back(dto::Key{.schemaName = schemaName, .partitionKey = key.getPartitionKey(), .rangeKey = key.getRangeKey()});
+    };
+    uint32_t slices = 0;
+    while (!indexer.scanSlice(cursor, 2, visitor)) {
+        if (++slices == 3) {
+            for (auto& schemaName : cursor.schemas) {
+                for (auto pkey : {"Key", "KeyZ"}) {
+                    dto::Key key{.schemaName = schemaName, .partitionKey = pkey, .rangeKey = ""};
+                    dto::DataRecord rec;
+                    rec.timestamp = ts[2];
+                    indexer.find(key).addCommitted(key, std::move(rec));
+                }
+            }
+        }
     }
+    // Every key which was there from the start is visited exactly once. After three slices, one schema has been
+    // scanned completely and the other one is at KeyB*, so only KeyZ of the other schema is ahead of the scan
+    REQUIRE(visited.size() == 11 + 1);
+    std::set<dto::Key> unique(visited.begin(), visited.end());
+    REQUIRE(unique.size() == visited.size());
 }
 
+SCENARIO("test10 record value arena") {
+    auto indexer = Indexer();
+    std::vector<dto::Timestamp> ts;
+    for (uint32_t i = 1000; i < 1010; ++i) {
+        ts.push_back(dto::Timestamp{.endCount=i, .tsoId=1, .startDelta=0});
+    }
+    indexer.start(ts[0]).get();
+    indexer.setArenaLimits(1024, 0.5);
+    dto::Schema sch;
+    sch.name = "schema1";
+    indexer.createSchema(sch);
+
+    auto makeKey = [&sch] (uint32_t i) {
+        return dto::Key{.schemaName = sch.name, .partitionKey = "Key" + std::to_string(1000 + i), .rangeKey = ""};
+    };
+    auto commit = [&indexer] (const dto::Key& key, dto::Timestamp ts, const String& data) {
+        dto::SKVRecord::Storage storage;
+        storage.fieldData = Payload(Payload::DefaultAllocator());
+        storage.fieldData.write(data);
+        storage.excludedFields = std::vector<bool>(3, false);
+        dto::DataRecord rec;
+        rec.value = indexer.copyValue(storage);
+        rec.timestamp = ts;
+        auto iter = indexer.find(key);
+        iter.addWI(key, std::move(rec), 10);
+        iter.commitWI();
+    };
+    auto readData = [&indexer] (const dto::Key& key, dto::Timestamp ts) {
+        auto iter = indexer.find(key);
+        auto [rec, conflict] = iter.getDataRecordAt(ts);
+        REQUIRE(rec != nullptr);
+        // an all-false exclusion bitmap isn't kept
+        REQUIRE(rec->value.excludedFields.empty());
+        String data;
+        rec->value.fieldData.seek(0);
+        REQUIRE(rec->value.fieldData.read(data));
+        rec->value.fieldData.seek(0);
+        return data;
+    };
+
+    // Each value takes 64 bytes (size prefix, 59 chars and the null), so 16 of them fill a slab.
+    // 100 values take up 6 full slabs and 4 values in the 7th one
+    for (uint32_t i = 0; i < 100; ++i) {
+        commit(makeKey(i), ts[1], String(59, 'a' + i % 26));
+    }
+    auto stats = indexer.getArenaStats();
+    REQUIRE(stats.slabs == 7);
+    REQUIRE(stats.slabBytes == 7 * 1024);
+    REQUIRE(stats.largeValues == 0);
+    // a big value gets its own allocation
+    commit(makeKey(100), ts[1], String(500, 'z'));
+    REQUIRE(indexer.getArenaStats().largeValues == 1);
+    REQUIRE(indexer.getArenaStats().slabs == 7);
+
+    // overwrite 9 out of 10 values. The versions at t1 are then dropped by the GC
+    for (uint32_t i = 0; i < 100; ++i) {
+        if (i % 10 != 0) {
+            commit(makeKey(i), ts[2], String(59, 'A' + i % 26));
+        }
+    }
+    // the first pass measures the slabs. The first 6 slabs keep only 1 or 2 values each, which makes them sparse
+    indexer.collectGarbage(ts[5]);
+    REQUIRE(indexer.getGCStats().reclaimedVersions == 90);
+    stats = indexer.getArenaStats();
+    REQUIRE(stats.freedSlabs == 0);
+    REQUIRE(stats.relocatedValues == 0);
+    REQUIRE(stats.liveBytes < stats.slabBytes);
+
+    // the next pass moves the survivors out of the sparse slabs, which frees them
+    indexer.collectGarbage(ts[5]);
+    stats = indexer.getArenaStats();
+    REQUIRE(stats.relocatedValues == 10);
+    REQUIRE(stats.relocatedBytes == 10 * 64);
+    REQUIRE(stats.freedSlabs == 6);
+    for (uint32_t i = 0; i < 100; ++i) {
+        REQUIRE(readData(makeKey(i), ts[6]) == String(59, (i % 10 == 0 ? 'a' : 'A') + i % 26));
+    }
+    REQUIRE(readData(makeKey(100), ts[6]) == String(500, 'z'));
+}
+
+SCENARIO("test11 encoded indexer keys") {
+    // keys with embedded nulls and keys which are prefixes of each other
+    String nul("\0", 1);
+    std::vector<std::pair<String, String>> parts{
+        {"", ""}, {"", "a"}, {"", nul}, {nul, ""}, {nul + nul, ""}, {nul + "a", ""}, {"a", ""}, {"a", nul},
+        {"a", "a"}, {"a" + nul, ""}, {"a" + nul + "b", "c"}, {"a" + nul + "\x01", ""}, {"a\x01", ""},
+        {"ab", ""}, {"a\xff", "\xff"}, {"b", ""}
+    };
+    std::vector<IndexerKey> keys;
+    for (auto& [pk, rk] : parts) {
+        keys.emplace_back(pk, rk);
+        String decodedPk, decodedRk;
+        keys.back().decode(decodedPk, decodedRk);
+        REQUIRE(decodedPk == pk);
+        REQUIRE(decodedRk == rk);
+        REQUIRE(keys.back().getPartitionKey() == pk);
+        REQUIRE(keys.back().getRangeKey() == rk);
+    }
+    // the byte order of the encoded keys is the same as the order of the (partitionKey, rangeKey) pairs
+    for (size_t i = 0; i < parts.size(); ++i) {
+        for (size_t j = 0; j < parts.size(); ++j) {
+            auto expected = parts[i] < parts[j] ? -1 : (parts[j] < parts[i] ? 1 : 0);
+            auto actual = keys[i].compare(keys[j]);
+            REQUIRE((actual < 0 ? -1 : (actual > 0 ? 1 : 0)) == expected);
+            REQUIRE((keys[i].bytes() < keys[j].bytes()) == (expected < 0));
+        }
+    }
+
+    // keys come back out of the indexer as they went in, along with the interned schema name
+    auto indexer = Indexer();
+    dto::Timestamp ts{.endCount=1000, .tsoId=1, .startDelta=0};
+    indexer.start(ts).get();
+    indexer.createSchema(String("schema1"));
+    for (auto& [pk, rk] : parts) {
+        dto::Key key{.schemaName = "schema1", .partitionKey = pk, .rangeKey = rk};
+        dto::DataRecord rec;
+        rec.timestamp = ts;
+        indexer.find(key).addCommitted(key, std::move(rec));
+    }
+    REQUIRE(indexer.size() == parts.size());
+    auto sorted = parts;
+    std::sort(sorted.begin(), sorted.end());
+    size_t idx = 0;
+    for (auto iter = indexer.find(dto::Key{.schemaName = "schema1", .partitionKey = "", .rangeKey = ""}); !iter.atEnd(); iter.next()) {
+        auto key = iter.getKey();
+        REQUIRE(key.schemaName == "schema1");
+        REQUIRE(key.partitionKey == sorted[idx].first);
+        REQUIRE(key.rangeKey == sorted[idx].second);
+        ++idx;
+    }
+    REQUIRE(idx == sorted.size());
+}
+
+// hashes many keys to the same few slots so that erases have to shift entries back
+struct CollidingHashTraits {
+    static size_t hash(const int& key) { return key % 7; }
+    static const int& key(const std::pair<const int, int>& entry) { return entry.first; }
+    static bool equal(const int& a, const int& b) { return a == b; }
+};
+
+SCENARIO("test12 hash index churn") {
+    std::map<int, int> entries;
+    HashIndex<int, std::pair<const int, int>, CollidingHashTraits> index;
+    for (int round = 0; round < 3; ++round) {
+        for (int i = 0; i < 200; ++i) {
+            auto [it, inserted] = entries.emplace(round * 1000 + i, i);
+            index.insert(&(*it));
+        }
+        // erase every third entry, including ones in the middle of probe sequences
+        for (auto it = entries.begin(); it != entries.end();) {
+            if (it->second % 3 == 0) {
+                index.erase(&(*it));
+                it = entries.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        REQUIRE(index.size() == entries.size());
+        for (int r = 0; r <= round; ++r) {
+            for (int i = 0; i < 200; ++i) {
+                auto* entry = index.find(r * 1000 + i);
+                if (i % 3 == 0) {
+                    REQUIRE(entry == nullptr);
+                } else {
+                    REQUIRE(entry != nullptr);
+                    REQUIRE(entry->first == r * 1000 + i);
+                }
+            }
+        }
+    }
+    // erasing an entry which isn't indexed does nothing
+    std::pair<const int, int> other{5, 5};
+    index.erase(&other);
+    REQUIRE(index.size() == entries.size());
+}
+
+SCENARIO("test13 read cache ranges") {
+    std::vector<dto::Timestamp> ts;
+    for (uint32_t i = 1000; i < 1010; ++i) {
+        ts.push_back(dto::Timestamp{.endCount=i, .tsoId=1, .startDelta=0});
+    }
+    auto bound = [] (const char* key) { return ReadCacheBound::pointStart(0, key); };
+    ReadCache cache(ts[0]);
+
+    // touching ranges with the same timestamp are merged
+    cache.add(bound("b"), bound("d"), ts[2]);
+    cache.add(bound("d"), bound("f"), ts[2]);
+    REQUIRE(cache.getStats().ranges == 1);
+    REQUIRE(cache.getMax(bound("a"), bound("b")) == ts[0]);
+    REQUIRE(cache.getMax(bound("c"), bound("e")) == ts[2]);
+
+    // an older read only fills in the gaps
+    cache.add(bound("a"), bound("g"), ts[1]);
+    REQUIRE(cache.getStats().ranges == 3);
+    REQUIRE(cache.getMax(bound("a"), bound("b")) == ts[1]);
+    REQUIRE(cache.getMax(bound("c"), bound("e")) == ts[2]);
+    REQUIRE(cache.getMax(bound("f"), bound("g")) == ts[1]);
+    REQUIRE(cache.getMax(bound("g"), bound("h")) == ts[0]);
+
+    // a newer read splits the ranges it overlaps
+    cache.add(bound("c"), bound("e"), ts[3]);
+    REQUIRE(cache.getStats().ranges == 5);
+    REQUIRE(cache.getMax(bound("b"), bound("c")) == ts[2]);
+    REQUIRE(cache.getMax(bound("a"), bound("z")) == ts[3]);
+    REQUIRE(cache.getMax(bound("e"), bound("f")) == ts[2]);
+
+    // reads at the low water mark are already covered
+    cache.add(bound("x"), bound("z"), ts[0]);
+    REQUIRE(cache.getStats().ranges == 5);
+
+    // over budget, the oldest ranges are dropped and the low water mark covers them
+    cache.setMemoryBudget(1);
+    REQUIRE(cache.getStats().ranges == 3);
+    REQUIRE(cache.getStats().evictedRanges == 2);
+    REQUIRE(cache.getLowWaterMark() == ts[1]);
+    REQUIRE(cache.getMax(bound("a"), bound("b")) == ts[1]);
+    REQUIRE(cache.getMax(bound("x"), bound("z")) == ts[1]);
+    REQUIRE(cache.getMax(bound("c"), bound("e")) == ts[3]);
+
+    // expiry drops the ranges older than the retention timestamp without touching the low water mark
+    cache.setMemoryBudget(0);
+    cache.expire(ts[3]);
+    REQUIRE(cache.getStats().ranges == 1);
+    REQUIRE(cache.getStats().expiredRanges == 2);
+    REQUIRE(cache.getLowWaterMark() == ts[1]);
+    REQUIRE(cache.getMax(bound("a"), bound("z")) == ts[3]);
+    cache.expire(ts[4]);
+    REQUIRE(cache.getStats().ranges == 0);
+    REQUIRE(cache.getStats().bytes == 0);
+}
+
+SCENARIO("test14 B+tree erase") {
+    // small nodes so that a few hundred keys build a tree with several inner levels
+    struct StringTraits {
+        static int compare(const String& a, const String& b) { return a.compare(b); }
+        static std::string_view prefixBytes(const String& k) { return std::string_view(k.data(), k.size()); }
+    };
+    typedef BPTree<String, uint32_t, StringTraits, 4, 4> TreeT;
+
+    // the tree must hold exactly the expected keys, in order in both directions, and find each one of them
+    auto verify = [] (TreeT& tree, const std::map<String, uint32_t>& expected) {
+        REQUIRE(tree.size() == expected.size());
+        auto exp = expected.begin();
+        for (auto it = tree.begin(); it != tree.end(); ++it, ++exp) {
+            REQUIRE(exp != expected.end());
+            REQUIRE(it->first == exp->first);
+            REQUIRE(it->second == exp->second);
+        }
+        REQUIRE(exp == expected.end());
+        auto rexp = expected.rbegin();
+        for (auto it = tree.end(); it != tree.begin(); ++rexp) {
+            --it;
+            REQUIRE(it->first == rexp->first);
+        }
+        REQUIRE(rexp == expected.rend());
+        for (auto& [key, value] : expected) {
+            auto it = tree.find(key);
+            REQUIRE(it != tree.end());
+            REQUIRE(it->second == value);
+        }
+    };
+
+    TreeT tree;
+    std::map<String, uint32_t> expected;
+    // keys with a long shared prefix, inserted out of order
+    auto makeKey = [] (uint32_t i) { return String(20, 'k') + std::to_string(10000 + (i * 7919) % 600); };
+    for (uint32_t i = 0; i < 600; ++i) {
+        auto key = makeKey(i);
+        tree.insert(std::make_pair(key, i));
+        expected.emplace(key, i);
+    }
+    verify(tree, expected);
+    auto fullHeight = tree.height();
+    REQUIRE(fullHeight >= 4);
+
+    // Erase two out of every three keys. Most leaves underflow and many become empty, which removes them from
+    // their parents and leaves some inner nodes with a single child
+    {
+        uint32_t i = 0;
+        for (auto it = tree.begin(); it != tree.end(); ++i) {
+            if (i % 3 == 0) {
+                ++it;
+                continue;
+            }
+            auto key = it->first;
+            it = tree.erase(it);
+            expected.erase(key);
+            if (it != tree.end()) {
+                REQUIRE(expected.upper_bound(key)->first == it->first);
+            }
+        }
+    }
+    verify(tree, expected);
+
+    // Erase the rest in an order which empties leaves all over the tree, and check the tree after each step.
+    // Inner nodes lose all their children and the root collapses one level at a time
+    std::vector<String> remaining;
+    for (auto& [key, value] : expected) {
+        remaining.push_back(key);
+    }
+    std::shuffle(remaining.begin(), remaining.end(), std::mt19937(42));
+    for (auto& key : remaining) {
+        auto it = tree.find(key);
+        REQUIRE(it != tree.end());
+        auto next = tree.erase(it);
+        expected.erase(key);
+        auto expNext = expected.upper_bound(key);
+        REQUIRE((next == tree.end()) == (expNext == expected.end()));
+        if (next != tree.end()) {
+            REQUIRE(next->first == expNext->first);
+        }
+        REQUIRE(tree.height() <= fullHeight);
+        verify(tree, expected);
+        if (expected.size() == 1) {
+            // a single entry must end up in a root leaf
+            REQUIRE(tree.height() == 1);
+        }
+    }
+    REQUIRE(tree.empty());
+    REQUIRE(tree.height() == 1);
+    REQUIRE(tree.begin() == tree.end());
+    REQUIRE(tree.lower_bound(makeKey(0)) == tree.end());
+
+    // the tree grows again from the empty root leaf
+    for (uint32_t i = 0; i < 100; ++i) {
+        auto key = makeKey(i);
+        tree.insert(std::make_pair(key, i));
+        expected.emplace(key, i);
+    }
+    verify(tree, expected);
+    REQUIRE(tree.height() > 1);
+}
     }  // namespace k2
     /*
     // 404 read between two values updates the ends to the max(existing, ts)
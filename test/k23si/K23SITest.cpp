@@ -72,66 +72,15 @@ public:  // application lifespan
         _cpo_client.init(_cpoConfigEp());
         _cpoEndpoint = RPC().getTXEndpoint(_cpoConfigEp());
         _testTimer.set_callback([this] {
-            _testFuture = seastar::make_ready_future()
-            .then([this] {
-                K2LOG_I(log::k23si, "Creating test collection...");
-                auto request = dto::CollectionCreateRequest{
-                    .metadata{
-                        .name = collname,
-                        .hashScheme = dto::HashScheme::HashCRC32C,
-                        .storageDriver = dto::StorageDriver::K23SI,
-                        .capacity{
-                            .dataCapacityMegaBytes = 1000,
-                            .readIOPs = 100000,
-                            .writeIOPs = 100000,
-                            .minNodes = 3 // Integration tests are set up with a three-core nodepool
-                        },
-                        .retentionPeriod = Duration(1h)*90*24
-                    },
-                    .rangeEnds{}
-                };
-                return _cpo_client.createAndWaitForCollection(Deadline<>(_createWaitTime()), std::move(request.metadata), std::move(request.rangeEnds));
-            })
-            .then([this](Status&& status) {
-                K2EXPECT(log::k23si, status, Statuses::S201_Created);
-                // check to make sure the collection is assigned
-                auto request = dto::CollectionGetRequest{.name = collname};
-                return RPC().callRPC<dto::CollectionGetRequest, dto::CollectionGetResponse>
-                    (dto::Verbs::CPO_COLLECTION_GET, request, *_cpoEndpoint, 100ms);
-            })
-            .then([this](auto&& response) {
-                // check collection was assigned
-                auto& [status, resp] = response;
-                K2EXPECT(log::k23si, status, Statuses::S200_OK);
-
-                _pgetter = dto::PartitionGetter(std::move(resp.collection));
-            })
-            .then([this] () {
-                _schema.name = "schema";
-                _schema.version = 1;
-                _schema.fields = std::vector<dto::SchemaField> {
-                        {dto::FieldType::STRING, "partition", false, false},
-                        {dto::FieldType::STRING, "range", false, false},
-                        {dto::FieldType::STRING, "f1", false, false},
-                        {dto::FieldType::STRING, "f2", false, false},
-                };
-
-                _schema.setPartitionKeyFieldsByName(std::vector<String>{"partition"});
-                _schema.setRangeKeyFieldsByName(std::vector<String> {"range"});
-
-                dto::CreateSchemaRequest request{ collname, _schema };
-                return RPC().callRPC<dto::CreateSchemaRequest, dto::CreateSchemaResponse>(dto::Verbs::CPO_SCHEMA_CREATE, request, *_cpoEndpoint, 1s);
-            })
-            .then([] (auto&& response) {
-                auto& [status, resp] = response;
-                K2EXPECT(log::k23si, status, Statuses::S200_OK);
-            })
+            _testFuture = _createCollection()
             .then([this] { return runScenario00(); })
             .then([this] { return runScenario01(); })
             .then([this] { return runScenario02(); })
             .then([this] { return runScenario03(); })
             .then([this] { return runScenario04(); })
             .then([this] { return runScenario05(); })
+            .then([this] { return runScenario06(); })
+            .then([this] { return runScenario07(); })
             .then([this] {
                 K2LOG_I(log::k23si, "======= All tests passed ========");
                 exitcode = 0;
@@ -170,10 +119,66 @@ private:
     dto::PartitionGetter _pgetter;
     dto::Schema _schema;
 
-    seastar::future<std::tuple<Status, dto::K23SIWriteResponse>>
-    doWrite(const dto::Key& key, const DataRec& data, const dto::K23SI_MTR& mtr, const dto::Key& trh, const String& cname, bool isDelete, bool isTRH) {
-        uint64_t id = 0;
+    // creates the test collection and its schema, and points the partition getter at the new collection
+    seastar::future<> _createCollection() {
+        return seastar::make_ready_future()
+        .then([this] {
+            K2LOG_I(log::k23si, "Creating test collection...");
+            auto request = dto::CollectionCreateRequest{
+                .metadata{
+                    .name = collname,
+                    .hashScheme = dto::HashScheme::HashCRC32C,
+                    .storageDriver = dto::StorageDriver::K23SI,
+                    .capacity{
+                        .dataCapacityMegaBytes = 1000,
+                        .readIOPs = 100000,
+                        .writeIOPs = 100000,
+                        .minNodes = 3 // Integration tests are set up with a three-core nodepool
+                    },
+                    .retentionPeriod = Duration(1h)*90*24
+                },
+                .rangeEnds{}
+            };
+            return _cpo_client.createAndWaitForCollection(Deadline<>(_createWaitTime()), std::move(request.metadata), std::move(request.rangeEnds));
+        })
+        .then([this](Status&& status) {
+            K2EXPECT(log::k23si, status, Statuses::S201_Created);
+            // check to make sure the collection is assigned
+            auto request = dto::CollectionGetRequest{.name = collname};
+            return RPC().callRPC<dto::CollectionGetRequest, dto::CollectionGetResponse>
+                (dto::Verbs::CPO_COLLECTION_GET, request, *_cpoEndpoint, 100ms);
+        })
+        .then([this](auto&& response) {
+            // check collection was assigned
+            auto& [status, resp] = response;
+            K2EXPECT(log::k23si, status, Statuses::S200_OK);
+
+            _pgetter = dto::PartitionGetter(std::move(resp.collection));
+        })
+        .then([this] () {
+            _schema.name = "schema";
+            _schema.version = 1;
+            _schema.fields = std::vector<dto::SchemaField> {
+                    {dto::FieldType::STRING, "partition", false, false},
+                    {dto::FieldType::STRING, "range", false, false},
+                    {dto::FieldType::STRING, "f1", false, false},
+                    {dto::FieldType::STRING, "f2", false, false},
+            };
+
+            _schema.setPartitionKeyFieldsByName(std::vector<String>{"partition"});
+            _schema.setRangeKeyFieldsByName(std::vector<String> {"range"});
+
+            dto::CreateSchemaRequest request{ collname, _schema };
+            return RPC().callRPC<dto::CreateSchemaRequest, dto::CreateSchemaResponse>(dto::Verbs::CPO_SCHEMA_CREATE, request, *_cpoEndpoint, 1s);
+        })
+        .then([] (auto&& response) {
+            auto& [status, resp] = response;
+            K2EXPECT(log::k23si, status, Statuses::S200_OK);
+        });
+    }
 
+    seastar::future<std::tuple<Status, dto::K23SIWriteResponse>>
+    doWrite(const dto::Key& key, const DataRec& data, const dto::K23SI_MTR& mtr, const dto::Key& trh, const String& cname, bool isDelete, bool isTRH, uint64_t id=0) {
         SKVRecord record(cname, std::make_shared<k2::dto::Schema>(_schema));
         record.serializeNext<String>(key.partitionKey);
         record.serializeNext<String>(key.rangeKey);
@@ -190,7 +195,7 @@ private:
             .isDelete = isDelete,
             .designateTRH = isTRH,
             .precondition = dto::ExistencePrecondition::None,
-            .request_id = id++,
+            .request_id = id,
             .key = key,
             .value = std::move(record.storage),
             .fieldsForPartialUpdate = std::vector<uint32_t>()
@@ -274,6 +279,35 @@ private:
             finally([request] () { delete request; });
     }
 
+    seastar::future<std::tuple<Status, dto::K23SIInspectWIsResponse>>
+    doRequestWIs(const dto::Key& key) {
+        auto& part = _pgetter.getPartitionForKey(key);
+        dto::K23SIInspectWIsRequest request;
+        return RPC().callRPC<dto::K23SIInspectWIsRequest, dto::K23SIInspectWIsResponse>
+                (dto::Verbs::K23SI_INSPECT_WIS, request, *part.preferredEndpoint, 100ms);
+    }
+
+    // true if the partition of the given key holds a WI for the given txn
+    seastar::future<bool> hasWI(const dto::Key& key, dto::Timestamp txnts) {
+        return doRequestWIs(key)
+            .then([txnts](auto&& response) {
+                auto& [status, k2response] = response;
+                K2EXPECT(log::k23si, status, Statuses::S200_OK);
+                for (auto& wi: k2response.WIs) {
+                    if (wi.data.timestamp == txnts) {
+                        return true;
+                    }
+                }
+                return false;
+            });
+    }
+
+    DataRec _toDataRec(SKVRecord::Storage&& storage) {
+        SKVRecord record(collname, std::make_shared<k2::dto::Schema>(_schema), std::move(storage), true);
+        record.seekField(2);
+        return DataRec{ *(record.deserializeNext<String>()), *(record.deserializeNext<String>()) };
+    }
+
 public: // tests
 
 seastar::future<> runScenario00() {
@@ -574,6 +608,367 @@ seastar::future<> runScenario05() {
         });
 }
 
+seastar::future<> runScenario06() {
+    K2LOG_I(log::k23si, "Scenario 06: partition recovery");
+    /*
+    Dropping the collection offloads its partitions without cleaning up the persisted data, so creating a
+    collection with the same name and layout brings up partitions which recover from the WAL. Before the restart:
+            - ("s06-pkey1", v1) -> committed
+            - ("s06-pkey2", v1), ("s06-pkey2", v2) -> committed, written twice in the same txn
+            - ("s06-pkey3", v1) -> aborted
+            - ("s06-pkey4", v1), ("s06-pkey5", v1), ("s06-pkey5", v2) -> WIs of an in-progress txn
+    */
+    return seastar::do_with(
+        dto::K23SI_MTR{},
+        dto::Key{"schema", "s06-pkey1", "rkey1"},
+        dto::K23SI_MTR{},
+        dto::Key{"schema", "s06-pkey2", "rkey1"},
+        dto::K23SI_MTR{},
+        dto::Key{"schema", "s06-pkey3", "rkey1"},
+        dto::K23SI_MTR{},
+        dto::Key{"schema", "s06-pkey4", "rkey1"},
+        dto::Key{"schema", "s06-pkey5", "rkey1"},
+        dto::K23SI_MTR{},
+        [this](auto& m1, auto& k1, auto& m2, auto& k2, auto& m3, auto& k3, auto& m4, auto& k4, auto& k5, auto& mr) {
+            return getTimeNow()
+                .then([&](dto::Timestamp&& ts) {
+                    m1.timestamp = ts;
+                    m1.priority = dto::TxnPriority::Medium;
+                    return doWrite(k1, {"v1", "f2"}, m1, k1, collname, false, true);
+                })
+                .then([&](auto&& result) {
+                    auto& [status, r] = result;
+                    K2EXPECT(log::k23si, status, dto::K23SIStatus::Created);
+                    return doEnd(k1, m1, collname, true, {k1});
+                })
+                .then([&](auto&& result) {
+                    auto& [status, r] = result;
+                    K2EXPECT(log::k23si, status, dto::K23SIStatus::OK);
+                    return getTimeNow();
+                })
+                .then([&](dto::Timestamp&& ts) {
+                    m2.timestamp = ts;
+                    m2.priority = dto::TxnPriority::Medium;
+                    return doWrite(k2, {"v1", "f2"}, m2, k2, collname, false, true, 1);
+                })
+                .then([&](auto&& result) {
+                    auto& [status, r] = result;
+                    K2EXPECT(log::k23si, status, dto::K23SIStatus::Created);
+                    return doWrite(k2, {"v2", "f2"}, m2, k2, collname, false, false, 2);
+                })
+                .then([&](auto&& result) {
+                    auto& [status, r] = result;
+                    K2EXPECT(log::k23si, status, dto::K23SIStatus::Created);
+                    return doEnd(k2, m2, collname, true, {k2});
+                })
+                .then([&](auto&& result) {
+                    auto& [status, r] = result;
+                    K2EXPECT(log::k23si, status, dto::K23SIStatus::OK);
+                    return getTimeNow();
+                })
+                .then([&](dto::Timestamp&& ts) {
+                    m3.timestamp = ts;
+                    m3.priority = dto::TxnPriority::Medium;
+                    return doWrite(k3, {"v1", "f2"}, m3, k3, collname, false, true);
+                })
+                .then([&](auto&& result) {
+                    auto& [status, r] = result;
+                    K2EXPECT(log::k23si, status, dto::K23SIStatus::Created);
+                    return doEnd(k3, m3, collname, false, {k3});
+                })
+                .then([&](auto&& result) {
+                    auto& [status, r] = result;
+                    K2EXPECT(log::k23si, status, dto::K23SIStatus::OK);
+                    return getTimeNow();
+                })
+                .then([&](dto::Timestamp&& ts) {
+                    m4.timestamp = ts;
+                    m4.priority = dto::TxnPriority::Medium;
+                    return doWrite(k4, {"v1", "f2"}, m4, k4, collname, false, true, 1);
+                })
+                .then([&](auto&& result) {
+                    auto& [status, r] = result;
+                    K2EXPECT(log::k23si, status, dto::K23SIStatus::Created);
+                    return doWrite(k5, {"v1", "f2"}, m4, k4, collname, false, false, 2);
+                })
+                .then([&](auto&& result) {
+                    auto& [status, r] = result;
+                    K2EXPECT(log::k23si, status, dto::K23SIStatus::Created);
+                    return doWrite(k5, {"v2", "f2"}, m4, k4, collname, false, false, 3);
+                })
+                .then([&](auto&& result) {
+                    auto& [status, r] = result;
+                    K2EXPECT(log::k23si, status, dto::K23SIStatus::Created);
+                    K2LOG_I(log::k23si, "Restarting the partitions of the test collection");
+                    return _cpo_client.dropCollection(collname);
+                })
+                .then([&](Status&& status) {
+                    K2EXPECT(log::k23si, status.is2xxOK(), true);
+                    return _createCollection();
+                })
+                // the WIs of the in-progress txn are recovered, along with their twim
+                .then([&] {
+                    return doRequestRecords(k5);
+                })
+                .then([&](auto&& response) {
+                    auto& [status, k2response] = response;
+                    K2EXPECT(log::k23si, status, Statuses::S200_OK);
+                    K2EXPECT(log::k23si, k2response.records.size(), 1);
+                    if (k2response.records.size() != 1) {
+                        return seastar::make_exception_future<std::tuple<Status, dto::K23SIInspectWIsResponse>>(std::runtime_error("expected a single WI for s06-pkey5"));
+                    }
+                    K2EXPECT(log::k23si, k2response.records[0].timestamp, m4.timestamp);
+                    DataRec d5{"v2", "f2"};
+                    K2EXPECT(log::k23si, _toDataRec(std::move(k2response.records[0].value)), d5);
+                    return doRequestWIs(k5);
+                })
+                .then([&](auto&& response) {
+                    auto& [status, k2response] = response;
+                    K2EXPECT(log::k23si, status, Statuses::S200_OK);
+                    bool found = false;
+                    for (auto& wi: k2response.WIs) {
+                        if (wi.data.timestamp == m4.timestamp) {
+                            found = true;
+                            K2EXPECT(log::k23si, wi.request_id, 3);
+                        }
+                    }
+                    K2EXPECT(log::k23si, found, true);
+                    return getTimeNow();
+                })
+                // committed data is recovered with the last write of each txn, and aborted data is gone
+                .then([&](dto::Timestamp&& ts) {
+                    mr.timestamp = ts;
+                    mr.priority = dto::TxnPriority::Medium;
+                    return seastar::when_all(doRead(k1, mr, collname), doRead(k2, mr, collname), doRead(k3, mr, collname));
+                })
+                .then([&](auto&& result) mutable {
+                    auto& [r1, r2, r3] = result;
+                    auto [status1, value1] = r1.get();
+                    auto [status2, value2] = r2.get();
+                    auto [status3, value3] = r3.get();
+                    K2EXPECT(log::k23si, status1, dto::K23SIStatus::OK);
+                    K2EXPECT(log::k23si, status2, dto::K23SIStatus::OK);
+                    K2EXPECT(log::k23si, status3, dto::K23SIStatus::KeyNotFound);
+                    DataRec d1{"v1", "f2"};
+                    DataRec d2{"v2", "f2"};
+                    K2EXPECT(log::k23si, value1, d1);
+                    K2EXPECT(log::k23si, value2, d2);
+                    // the in-progress txn can still commit after the restart
+                    return doEnd(k4, m4, collname, true, {k4, k5});
+                })
+                .then([&](auto&& result) {
+                    auto& [status, r] = result;
+                    K2EXPECT(log::k23si, status, dto::K23SIStatus::OK);
+                    return getTimeNow();
+                })
+                .then([&](dto::Timestamp&& ts) {
+                    mr.timestamp = ts;
+                    return seastar::when_all(doRead(k4, mr, collname), doRead(k5, mr, collname));
+                })
+                .then([&](auto&& result) mutable {
+                    auto& [r4, r5] = result;
+                    auto [status4, value4] = r4.get();
+                    auto [status5, value5] = r5.get();
+                    K2EXPECT(log::k23si, status4, dto::K23SIStatus::OK);
+                    K2EXPECT(log::k23si, status5, dto::K23SIStatus::OK);
+                    DataRec d4{"v1", "f2"};
+                    DataRec d5{"v2", "f2"};
+                    K2EXPECT(log::k23si, value4, d4);
+                    K2EXPECT(log::k23si, value5, d5);
+                });
+        });
+}
+
+seastar::future<> runScenario07() {
+    K2LOG_I(log::k23si, "Scenario 07: one-phase commit");
+    /*
+    Transactions which only write to their TRH partition are finalized in place when they end, so once the end
+    response arrives there are no WIs left and the txn record is gone. The txn metadata can also be in a state which
+    doesn't allow finalizing in place, e.g. when a push already aborted the writes, in which case the TRH falls back
+    to the regular finalization with RPCs:
+            - ("s07-pkey1", rkey1), ("s07-pkey1", rkey2) -> committed in one phase
+            - ("s07-pkey2", rkey1), ("s07-pkey2", rkey2) -> aborted in one phase
+            - ("s07-pkey3", rkey1) -> written by a txn which is aborted by a push, then ended with RPC finalization
+    */
+    return seastar::do_with(
+        dto::K23SI_MTR{},
+        dto::Key{"schema", "s07-pkey1", "rkey1"},
+        dto::Key{"schema", "s07-pkey1", "rkey2"},
+        dto::K23SI_MTR{},
+        dto::Key{"schema", "s07-pkey2", "rkey1"},
+        dto::Key{"schema", "s07-pkey2", "rkey2"},
+        dto::K23SI_MTR{},
+        dto::K23SI_MTR{},
+        dto::Key{"schema", "s07-pkey3", "rkey1"},
+        dto::K23SI_MTR{},
+        int{0},
+        [this](auto& mc, auto& k1, auto& k2, auto& ma, auto& k3, auto& k4, auto& mf, auto& mp, auto& k5, auto& mr, auto& attempts) {
+            return getTimeNow()
+                .then([&](dto::Timestamp&& ts) {
+                    mc.timestamp = ts;
+                    mc.priority = dto::TxnPriority::Medium;
+                    return doWrite(k1, {"v1", "f2"}, mc, k1, collname, false, true);
+                })
+                .then([&](auto&& result) {
+                    auto& [status, r] = result;
+                    K2EXPECT(log::k23si, status, dto::K23SIStatus::Created);
+                    return doWrite(k2, {"v2", "f2"}, mc, k1, collname, false, false);
+                })
+                .then([&](auto&& result) {
+                    auto& [status, r] = result;
+                    K2EXPECT(log::k23si, status, dto::K23SIStatus::Created);
+                    return doEnd(k1, mc, collname, true, {k1, k2});
+                })
+                .then([&](auto&& result) {
+                    auto& [status, r] = result;
+                    K2EXPECT(log::k23si, status, dto::K23SIStatus::OK);
+                    // the txn record is erased before the response when finalizing in place
+                    return doRequestTRH(k1, mc);
+                })
+                .then([&](auto&& response) {
+                    auto& [status, k2response] = response;
+                    K2EXPECT(log::k23si, status, dto::K23SIStatus::KeyNotFound);
+                    return hasWI(k1, mc.timestamp);
+                })
+                .then([&](bool found) {
+                    K2EXPECT(log::k23si, found, false);
+                    return getTimeNow();
+                })
+                .then([&](dto::Timestamp&& ts) {
+                    mr.timestamp = ts;
+                    mr.priority = dto::TxnPriority::Medium;
+                    return seastar::when_all(doRead(k1, mr, collname), doRead(k2, mr, collname));
+                })
+                .then([&](auto&& result) mutable {
+                    auto& [r1, r2] = result;
+                    auto [status1, value1] = r1.get();
+                    auto [status2, value2] = r2.get();
+                    K2EXPECT(log::k23si, status1, dto::K23SIStatus::OK);
+                    K2EXPECT(log::k23si, status2, dto::K23SIStatus::OK);
+                    DataRec d1{"v1", "f2"};
+                    DataRec d2{"v2", "f2"};
+                    K2EXPECT(log::k23si, value1, d1);
+                    K2EXPECT(log::k23si, value2, d2);
+                    return getTimeNow();
+                })
+                .then([&](dto::Timestamp&& ts) {
+                    ma.timestamp = ts;
+                    ma.priority = dto::TxnPriority::Medium;
+                    return doWrite(k3, {"v1", "f2"}, ma, k3, collname, false, true);
+                })
+                .then([&](auto&& result) {
+                    auto& [status, r] = result;
+                    K2EXPECT(log::k23si, status, dto::K23SIStatus::Created);
+                    return doWrite(k4, {"v2", "f2"}, ma, k3, collname, false, false);
+                })
+                .then([&](auto&& result) {
+                    auto& [status, r] = result;
+                    K2EXPECT(log::k23si, status, dto::K23SIStatus::Created);
+                    return doEnd(k3, ma, collname, false, {k3, k4});
+                })
+                .then([&](auto&& result) {
+                    auto& [status, r] = result;
+                    K2EXPECT(log::k23si, status, dto::K23SIStatus::OK);
+                    return doRequestTRH(k3, ma);
+                })
+                .then([&](auto&& response) {
+                    auto& [status, k2response] = response;
+                    K2EXPECT(log::k23si, status, dto::K23SIStatus::KeyNotFound);
+                    return hasWI(k3, ma.timestamp);
+                })
+                .then([&](bool found) {
+                    K2EXPECT(log::k23si, found, false);
+                    return getTimeNow();
+                })
+                .then([&](dto::Timestamp&& ts) {
+                    mr.timestamp = ts;
+                    return seastar::when_all(doRead(k3, mr, collname), doRead(k4, mr, collname));
+                })
+                .then([&](auto&& result) mutable {
+                    auto& [r3, r4] = result;
+                    auto [status3, value3] = r3.get();
+                    auto [status4, value4] = r4.get();
+                    K2EXPECT(log::k23si, status3, dto::K23SIStatus::KeyNotFound);
+                    K2EXPECT(log::k23si, status4, dto::K23SIStatus::KeyNotFound);
+                    return getTimeNow();
+                })
+                .then([&](dto::Timestamp&& ts) {
+                    mf.timestamp = ts;
+                    mf.priority = dto::TxnPriority::Medium;
+                    return doWrite(k5, {"v1", "f2"}, mf, k5, collname, false, true);
+                })
+                .then([&](auto&& result) {
+                    auto& [status, r] = result;
+                    K2EXPECT(log::k23si, status, dto::K23SIStatus::Created);
+                    return getTimeNow();
+                })
+                .then([&](dto::Timestamp&& ts) {
+                    // the newer txn wins the push, which aborts the write of the older txn in its txn metadata
+                    mp.timestamp = ts;
+                    mp.priority = dto::TxnPriority::Medium;
+                    return doWrite(k5, {"v2", "f2"}, mp, k5, collname, false, true);
+                })
+                .then([&](auto&& result) {
+                    auto& [status, r] = result;
+                    K2EXPECT(log::k23si, status, dto::K23SIStatus::Created);
+                    return doRequestTRH(k5, mf);
+                })
+                .then([&](auto&& response) {
+                    auto& [status, k2response] = response;
+                    K2EXPECT(log::k23si, status, Statuses::S200_OK);
+                    K2EXPECT(log::k23si, k2response.state, dto::TxnRecordState::ForceAborted);
+                    // the txn metadata is not InProgress anymore so the end falls back to finalize RPCs
+                    return doEnd(k5, mf, collname, false, {k5});
+                })
+                .then([&](auto&& result) {
+                    auto& [status, r] = result;
+                    K2EXPECT(log::k23si, status, dto::K23SIStatus::OK);
+                    // the background finalization removes the txn record once it completes
+                    return seastar::do_until(
+                        [&] { return attempts < 0 || attempts >= 50; },
+                        [&] {
+                            return doRequestTRH(k5, mf)
+                                .then([&](auto&& response) {
+                                    auto& [status, k2response] = response;
+                                    if (status == dto::K23SIStatus::KeyNotFound) {
+                                        attempts = -1;
+                                        return seastar::make_ready_future();
+                                    }
+                                    ++attempts;
+                                    return seastar::sleep(10ms);
+                                });
+                        });
+                })
+                .then([&] {
+                    K2EXPECT(log::k23si, attempts, -1);
+                    return doEnd(k5, mp, collname, true, {k5});
+                })
+                .then([&](auto&& result) {
+                    auto& [status, r] = result;
+                    K2EXPECT(log::k23si, status, dto::K23SIStatus::OK);
+                    return hasWI(k5, mf.timestamp);
+                })
+                .then([&](bool found) {
+                    K2EXPECT(log::k23si, found, false);
+                    return hasWI(k5, mp.timestamp);
+                })
+                .then([&](bool found) {
+                    K2EXPECT(log::k23si, found, false);
+                    return getTimeNow();
+                })
+                .then([&](dto::Timestamp&& ts) {
+                    mr.timestamp = ts;
+                    return doRead(k5, mr, collname);
+                })
+                .then([&](auto&& result) {
+                    auto& [status, value] = result;
+                    K2EXPECT(log::k23si, status, dto::K23SIStatus::OK);
+                    DataRec d5{"v2", "f2"};
+                    K2EXPECT(log::k23si, value, d5);
+                });
+        });
+}
+
 };  // class K23SITest
 } // ns k2
 
@@ -0,0 +1,362 @@
+/*
+MIT License
+
+Copyright(c) 2020 Futurewei Cloud
+
+    Permission is hereby granted,
+    free of charge, to any person obtaining a copy of this software and associated documentation files(the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
+
+    The above copyright notice and this permission notice shall be included in all copies
+    or
+    substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS",
+    WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER
+    LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+*/
+
+#include <k2/appbase/AppEssentials.h>
+#include <k2/appbase/Appbase.h>
+#include <k2/dto/K23SI.h>
+#include <k2/dto/MessageVerbs.h>
+#include <k2/module/k23si/Persistence.h>
+#include <k2/transport/RPCDispatcher.h>  // for RPC
+
+#include <seastar/core/loop.hh>
+#include <seastar/core/when_all.hh>
+
+#include "Log.h"
+
+namespace k2 {
+
+// A record persisted with append_cont, laid out the same as the records the tests write with appendRecord
+struct PersistenceTestRecord {
+    uint64_t i = 0;
+    String data;
+    K2_PAYLOAD_FIELDS(i, data);
+};
+
+template <>
+struct PersistedRecordTraits<PersistenceTestRecord> {
+    static constexpr PersistedRecordType type = PersistedRecordType::SnapshotVersion;
+};
+
+// Tests for the partition side of persistence: group commit, the limit of flushes in flight, the sizing of the
+// flush batches, and the checks which keep persistence from appending a send after a gap.
+// Runs against a persistence service with a clean WAL directory, with --k23si_persistence_max_inflight_flushes of
+// at least 2 and a non-zero --k23si_persistence_target_flush_latency
+class PersistenceTest {
+public:  // application lifespan
+    PersistenceTest() { K2LOG_I(log::k23si, "ctor"); }
+    ~PersistenceTest() { K2LOG_I(log::k23si, "dtor"); }
+
+    // required for seastar::distributed interface
+    seastar::future<> gracefulStop() {
+        K2LOG_I(log::k23si, "stop");
+        return std::move(_testFuture);
+    }
+
+    seastar::future<> start() {
+        K2LOG_I(log::k23si, "start");
+        _persistenceEndpoint = RPC().getTXEndpoint(_config.persistenceEndpoint()[0]);
+        _testTimer.set_callback([this] {
+            _testFuture = runTest1()
+            .then([this] { return runTest2(); })
+            .then([this] { return runTest3(); })
+            .then([this] { return runTest4(); })
+            .then([this] { return runTest5(); })
+            .then([this] {
+                K2LOG_I(log::k23si, "======= All tests passed ========");
+                exitcode = 0;
+            })
+            .handle_exception([this](auto exc) {
+                K2LOG_W_EXC(log::k23si, exc, "======= Test failed ========");
+                exitcode = -1;
+            })
+            .finally([this] {
+                K2LOG_I(log::k23si, "======= Test ended ========");
+                AppBase().stop(exitcode);
+            });
+        });
+        _testTimer.arm(0ms);
+        return seastar::make_ready_future<>();
+    }
+
+private:
+    int exitcode = -1;
+    K23SIConfig _config;
+    std::unique_ptr<TXEndpoint> _persistenceEndpoint;
+    seastar::timer<> _testTimer;
+    seastar::future<> _testFuture = seastar::make_ready_future();
+
+    static constexpr const char* _collection = "persistence_test_collection";
+
+    // The data for record i. The sizes go from a single byte to a few KB
+    static String _recordData(uint64_t i) {
+        String data(1 + (i * 997) % 3000, '\0');
+        for (size_t j = 0; j < data.size(); ++j) {
+            data[j] = 'a' + (i + j) % 26;
+        }
+        return data;
+    }
+
+    static void _appendRecord(Persistence& persistence, uint64_t i) {
+        persistence.appendRecord(PersistedRecordType::SnapshotVersion, i, _recordData(i));
+    }
+
+    // read back the log of the given persistence and check that it holds exactly the records [0, count), in order
+    static seastar::future<> _checkRecords(Persistence& persistence, uint64_t count) {
+        return seastar::do_with(uint64_t(0), [&persistence, count] (auto& next) {
+            return persistence.replay(LogPosition{}, [&next] (Payload&& page) {
+                page.seek(0);
+                while (page.getDataRemaining() > 0) {
+                    PersistedRecordType type;
+                    uint64_t i = 0;
+                    String data;
+                    if (!page.read(type) || !page.read(i) || !page.read(data)) {
+                        throw std::runtime_error(fmt::format("unable to read record {}", next));
+                    }
+                    K2EXPECT(log::k23si, type, PersistedRecordType::SnapshotVersion);
+                    K2EXPECT(log::k23si, i, next);
+                    K2EXPECT(log::k23si, data, _recordData(next));
+                    ++next;
+                }
+                return seastar::make_ready_future<seastar::stop_iteration>(seastar::stop_iteration::no);
+            })
+            .then([&next, count] {
+                K2EXPECT(log::k23si, next, count);
+            });
+        });
+    }
+
+    // send a raw persist request with the given writer and sequence number
+    seastar::future<Status> _persist(uint64_t partitionId, uint64_t writerId, uint64_t sequence) {
+        auto payload = _persistenceEndpoint->newPayload();
+        payload->write(PersistedRecordType::SnapshotVersion);
+        payload->write(sequence);
+        payload->write(_recordData(sequence));
+        dto::K23SI_PersistenceRequest<Payload> request{};
+        request.collectionName = _collection;
+        request.partitionId = partitionId;
+        request.writerId = writerId;
+        request.sequence = sequence;
+        request.value.val = std::move(*payload);
+        return RPC().callRPC<dto::K23SI_PersistenceRequest<Payload>, dto::K23SI_PersistenceResponse>
+            (dto::Verbs::K23SI_Persist, request, *_persistenceEndpoint, 1s)
+        .then([] (auto&& result) {
+            auto& [status, _] = result;
+            return std::move(status);
+        });
+    }
+
+public: // tests
+seastar::future<> runTest1() {
+    K2LOG_I(log::k23si, ">>> Test1: group commit");
+    // Flushes go out right away until the in-flight limit is reached. The flushes after that wait and go out
+    // together, in one send, once the first send completes
+    return seastar::do_with(std::make_unique<Persistence>(_collection, 1), [] (auto& persistence) {
+        return persistence->start()
+        .then([&persistence] {
+            const uint64_t count = 50;
+            const uint32_t maxInflight = persistence->_config.persistenceMaxInflightFlushes();
+            std::vector<seastar::future<std::tuple<Status, LogPosition>>> futs;
+            for (uint64_t i = 0; i < count; ++i) {
+                _appendRecord(*persistence, i);
+                futs.push_back(persistence->flushWithPosition());
+                K2EXPECT(log::k23si, persistence->_inflight <= maxInflight, true);
+            }
+            K2EXPECT(log::k23si, persistence->_sends, maxInflight);
+            K2EXPECT(log::k23si, persistence->_inflight, maxInflight);
+            return seastar::when_all_succeed(futs.begin(), futs.end())
+            .then([&persistence, count, maxInflight] (std::vector<std::tuple<Status, LogPosition>>&& results) {
+                K2EXPECT(log::k23si, results.size(), count);
+                LogPosition last;
+                for (auto& [status, position]: results) {
+                    K2EXPECT(log::k23si, status.is2xxOK(), true);
+                    // the flushes complete in order
+                    K2EXPECT(log::k23si, position.segment > last.segment ||
+                        (position.segment == last.segment && position.offset >= last.offset), true);
+                    last = position;
+                }
+                K2EXPECT(log::k23si, last.offset > 0, true);
+                K2EXPECT(log::k23si, persistence->_sends, maxInflight + 1);
+                K2EXPECT(log::k23si, persistence->_inflight, 0);
+                return _checkRecords(*persistence, count);
+            });
+        })
+        .finally([&persistence] {
+            return persistence->stop();
+        });
+    });
+}
+
+seastar::future<> runTest2() {
+    K2LOG_I(log::k23si, ">>> Test2: in-flight limit");
+    // Appends send the buffered data on their own once it is large enough, but only while there is room in flight.
+    // The rest keeps buffering until a flush
+    return seastar::do_with(std::make_unique<Persistence>(_collection, 2), [] (auto& persistence) {
+        return persistence->start()
+        .then([&persistence] {
+            const uint32_t maxInflight = persistence->_config.persistenceMaxInflightFlushes();
+            const uint64_t flushBytes = persistence->_config.persistenceFlushBytes();
+            uint64_t count = 0;
+            for (uint64_t bytes = 0; bytes < 4 * maxInflight * flushBytes; ++count) {
+                _appendRecord(*persistence, count);
+                bytes += _recordData(count).size();
+                K2EXPECT(log::k23si, persistence->_inflight <= maxInflight, true);
+            }
+            K2EXPECT(log::k23si, persistence->_sends, maxInflight);
+            K2EXPECT(log::k23si, persistence->_buffer->getSize() > flushBytes, true);
+            return persistence->flush()
+            .then([&persistence, count, maxInflight] (auto&& status) {
+                K2EXPECT(log::k23si, status.is2xxOK(), true);
+                // the flush waited for room in flight and then sent everything else at once
+                K2EXPECT(log::k23si, persistence->_sends, maxInflight + 1);
+                K2EXPECT(log::k23si, persistence->_inflight, 0);
+                return _checkRecords(*persistence, count);
+            });
+        })
+        .finally([&persistence] {
+            return persistence->stop();
+        });
+    });
+}
+
+seastar::future<> runTest3() {
+    K2LOG_I(log::k23si, ">>> Test3: flush batch target");
+    return seastar::do_with(std::make_unique<Persistence>(_collection, 3), [] (auto& persistence) {
+        auto& p = *persistence;
+        const Duration target = p._config.persistenceTargetFlushLatency();
+        const uint64_t maxTarget = p._config.persistenceFlushBytes();
+        const uint64_t minTarget = 4 * 1024;
+        K2EXPECT(log::k23si, maxTarget >= 2 * minTarget, true);
+
+        // fast flushes grow the target from the minimum, by 1/8 at a time
+        p._adjustBatchTarget(0ns);
+        K2EXPECT(log::k23si, p._batchTarget, minTarget);
+        p._adjustBatchTarget(0ns);
+        K2EXPECT(log::k23si, p._batchTarget, minTarget + minTarget / 8);
+
+        // latency between half the target and the target doesn't change anything
+        p._latencyEstimate = target * 3 / 4;
+        p._adjustBatchTarget(target * 3 / 4);
+        K2EXPECT(log::k23si, p._batchTarget, minTarget + minTarget / 8);
+
+        // slow flushes with room in flight halve the target, so that the batches go out sooner, down to the minimum
+        p._batchTarget = maxTarget;
+        p._latencyEstimate = target * 10;
+        p._adjustBatchTarget(target * 10);
+        K2EXPECT(log::k23si, p._batchTarget, std::max(maxTarget / 2, minTarget));
+        for (int i = 0; i < 64; ++i) {
+            p._adjustBatchTarget(target * 10);
+        }
+        K2EXPECT(log::k23si, p._batchTarget, minTarget);
+
+        // slow flushes at the in-flight limit double the target, up to the flush size
+        p._inflight = p._config.persistenceMaxInflightFlushes();
+        p._adjustBatchTarget(target * 10);
+        K2EXPECT(log::k23si, p._batchTarget, 2 * minTarget);
+        for (int i = 0; i < 64; ++i) {
+            p._adjustBatchTarget(target * 10);
+        }
+        K2EXPECT(log::k23si, p._batchTarget, maxTarget);
+        p._inflight = 0;
+
+        // a single slow flush is smoothed out
+        p._latencyEstimate = 0ns;
+        p._adjustBatchTarget(target * 2);
+        K2EXPECT(log::k23si, p._latencyEstimate, target * 2 / 8);
+        K2EXPECT(log::k23si, p._batchTarget, maxTarget);
+        return seastar::make_ready_future();
+    });
+}
+
+seastar::future<> runTest4() {
+    K2LOG_I(log::k23si, ">>> Test4: sequence numbers");
+    // persistence only takes the next request of the current writer, or the first request of a new writer
+    struct Step {
+        uint64_t writerId;
+        uint64_t sequence;
+        Status expected;
+    };
+    std::vector<Step> steps{
+        {100, 1, Statuses::S200_OK},
+        // a gap after request 1
+        {100, 3, Statuses::S409_Conflict},
+        {100, 2, Statuses::S200_OK},
+        // a repeat
+        {100, 2, Statuses::S409_Conflict},
+        {100, 3, Statuses::S200_OK},
+        // a new writer has to start from its first request
+        {200, 2, Statuses::S409_Conflict},
+        {200, 1, Statuses::S200_OK},
+        // the old writer is gone once a new one takes over
+        {100, 4, Statuses::S409_Conflict},
+        {200, 2, Statuses::S200_OK},
+    };
+    return seastar::do_with(std::move(steps), [this] (auto& steps) {
+        return seastar::do_for_each(steps, [this] (auto& step) {
+            return _persist(4, step.writerId, step.sequence)
+            .then([&step] (Status&& status) {
+                K2LOG_D(log::k23si, "writer={}, seq={}, status={}", step.writerId, step.sequence, status);
+                K2EXPECT(log::k23si, status, step.expected);
+            });
+        });
+    });
+}
+
+seastar::future<> runTest5() {
+    K2LOG_I(log::k23si, ">>> Test5: append_cont which triggers a send");
+    // The appends send the buffered data once it reaches the flush size. The append which crosses it goes out with
+    // that send, and is notified once it is persisted. A flush right after that has no data of its own to send
+    return seastar::do_with(std::make_unique<Persistence>(_collection, 5), [] (auto& persistence) {
+        return persistence->start()
+        .then([&persistence] {
+            const uint64_t flushBytes = persistence->_config.persistenceFlushBytes();
+            std::vector<seastar::future<Status>> futs;
+            uint64_t count = 0;
+            for (uint64_t bytes = 0; persistence->_sends == 0 && bytes < 2 * flushBytes; ++count) {
+                futs.push_back(persistence->append_cont(PersistenceTestRecord{.i=count, .data=_recordData(count)}));
+                bytes += _recordData(count).size();
+            }
+            K2EXPECT(log::k23si, persistence->_sends, uint64_t(1));
+            K2EXPECT(log::k23si, (bool)persistence->_buffer, false);
+            K2EXPECT(log::k23si, persistence->_pendingProms.empty(), true);
+            auto flushed = persistence->flush();
+            return seastar::when_all_succeed(futs.begin(), futs.end())
+            .then([flushed=std::move(flushed)] (std::vector<Status>&& statuses) mutable {
+                for (auto& status: statuses) {
+                    K2EXPECT(log::k23si, status.is2xxOK(), true);
+                }
+                return std::move(flushed);
+            })
+            .then([&persistence, count] (auto&& status) {
+                K2EXPECT(log::k23si, status.is2xxOK(), true);
+                return _checkRecords(*persistence, count);
+            });
+        })
+        .finally([&persistence] {
+            return persistence->stop();
+        });
+    });
+}
+
+};  // class PersistenceTest
+} // ns k2
+
+int main(int argc, char** argv) {
+    k2::App app("PersistenceTest");
+    app.addOptions()
+        ("k23si_persistence_max_inflight_flushes", bpo::value<uint32_t>(), "Max number of persistence flushes in flight at the same time")
+        ("k23si_persistence_flush_bytes", bpo::value<uint64_t>(), "Flush the buffered persistence data once it reaches this many bytes")
+        ("k23si_persistence_target_flush_latency", bpo::value<k2::ParseableDuration>(), "Target latency of persistence flushes, used to size the flush batches, as chrono literals")
+        ("k23si_persistence_endpoints", bpo::value<std::vector<k2::String>>()->multitoken()->default_value(std::vector<k2::String>()), "A space-delimited list of k2 persistence endpoints");
+    app.addApplet<k2::PersistenceTest>();
+    return app.start(argc, argv);
+}
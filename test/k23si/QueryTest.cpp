@@ -26,6 +26,9 @@ Copyright(c) 2020 Futurewei Cloud
 #include <k2/cpo/client/Client.h>
 #include <k2/module/k23si/client/k23si_client.h>
 #include <seastar/core/sleep.hh>
+
+#include <algorithm>
+#include <map>
 #include "Log.h"
 using namespace k2;
 namespace k2e = k2::dto::expression;
@@ -111,6 +114,9 @@ public:  // application lifespan
         .then([this] { return runScenario06(); })
         .then([this] { return runScenario07(); })
         .then([this] { return runScenario08(); })
+        .then([this] { return runAggregationScenario(); })
+        .then([this] { return runCursorScenario(); })
+        .then([this] { return runStreamScenario(); })
         .then([this] { return writeAdditionalData(); })
         .then([this] { return runScenario09(); })
         .then([this] {
@@ -879,6 +885,256 @@ seastar::future<> runScenario09() {
 }
 
 
+// Run the query to completion. Returns all records, the aggregates, and the number of pages
+seastar::future<std::tuple<std::vector<k2::dto::SKVRecord>, std::vector<k2::dto::AggregateGroup>, uint32_t>>
+doQueryAllPages(k2::Status expectedStatus=k2::dto::K23SIStatus::OK) {
+    using ResultT = std::tuple<std::vector<k2::dto::SKVRecord>, std::vector<k2::dto::AggregateGroup>, uint32_t>;
+    return seastar::do_with(ResultT(), false, [this, expectedStatus] (ResultT& result, bool& done) {
+        return seastar::do_until(
+            [&done] () { return done; },
+            [this, &result, &done, expectedStatus] () {
+                return txn.query(query)
+                .then([this, &result, &done, expectedStatus] (auto&& response) {
+                    K2EXPECT(log::k23si, response.status, expectedStatus);
+                    done = response.status.is2xxOK() ? query.isDone() : true;
+                    auto& [records, aggregates, pages] = result;
+                    std::move(response.records.begin(), response.records.end(), std::back_inserter(records));
+                    if (!response.aggregates.empty()) {
+                        aggregates = std::move(response.aggregates);
+                    }
+                    ++pages;
+                });
+        })
+        .then([&result] () {
+            return std::move(result);
+        });
+    });
+}
+
+// Aggregation push-down. The aggregates are checked against the ones computed from the records of a plain query
+seastar::future<> runAggregationScenario() {
+    K2LOG_I(log::k23si, "runAggregationScenario");
+    return _client.beginTxn(k2::K2TxnOptions{})
+    .then([this] (k2::K2TxnHandle&& t) {
+        txn = std::move(t);
+        return _client.createQuery(collname, "schema");
+    })
+    .then([this] (auto&& response) {
+        K2EXPECT(log::k23si, response.status.is2xxOK(), true);
+        query = std::move(response.query);
+        return doQueryAllPages();
+    })
+    .then([this] (auto&& result) {
+        auto& [records, aggregates, pages] = result;
+        K2EXPECT(log::k23si, aggregates.size(), 0);
+        return seastar::do_with(std::move(records), pages, [this] (auto& records, auto& plainPages) {
+            return _client.createQuery(collname, "schema")
+            .then([this] (auto&& response) {
+                K2EXPECT(log::k23si, response.status.is2xxOK(), true);
+                query = std::move(response.query);
+                query.addAggregate(k2::dto::AggregateFunction::COUNT);
+                query.addAggregate(k2::dto::AggregateFunction::COUNT, "data1");
+                query.addAggregate(k2::dto::AggregateFunction::SUM, "data2");
+                query.addAggregate(k2::dto::AggregateFunction::MIN, "data1");
+                query.addAggregate(k2::dto::AggregateFunction::MAX, "data2");
+                return doQueryAllPages();
+            })
+            .then([this, &records, &plainPages] (auto&& result) {
+                auto& [aggRecords, aggregates, pages] = result;
+                K2LOG_I(log::k23si, "Aggregation over {} records took {} pages, plain query took {}",
+                        records.size(), pages, plainPages);
+                K2EXPECT(log::k23si, aggRecords.size(), 0);
+                K2EXPECT(log::k23si, pages <= plainPages, true);
+
+                int64_t count = records.size(), countData1 = 0, sumData2 = 0;
+                std::optional<int32_t> minData1, maxData2;
+                for (auto& record : records) {
+                    auto data1 = record.deserializeField<int32_t>("data1");
+                    auto data2 = record.deserializeField<int32_t>("data2");
+                    if (data1) {
+                        ++countData1;
+                        minData1 = minData1 ? std::min(*minData1, *data1) : *data1;
+                    }
+                    if (data2) {
+                        sumData2 += *data2;
+                        maxData2 = maxData2 ? std::max(*maxData2, *data2) : *data2;
+                    }
+                }
+
+                K2EXPECT(log::k23si, aggregates.size(), 1);
+                auto& values = aggregates[0].values;
+                K2EXPECT(log::k23si, values.size(), 5);
+                K2EXPECT(log::k23si, values[0].intValue, count);
+                K2EXPECT(log::k23si, values[1].intValue, countData1);
+                K2EXPECT(log::k23si, values[2].type, k2::dto::FieldType::INT64T);
+                K2EXPECT(log::k23si, values[2].intValue, sumData2);
+                K2EXPECT(log::k23si, values[3].type, k2::dto::FieldType::INT32T);
+                K2EXPECT(log::k23si, values[3].intValue, *minData1);
+                K2EXPECT(log::k23si, values[4].intValue, *maxData2);
+
+                return _client.createQuery(collname, "schema");
+            })
+            .then([this] (auto&& response) {
+                K2EXPECT(log::k23si, response.status.is2xxOK(), true);
+                query = std::move(response.query);
+                query.addGroupBy("partition");
+                query.addAggregate(k2::dto::AggregateFunction::COUNT);
+                query.addAggregate(k2::dto::AggregateFunction::SUM, "data2");
+                return doQueryAllPages();
+            })
+            .then([&records] (auto&& result) {
+                auto& [aggRecords, aggregates, pages] = result;
+                std::map<k2::String, std::pair<int64_t, int64_t>> expected;
+                for (auto& record : records) {
+                    auto partition = record.deserializeField<k2::String>("partition");
+                    auto data2 = record.deserializeField<int32_t>("data2");
+                    auto& [count, sum] = expected[*partition];
+                    ++count;
+                    sum += data2 ? *data2 : 0;
+                }
+
+                K2EXPECT(log::k23si, aggregates.size(), expected.size());
+                for (auto& group : aggregates) {
+                    K2EXPECT(log::k23si, group.groupValues.size(), 1);
+                    auto it = expected.find(group.groupValues[0].stringValue);
+                    K2EXPECT(log::k23si, it != expected.end(), true);
+                    if (it != expected.end()) {
+                        K2EXPECT(log::k23si, group.values[0].intValue, it->second.first);
+                        K2EXPECT(log::k23si, group.values[1].intValue, it->second.second);
+                    }
+                }
+            });
+        });
+    })
+    .then([this] () {
+        return txn.end(false);
+    })
+    .then([this] (auto&& response) {
+        K2EXPECT(log::k23si, response.status, k2::dto::K23SIStatus::OK);
+        return _client.beginTxn(k2::K2TxnOptions{});
+    })
+    .then([this] (k2::K2TxnHandle&& t) {
+        txn = std::move(t);
+        return _client.createQuery(collname, "schema");
+    })
+    .then([this] (auto&& response) {
+        K2LOG_I(log::k23si, "SUM over a STRING field is not allowed");
+        K2EXPECT(log::k23si, response.status.is2xxOK(), true);
+        query = std::move(response.query);
+        query.addAggregate(k2::dto::AggregateFunction::SUM, "partition");
+        return doQueryAllPages(k2::dto::K23SIStatus::OperationNotAllowed).discard_result();
+    })
+    .then([this] () {
+        return txn.end(false);
+    })
+    .then([] (auto&& response) {
+        K2EXPECT(log::k23si, response.status, k2::dto::K23SIStatus::OK);
+    });
+}
+
+// A write lands right after the position where the server paused the query. The next page must not resume the
+// paused cursor blindly, as it would skip the new key
+seastar::future<> runCursorScenario() {
+    K2LOG_I(log::k23si, "runCursorScenario");
+    k2::K2TxnOptions options{};
+    options.syncFinalize = true;
+    return _client.beginTxn(options)
+    .then([this] (k2::K2TxnHandle&& t) {
+        txn = std::move(t);
+        return _client.createQuery(collname, "schema");
+    })
+    .then([this] (auto&& response) {
+        K2EXPECT(log::k23si, response.status.is2xxOK(), true);
+        query = std::move(response.query);
+        query.startScanRecord.serializeNext<k2::String>("default");
+        query.startScanRecord.serializeNext<k2::String>("a");
+        query.startScanRecord.serializeNext<k2::String>("");
+        query.endScanRecord.serializeNext<k2::String>("default");
+        query.endScanRecord.serializeNext<k2::String>("d");
+        query.endScanRecord.serializeNext<k2::String>("");
+        return txn.query(query);
+    })
+    .then([this] (auto&& response) {
+        // the first page returns "a" and "b" and stops at "c" due to the pagination limit
+        K2EXPECT(log::k23si, response.status, k2::dto::K23SIStatus::OK);
+        K2EXPECT(log::k23si, response.records.size(), 2);
+        K2EXPECT(log::k23si, query.isDone(), false);
+        return _client.getSchema(collname, "schema", 1);
+    })
+    .then([this] (auto&& response) {
+        auto& [status, schemaPtr] = response;
+        K2EXPECT(log::k23si, status.is2xxOK(), true);
+        k2::dto::SKVRecord record(collname, schemaPtr);
+        record.serializeNext<k2::String>("default");
+        record.serializeNext<k2::String>("c");
+        record.serializeNext<k2::String>("z");
+        record.serializeNext<int32_t>(100);
+        record.serializeNext<int32_t>(100);
+        record.serializeNext<uint32_t>(0);
+        return txn.write<k2::dto::SKVRecord>(record);
+    })
+    .then([this] (auto&& response) {
+        K2EXPECT(log::k23si, response.status, k2::dto::K23SIStatus::Created);
+        return doQueryAllPages();
+    })
+    .then([this] (auto&& result) {
+        auto& [records, aggregates, pages] = result;
+        K2EXPECT(log::k23si, records.size(), 2);
+        std::vector<k2::String> ranges;
+        for (auto& rec : records) {
+            rec.deserializeNext<k2::String>();
+            K2EXPECT(log::k23si, *rec.deserializeNext<k2::String>(), "c");
+            ranges.push_back(*rec.deserializeNext<k2::String>());
+        }
+        K2EXPECT(log::k23si, ranges.size(), 2);
+        K2EXPECT(log::k23si, ranges[0], "");
+        K2EXPECT(log::k23si, ranges[1], "z");
+        return txn.end(false);
+    })
+    .then([] (auto&& response) {
+        K2EXPECT(log::k23si, response.status, k2::dto::K23SIStatus::OK);
+    });
+}
+
+// Streamed full scan. The pages arrive in order while the next ones are being prefetched
+seastar::future<> runStreamScenario() {
+    K2LOG_I(log::k23si, "runStreamScenario");
+    return _client.beginTxn(k2::K2TxnOptions{})
+    .then([this] (k2::K2TxnHandle&& t) {
+        txn = std::move(t);
+        return _client.createQuery(collname, "schema");
+    })
+    .then([this] (auto&& response) {
+        K2EXPECT(log::k23si, response.status.is2xxOK(), true);
+        query = std::move(response.query);
+        return seastar::do_with(std::vector<k2::dto::SKVRecord>(), uint32_t(0), [this] (auto& records, auto& pages) {
+            return txn.queryStream(query, [&records, &pages] (k2::QueryResult&& result) {
+                ++pages;
+                std::move(result.records.begin(), result.records.end(), std::back_inserter(records));
+                // give the producer a chance to run ahead of us
+                return seastar::sleep(1ms);
+            }, 3)
+            .then([this, &records, &pages] (k2::Status&& status) {
+                K2EXPECT(log::k23si, status, k2::dto::K23SIStatus::OK);
+                K2EXPECT(log::k23si, query.isDone(), true);
+                K2EXPECT(log::k23si, records.size(), 8);
+                K2EXPECT(log::k23si, pages, 5);
+                std::vector<k2::String> keys;
+                for (auto& rec : records) {
+                    keys.push_back(*rec.deserializeNext<k2::String>() + "/" + *rec.deserializeNext<k2::String>());
+                }
+                K2EXPECT(log::k23si, std::is_sorted(keys.begin(), keys.end()), true);
+            });
+        });
+    })
+    .then([this] () {
+        return txn.end(false);
+    })
+    .then([] (auto&& response) {
+        K2EXPECT(log::k23si, response.status, k2::dto::K23SIStatus::OK);
+    });
+}
+
 // TODO: add test Scenario to deal with query request while change the partition map
 
 };  // class QueryTest
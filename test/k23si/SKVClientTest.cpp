@@ -26,6 +26,8 @@ Copyright(c) 2020 Futurewei Cloud
 #include <k2/cpo/client/Client.h>
 #include <k2/module/k23si/client/k23si_client.h>
 #include <seastar/core/sleep.hh>
+
+#include <set>
 using namespace k2;
 #include "Log.h"
 const char* collname1 = "k23si_test_collection1";
@@ -173,6 +175,13 @@ public:  // application lifespan
             .then([this] { return runScenario09(); })
             .then([this] { return runScenario10(); })
             .then([this] { return runScenario11(); })
+            .then([this] { return runScenario12(); })
+            .then([this] { return runScenario13(); })
+            .then([this] { return runScenario14(); })
+            .then([this] { return runScenario15(); })
+            .then([this] { return runScenario16(); })
+            .then([this] { return runScenario17(); })
+            .then([this] { return runScenario18(); })
             .then([this] {
                 K2LOG_I(log::k23si, "======= All tests passed ========");
                 exitcode = 0;
@@ -1585,6 +1594,607 @@ seastar::future<> runScenario11() {
     });
 }
 
+// Multi-key reads: committed keys, a missing key and the txn's own write, in one call
+seastar::future<> runScenario12() {
+    K2LOG_I(log::k23si, "Scenario 12");
+    return _client.beginTxn(K2TxnOptions())
+    .then([this] (K2TxnHandle&& txn) {
+        _txn1 = std::move(txn);
+        return _client.getSchema(collname1, "1_schema", 1);
+    })
+    .then([this] (auto&& response) {
+        auto& [status, schemaPtr] = response;
+        K2EXPECT(log::k23si, status.is2xxOK(), true);
+        _schema = schemaPtr;
+
+        std::vector<seastar::future<WriteResult>> writes;
+        for (int i = 0; i < 5; ++i) {
+            dto::SKVRecord record(collname1, _schema);
+            record.serializeNext<String>(fmt::format("partkey_s12_{}", i));
+            record.serializeNext<String>("rangekey_s12");
+            record.serializeNext<String>(fmt::format("data_{}", i));
+            record.serializeNext<String>("data2");
+            writes.push_back(_txn1.write(record));
+        }
+        return seastar::when_all_succeed(writes.begin(), writes.end());
+    })
+    .then([this] (auto&& responses) {
+        for (auto& response : responses) {
+            K2EXPECT(log::k23si, response.status, dto::K23SIStatus::Created);
+        }
+        return _txn1.end(true);
+    })
+    .then([this] (auto&& response) {
+        K2EXPECT(log::k23si, response.status, dto::K23SIStatus::OK);
+        return _client.beginTxn(K2TxnOptions());
+    })
+    .then([this] (K2TxnHandle&& txn) {
+        _txn1 = std::move(txn);
+
+        dto::SKVRecord record(collname1, _schema);
+        record.serializeNext<String>("partkey_s12_own");
+        record.serializeNext<String>("rangekey_s12");
+        record.serializeNext<String>("data_own");
+        record.serializeNext<String>("data2");
+        return _txn1.write(record);
+    })
+    .then([this] (auto&& response) {
+        K2EXPECT(log::k23si, response.status, dto::K23SIStatus::Created);
+
+        std::vector<dto::Key> keys;
+        for (auto partkey : {"partkey_s12_3", "partkey_s12_missing", "partkey_s12_own", "partkey_s12_0",
+                             "partkey_s12_4", "partkey_s12_1", "partkey_s12_2"}) {
+            dto::SKVRecord record(collname1, _schema);
+            record.serializeNext<String>(partkey);
+            record.serializeNext<String>("rangekey_s12");
+            keys.push_back(record.getKey());
+        }
+        return _txn1.multiRead(std::move(keys), collname1);
+    })
+    .then([this] (std::vector<ReadResult<dto::SKVRecord>>&& results) {
+        K2EXPECT(log::k23si, results.size(), 7);
+        std::vector<String> expected{"data_3", "", "data_own", "data_0", "data_4", "data_1", "data_2"};
+        for (size_t i = 0; i < results.size(); ++i) {
+            if (expected[i].empty()) {
+                K2EXPECT(log::k23si, results[i].status, dto::K23SIStatus::KeyNotFound);
+                continue;
+            }
+            K2EXPECT(log::k23si, results[i].status, dto::K23SIStatus::OK);
+            results[i].value.deserializeNext<String>();
+            results[i].value.deserializeNext<String>();
+            std::optional<String> data1 = results[i].value.deserializeNext<String>();
+            K2EXPECT(log::k23si, *data1, expected[i]);
+        }
+        return _txn1.end(false);
+    })
+    .then([this] (auto&& response) {
+        K2EXPECT(log::k23si, response.status, dto::K23SIStatus::OK);
+        return seastar::make_ready_future<>();
+    });
+}
+
+// Multi-key writes: a batch spread over the partitions, with a failed precondition, as the first op of a txn
+seastar::future<> runScenario13() {
+    K2LOG_I(log::k23si, "Scenario 13");
+    return _client.beginTxn(K2TxnOptions())
+    .then([this] (K2TxnHandle&& txn) {
+        _txn1 = std::move(txn);
+        return seastar::do_with(std::vector<dto::SKVRecord>(), [this] (auto& records) {
+            for (int i = 0; i < 10; ++i) {
+                dto::SKVRecord record(collname1, _schema);
+                record.serializeNext<String>(fmt::format("partkey_s13_{}", i));
+                record.serializeNext<String>("rangekey_s13");
+                record.serializeNext<String>(fmt::format("data_{}", i));
+                record.serializeNext<String>("data2");
+                records.push_back(std::move(record));
+            }
+            return _txn1.multiWrite(records);
+        });
+    })
+    .then([this] (std::vector<WriteResult>&& results) {
+        K2EXPECT(log::k23si, results.size(), 10);
+        for (auto& result : results) {
+            K2EXPECT(log::k23si, result.status, dto::K23SIStatus::Created);
+        }
+        return _txn1.end(true);
+    })
+    .then([this] (auto&& response) {
+        K2EXPECT(log::k23si, response.status, dto::K23SIStatus::OK);
+        return _client.beginTxn(K2TxnOptions());
+    })
+    .then([this] (K2TxnHandle&& txn) {
+        _txn1 = std::move(txn);
+        return seastar::do_with(std::vector<dto::SKVRecord>(), [this] (auto& records) {
+            // the first key already exists
+            for (auto i : {0, 10, 11}) {
+                dto::SKVRecord record(collname1, _schema);
+                record.serializeNext<String>(fmt::format("partkey_s13_{}", i));
+                record.serializeNext<String>("rangekey_s13");
+                record.serializeNext<String>(fmt::format("data_{}", i));
+                record.serializeNext<String>("data2");
+                records.push_back(std::move(record));
+            }
+            return _txn1.multiWrite(records, false, dto::ExistencePrecondition::NotExists);
+        });
+    })
+    .then([this] (std::vector<WriteResult>&& results) {
+        K2EXPECT(log::k23si, results.size(), 3);
+        K2EXPECT(log::k23si, results[0].status, dto::K23SIStatus::ConditionFailed);
+        K2EXPECT(log::k23si, results[1].status, dto::K23SIStatus::Created);
+        K2EXPECT(log::k23si, results[2].status, dto::K23SIStatus::Created);
+        return _txn1.end(true);
+    })
+    .then([this] (auto&& response) {
+        K2EXPECT(log::k23si, response.status, dto::K23SIStatus::OK);
+        return _client.beginTxn(K2TxnOptions());
+    })
+    .then([this] (K2TxnHandle&& txn) {
+        _txn1 = std::move(txn);
+        std::vector<dto::Key> keys;
+        for (int i = 0; i < 12; ++i) {
+            dto::SKVRecord record(collname1, _schema);
+            record.serializeNext<String>(fmt::format("partkey_s13_{}", i));
+            record.serializeNext<String>("rangekey_s13");
+            keys.push_back(record.getKey());
+        }
+        return _txn1.multiRead(std::move(keys), collname1);
+    })
+    .then([this] (std::vector<ReadResult<dto::SKVRecord>>&& results) {
+        K2EXPECT(log::k23si, results.size(), 12);
+        for (size_t i = 0; i < results.size(); ++i) {
+            K2EXPECT(log::k23si, results[i].status, dto::K23SIStatus::OK);
+            if (!results[i].status.is2xxOK()) {
+                continue;
+            }
+            results[i].value.deserializeNext<String>();
+            results[i].value.deserializeNext<String>();
+            std::optional<String> data1 = results[i].value.deserializeNext<String>();
+            K2EXPECT(log::k23si, *data1, fmt::format("data_{}", i));
+        }
+        return _txn1.end(false);
+    })
+    .then([this] (auto&& response) {
+        K2EXPECT(log::k23si, response.status, dto::K23SIStatus::OK);
+        return seastar::make_ready_future<>();
+    });
+}
+
+// Fetch all pages of the given query
+seastar::future<std::vector<dto::SKVRecord>> queryAll(K2TxnHandle& txn, Query& query) {
+    return seastar::do_with(std::vector<dto::SKVRecord>(), [&txn, &query] (auto& records) {
+        return seastar::do_until([&query] { return query.isDone(); }, [&txn, &query, &records] {
+            return txn.query(query)
+            .then([&records] (QueryResult&& result) {
+                K2EXPECT(log::k23si, result.status, dto::K23SIStatus::OK);
+                std::move(result.records.begin(), result.records.end(), std::back_inserter(records));
+            });
+        })
+        .then([&records] {
+            return std::move(records);
+        });
+    });
+}
+
+// Queries over a hash partitioned collection: unordered, ordered in both directions, filtered and limited
+seastar::future<> runScenario14() {
+    K2LOG_I(log::k23si, "Scenario 14");
+    dto::Schema schema;
+    schema.name = "s14_schema";
+    schema.version = 1;
+    schema.fields = std::vector<dto::SchemaField> {
+            {dto::FieldType::STRING, "partition", false, false},
+            {dto::FieldType::STRING, "range", false, false},
+            {dto::FieldType::INT32T, "data", false, false},
+    };
+    schema.setPartitionKeyFieldsByName(std::vector<String>{"partition"});
+    schema.setRangeKeyFieldsByName(std::vector<String> {"range"});
+
+    return _client.createSchema(collname1, std::move(schema))
+    .then([this] (auto&& result) {
+        K2EXPECT(log::k23si, result.status.is2xxOK(), true);
+        return seastar::when_all_succeed(_client.getSchema(collname1, "s14_schema", 1), _client.beginTxn(K2TxnOptions()));
+    })
+    .then([this] (auto&& results) {
+        auto& [response, txn] = results;
+        K2EXPECT(log::k23si, response.status.is2xxOK(), true);
+        _txn1 = std::move(txn);
+        return seastar::do_with(std::vector<dto::SKVRecord>(), [this, schema=response.schema] (auto& records) {
+            for (int32_t i = 0; i < 20; ++i) {
+                dto::SKVRecord record(collname1, schema);
+                record.serializeNext<String>(fmt::format("pkey_s14_{:02}", i));
+                record.serializeNext<String>("rkey_s14");
+                record.serializeNext<int32_t>(i);
+                records.push_back(std::move(record));
+            }
+            return _txn1.multiWrite(records);
+        });
+    })
+    .then([this] (std::vector<WriteResult>&& results) {
+        for (auto& result : results) {
+            K2EXPECT(log::k23si, result.status, dto::K23SIStatus::Created);
+        }
+        return _txn1.end(true);
+    })
+    .then([this] (auto&& response) {
+        K2EXPECT(log::k23si, response.status, dto::K23SIStatus::OK);
+        return _client.beginTxn(K2TxnOptions());
+    })
+    .then([this] (K2TxnHandle&& txn) {
+        _txn1 = std::move(txn);
+        return _client.createQuery(collname1, "s14_schema");
+    })
+    .then([this] (auto&& response) {
+        K2EXPECT(log::k23si, response.status.is2xxOK(), true);
+        return seastar::do_with(std::move(response.query), [this] (Query& query) {
+            return queryAll(_txn1, query);
+        });
+    })
+    .then([this] (std::vector<dto::SKVRecord>&& records) {
+        K2LOG_I(log::k23si, "Scenario 14 unordered");
+        K2EXPECT(log::k23si, records.size(), 20);
+        std::set<int32_t> seen;
+        for (auto& record : records) {
+            record.deserializeNext<String>();
+            record.deserializeNext<String>();
+            seen.insert(*record.deserializeNext<int32_t>());
+        }
+        K2EXPECT(log::k23si, seen.size(), 20);
+        return _client.createQuery(collname1, "s14_schema");
+    })
+    .then([this] (auto&& response) {
+        K2EXPECT(log::k23si, response.status.is2xxOK(), true);
+        return seastar::do_with(std::move(response.query), [this] (Query& query) {
+            query.setOrdered(true);
+            return queryAll(_txn1, query);
+        });
+    })
+    .then([this] (std::vector<dto::SKVRecord>&& records) {
+        K2LOG_I(log::k23si, "Scenario 14 ordered");
+        K2EXPECT(log::k23si, records.size(), 20);
+        for (int32_t i = 0; i < (int32_t)records.size(); ++i) {
+            K2EXPECT(log::k23si, *records[i].deserializeField<int32_t>("data"), i);
+        }
+        return _client.createQuery(collname1, "s14_schema");
+    })
+    .then([this] (auto&& response) {
+        K2EXPECT(log::k23si, response.status.is2xxOK(), true);
+        return seastar::do_with(std::move(response.query), [this] (Query& query) {
+            query.setOrdered(true);
+            query.setReverseDirection(true);
+            return queryAll(_txn1, query);
+        });
+    })
+    .then([this] (std::vector<dto::SKVRecord>&& records) {
+        K2LOG_I(log::k23si, "Scenario 14 ordered reverse");
+        K2EXPECT(log::k23si, records.size(), 20);
+        for (int32_t i = 0; i < (int32_t)records.size(); ++i) {
+            K2EXPECT(log::k23si, *records[i].deserializeField<int32_t>("data"), 19 - i);
+        }
+        return _client.createQuery(collname1, "s14_schema");
+    })
+    .then([this] (auto&& response) {
+        K2EXPECT(log::k23si, response.status.is2xxOK(), true);
+        return seastar::do_with(std::move(response.query), [this] (Query& query) {
+            std::vector<dto::expression::Value> values;
+            values.emplace_back(dto::expression::makeValueReference("data"));
+            values.emplace_back(dto::expression::makeValueLiteral<int32_t>(5));
+            query.setFilterExpression(dto::expression::makeExpression(dto::expression::Operation::LT,
+                                                                      std::move(values), {}));
+            query.setOrdered(true);
+            return queryAll(_txn1, query);
+        });
+    })
+    .then([this] (std::vector<dto::SKVRecord>&& records) {
+        K2LOG_I(log::k23si, "Scenario 14 filtered");
+        K2EXPECT(log::k23si, records.size(), 5);
+        for (int32_t i = 0; i < (int32_t)records.size(); ++i) {
+            K2EXPECT(log::k23si, *records[i].deserializeField<int32_t>("data"), i);
+        }
+        return _client.createQuery(collname1, "s14_schema");
+    })
+    .then([this] (auto&& response) {
+        K2EXPECT(log::k23si, response.status.is2xxOK(), true);
+        return seastar::do_with(std::move(response.query), [this] (Query& query) {
+            query.setLimit(7);
+            return queryAll(_txn1, query);
+        });
+    })
+    .then([this] (std::vector<dto::SKVRecord>&& records) {
+        K2LOG_I(log::k23si, "Scenario 14 limited");
+        K2EXPECT(log::k23si, records.size(), 7);
+        return _txn1.end(false);
+    })
+    .then([] (auto&& response) {
+        K2EXPECT(log::k23si, response.status, dto::K23SIStatus::OK);
+    });
+}
+
+// Async writes: the first write designates the TRH synchronously, the rest are sent one-way and
+// must all be reported to the TRH before the commit succeeds
+seastar::future<> runScenario15() {
+    K2LOG_I(log::k23si, "Scenario 15");
+    dto::Schema schema;
+    schema.name = "s15_schema";
+    schema.version = 1;
+    schema.fields = std::vector<dto::SchemaField> {
+            {dto::FieldType::STRING, "partition", false, false},
+            {dto::FieldType::STRING, "range", false, false},
+            {dto::FieldType::INT32T, "data", false, false},
+    };
+    schema.setPartitionKeyFieldsByName(std::vector<String>{"partition"});
+    schema.setRangeKeyFieldsByName(std::vector<String> {"range"});
+
+    return _client.createSchema(collname1, std::move(schema))
+    .then([this] (auto&& result) {
+        K2EXPECT(log::k23si, result.status.is2xxOK(), true);
+        K2TxnOptions options;
+        options.asyncWrites = true;
+        return seastar::when_all_succeed(_client.getSchema(collname1, "s15_schema", 1), _client.beginTxn(options));
+    })
+    .then([this] (auto&& results) {
+        auto& [response, txn] = results;
+        K2EXPECT(log::k23si, response.status.is2xxOK(), true);
+        _txn1 = std::move(txn);
+        return seastar::do_with(int32_t(0), response.schema, [this] (int32_t& i, auto& schema) {
+            return seastar::do_until([&i] { return i == 10; }, [this, &i, &schema] {
+                dto::SKVRecord record(collname1, schema);
+                record.serializeNext<String>(fmt::format("pkey_s15_{:02}", i));
+                record.serializeNext<String>("rkey_s15");
+                record.serializeNext<int32_t>(i);
+                ++i;
+                return _txn1.write(record).then([] (auto&& result) {
+                    K2EXPECT(log::k23si, result.status, dto::K23SIStatus::Created);
+                });
+            });
+        });
+    })
+    .then([this] {
+        return _txn1.end(true);
+    })
+    .then([this] (auto&& response) {
+        K2EXPECT(log::k23si, response.status, dto::K23SIStatus::OK);
+        return _client.beginTxn(K2TxnOptions());
+    })
+    .then([this] (K2TxnHandle&& txn) {
+        _txn1 = std::move(txn);
+        return _client.createQuery(collname1, "s15_schema");
+    })
+    .then([this] (auto&& response) {
+        K2EXPECT(log::k23si, response.status.is2xxOK(), true);
+        return seastar::do_with(std::move(response.query), [this] (Query& query) {
+            return queryAll(_txn1, query);
+        });
+    })
+    .then([this] (std::vector<dto::SKVRecord>&& records) {
+        K2EXPECT(log::k23si, records.size(), 10);
+        return _txn1.end(false);
+    })
+    .then([] (auto&& response) {
+        K2EXPECT(log::k23si, response.status, dto::K23SIStatus::OK);
+    });
+}
+
+// Async writes: a read in the txn observes an earlier async write to the same key, and the commit fails if an
+// async write fails at its partition
+seastar::future<> runScenario16() {
+    K2LOG_I(log::k23si, "Scenario 16");
+    K2TxnOptions options;
+    options.asyncWrites = true;
+    return seastar::when_all_succeed(_client.getSchema(collname1, "s15_schema", 1), _client.beginTxn(options))
+    .then([this] (auto&& results) {
+        auto& [response, txn] = results;
+        K2EXPECT(log::k23si, response.status.is2xxOK(), true);
+        _schema = response.schema;
+        _txn1 = std::move(txn);
+        // designates the TRH, so the following writes are async
+        dto::SKVRecord record(collname1, _schema);
+        record.serializeNext<String>("pkey_s16_00");
+        record.serializeNext<String>("rkey_s16");
+        record.serializeNext<int32_t>(0);
+        return _txn1.write(record);
+    })
+    .then([this] (auto&& result) {
+        K2EXPECT(log::k23si, result.status, dto::K23SIStatus::Created);
+        dto::SKVRecord record(collname1, _schema);
+        record.serializeNext<String>("pkey_s16_01");
+        record.serializeNext<String>("rkey_s16");
+        record.serializeNext<int32_t>(1);
+        return _txn1.write(record);
+    })
+    .then([this] (auto&& result) {
+        K2EXPECT(log::k23si, result.status, dto::K23SIStatus::Created);
+        dto::SKVRecord record(collname1, _schema);
+        record.serializeNext<String>("pkey_s16_01");
+        record.serializeNext<String>("rkey_s16");
+        return _txn1.read(std::move(record));
+    })
+    .then([this] (auto&& result) {
+        K2EXPECT(log::k23si, result.status, dto::K23SIStatus::OK);
+        result.value.seekField(2);
+        K2EXPECT(log::k23si, *(result.value.template deserializeNext<int32_t>()), 1);
+        // the record was committed in scenario 15, so this insert fails at the partition
+        dto::SKVRecord record(collname1, _schema);
+        record.serializeNext<String>("pkey_s15_00");
+        record.serializeNext<String>("rkey_s15");
+        record.serializeNext<int32_t>(100);
+        return _txn1.write(record, false, dto::ExistencePrecondition::NotExists);
+    })
+    .then([this] (auto&& result) {
+        // async writes are only queued here
+        K2EXPECT(log::k23si, result.status, dto::K23SIStatus::Created);
+        return _txn1.end(true);
+    })
+    .then([this] (auto&& response) {
+        K2EXPECT(log::k23si, response.status.is2xxOK(), false);
+        return _client.beginTxn(K2TxnOptions());
+    })
+    .then([this] (K2TxnHandle&& txn) {
+        _txn1 = std::move(txn);
+        dto::SKVRecord record1(collname1, _schema);
+        record1.serializeNext<String>("pkey_s16_01");
+        record1.serializeNext<String>("rkey_s16");
+        dto::SKVRecord record2(collname1, _schema);
+        record2.serializeNext<String>("pkey_s15_00");
+        record2.serializeNext<String>("rkey_s15");
+        return seastar::when_all_succeed(_txn1.read(std::move(record1)), _txn1.read(std::move(record2)));
+    })
+    .then([this] (auto&& results) {
+        auto& [result1, result2] = results;
+        K2EXPECT(log::k23si, result1.status, dto::K23SIStatus::KeyNotFound);
+        K2EXPECT(log::k23si, result2.status, dto::K23SIStatus::OK);
+        result2.value.seekField(2);
+        K2EXPECT(log::k23si, *(result2.value.template deserializeNext<int32_t>()), 0);
+        return _txn1.end(false);
+    })
+    .then([] (auto&& response) {
+        K2EXPECT(log::k23si, response.status, dto::K23SIStatus::OK);
+    });
+}
+
+// Heartbeats: long-running txns with their TRH in the same partition are heartbeated together, and survive past the
+// heartbeat deadline. The handles are moved after their first write, which hands their heartbeat over
+seastar::future<> runScenario17() {
+    K2LOG_I(log::k23si, "Scenario 17");
+    return _client.getSchema(collname1, "s15_schema", 1)
+    .then([this] (auto&& response) {
+        K2EXPECT(log::k23si, response.status.is2xxOK(), true);
+        _schema = response.schema;
+        return seastar::do_with(std::vector<K2TxnHandle>(), int32_t(0), uint64_t(0), uint64_t(0),
+            [this] (auto& txns, int32_t& i, uint64_t& heartbeats, uint64_t& multiHeartbeats) {
+            return seastar::do_until([&i] { return i == 3; }, [this, &txns, &i] {
+                return _client.beginTxn(K2TxnOptions())
+                .then([this, &txns, &i] (K2TxnHandle&& txn) {
+                    return seastar::do_with(std::move(txn), [this, &txns, &i] (K2TxnHandle& txn) {
+                        dto::SKVRecord record(collname1, _schema);
+                        record.serializeNext<String>(fmt::format("pkey_s17_{:02}", i));
+                        record.serializeNext<String>("rkey_s17");
+                        record.serializeNext<int32_t>(i);
+                        ++i;
+                        return txn.write(record)
+                        .then([&txns, &txn] (auto&& result) {
+                            K2EXPECT(log::k23si, result.status, dto::K23SIStatus::Created);
+                            txns.push_back(std::move(txn));
+                        });
+                    });
+                });
+            })
+            .then([this, &heartbeats, &multiHeartbeats] {
+                heartbeats = _client.heartbeats;
+                multiHeartbeats = _client.multi_heartbeats;
+                auto deadline = _client.cpo_client.collections[collname1]->collection.metadata.heartbeatDeadline;
+                K2LOG_I(log::k23si, "Waiting past the heartbeat deadline of {}", deadline);
+                return seastar::sleep(deadline + deadline / 2);
+            })
+            .then([this, &txns, &heartbeats, &multiHeartbeats] {
+                auto sent = _client.heartbeats - heartbeats;
+                auto messages = _client.multi_heartbeats - multiHeartbeats;
+                K2LOG_I(log::k23si, "Sent {} heartbeats in {} messages", sent, messages);
+                // at least two ticks for the three txns, which share their messages
+                K2EXPECT(log::k23si, sent >= 2 * txns.size(), true);
+                K2EXPECT(log::k23si, messages < sent, true);
+                return seastar::parallel_for_each(txns, [] (K2TxnHandle& txn) {
+                    return txn.end(true).then([] (auto&& response) {
+                        K2EXPECT(log::k23si, response.status, dto::K23SIStatus::OK);
+                    });
+                });
+            });
+        });
+    })
+    .then([this] {
+        return _client.beginTxn(K2TxnOptions());
+    })
+    .then([this] (K2TxnHandle&& txn) {
+        _txn1 = std::move(txn);
+        return seastar::do_with(int32_t(0), [this] (int32_t& i) {
+            return seastar::do_until([&i] { return i == 3; }, [this, &i] {
+                dto::SKVRecord record(collname1, _schema);
+                record.serializeNext<String>(fmt::format("pkey_s17_{:02}", i));
+                record.serializeNext<String>("rkey_s17");
+                return _txn1.read(std::move(record))
+                .then([&i] (auto&& result) {
+                    K2EXPECT(log::k23si, result.status, dto::K23SIStatus::OK);
+                    result.value.seekField(2);
+                    K2EXPECT(log::k23si, *(result.value.template deserializeNext<int32_t>()), i);
+                    ++i;
+                });
+            });
+        });
+    })
+    .then([this] {
+        return _txn1.end(false);
+    })
+    .then([] (auto&& response) {
+        K2EXPECT(log::k23si, response.status, dto::K23SIStatus::OK);
+    });
+}
+
+// Async writes: the commit fails if the outcome of an async write never reaches the TRH. The write goes to a
+// partition which was offloaded after the client cached the partition map, so it is dropped without a report.
+// This drops collection 3, so it has to be the last scenario which uses it
+seastar::future<> runScenario18() {
+    K2LOG_I(log::k23si, "Scenario 18");
+    K2TxnOptions options;
+    options.asyncWrites = true;
+    return seastar::when_all_succeed(_client.getSchema(collname3, "3_schema", 3), _client.beginTxn(options))
+    .then([this] (auto&& results) {
+        auto& [response, txn] = results;
+        K2EXPECT(log::k23si, response.status.is2xxOK(), true);
+        _schema = response.schema;
+        _txn1 = std::move(txn);
+        return _client.getSchema(collname1, "s15_schema", 1);
+    })
+    .then([this] (auto&& response) {
+        K2EXPECT(log::k23si, response.status.is2xxOK(), true);
+        dto::SKVRecord record(collname1, response.schema);
+        record.serializeNext<String>("pkey_s18_00");
+        record.serializeNext<String>("rkey_s18");
+        record.serializeNext<int32_t>(0);
+        return _txn1.write(record);
+    })
+    .then([this] (auto&& result) {
+        K2EXPECT(log::k23si, result.status, dto::K23SIStatus::Created);
+        // drop the collection behind the client's back so that it keeps sending to the old partition
+        K2EXPECT(log::k23si, _client.cpo_client.collections.count(collname3), 1);
+        dto::CollectionDropRequest request{.name = collname3};
+        return RPC().callRPC<dto::CollectionDropRequest, dto::CollectionDropResponse>
+            (dto::Verbs::CPO_COLLECTION_DROP, request, *_client.cpo_client.cpo, 1s);
+    })
+    .then([this] (auto&& response) {
+        auto& [status, k2response] = response;
+        K2EXPECT(log::k23si, status.is2xxOK(), true);
+        dto::SKVRecord record(collname3, _schema);
+        record.serializeNext<int32_t>(18);
+        record.serializeNext<bool>(true);
+        record.serializeNext<String>("3_data1");
+        record.serializeNext<String>("3_data2");
+        return _txn1.write(record);
+    })
+    .then([this] (auto&& result) {
+        K2EXPECT(log::k23si, result.status, dto::K23SIStatus::Created);
+        return _txn1.end(true);
+    })
+    .then([this] (auto&& response) {
+        K2EXPECT(log::k23si, response.status.is2xxOK(), false);
+        return seastar::when_all_succeed(_client.getSchema(collname1, "s15_schema", 1), _client.beginTxn(K2TxnOptions()));
+    })
+    .then([this] (auto&& results) {
+        auto& [response, txn] = results;
+        K2EXPECT(log::k23si, response.status.is2xxOK(), true);
+        _txn1 = std::move(txn);
+        dto::SKVRecord record(collname1, response.schema);
+        record.serializeNext<String>("pkey_s18_00");
+        record.serializeNext<String>("rkey_s18");
+        return _txn1.read(std::move(record));
+    })
+    .then([this] (auto&& result) {
+        K2EXPECT(log::k23si, result.status, dto::K23SIStatus::KeyNotFound);
+        return _txn1.end(false);
+    })
+    .then([] (auto&& response) {
+        K2EXPECT(log::k23si, response.status, dto::K23SIStatus::OK);
+    });
+}
+
 };  // class SKVClientTest
 
 int main(int argc, char** argv) {
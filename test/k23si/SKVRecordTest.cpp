@@ -257,3 +257,58 @@ TEST_CASE("Test4: getSKVKeyRecord test") {
     std::optional<int32_t> balance = reconstructed.deserializeNext<int32_t>();
     REQUIRE(!balance.has_value());
 }
+
+TEST_CASE("Test5: out of order field access") {
+    k2::dto::Schema schema;
+    schema.name = "test_schema";
+    schema.version = 1;
+    schema.fields = std::vector<k2::dto::SchemaField> {
+            {k2::dto::FieldType::STRING, "LastName", false, false},
+            {k2::dto::FieldType::STRING, "FirstName", false, false},
+            {k2::dto::FieldType::UINT32T, "Due", false, false},
+            {k2::dto::FieldType::STRING, "Address", false, false},
+            {k2::dto::FieldType::INT32T, "Balance", false, false},
+    };
+    schema.setPartitionKeyFieldsByName(std::vector<k2::String>{"LastName"});
+    schema.setRangeKeyFieldsByName(std::vector<k2::String>{"FirstName"});
+    REQUIRE(schema.getFieldIndex("Address") == 3u);
+    REQUIRE(!schema.getFieldIndex("NoSuchField").has_value());
+
+    k2::dto::SKVRecord doc("collection", std::make_shared<k2::dto::Schema>(schema));
+    doc.serializeNext<k2::String>("Baggins");
+    doc.serializeNext<k2::String>("Bilbo");
+    doc.serializeNull();
+    doc.serializeNext<k2::String>("Bag End");
+    doc.serializeNext<int32_t>(777);
+
+    auto checkFields = [](k2::dto::SKVRecord& rec) {
+        REQUIRE(rec.deserializeField<int32_t>("Balance") == 777);
+        REQUIRE(rec.deserializeField<k2::String>("FirstName") == "Bilbo");
+        REQUIRE(!rec.deserializeField<uint32_t>("Due").has_value());
+        REQUIRE(rec.deserializeField<k2::String>("Address") == "Bag End");
+        REQUIRE(rec.deserializeField<k2::String>(0) == "Baggins");
+        REQUIRE(rec.deserializeNext<k2::String>() == "Bilbo");
+        REQUIRE(rec.deserializeField<int32_t>(4) == 777);
+        try {
+            rec.deserializeField<int32_t>("NoSuchField");
+            REQUIRE(false);
+        } catch (k2::dto::NoFieldFoundException&) {}
+    };
+
+    // offsets recorded at serialization time
+    checkFields(doc);
+
+    // offsets computed on a record reconstructed from storage
+    k2::Payload payload(k2::Payload::DefaultAllocator());
+    payload.write(doc.getStorage());
+    k2::dto::SKVRecord::Storage read_storage{};
+    payload.seek(0);
+    payload.read(read_storage);
+    k2::dto::SKVRecord reconstructed("collection", std::make_shared<k2::dto::Schema>(schema),
+                                     std::move(read_storage), true);
+    checkFields(reconstructed);
+
+    // the name index picks up changes to the schema fields
+    schema.fields.push_back({k2::dto::FieldType::BOOL, "Active", false, false});
+    REQUIRE(schema.getFieldIndex("Active") == 5u);
+}
@@ -0,0 +1,508 @@
+/*
+MIT License
+
+Copyright(c) 2022 Futurewei Cloud
+
+    Permission is hereby granted,
+    free of charge, to any person obtaining a copy of this software and associated documentation files(the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
+
+    The above copyright notice and this permission notice shall be included in all copies
+    or
+    substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS",
+    WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER
+    LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+*/
+
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/range/irange.hpp>
+#include <crc32c/crc32c.h>
+#include <k2/appbase/AppEssentials.h>
+#include <k2/appbase/Appbase.h>
+#include <k2/persistence/service/WriteAheadLog.h>
+#include <seastar/core/loop.hh>
+#include <seastar/core/seastar.hh>
+#include <seastar/core/when_all.hh>
+
+using namespace k2;
+
+namespace k2::log {
+inline thread_local k2::logging::Logger wtest("k2::wal_test");
+}
+
+// Tests for the write-ahead log of the persistence service. Each test keeps its log in a separate sub-directory
+// of --wal_test_dir, which must not exist yet
+class WALTest {
+public:  // application lifespan
+    WALTest() { K2LOG_I(log::wtest, "ctor"); }
+    ~WALTest() { K2LOG_I(log::wtest, "dtor"); }
+
+    // required for seastar::distributed interface
+    seastar::future<> gracefulStop() {
+        K2LOG_I(log::wtest, "stop");
+        return std::move(_testFuture);
+    }
+
+    seastar::future<> start() {
+        K2LOG_I(log::wtest, "start");
+        // let start() finish and then run the tests
+        _testTimer.set_callback([this] {
+            _testFuture = runTest1()
+            .then([this] { return runTest2(); })
+            .then([this] { return runTest3(); })
+            .then([this] { return runTest4(); })
+            .then([this] { return runTest5(); })
+            .then([this] {
+                K2LOG_I(log::wtest, "======= All tests passed ========");
+                exitcode = 0;
+            })
+            .handle_exception([this](auto exc) {
+                K2LOG_W_EXC(log::wtest, exc, "======= Test failed ========");
+                exitcode = -1;
+            })
+            .finally([this] {
+                K2LOG_I(log::wtest, "======= Test ended ========");
+                AppBase().stop(exitcode);
+            });
+        });
+        _testTimer.arm(0ms);
+        return seastar::make_ready_future<>();
+    }
+
+private:
+    // a log under test, together with the records we expect to find in it
+    struct WALState {
+        WALState(String dir, uint64_t segmentSize) : dir(std::move(dir)), segmentSize(segmentSize) {}
+        // Create a new log instance on our directory. Calling this again simulates a restart of the process.
+        // The log refers to our histogram, so this must be called once the state is in its final location
+        seastar::future<> open() {
+            wal = std::make_unique<WriteAheadLog>(dir, segmentSize, latency);
+            return wal->start();
+        }
+        String dir;
+        uint64_t segmentSize;
+        ExponentialHistogram latency;
+        std::unique_ptr<WriteAheadLog> wal;
+        // the data of each appended record, and the position returned by append() for it
+        std::vector<String> records;
+        std::vector<WALPosition> positions;
+    };
+
+    // everything we got from reading the log to the end
+    struct ReadBack {
+        String data;
+        uint64_t records{0};
+        uint64_t reads{0};
+    };
+
+    // The data for record i. The sizes go from a single byte to a few KB so that frames straddle the DMA blocks
+    static String _recordData(uint64_t i) {
+        String data(1 + (i * 997) % 3000, '\0');
+        for (size_t j = 0; j < data.size(); ++j) {
+            data[j] = 'a' + (i + j) % 26;
+        }
+        return data;
+    }
+
+    static bool _before(const WALPosition& a, const WALPosition& b) {
+        return a.segment < b.segment || (a.segment == b.segment && a.offset < b.offset);
+    }
+
+    // the offset of the data of record i in a segment whose first record is `first`
+    static uint64_t _dataOffset(uint64_t first, uint64_t i) {
+        uint64_t offset = sizeof(wal::SegmentHeader);
+        for (auto j = first; j < i; ++j) {
+            offset += sizeof(wal::FrameHeader) + _recordData(j).size();
+        }
+        return offset + sizeof(wal::FrameHeader);
+    }
+
+    // Overwrite part of a segment file to simulate on-disk corruption. The log must be stopped
+    static void _overwrite(const String& file, uint64_t offset, const String& data) {
+        int fd = ::open(file.c_str(), O_WRONLY);
+        if (fd < 0) {
+            throw std::runtime_error(fmt::format("unable to open {}", file));
+        }
+        auto written = ::pwrite(fd, data.data(), data.size(), offset);
+        ::close(fd);
+        if (written != (ssize_t)data.size()) {
+            throw std::runtime_error(fmt::format("unable to write to {}", file));
+        }
+    }
+
+    // the concatenated data of the given records, in order
+    static String _expected(const WALState& st, const std::vector<size_t>& indexes) {
+        String result;
+        for (auto i : indexes) {
+            result += st.records[i];
+        }
+        return result;
+    }
+
+    static std::vector<size_t> _range(size_t begin, size_t end) {
+        std::vector<size_t> result;
+        for (auto i = begin; i < end; ++i) {
+            result.push_back(i);
+        }
+        return result;
+    }
+
+    String _dir(const char* name) {
+        return fmt::format("{}/{}", _testDir(), name);
+    }
+
+    // Append the records [first, first+count) without waiting in between, so that they can be grouped together
+    seastar::future<> _append(WALState& st, uint64_t first, uint64_t count, bool newSegment=false) {
+        std::vector<seastar::future<WALPosition>> futs;
+        for (auto i = first; i < first + count; ++i) {
+            auto data = _recordData(i);
+            Payload payload(Payload::DefaultAllocator());
+            payload.write(data.data(), data.size());
+            futs.push_back(st.wal->append(std::move(payload), newSegment && i == first));
+            st.records.push_back(std::move(data));
+        }
+        return seastar::when_all_succeed(futs.begin(), futs.end())
+        .then([&st] (std::vector<WALPosition>&& positions) {
+            for (auto& pos : positions) {
+                st.positions.push_back(pos);
+            }
+        });
+    }
+
+    // Append the records [first, first+count), waiting for each one to become durable before appending the next
+    seastar::future<> _appendEach(WALState& st, uint64_t first, uint64_t count) {
+        auto ids = boost::irange(first, first + count);
+        return seastar::do_for_each(ids.begin(), ids.end(), [this, &st] (uint64_t i) {
+            return _append(st, i, 1);
+        });
+    }
+
+    // read from the given position until the end of the log, maxBytes at a time
+    seastar::future<ReadBack> _readAll(WriteAheadLog& wal, WALPosition from, size_t maxBytes) {
+        return seastar::do_with(ReadBack{}, from, [&wal, maxBytes] (auto& rb, auto& next) {
+            return seastar::repeat([&wal, &rb, &next, maxBytes] {
+                return wal.read(next, maxBytes)
+                .then([&rb, &next] (WALReadResult&& result) {
+                    auto size = result.data.getSize();
+                    if (size > 0) {
+                        String chunk(size, '\0');
+                        result.data.seek(0);
+                        result.data.read(chunk.data(), size);
+                        rb.data += chunk;
+                    }
+                    rb.records += result.records;
+                    rb.reads++;
+                    next = result.next;
+                    return result.done ? seastar::stop_iteration::yes : seastar::stop_iteration::no;
+                });
+            })
+            .then([&rb] {
+                return std::move(rb);
+            });
+        });
+    }
+
+public:
+    seastar::future<> runTest1() {
+        K2LOG_I(log::wtest, ">>> Test1: append and read back");
+        return seastar::do_with(WALState(_dir("test1"), 1024 * 1024), [this] (auto& st) {
+            return st.open()
+            .then([this, &st] {
+                return _appendEach(st, 0, 50);
+            })
+            .then([this, &st] {
+                K2EXPECT(log::wtest, st.wal->getStats().commits, 50);
+                // records which arrive together are committed together
+                return _append(st, 50, 50);
+            })
+            .then([this, &st] {
+                auto& stats = st.wal->getStats();
+                K2EXPECT(log::wtest, stats.records, 100);
+                K2EXPECT(log::wtest, stats.commits <= 52, true);
+                K2EXPECT(log::wtest, stats.segments, 1);
+                for (size_t i = 1; i < st.positions.size(); ++i) {
+                    K2EXPECT(log::wtest, _before(st.positions[i], st.positions[i - 1]), false);
+                }
+                K2EXPECT(log::wtest, st.positions.back().segment, 0);
+                return _readAll(*st.wal, WALPosition{}, 100 * 1024 * 1024);
+            })
+            .then([this, &st] (ReadBack&& rb) {
+                K2EXPECT(log::wtest, rb.records, 100);
+                K2EXPECT(log::wtest, rb.reads, 1);
+                K2EXPECT(log::wtest, rb.data == _expected(st, _range(0, 100)), true);
+                K2LOG_I(log::wtest, "Test1.1: read in small chunks");
+                return _readAll(*st.wal, WALPosition{}, 4096);
+            })
+            .then([this, &st] (ReadBack&& rb) {
+                K2EXPECT(log::wtest, rb.records, 100);
+                K2EXPECT(log::wtest, rb.reads > 10, true);
+                K2EXPECT(log::wtest, rb.data == _expected(st, _range(0, 100)), true);
+                K2LOG_I(log::wtest, "Test1.2: read from the position returned by an append");
+                return _readAll(*st.wal, st.positions[49], 100 * 1024 * 1024);
+            })
+            .then([this, &st] (ReadBack&& rb) {
+                K2EXPECT(log::wtest, rb.records, 50);
+                K2EXPECT(log::wtest, rb.data == _expected(st, _range(50, 100)), true);
+                return st.wal->stop();
+            })
+            .then([&st] {
+                // the log refuses appends once stopped
+                Payload payload(Payload::DefaultAllocator());
+                payload.write("x", 1);
+                return st.wal->append(std::move(payload))
+                .then_wrapped([] (auto&& fut) {
+                    K2EXPECT(log::wtest, fut.failed(), true);
+                    fut.ignore_ready_future();
+                });
+            });
+        });
+    }
+
+    seastar::future<> runTest2() {
+        K2LOG_I(log::wtest, ">>> Test2: segment rollover, restart and truncation");
+        return seastar::do_with(WALState(_dir("test2"), 64 * 1024), [this] (auto& st) {
+            return st.open()
+            .then([this, &st] {
+                auto groups = boost::irange(0, 30);
+                return seastar::do_for_each(groups.begin(), groups.end(), [this, &st] (int g) {
+                    return _append(st, g * 10, 10);
+                });
+            })
+            .then([this, &st] {
+                // ~450KB of records in 64KB segments
+                K2EXPECT(log::wtest, st.wal->getStats().segments > 5, true);
+                for (size_t i = 1; i < st.positions.size(); ++i) {
+                    K2EXPECT(log::wtest, _before(st.positions[i], st.positions[i - 1]), false);
+                    K2EXPECT(log::wtest, st.positions[i].offset <= st.segmentSize, true);
+                }
+                K2LOG_I(log::wtest, "Test2.1: force a new segment");
+                return _append(st, 300, 1, true);
+            })
+            .then([this, &st] {
+                K2EXPECT(log::wtest, st.positions[300].segment, st.positions[299].segment + 1);
+                return _readAll(*st.wal, WALPosition{}, 100 * 1024 * 1024);
+            })
+            .then([this, &st] (ReadBack&& rb) {
+                K2EXPECT(log::wtest, rb.records, 301);
+                K2EXPECT(log::wtest, rb.data == _expected(st, _range(0, 301)), true);
+                K2LOG_I(log::wtest, "Test2.2: restart the log");
+                return st.wal->stop();
+            })
+            .then([&st] {
+                return st.open();
+            })
+            .then([this, &st] {
+                return _readAll(*st.wal, WALPosition{}, 100 * 1024 * 1024);
+            })
+            .then([this, &st] (ReadBack&& rb) {
+                K2EXPECT(log::wtest, rb.records, 301);
+                K2EXPECT(log::wtest, rb.data == _expected(st, _range(0, 301)), true);
+                return _append(st, 301, 10);
+            })
+            .then([this, &st] {
+                // we never append to a segment from before the restart
+                K2EXPECT(log::wtest, st.positions[301].segment, st.positions[300].segment + 1);
+                return _readAll(*st.wal, WALPosition{}, 100 * 1024 * 1024);
+            })
+            .then([this, &st] (ReadBack&& rb) {
+                K2EXPECT(log::wtest, rb.records, 311);
+                K2EXPECT(log::wtest, rb.data == _expected(st, _range(0, 311)), true);
+
+                K2LOG_I(log::wtest, "Test2.3: truncate the log");
+                return st.wal->truncate(st.positions[150].segment);
+            })
+            .then([this, &st] {
+                auto cut = st.positions[150].segment;
+                K2EXPECT(log::wtest, st.wal->getStats().truncatedSegments, cut);
+                return seastar::file_exists(WriteAheadLog::segmentName(st.dir, cut - 1));
+            })
+            .then([this, &st] (bool exists) {
+                K2EXPECT(log::wtest, exists, false);
+                // reads from a removed position start at the oldest remaining segment
+                return _readAll(*st.wal, WALPosition{}, 100 * 1024 * 1024);
+            })
+            .then([this, &st] (ReadBack&& rb) {
+                std::vector<size_t> remaining;
+                for (size_t i = 0; i < st.records.size(); ++i) {
+                    if (st.positions[i].segment >= st.positions[150].segment) {
+                        remaining.push_back(i);
+                    }
+                }
+                K2EXPECT(log::wtest, rb.records, remaining.size());
+                K2EXPECT(log::wtest, rb.data == _expected(st, remaining), true);
+                return st.wal->stop();
+            });
+        });
+    }
+
+    seastar::future<> runTest3() {
+        K2LOG_I(log::wtest, ">>> Test3: a checksum mismatch ends the segment");
+        return seastar::do_with(WALState(_dir("test3"), 1024 * 1024), [this] (auto& st) {
+            return st.open()
+            .then([this, &st] {
+                return _append(st, 0, 10);
+            })
+            .then([&st] {
+                return st.wal->stop();
+            })
+            .then([&st] {
+                // flip a byte in the data of record 6 in the sealed segment
+                auto offset = _dataOffset(0, 6) + st.records[6].size() / 2;
+                String flipped(1, st.records[6][st.records[6].size() / 2] ^ 0x01);
+                _overwrite(WriteAheadLog::segmentName(st.dir, 0), offset, flipped);
+                return st.open();
+            })
+            .then([this, &st] {
+                return _append(st, 10, 5);
+            })
+            .then([this, &st] {
+                return _readAll(*st.wal, WALPosition{}, 100 * 1024 * 1024);
+            })
+            .then([this, &st] (ReadBack&& rb) {
+                // the rest of the damaged segment is skipped and the reader continues with the next segment
+                auto expected = _range(0, 6);
+                for (auto i : _range(10, 15)) {
+                    expected.push_back(i);
+                }
+                K2EXPECT(log::wtest, rb.records, expected.size());
+                K2EXPECT(log::wtest, rb.data == _expected(st, expected), true);
+                return st.wal->stop();
+            });
+        });
+    }
+
+    seastar::future<> runTest4() {
+        K2LOG_I(log::wtest, ">>> Test4: a torn write at the tail of a segment");
+        return seastar::do_with(WALState(_dir("test4"), 1024 * 1024), [this] (auto& st) {
+            return st.open()
+            .then([this, &st] {
+                return _appendEach(st, 0, 10);
+            })
+            .then([&st] {
+                return st.wal->stop();
+            })
+            .then([&st] {
+                // Simulate a crash in the middle of writing the header of the last frame: it is cut short half way
+                // through, and neither its data nor the segment footer made it to disk
+                auto headerStart = _dataOffset(0, 9) - sizeof(wal::FrameHeader);
+                auto tornStart = headerStart + sizeof(wal::FrameHeader) / 2;
+                auto end = _dataOffset(0, 9) + st.records[9].size() + sizeof(wal::FrameHeader) + sizeof(wal::SegmentFooter);
+                _overwrite(WriteAheadLog::segmentName(st.dir, 0), tornStart, String(end - tornStart, '\0'));
+                return st.open();
+            })
+            .then([this, &st] {
+                return _readAll(*st.wal, WALPosition{}, 100 * 1024 * 1024);
+            })
+            .then([this, &st] (ReadBack&& rb) {
+                // everything up to the torn frame is recovered
+                K2EXPECT(log::wtest, rb.records, 9);
+                K2EXPECT(log::wtest, rb.data == _expected(st, _range(0, 9)), true);
+                return _append(st, 10, 3);
+            })
+            .then([this, &st] {
+                // new records go into a new segment, and are read right after the recovered ones
+                K2EXPECT(log::wtest, st.positions[10].segment, 1);
+                return _readAll(*st.wal, WALPosition{}, 100 * 1024 * 1024);
+            })
+            .then([this, &st] (ReadBack&& rb) {
+                auto expected = _range(0, 9);
+                for (auto i : _range(10, 13)) {
+                    expected.push_back(i);
+                }
+                K2EXPECT(log::wtest, rb.records, expected.size());
+                K2EXPECT(log::wtest, rb.data == _expected(st, expected), true);
+                return st.wal->stop();
+            });
+        });
+    }
+
+    seastar::future<> runTest5() {
+        K2LOG_I(log::wtest, ">>> Test5: a footer which doesn't match the segment fails the read");
+        return seastar::do_with(WALState(_dir("test5"), 1024 * 1024), [this] (auto& st) {
+            return st.open()
+            .then([this, &st] {
+                return _appendEach(st, 0, 10);
+            })
+            .then([this, &st] {
+                return _append(st, 10, 5, true);
+            })
+            .then([this, &st] {
+                // a read which starts in the middle of a sealed segment checks all of its frames against the footer
+                return _readAll(*st.wal, st.positions[4], 100 * 1024 * 1024);
+            })
+            .then([this, &st] (ReadBack&& rb) {
+                K2EXPECT(log::wtest, rb.records, 10);
+                K2EXPECT(log::wtest, rb.data == _expected(st, _range(5, 15)), true);
+                return st.wal->stop();
+            })
+            .then([&st] {
+                // Replace the footer of the first segment with a well-formed one which is missing the last frame,
+                // as if a data frame had been lost
+                uint32_t dataCrc = 0;
+                for (auto i : _range(0, 9)) {
+                    dataCrc = crc32c::Extend(dataCrc, (const uint8_t*)st.records[i].data(), st.records[i].size());
+                }
+                wal::SegmentFooter footer{.frames = 9, .dataCrc = dataCrc, .reserved = 0};
+                wal::FrameHeader header{
+                    .magic = wal::FRAME_MAGIC,
+                    .type = (uint32_t)wal::FrameType::SegmentEnd,
+                    .size = sizeof(footer),
+                    .dataCrc = crc32c::Crc32c((const char*)&footer, sizeof(footer)),
+                    .headerCrc = 0
+                };
+                header.headerCrc = crc32c::Crc32c((const char*)&header, offsetof(wal::FrameHeader, headerCrc));
+                String frame(sizeof(header) + sizeof(footer), '\0');
+                std::memcpy(frame.data(), &header, sizeof(header));
+                std::memcpy(frame.data() + sizeof(header), &footer, sizeof(footer));
+                _overwrite(WriteAheadLog::segmentName(st.dir, 0), _dataOffset(0, 10) - sizeof(wal::FrameHeader), frame);
+                return st.open();
+            })
+            .then([this, &st] {
+                return _readAll(*st.wal, WALPosition{}, 100 * 1024 * 1024)
+                .then_wrapped([] (auto&& fut) {
+                    K2EXPECT(log::wtest, fut.failed(), true);
+                    fut.ignore_ready_future();
+                });
+            })
+            .then([this, &st] {
+                return _readAll(*st.wal, st.positions[4], 100 * 1024 * 1024)
+                .then_wrapped([] (auto&& fut) {
+                    K2EXPECT(log::wtest, fut.failed(), true);
+                    fut.ignore_ready_future();
+                });
+            })
+            .then([this, &st] {
+                // the intact segment after it still reads fine
+                return _readAll(*st.wal, WALPosition{.segment = 1, .offset = 0}, 100 * 1024 * 1024);
+            })
+            .then([this, &st] (ReadBack&& rb) {
+                K2EXPECT(log::wtest, rb.records, 5);
+                K2EXPECT(log::wtest, rb.data == _expected(st, _range(10, 15)), true);
+                return st.wal->stop();
+            });
+        });
+    }
+
+private:
+    int exitcode = -1;
+    ConfigVar<String> _testDir{"wal_test_dir"};
+    seastar::future<> _testFuture = seastar::make_ready_future();
+    seastar::timer<> _testTimer;
+}; // class WALTest
+
+int main(int argc, char** argv) {
+    k2::App app("WALTest");
+    app.addOptions()("wal_test_dir", bpo::value<k2::String>(), "The directory in which the tests create their logs");
+    app.addApplet<WALTest>();
+    return app.start(argc, argv);
+}
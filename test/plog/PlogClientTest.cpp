@@ -21,9 +21,13 @@ Copyright(c) 2020 Futurewei Cloud
     SOFTWARE.
 */
 
+#include <fcntl.h>
+#include <unistd.h>
+
 #include <k2/appbase/Appbase.h>
 #include <k2/appbase/AppEssentials.h>
 #include <k2/persistence/plog_client/PlogClient.h>
+#include <k2/persistence/plog_service/PlogServer.h>
 #include <seastar/core/reactor.hh>
 #include <seastar/core/sleep.hh>
 #include <k2/dto/PersistenceCluster.h>
@@ -41,10 +45,15 @@ private:
     std::unique_ptr<k2::TXEndpoint> _cpoEndpoint;
     k2::PlogClient _client;
     k2::ConfigVar<std::vector<k2::String>> _plogConfigEps{"plog_server_endpoints"};
+    // The reload tests run in two phases, with a restart of the plog servers in between. They work directly with
+    // the first plog server, and need its data directory in order to damage plog files
+    k2::ConfigVar<uint32_t> _testPhase{"plog_test_phase", 1};
+    k2::ConfigVar<k2::String> _plogDataDir{"plog_data_dir", "/tmp/___k2_plog"};
     seastar::future<> _testFuture = seastar::make_ready_future();
     seastar::timer<> _testTimer;
 
     k2::String _plogId;
+    std::unique_ptr<k2::TXEndpoint> _firstServerEp;
 
 public:  // application lifespan
     PlogTest() {
@@ -64,11 +73,19 @@ public:  // application lifespan
         K2LOG_I(log::ptest, "start");
         ConfigVar<String> configEp("cpo_url");
         _cpoEndpoint = RPC().getTXEndpoint(configEp());
+        _firstServerEp = RPC().getTXEndpoint(_plogConfigEps()[0]);
 
         // let start() finish and then run the tests
         _testTimer.set_callback([this] {
-            _testFuture = runTest2()
-            .then([this] { return runTest3(); })
+            _testFuture = seastar::make_ready_future()
+            .then([this] {
+                if (_testPhase() == 2) {
+                    return runTest5();
+                }
+                return runTest2()
+                    .then([this] { return runTest3(); })
+                    .then([this] { return runTest4(); });
+            })
             .then([this] {
                 K2LOG_I(log::ptest, "======= All tests passed ========");
                 exitcode = 0;
@@ -260,12 +277,231 @@ public:  // application lifespan
             return seastar::make_ready_future<>();
         });
     }
+    // the file of the given plog on the first plog server. This follows the file naming of the PlogServer
+    String _plogFile(const String& plogId) {
+        String hex;
+        for (unsigned char c: plogId) {
+            hex += fmt::format("{:02x}", c);
+        }
+        return fmt::format("{}/shard_0/plog_{}.plog", _plogDataDir(), hex);
+    }
+
+    static void _overwrite(const String& file, uint64_t offset, const String& data) {
+        int fd = ::open(file.c_str(), O_WRONLY);
+        if (fd < 0) {
+            throw std::runtime_error(fmt::format("unable to open {}", file));
+        }
+        auto written = ::pwrite(fd, data.data(), data.size(), offset);
+        ::close(fd);
+        if (written != (ssize_t)data.size()) {
+            throw std::runtime_error(fmt::format("unable to write to {}", file));
+        }
+    }
+
+    seastar::future<std::tuple<Status, dto::PlogCreateResponse>> _create(const String& plogId) {
+        dto::PlogCreateRequest request{.plogId = plogId};
+        return RPC().callRPC<dto::PlogCreateRequest, dto::PlogCreateResponse>(dto::Verbs::PLOG_CREATE, request, *_firstServerEp, 1s);
+    }
+
+    seastar::future<std::tuple<Status, dto::PlogAppendResponse>> _append(const String& plogId, uint32_t offset, const String& data) {
+        Payload payload(Payload::DefaultAllocator(4096));
+        payload.write(data);
+        dto::PlogAppendRequest request{.plogId=plogId, .offset=offset, .payload=std::move(payload)};
+        return RPC().callRPC<dto::PlogAppendRequest, dto::PlogAppendResponse>(dto::Verbs::PLOG_APPEND, request, *_firstServerEp, 1s);
+    }
+
+    seastar::future<std::tuple<Status, dto::PlogReadResponse>> _read(const String& plogId, uint32_t offset, uint32_t size) {
+        dto::PlogReadRequest request{.plogId=plogId, .offset=offset, .size=size};
+        return RPC().callRPC<dto::PlogReadRequest, dto::PlogReadResponse>(dto::Verbs::PLOG_READ, request, *_firstServerEp, 1s);
+    }
+
+    seastar::future<std::tuple<Status, dto::PlogGetStatusResponse>> _getStatus(const String& plogId) {
+        dto::PlogGetStatusRequest request{.plogId=plogId};
+        return RPC().callRPC<dto::PlogGetStatusRequest, dto::PlogGetStatusResponse>(dto::Verbs::PLOG_GET_STATUS, request, *_firstServerEp, 1s);
+    }
+
+    // create a plog with the given strings appended to it, one append each
+    seastar::future<> _createWith(const String& plogId, std::vector<String> data) {
+        return _create(plogId)
+        .then([this, plogId, data=std::move(data)] (auto&& response) mutable {
+            auto& [status, resp] = response;
+            K2EXPECT(log::ptest, status, Statuses::S201_Created);
+            return seastar::do_with(std::move(data), uint32_t(0), [this, plogId] (auto& data, auto& offset) {
+                return seastar::do_for_each(data, [this, plogId, &offset] (auto& str) {
+                    return _append(plogId, offset, str)
+                    .then([&offset] (auto&& response) {
+                        auto& [status, resp] = response;
+                        K2EXPECT(log::ptest, status, Statuses::S200_OK);
+                        if (!status.is2xxOK()) {
+                            throw std::runtime_error(fmt::format("unable to append: {}", status));
+                        }
+                        offset = resp.newOffset;
+                    });
+                });
+            });
+        });
+    }
+
+    seastar::future<> runTest4() {
+        K2LOG_I(log::ptest, ">>> Test4: prepare plog files for reloading");
+        // Each string takes 15 bytes in the plog: 10 characters, their size and the null terminator
+        return _createWith("reload_plog", {"1234567890", "0987654321"})
+        .then([this] {
+            return _createWith("sealed_plog", {"1234567890"});
+        })
+        .then([this] {
+            dto::PlogSealRequest request{.plogId="sealed_plog", .truncateOffset=15};
+            return RPC().callRPC<dto::PlogSealRequest, dto::PlogSealResponse>(dto::Verbs::PLOG_SEAL, request, *_firstServerEp, 1s);
+        })
+        .then([this] (auto&& response) {
+            auto& [status, resp] = response;
+            K2EXPECT(log::ptest, status, Statuses::S200_OK);
+            return _createWith("torn_plog", {"1234567890", "0987654321"});
+        })
+        .then([this] {
+            // damage the data of the last commit, as if it didn't make it to disk before a crash
+            _overwrite(_plogFile("torn_plog"), plog::HEADER_SIZE + 20, "X");
+            return _createWith("torn_header_plog", {"1234567890", "0987654321"});
+        })
+        .then([this] {
+            // The create and the two appends are commits 1 to 3, so the last header is in slot 1. Damage it as if
+            // the header write of the last commit didn't make it to disk in one piece
+            _overwrite(_plogFile("torn_header_plog"), plog::HEADER_SLOT_SIZE + 20, "X");
+            return _createWith("corrupt_plog", {"1234567890"});
+        })
+        .then([this] {
+            // each header slot starts with the magic number
+            _overwrite(_plogFile("corrupt_plog"), 0, String(4, '\0'));
+            _overwrite(_plogFile("corrupt_plog"), plog::HEADER_SLOT_SIZE, String(4, '\0'));
+        });
+    }
+
+    seastar::future<> runTest5() {
+        K2LOG_I(log::ptest, ">>> Test5: reload plogs after a restart of the plog servers");
+        return seastar::make_ready_future()
+        .then([this] {
+            K2LOG_I(log::ptest, "Test5.1: the status of a reloaded plog");
+            return _getStatus("reload_plog");
+        })
+        .then([this] (auto&& response) {
+            K2LOG_I(log::ptest, "Test5.2: read the data of a reloaded plog");
+            auto& [status, resp] = response;
+            K2EXPECT(log::ptest, status, Statuses::S200_OK);
+            K2EXPECT(log::ptest, resp.currentOffset, 30);
+            K2EXPECT(log::ptest, resp.sealed, false);
+            return _read("reload_plog", 0, 30);
+        })
+        .then([this] (auto&& response) {
+            K2LOG_I(log::ptest, "Test5.3: append to a reloaded plog");
+            auto& [status, resp] = response;
+            K2EXPECT(log::ptest, status, Statuses::S200_OK);
+            String str, str2;
+            resp.payload.seek(0);
+            resp.payload.read(str);
+            resp.payload.read(str2);
+            K2EXPECT(log::ptest, str, "1234567890");
+            K2EXPECT(log::ptest, str2, "0987654321");
+            return _append("reload_plog", 30, "2333333333");
+        })
+        .then([this] (auto&& response) {
+            auto& [status, resp] = response;
+            K2EXPECT(log::ptest, status, Statuses::S200_OK);
+            K2EXPECT(log::ptest, resp.newOffset, 45);
+            return _read("reload_plog", 15, 30);
+        })
+        .then([this] (auto&& response) {
+            K2LOG_I(log::ptest, "Test5.4: a sealed plog stays sealed");
+            auto& [status, resp] = response;
+            K2EXPECT(log::ptest, status, Statuses::S200_OK);
+            String str, str2;
+            resp.payload.seek(0);
+            resp.payload.read(str);
+            resp.payload.read(str2);
+            K2EXPECT(log::ptest, str, "0987654321");
+            K2EXPECT(log::ptest, str2, "2333333333");
+            return _getStatus("sealed_plog");
+        })
+        .then([this] (auto&& response) {
+            auto& [status, resp] = response;
+            K2EXPECT(log::ptest, status, Statuses::S200_OK);
+            K2EXPECT(log::ptest, resp.currentOffset, 15);
+            K2EXPECT(log::ptest, resp.sealed, true);
+            return _append("sealed_plog", 15, "1234567890");
+        })
+        .then([this] (auto&& response) {
+            K2LOG_I(log::ptest, "Test5.5: a plog with a torn last commit falls back to the previous commit");
+            auto& [status, resp] = response;
+            K2EXPECT(log::ptest, status, Statuses::S409_Conflict);
+            return _getStatus("torn_plog");
+        })
+        .then([this] (auto&& response) {
+            auto& [status, resp] = response;
+            K2EXPECT(log::ptest, status, Statuses::S200_OK);
+            K2EXPECT(log::ptest, resp.currentOffset, 15);
+            return _append("torn_plog", 15, "2333333333");
+        })
+        .then([this] (auto&& response) {
+            auto& [status, resp] = response;
+            K2EXPECT(log::ptest, status, Statuses::S200_OK);
+            K2EXPECT(log::ptest, resp.newOffset, 30);
+            return _read("torn_plog", 0, 30);
+        })
+        .then([this] (auto&& response) {
+            K2LOG_I(log::ptest, "Test5.6: a plog with a torn last header falls back to the header of the previous commit");
+            auto& [status, resp] = response;
+            K2EXPECT(log::ptest, status, Statuses::S200_OK);
+            String str, str2;
+            resp.payload.seek(0);
+            resp.payload.read(str);
+            resp.payload.read(str2);
+            K2EXPECT(log::ptest, str, "1234567890");
+            K2EXPECT(log::ptest, str2, "2333333333");
+            return _getStatus("torn_header_plog");
+        })
+        .then([this] (auto&& response) {
+            auto& [status, resp] = response;
+            K2EXPECT(log::ptest, status, Statuses::S200_OK);
+            K2EXPECT(log::ptest, resp.currentOffset, 15);
+            K2EXPECT(log::ptest, resp.sealed, false);
+            // the next commit goes in the slot of the torn header
+            return _append("torn_header_plog", 15, "2333333333");
+        })
+        .then([this] (auto&& response) {
+            auto& [status, resp] = response;
+            K2EXPECT(log::ptest, status, Statuses::S200_OK);
+            K2EXPECT(log::ptest, resp.newOffset, 30);
+            return _read("torn_header_plog", 0, 30);
+        })
+        .then([this] (auto&& response) {
+            K2LOG_I(log::ptest, "Test5.7: a plog file with no valid header is not loaded");
+            auto& [status, resp] = response;
+            K2EXPECT(log::ptest, status, Statuses::S200_OK);
+            String str, str2;
+            resp.payload.seek(0);
+            resp.payload.read(str);
+            resp.payload.read(str2);
+            K2EXPECT(log::ptest, str, "1234567890");
+            K2EXPECT(log::ptest, str2, "2333333333");
+            return _getStatus("corrupt_plog");
+        })
+        .then([this] (auto&& response) {
+            auto& [status, resp] = response;
+            K2EXPECT(log::ptest, status, Statuses::S404_Not_Found);
+            return _read("corrupt_plog", 0, 15);
+        })
+        .then([] (auto&& response) {
+            auto& [status, resp] = response;
+            K2EXPECT(log::ptest, status, Statuses::S404_Not_Found);
+        });
+    }
 };
 
 int main(int argc, char** argv) {
     k2::App app("PlogTest");
     app.addOptions()("cpo_url", bpo::value<k2::String>(), "The endpoint of the CPO service");
     app.addOptions()("plog_server_endpoints", bpo::value<std::vector<k2::String>>()->multitoken(), "The endpoints of the plog servers");
+    app.addOptions()("plog_test_phase", bpo::value<uint32_t>(), "Phase 1 runs the tests and prepares plogs for reloading. Phase 2 checks the reloaded plogs after a restart of the plog servers");
+    app.addOptions()("plog_data_dir", bpo::value<k2::String>(), "The data directory of the plog servers");
     app.addApplet<PlogTest>();
     return app.start(argc, argv);
 }
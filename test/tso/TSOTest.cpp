@@ -0,0 +1,237 @@
+/*
+MIT License
+
+Copyright(c) 2022 Futurewei Cloud
+
+    Permission is hereby granted,
+    free of charge, to any person obtaining a copy of this software and associated documentation files(the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
+
+    The above copyright notice and this permission notice shall be included in all copies
+    or
+    substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS",
+    WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER
+    LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+*/
+
+
+#include <k2/appbase/AppEssentials.h>
+#include <k2/appbase/Appbase.h>
+#include <k2/dto/MessageVerbs.h>
+#include <k2/dto/TSO.h>
+#include <k2/tso/client/Client.h>
+#include <seastar/core/loop.hh>
+#include <seastar/core/sleep.hh>
+#include <seastar/core/when_all.hh>
+
+using namespace k2;
+
+namespace k2::log {
+inline thread_local k2::logging::Logger tsotest("k2::tso_test");
+}
+
+// Tests for handing out timestamps in batches. The TSO has to run with --tso.max_batch_size set to
+// --tso_test_max_batch_size. That has to be well under half the TSO error bound, so that we can see the batches
+// capped both by the max batch size and by the lower bound of the gps time
+class TSOTest {
+public:  // application lifespan
+    TSOTest() { K2LOG_I(log::tsotest, "ctor"); }
+    ~TSOTest() { K2LOG_I(log::tsotest, "dtor"); }
+
+    // required for seastar::distributed interface
+    seastar::future<> gracefulStop() {
+        K2LOG_I(log::tsotest, "stop");
+        return std::move(_testFuture);
+    }
+
+    seastar::future<> start() {
+        K2LOG_I(log::tsotest, "start");
+        _tsoEndpoint = RPC().getTXEndpoint(_tsoEndpointUrl());
+        // let start() finish and then run the tests
+        _testTimer.set_callback([this] {
+            _testFuture = runTest1()
+            .then([this] { return runTest2(); })
+            .then([this] { return runTest3(); })
+            .then([this] { return runTest4(); })
+            .then([this] {
+                K2LOG_I(log::tsotest, "======= All tests passed ========");
+                exitcode = 0;
+            })
+            .handle_exception([this](auto exc) {
+                K2LOG_W_EXC(log::tsotest, exc, "======= Test failed ========");
+                exitcode = -1;
+            })
+            .finally([this] {
+                K2LOG_I(log::tsotest, "======= Test ended ========");
+                AppBase().stop(exitcode);
+            });
+        });
+        _testTimer.arm(0ms);
+        return seastar::make_ready_future<>();
+    }
+
+private:
+    int exitcode = -1;
+    ConfigVar<String> _tsoEndpointUrl{"tso_endpoint"};
+    ConfigVar<uint32_t> _maxBatchSize{"tso_test_max_batch_size"};
+    std::unique_ptr<TXEndpoint> _tsoEndpoint;
+    seastar::future<> _testFuture = seastar::make_ready_future();
+    seastar::timer<> _testTimer;
+
+    // the last end count handed out by the TSO, as far as we know
+    uint64_t _lastEndCount{0};
+
+    tso::TSOClient& _tsoClient() {
+        return AppBase().getDist<tso::TSOClient>().local();
+    }
+
+    seastar::future<std::tuple<Status, dto::GetTimestampResponse>> _requestBatch(uint32_t count) {
+        dto::GetTimestampRequest request{.count=count};
+        return RPC().callRPC<dto::GetTimestampRequest, dto::GetTimestampResponse>
+            (dto::Verbs::GET_TSO_TIMESTAMP, request, *_tsoEndpoint, 100ms);
+    }
+
+    // checks which hold for every batch the TSO returns
+    void _checkBatch(const dto::GetTimestampResponse& batch) {
+        K2LOG_D(log::tsotest, "checking batch {}", batch);
+        K2EXPECT(log::tsotest, batch.count >= 1, true);
+        K2EXPECT(log::tsotest, batch.count <= _maxBatchSize(), true);
+        // The first end count is at least half the error bound past the gps time. Every timestamp in the batch
+        // has to contain the lower bound of the gps time, so the batch can't be longer than that
+        K2EXPECT(log::tsotest, batch.count <= batch.timestamp.startDelta / 2 + 1, true);
+        // the true time passes the first end count within the error bound
+        K2EXPECT(log::tsotest, (uint64_t)nsec(batch.validFor).count() <= batch.timestamp.startDelta, true);
+        // batches never overlap
+        K2EXPECT(log::tsotest, batch.timestamp.endCount > _lastEndCount, true);
+        _lastEndCount = batch.timestamp.endCount + batch.count - 1;
+    }
+
+public:
+    seastar::future<> runTest1() {
+        K2LOG_I(log::tsotest, ">>> Test1: the TSO returns the timestamps asked for, up to the max batch size");
+        return _requestBatch(1)
+        .then([this] (auto&& response) {
+            auto& [status, batch] = response;
+            K2EXPECT(log::tsotest, status, Statuses::S200_OK);
+            _checkBatch(batch);
+            K2EXPECT(log::tsotest, batch.count, 1);
+            return _requestBatch(100);
+        })
+        .then([this] (auto&& response) {
+            auto& [status, batch] = response;
+            K2EXPECT(log::tsotest, status, Statuses::S200_OK);
+            _checkBatch(batch);
+            K2EXPECT(log::tsotest, batch.count, 100);
+            return _requestBatch(_maxBatchSize() * 2);
+        })
+        .then([this] (auto&& response) {
+            auto& [status, batch] = response;
+            K2EXPECT(log::tsotest, status, Statuses::S200_OK);
+            _checkBatch(batch);
+            K2EXPECT(log::tsotest, batch.count, _maxBatchSize());
+        });
+    }
+
+    seastar::future<> runTest2() {
+        K2LOG_I(log::tsotest, ">>> Test2: batches don't extend past the lower bound of the gps time");
+        // Each of these batches reserves end counts well ahead of the time it takes to get the next one. Once the
+        // reserved end counts run up against the lower bound of the gps time, the batches get shorter
+        return seastar::do_with(false, 0, [this] (auto& capped, auto& requests) {
+            return seastar::do_until(
+                [&capped, &requests] { return capped || requests >= 1000; },
+                [this, &capped, &requests] {
+                    ++requests;
+                    return _requestBatch(_maxBatchSize())
+                    .then([this, &capped] (auto&& response) {
+                        auto& [status, batch] = response;
+                        if (!status.is2xxOK()) {
+                            // the gps error may be too high for a moment
+                            K2LOG_W(log::tsotest, "unable to get timestamps: {}", status);
+                            return;
+                        }
+                        _checkBatch(batch);
+                        capped = batch.count < _maxBatchSize();
+                    });
+                })
+            .then([&capped, &requests] {
+                K2LOG_I(log::tsotest, "batch capped after {} requests", requests);
+                K2EXPECT(log::tsotest, capped, true);
+            });
+        });
+    }
+
+    seastar::future<> runTest3() {
+        K2LOG_I(log::tsotest, ">>> Test3: concurrent callers are served from a single batch");
+        // wait for the gps time to catch up with the end counts reserved by the previous tests
+        return seastar::sleep(50ms)
+        .then([this] {
+            std::vector<seastar::future<dto::Timestamp>> futs;
+            for (int i = 0; i < 50; ++i) {
+                futs.push_back(_tsoClient().getTimestamp());
+            }
+            return seastar::when_all_succeed(futs.begin(), futs.end());
+        })
+        .then([] (std::vector<dto::Timestamp>&& timestamps) {
+            for (size_t i = 1; i < timestamps.size(); ++i) {
+                K2EXPECT(log::tsotest, timestamps[i].endCount, timestamps[0].endCount + i);
+            }
+        });
+    }
+
+    seastar::future<> runTest4() {
+        K2LOG_I(log::tsotest, ">>> Test4: timestamps are handed out from a batch only while it is valid");
+        return seastar::do_with(dto::Timestamp{}, dto::GetTimestampResponse{}, [this] (auto& first, auto& other) {
+            // The batch from test3 still has timestamps left, but it's no longer valid after the error bound
+            return seastar::sleep(50ms)
+            .then([this] {
+                return _tsoClient().getTimestamp();
+            })
+            .then([this, &first] (dto::Timestamp&& ts) {
+                first = ts;
+                return _tsoClient().getTimestamp();
+            })
+            .then([this, &first] (dto::Timestamp&& ts) {
+                // served from the batch we just received
+                K2EXPECT(log::tsotest, ts.endCount, first.endCount + 1);
+                // someone else gets timestamps from the TSO meanwhile
+                return _requestBatch(1);
+            })
+            .then([this, &other] (auto&& response) {
+                auto& [status, batch] = response;
+                K2EXPECT(log::tsotest, status, Statuses::S200_OK);
+                other = batch;
+                return _tsoClient().getTimestamp();
+            })
+            .then([&first, &other] (dto::Timestamp&& ts) {
+                // still served from our batch, which was reserved before the other request
+                K2EXPECT(log::tsotest, ts.endCount, first.endCount + 2);
+                K2EXPECT(log::tsotest, ts.endCount < other.timestamp.endCount, true);
+                return seastar::sleep(50ms);
+            })
+            .then([this] {
+                return _tsoClient().getTimestamp();
+            })
+            .then([&other] (dto::Timestamp&& ts) {
+                // our batch has expired, so this one comes from a new batch, after the other request
+                K2EXPECT(log::tsotest, ts.endCount > other.timestamp.endCount, true);
+            });
+        });
+    }
+};
+
+int main(int argc, char** argv) {
+    k2::App app("TSOTest");
+    app.addOptions()("cpo", bpo::value<k2::String>(), "The endpoint of the CPO");
+    app.addOptions()("tso_endpoint", bpo::value<k2::String>(), "The endpoint of the TSO to request batches from directly");
+    app.addOptions()("tso_test_max_batch_size", bpo::value<uint32_t>(), "The max batch size the TSO is configured with");
+    app.addApplet<k2::tso::TSOClient>();
+    app.addApplet<TSOTest>();
+    return app.start(argc, argv);
+}